@@ -74,18 +74,43 @@ struct header {
 	u16 small_free_list;
 	u16 large_free_list;
 
-	/* List of huge allocs. */
+	/* Tree of huge allocs, ordered by address. */
 	unsigned long huge;
 
+	/* List of thread caches (see alloc_cache_new). */
+	unsigned long caches;
+
 	/* This is less defined: we have two buckets for each power of 2 */
 	struct bucket_state bs[1];
 };
 
+/* Huge allocs are kept in a treap (ordered by off, heap-ordered by a hash
+ * of the node's own offset), so lookups are O(log n). */
 struct huge_alloc {
-	unsigned long next, prev;
+	unsigned long left, right;
 	unsigned long off, len;
 };
 
+/* Objects of this size or less go through the thread caches. */
+#define CACHE_MAX_SIZE 1024
+/* 1024 is bucket 40. */
+#define CACHE_BUCKETS 41
+/* How many free objects each cache holds per bucket. */
+#define CACHE_MAGAZINE 16
+
+struct magazine {
+	unsigned long num;
+	unsigned long off[CACHE_MAGAZINE];
+};
+
+struct alloc_cache {
+	unsigned long next, prev;
+	void (*lock)(void *arg);
+	void (*unlock)(void *arg);
+	void *arg;
+	struct magazine mag[CACHE_BUCKETS];
+};
+
 struct page_header {
 	u16 next, prev;
 	/* FIXME: We can just count all-0 and all-1 used[] elements. */
@@ -216,33 +241,100 @@ static u16 pop_from_list(struct header *head,
 	return h;
 }
 
-static void add_to_huge_list(struct header *head, struct huge_alloc *ha)
+static struct huge_alloc *to_huge(struct header *head, unsigned long hoff)
 {
-	unsigned long h = head->huge;
-	unsigned long offset = (char *)ha - (char *)head;
+	return (struct huge_alloc *)((char *)head + hoff);
+}
 
-	ha->next = h;
-	if (h) {
-		struct huge_alloc *prev = (void *)((char *)head + h);
-		assert(prev->prev == 0);
-		prev->prev = offset;
-	}
-	head->huge = offset;
-	ha->prev = 0;
+/* Treap priority: a hash of where the node lives. */
+static u32 huge_priority(unsigned long hoff)
+{
+	u32 x = hoff ^ (hoff >> 16 >> 16);
+
+	x ^= x >> 16;
+	x *= 0x45d9f3b;
+	x ^= x >> 16;
+	return x;
 }
 
-static void del_from_huge(struct header *head, struct huge_alloc *ha)
+static void rotate_left(struct header *head, unsigned long *link)
 {
-	/* Front of list? */
-	if (ha->prev == 0) {
-		head->huge = ha->next;
+	struct huge_alloc *ha = to_huge(head, *link);
+	unsigned long right = ha->right;
+
+	ha->right = to_huge(head, right)->left;
+	to_huge(head, right)->left = *link;
+	*link = right;
+}
+
+static void rotate_right(struct header *head, unsigned long *link)
+{
+	struct huge_alloc *ha = to_huge(head, *link);
+	unsigned long left = ha->left;
+
+	ha->left = to_huge(head, left)->right;
+	to_huge(head, left)->right = *link;
+	*link = left;
+}
+
+static void add_to_huge_tree(struct header *head, unsigned long *link,
+			     struct huge_alloc *ha)
+{
+	struct huge_alloc *parent;
+
+	if (!*link) {
+		ha->left = ha->right = 0;
+		*link = (char *)ha - (char *)head;
+		return;
+	}
+
+	parent = to_huge(head, *link);
+	if (ha->off < parent->off) {
+		add_to_huge_tree(head, &parent->left, ha);
+		if (huge_priority(parent->left) > huge_priority(*link))
+			rotate_right(head, link);
 	} else {
-		struct huge_alloc *prev = (void *)((char *)head + ha->prev);
-		prev->next = ha->next;
+		add_to_huge_tree(head, &parent->right, ha);
+		if (huge_priority(parent->right) > huge_priority(*link))
+			rotate_left(head, link);
 	}
-	if (ha->next != 0) {
-		struct huge_alloc *next = (void *)((char *)head + ha->next);
-		next->prev = ha->prev;
+}
+
+/* Returns the link pointing to the huge alloc at this offset (or NULL). */
+static unsigned long *find_huge(struct header *head, unsigned long off)
+{
+	unsigned long *link = &head->huge;
+
+	while (*link) {
+		struct huge_alloc *ha = to_huge(head, *link);
+		if (off == ha->off)
+			return link;
+		link = (off < ha->off) ? &ha->left : &ha->right;
+	}
+	return NULL;
+}
+
+/* Rotate it down until it's a leaf, then cut it off. */
+static void del_from_huge(struct header *head, unsigned long *link)
+{
+	for (;;) {
+		struct huge_alloc *ha = to_huge(head, *link);
+
+		if (!ha->left) {
+			*link = ha->right;
+			return;
+		}
+		if (!ha->right) {
+			*link = ha->left;
+			return;
+		}
+		if (huge_priority(ha->left) > huge_priority(ha->right)) {
+			rotate_right(head, link);
+			link = &to_huge(head, *link)->right;
+		} else {
+			rotate_left(head, link);
+			link = &to_huge(head, *link)->left;
+		}
 	}
 }
 
@@ -513,17 +605,22 @@ static u16 get_small_page(struct header *head, unsigned long poolsize,
 	return ret;
 }
 
-static bool huge_allocated(struct header *head, unsigned long offset)
+/* Which huge alloc (if any) covers this offset? */
+static struct huge_alloc *huge_allocated(struct header *head,
+					 unsigned long offset)
 {
 	unsigned long i;
-	struct huge_alloc *ha;
+	struct huge_alloc *ha, *best = NULL;
 
-	for (i = head->huge; i; i = ha->next) {
-		ha = (void *)((char *)head + i);
-		if (ha->off <= offset && ha->off + ha->len > offset)
-			return true;
+	/* Find the last one which starts at or before offset. */
+	for (i = head->huge; i; i = (offset < ha->off) ? ha->left : ha->right) {
+		ha = to_huge(head, i);
+		if (ha->off <= offset)
+			best = ha;
 	}
-	return false;
+	if (best && best->off + best->len > offset)
+		return best;
+	return NULL;
 }
 
 /* They want something really big.  Aim for contiguous pages (slow). */
@@ -531,7 +628,7 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 			     unsigned long size, unsigned long align)
 {
 	struct header *head = pool;
-	struct huge_alloc *ha;
+	struct huge_alloc *ha, *other;
 	unsigned long i, sp_bits, lp_bits, num, header_size;
 
 	sp_bits = small_page_bits(poolsize);
@@ -552,9 +649,10 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 		struct page_header *pg;
 		unsigned long off = (i << sp_bits);
 
-		/* Skip over large pages. */
+		/* Skip over large pages (so we're not contiguous). */
 		if (test_bit(head->pagesize, i >> BITS_FROM_SMALL_TO_LARGE_PAGE)) {
 			i += (1UL << BITS_FROM_SMALL_TO_LARGE_PAGE)-1;
+			num = 0;
 			continue;
 		}
 
@@ -562,8 +660,10 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 		if (!num && off % align != 0)
 			continue;
 
-		/* FIXME: This makes us O(n^2). */
-		if (huge_allocated(head, off)) {
+		/* Skip over other huge allocs entirely. */
+		other = huge_allocated(head, off);
+		if (other) {
+			i = ((other->off + other->len) >> sp_bits) - 1;
 			num = 0;
 			continue;
 		}
@@ -608,8 +708,10 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 		if (!num && off % align != 0)
 			continue;
 
-		/* FIXME: This makes us O(n^2). */
-		if (huge_allocated(head, off)) {
+		/* Skip over other huge allocs entirely. */
+		other = huge_allocated(head, off);
+		if (other) {
+			i = ((other->off + other->len) >> lp_bits) - 1;
 			num = 0;
 			continue;
 		}
@@ -642,23 +744,20 @@ static COLD void *huge_alloc(void *pool, unsigned long poolsize,
 	return NULL;
 
 done:
-	add_to_huge_list(pool, ha);
+	add_to_huge_tree(pool, &head->huge, ha);
 	return (char *)pool + ha->off;
 }
 
 static COLD void
 huge_free(struct header *head, unsigned long poolsize, void *free)
 {
-	unsigned long i, off, pgnum, free_off = (char *)free - (char *)head;
+	unsigned long *link, off, pgnum, free_off = (char *)free - (char *)head;
 	unsigned int sp_bits, lp_bits;
 	struct huge_alloc *ha;
 
-	for (i = head->huge; i; i = ha->next) {
-		ha = (void *)((char *)head + i);
-		if (free_off == ha->off)
-			break;
-	}
-	assert(i);
+	link = find_huge(head, free_off);
+	assert(link);
+	ha = to_huge(head, *link);
 
 	/* Free up all the pages, delete and free ha */
 	sp_bits = small_page_bits(poolsize);
@@ -682,48 +781,25 @@ huge_free(struct header *head, unsigned long poolsize, void *free)
 						   sp_bits);
 		}
 	}
-	del_from_huge(head, ha);
+	del_from_huge(head, link);
 	alloc_free(head, poolsize, ha);
 }
 
 static COLD unsigned long huge_size(struct header *head, void *p)
 {
-	unsigned long i, off = (char *)p - (char *)head;
-	struct huge_alloc *ha;
+	unsigned long *link = find_huge(head, (char *)p - (char *)head);
 
-	for (i = head->huge; i; i = ha->next) {
-		ha = (void *)((char *)head + i);
-		if (off == ha->off) {
-			return ha->len;
-		}
-	}
-	abort();
+	if (!link)
+		abort();
+	return to_huge(head, *link)->len;
 }
 
-void *alloc_get(void *pool, unsigned long poolsize,
-		unsigned long size, unsigned long align)
+static void *bucket_alloc(struct header *head, unsigned long poolsize,
+			  unsigned int bucket, unsigned int sp_bits)
 {
-	struct header *head = pool;
-	unsigned int bucket;
 	unsigned long i;
 	struct bucket_state *bs;
 	struct page_header *ph;
-	unsigned int sp_bits;
-
-	if (poolsize < MIN_USEFUL_SIZE) {
-		return tiny_alloc_get(pool, poolsize, size, align);
-	}
-
-	size = align_up(size, align);
-	if (unlikely(!size))
-		size = 1;
-	bucket = size_to_bucket(size);
-
-	sp_bits = small_page_bits(poolsize);
-
-	if (bucket >= max_bucket(sp_bits + BITS_FROM_SMALL_TO_LARGE_PAGE)) {
-		return huge_alloc(pool, poolsize, size, align);
-	}
 
 	bs = &head->bs[bucket];
 
@@ -763,6 +839,31 @@ void *alloc_get(void *pool, unsigned long poolsize,
 	       + i * bucket_to_size(bucket);
 }
 
+void *alloc_get(void *pool, unsigned long poolsize,
+		unsigned long size, unsigned long align)
+{
+	struct header *head = pool;
+	unsigned int bucket;
+	unsigned int sp_bits;
+
+	if (poolsize < MIN_USEFUL_SIZE) {
+		return tiny_alloc_get(pool, poolsize, size, align);
+	}
+
+	size = align_up(size, align);
+	if (unlikely(!size))
+		size = 1;
+	bucket = size_to_bucket(size);
+
+	sp_bits = small_page_bits(poolsize);
+
+	if (bucket >= max_bucket(sp_bits + BITS_FROM_SMALL_TO_LARGE_PAGE)) {
+		return huge_alloc(pool, poolsize, size, align);
+	}
+
+	return bucket_alloc(head, poolsize, bucket, sp_bits);
+}
+
 void alloc_free(void *pool, unsigned long poolsize, void *free)
 {
 	struct header *head = pool;
@@ -845,6 +946,203 @@ unsigned long alloc_size(void *pool, unsigned long poolsize, void *p)
 	return bucket_to_size(ph->bucket);
 }
 
+static void add_to_cache_list(struct header *head, struct alloc_cache *c)
+{
+	unsigned long h = head->caches;
+	unsigned long offset = (char *)c - (char *)head;
+
+	c->next = h;
+	if (h) {
+		struct alloc_cache *prev = (void *)((char *)head + h);
+		assert(prev->prev == 0);
+		prev->prev = offset;
+	}
+	head->caches = offset;
+	c->prev = 0;
+}
+
+static void del_from_cache_list(struct header *head, struct alloc_cache *c)
+{
+	/* Front of list? */
+	if (c->prev == 0) {
+		head->caches = c->next;
+	} else {
+		struct alloc_cache *prev = (void *)((char *)head + c->prev);
+		prev->next = c->next;
+	}
+	if (c->next != 0) {
+		struct alloc_cache *next = (void *)((char *)head + c->next);
+		next->prev = c->prev;
+	}
+}
+
+static void cache_lock(struct alloc_cache *c)
+{
+	if (c->lock)
+		c->lock(c->arg);
+}
+
+static void cache_unlock(struct alloc_cache *c)
+{
+	if (c->unlock)
+		c->unlock(c->arg);
+}
+
+/* Which bucket is this (non-huge) object in?  -1 if not cachable. */
+static int cache_bucket(struct header *head, unsigned long poolsize, void *p)
+{
+	unsigned long pgnum, sp_bits;
+	struct page_header *ph;
+
+	sp_bits = small_page_bits(poolsize);
+	pgnum = ((char *)p - (char *)head) >> sp_bits;
+
+	/* The page can't change size while p is allocated in it. */
+	if (test_bit(head->pagesize, pgnum >> BITS_FROM_SMALL_TO_LARGE_PAGE))
+		pgnum &= ~(SMALL_PAGES_PER_LARGE_PAGE - 1);
+
+	ph = from_pgnum(head, pgnum, sp_bits);
+	if ((void *)ph == p || ph->bucket >= CACHE_BUCKETS)
+		return -1;
+	return ph->bucket;
+}
+
+/* Give the oldest num objects in the magazine back to the pool. */
+static void flush_magazine(struct header *head, unsigned long poolsize,
+			   struct magazine *m, unsigned long num)
+{
+	unsigned long i;
+
+	for (i = 0; i < num; i++)
+		alloc_free(head, poolsize, (char *)head + m->off[i]);
+	memmove(m->off, m->off + num, (m->num - num) * sizeof(m->off[0]));
+	m->num -= num;
+}
+
+struct alloc_cache *alloc_cache_new(void *pool, unsigned long poolsize,
+				    void (*lock)(void *arg),
+				    void (*unlock)(void *arg),
+				    void *arg)
+{
+	struct alloc_cache *c;
+
+	if (lock)
+		lock(arg);
+	c = alloc_get(pool, poolsize, sizeof(*c), ALIGNOF(*c));
+	if (c) {
+		c->lock = lock;
+		c->unlock = unlock;
+		c->arg = arg;
+		memset(c->mag, 0, sizeof(c->mag));
+		/* Tiny pools don't cache, so don't need to track it. */
+		if (poolsize >= MIN_USEFUL_SIZE)
+			add_to_cache_list(pool, c);
+	}
+	if (unlock)
+		unlock(arg);
+	return c;
+}
+
+void *alloc_cache_get(struct alloc_cache *c, void *pool,
+		      unsigned long poolsize,
+		      unsigned long size, unsigned long align)
+{
+	struct magazine *m;
+	unsigned int bucket, sp_bits;
+	void *p;
+
+	if (poolsize < MIN_USEFUL_SIZE)
+		goto uncached;
+
+	size = align_up(size, align);
+	if (size > CACHE_MAX_SIZE)
+		goto uncached;
+	if (unlikely(!size))
+		size = 1;
+	bucket = size_to_bucket(size);
+
+	sp_bits = small_page_bits(poolsize);
+	if (bucket >= max_bucket(sp_bits + BITS_FROM_SMALL_TO_LARGE_PAGE))
+		goto uncached;
+
+	m = &c->mag[bucket];
+	if (unlikely(!m->num)) {
+		/* Refill half the magazine in one go. */
+		cache_lock(c);
+		while (m->num < CACHE_MAGAZINE / 2) {
+			p = bucket_alloc(pool, poolsize, bucket, sp_bits);
+			if (!p)
+				break;
+			m->off[m->num++] = (char *)p - (char *)pool;
+		}
+		cache_unlock(c);
+		if (!m->num)
+			return NULL;
+	}
+	return (char *)pool + m->off[--m->num];
+
+uncached:
+	cache_lock(c);
+	p = alloc_get(pool, poolsize, size, align);
+	cache_unlock(c);
+	return p;
+}
+
+void alloc_cache_free(struct alloc_cache *c, void *pool,
+		      unsigned long poolsize, void *free)
+{
+	struct magazine *m;
+	int bucket;
+
+	if (poolsize >= MIN_USEFUL_SIZE) {
+		bucket = cache_bucket(pool, poolsize, free);
+		if (bucket >= 0) {
+			m = &c->mag[bucket];
+			if (unlikely(m->num == CACHE_MAGAZINE)) {
+				cache_lock(c);
+				flush_magazine(pool, poolsize, m,
+					       CACHE_MAGAZINE / 2);
+				cache_unlock(c);
+			}
+			m->off[m->num++] = (char *)free - (char *)pool;
+			return;
+		}
+	}
+
+	cache_lock(c);
+	alloc_free(pool, poolsize, free);
+	cache_unlock(c);
+}
+
+void alloc_cache_flush(struct alloc_cache *c, void *pool,
+		       unsigned long poolsize)
+{
+	unsigned int i;
+
+	cache_lock(c);
+	for (i = 0; i < CACHE_BUCKETS; i++)
+		flush_magazine(pool, poolsize, &c->mag[i], c->mag[i].num);
+	cache_unlock(c);
+}
+
+void alloc_cache_destroy(struct alloc_cache *c, void *pool,
+			 unsigned long poolsize)
+{
+	/* c is in the pool, so save the lock details before freeing it. */
+	void (*unlock)(void *arg) = c->unlock;
+	void *arg = c->arg;
+	unsigned int i;
+
+	cache_lock(c);
+	for (i = 0; i < CACHE_BUCKETS; i++)
+		flush_magazine(pool, poolsize, &c->mag[i], c->mag[i].num);
+	if (poolsize >= MIN_USEFUL_SIZE)
+		del_from_cache_list(pool, c);
+	alloc_free(pool, poolsize, c);
+	if (unlock)
+		unlock(arg);
+}
+
 /* Useful for gdb breakpoints. */
 static bool check_fail(void)
 {
@@ -984,12 +1282,140 @@ static bool check_bucket(struct header *head,
 	return true;
 }
 
+/* Is this offset in any cache magazine before (cache, bucket, n)? */
+static bool cached_earlier(struct header *head, unsigned long off,
+			   struct alloc_cache *cache, unsigned int bucket,
+			   unsigned long n)
+{
+	unsigned long i, b, j;
+	struct alloc_cache *c;
+
+	for (i = head->caches; i; i = c->next) {
+		c = (void *)((char *)head + i);
+		for (b = 0; b < CACHE_BUCKETS; b++) {
+			for (j = 0; j < c->mag[b].num; j++) {
+				if (c == cache && b == bucket && j == n)
+					return false;
+				if (c->mag[b].off[j] == off)
+					return true;
+			}
+		}
+	}
+	return false;
+}
+
+static bool check_magazine(struct header *head,
+			   unsigned long poolsize,
+			   unsigned long pages[],
+			   struct alloc_cache *c,
+			   unsigned int bindex)
+{
+	struct magazine *m = &c->mag[bindex];
+	struct page_header *ph;
+	unsigned long i, pgnum, off, sp_bits;
+
+	sp_bits = small_page_bits(poolsize);
+
+	if (m->num > CACHE_MAGAZINE)
+		return check_fail();
+
+	for (i = 0; i < m->num; i++) {
+		/* Bad pointer? */
+		if (m->off[i] >= poolsize)
+			return check_fail();
+		pgnum = m->off[i] >> sp_bits;
+		if (test_bit(head->pagesize,
+			     pgnum >> BITS_FROM_SMALL_TO_LARGE_PAGE))
+			pgnum &= ~(SMALL_PAGES_PER_LARGE_PAGE - 1);
+		/* Page not in use by a bucket? */
+		if (!test_bit(pages, pgnum))
+			return check_fail();
+		ph = from_pgnum(head, pgnum, sp_bits);
+		/* Wrong bucket? */
+		if (ph->bucket != bindex)
+			return check_fail();
+		off = m->off[i] - (pgnum << sp_bits)
+			- page_header_size(bindex / INTER_BUCKET_SPACE,
+					   head->bs[bindex].elements_per_page);
+		/* Not the start of an element? */
+		if (off % bucket_to_size(bindex))
+			return check_fail();
+		/* Not allocated? */
+		if (!test_bit(ph->used, off / bucket_to_size(bindex)))
+			return check_fail();
+		/* In two caches at once (double free)? */
+		if (cached_earlier(head, m->off[i], c, bindex, i))
+			return check_fail();
+	}
+	return true;
+}
+
+/* Every huge alloc off must be within [min, max), as it's a search tree. */
+static bool check_huge(struct header *head,
+		       unsigned long poolsize,
+		       unsigned long pages[],
+		       unsigned long i,
+		       unsigned long min, unsigned long max,
+		       u32 max_priority)
+{
+	unsigned long pgbits, j, sp_bits, lp_bits;
+	struct huge_alloc *ha;
+
+	if (!i)
+		return true;
+
+	sp_bits = small_page_bits(poolsize);
+	lp_bits = sp_bits + BITS_FROM_SMALL_TO_LARGE_PAGE;
+
+	/* Bad pointer? */
+	if (i >= poolsize || i + sizeof(*ha) > poolsize)
+		return check_fail();
+	ha = to_huge(head, i);
+
+	/* Check contents of ha. */
+	if (ha->off > poolsize || ha->off + ha->len > poolsize || !ha->len)
+		return check_fail();
+
+	/* Out of order? */
+	if (ha->off < min || ha->off >= max)
+		return check_fail();
+
+	/* Not heap ordered? */
+	if (huge_priority(i) > max_priority)
+		return check_fail();
+
+	/* Large or small page? */
+	pgbits = test_bit(head->pagesize, ha->off >> lp_bits)
+		? lp_bits : sp_bits;
+
+	/* Not page boundary? */
+	if ((ha->off % (1UL << pgbits)) != 0)
+		return check_fail();
+
+	/* Not page length? */
+	if ((ha->len % (1UL << pgbits)) != 0)
+		return check_fail();
+
+	/* This also catches loops in the tree. */
+	for (j = ha->off; j < ha->off + ha->len; j += (1UL<<sp_bits)) {
+		/* Already seen this page? */
+		if (test_bit(pages, j >> sp_bits))
+			return check_fail();
+		set_bit(pages, j >> sp_bits);
+	}
+
+	return check_huge(head, poolsize, pages, ha->left,
+			  min, ha->off, huge_priority(i))
+		&& check_huge(head, poolsize, pages, ha->right,
+			      ha->off + ha->len, max, huge_priority(i));
+}
+
 bool alloc_check(void *pool, unsigned long poolsize)
 {
 	struct header *head = pool;
 	unsigned long prev, i, lp_bits, sp_bits, header_size, num_buckets;
 	struct page_header *ph;
-	struct huge_alloc *ha;
+	struct alloc_cache *c;
 	unsigned long pages[MAX_SMALL_PAGES / BITS_PER_LONG] = { 0 };
 
 	if (poolsize < MIN_USEFUL_SIZE)
@@ -1057,43 +1483,27 @@ bool alloc_check(void *pool, unsigned long poolsize)
 			return false;
 	}
 
-	/* Check the huge alloc list. */
+	/* Check the huge alloc tree. */
+	if (!check_huge(head, poolsize, pages, head->huge, 0, poolsize, -1U))
+		return false;
+
+	/* Check the thread caches. */
 	prev = 0;
-	for (i = head->huge; i; i = ha->next) {
-		unsigned long pgbits, j;
+	for (i = head->caches; i; i = c->next) {
+		unsigned int b;
 
 		/* Bad pointer? */
-		if (i >= poolsize || i + sizeof(*ha) > poolsize)
-			return check_fail();
-		ha = (void *)((char *)head + i);
-
-		/* Check contents of ha. */
-		if (ha->off > poolsize || ha->off + ha->len > poolsize)
-			return check_fail();
-
-		/* Large or small page? */
-		pgbits = test_bit(head->pagesize, ha->off >> lp_bits)
-			? lp_bits : sp_bits;
-
-		/* Not page boundary? */
-		if ((ha->off % (1UL << pgbits)) != 0)
-			return check_fail();
-
-		/* Not page length? */
-		if ((ha->len % (1UL << pgbits)) != 0)
+		if (i >= poolsize || i + sizeof(*c) > poolsize)
 			return check_fail();
+		c = (void *)((char *)head + i);
 
 		/* Linked list corrupt? */
-		if (ha->prev != prev)
+		if (c->prev != prev)
 			return check_fail();
 
-		for (j = ha->off; j < ha->off + ha->len; j += (1UL<<sp_bits)) {
-			/* Already seen this page? */
-			if (test_bit(pages, j >> sp_bits))
-				return check_fail();
-			set_bit(pages, j >> sp_bits);
-		}
-
+		for (b = 0; b < CACHE_BUCKETS; b++)
+			if (!check_magazine(head, poolsize, pages, c, b))
+				return false;
 		prev = i;
 	}
 		
@@ -1186,6 +1596,28 @@ static unsigned long visualize_bucket(FILE *out, struct header *head,
 	return overhead;
 }
 
+static unsigned long visualize_caches(FILE *out, struct header *head,
+				      unsigned long poolsize)
+{
+	unsigned long i, b, num_caches = 0, elems = 0, bytes = 0;
+	struct alloc_cache *c;
+
+	for (i = head->caches; i; i = c->next) {
+		c = (void *)((char *)head + i);
+		num_caches++;
+		for (b = 0; b < CACHE_BUCKETS; b++) {
+			elems += c->mag[b].num;
+			bytes += c->mag[b].num * bucket_to_size(b);
+		}
+	}
+	if (!num_caches)
+		return 0;
+
+	fprintf(out, "%lu thread caches holding %lu free elements\n",
+		num_caches, elems);
+	return print_overhead(out, "thread cache elements", bytes, poolsize);
+}
+
 void alloc_visualize(FILE *out, void *pool, unsigned long poolsize)
 {
 	struct header *head = pool;
@@ -1234,5 +1666,7 @@ void alloc_visualize(FILE *out, void *pool, unsigned long poolsize)
 	for (i = 0; i < num_buckets; i++)
 		overhead += visualize_bucket(out, head, i, poolsize, sp_bits);
 
+	overhead += visualize_caches(out, head, poolsize);
+
 	print_overhead(out, "total", overhead, poolsize);
 }
@@ -126,4 +126,110 @@ bool alloc_check(void *pool, unsigned long poolsize);
  *	}
  */
 void alloc_visualize(FILE *out, void *pool, unsigned long poolsize);
+
+/**
+ * alloc_cache_new - create a cache to share a pool between threads
+ * @pool: the contiguous bytes for the allocator to use
+ * @poolsize: the size of the pool
+ * @lock: the function to lock the pool (or NULL)
+ * @unlock: the function to unlock the pool (or NULL)
+ * @arg: the argument to hand to @lock and @unlock
+ *
+ * None of the alloc functions are thread-safe, so a pool shared between
+ * threads needs a lock around every call.  Instead, each thread can
+ * create its own cache and use alloc_cache_get() and alloc_cache_free():
+ * these keep a few free objects of each small size, and only take the
+ * lock to refill or flush them in batches.  Large allocations go straight
+ * to the pool (under the lock).
+ *
+ * The cache itself is allocated within the pool, and alloc_check() and
+ * alloc_visualize() know about the objects held in caches.  Caches don't
+ * help tiny pools: they simply take the lock around each call.
+ *
+ * Returns NULL if the cache could not be allocated.
+ *
+ * Example:
+ *	#include <pthread.h>
+ *
+ *	static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+ *
+ *	static void lock_pool(void *arg)
+ *	{
+ *		pthread_mutex_lock(arg);
+ *	}
+ *
+ *	static void unlock_pool(void *arg)
+ *	{
+ *		pthread_mutex_unlock(arg);
+ *	}
+ *	...
+ *		struct alloc_cache *cache;
+ *
+ *		cache = alloc_cache_new(pool, 32*1024*1024,
+ *					lock_pool, unlock_pool, &pool_lock);
+ *		if (!cache)
+ *			errx(1, "Could not allocate thread cache");
+ */
+struct alloc_cache *alloc_cache_new(void *pool, unsigned long poolsize,
+				    void (*lock)(void *arg),
+				    void (*unlock)(void *arg),
+				    void *arg);
+
+/**
+ * alloc_cache_get - allocate some memory from the pool via a cache
+ * @cache: the cache from alloc_cache_new()
+ * @pool: the contiguous bytes for the allocator to use
+ * @poolsize: the size of the pool
+ * @size: the size of the desired allocation
+ * @align: the alignment of the desired allocation (0 or power of 2)
+ *
+ * This is alloc_get(), but only locks the pool when the cache is empty.
+ * Only one thread may use a cache at a time.
+ *
+ * Example:
+ *	d = alloc_cache_get(cache, pool, 32*1024*1024,
+ *			    sizeof(*d), ALIGNOF(*d));
+ */
+void *alloc_cache_get(struct alloc_cache *cache, void *pool,
+		      unsigned long poolsize,
+		      unsigned long size, unsigned long align);
+
+/**
+ * alloc_cache_free - free some allocated memory via a cache
+ * @cache: the cache from alloc_cache_new()
+ * @pool: the contiguous bytes for the allocator to use
+ * @poolsize: the size of the pool
+ * @p: the non-NULL pointer returned from alloc_get or alloc_cache_get.
+ *
+ * This is alloc_free(), but only locks the pool when the cache is full.
+ * The pointer need not have come from the same cache.
+ *
+ * Example:
+ *	alloc_cache_free(cache, pool, 32*1024*1024, d);
+ */
+void alloc_cache_free(struct alloc_cache *cache, void *pool,
+		      unsigned long poolsize, void *p);
+
+/**
+ * alloc_cache_flush - return all the objects held by a cache to the pool
+ * @cache: the cache from alloc_cache_new()
+ * @pool: the contiguous bytes for the allocator to use
+ * @poolsize: the size of the pool
+ *
+ * Useful if the pool is low on memory, or a thread is going idle.
+ */
+void alloc_cache_flush(struct alloc_cache *cache, void *pool,
+		       unsigned long poolsize);
+
+/**
+ * alloc_cache_destroy - flush and free a cache
+ * @cache: the cache from alloc_cache_new()
+ * @pool: the contiguous bytes for the allocator to use
+ * @poolsize: the size of the pool
+ *
+ * Example:
+ *	alloc_cache_destroy(cache, pool, 32*1024*1024);
+ */
+void alloc_cache_destroy(struct alloc_cache *cache, void *pool,
+			 unsigned long poolsize);
 #endif /* ALLOC_H */
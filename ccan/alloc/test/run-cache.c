@@ -0,0 +1,133 @@
+#include <ccan/alloc/alloc.h>
+#include <ccan/tap/tap.h>
+#include <ccan/alloc/alloc.c>
+#include <ccan/alloc/bitops.c>
+#include <ccan/alloc/tiny.c>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <err.h>
+
+#define POOL_SIZE (1024*1024)
+#define NUM 2000
+
+static int locked, lock_calls;
+
+static void lock(void *arg)
+{
+	if (locked)
+		errx(1, "nested locking");
+	locked = 1;
+	lock_calls++;
+}
+
+static void unlock(void *arg)
+{
+	if (!locked)
+		errx(1, "unlock without lock");
+	locked = 0;
+}
+
+static bool all_unique(void *p[], unsigned int num)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < num; i++)
+		for (j = i + 1; j < num; j++)
+			if (p[i] == p[j])
+				return false;
+	return true;
+}
+
+static void test_pool(unsigned long pool_size)
+{
+	void *mem = malloc(pool_size), *p[NUM], *big;
+	struct alloc_cache *c1, *c2;
+	unsigned int i, num;
+	bool sizes_ok;
+
+	alloc_init(mem, pool_size);
+	c1 = alloc_cache_new(mem, pool_size, lock, unlock, NULL);
+	c2 = alloc_cache_new(mem, pool_size, lock, unlock, NULL);
+	ok1(c1 && c2);
+	ok1(alloc_check(mem, pool_size));
+
+	/* Alternate between the caches, with a mix of sizes. */
+	lock_calls = 0;
+	sizes_ok = true;
+	for (num = 0; num < NUM; num++) {
+		p[num] = alloc_cache_get(num % 2 ? c1 : c2, mem, pool_size,
+					 num % 100, 1 << (num % 4));
+		if (!p[num])
+			break;
+		if (alloc_size(mem, pool_size, p[num]) < num % 100)
+			sizes_ok = false;
+		if ((unsigned long)((char *)p[num] - (char *)mem)
+		    % (1 << (num % 4)))
+			sizes_ok = false;
+	}
+	ok1(num > 0);
+	ok1(sizes_ok);
+	ok1(all_unique(p, num));
+	ok1(alloc_check(mem, pool_size));
+	/* Small pools can't cache. */
+	if (pool_size >= MIN_USEFUL_SIZE)
+		ok1(lock_calls < num / 2);
+	else
+		ok1(lock_calls == num);
+
+	/* Free every second one through the "wrong" cache. */
+	for (i = 0; i < num; i += 2)
+		alloc_cache_free(c1, mem, pool_size, p[i]);
+	ok1(alloc_check(mem, pool_size));
+	for (i = 1; i < num; i += 2)
+		alloc_cache_free(c1, mem, pool_size, p[i]);
+	ok1(alloc_check(mem, pool_size));
+
+	/* Huge allocations go straight to the pool. */
+	big = alloc_cache_get(c2, mem, pool_size, pool_size / 4, 1);
+	ok1(alloc_check(mem, pool_size));
+	if (big)
+		alloc_cache_free(c2, mem, pool_size, big);
+	ok1(alloc_check(mem, pool_size));
+
+	alloc_cache_flush(c1, mem, pool_size);
+	ok1(alloc_check(mem, pool_size));
+	alloc_cache_destroy(c1, mem, pool_size);
+	alloc_cache_destroy(c2, mem, pool_size);
+	ok1(alloc_check(mem, pool_size));
+	ok1(!locked);
+
+	/* Everything went back: we can get it all again. */
+	for (i = 0; i < num; i++)
+		if (!alloc_get(mem, pool_size, i % 100, 1 << (i % 4)))
+			break;
+	ok1(i == num);
+
+	free(mem);
+}
+
+int main(int argc, char *argv[])
+{
+	void *mem = malloc(POOL_SIZE);
+	struct alloc_cache *c;
+	void *p;
+
+	plan_tests(15 * 2 + 3);
+
+	test_pool(POOL_SIZE);
+	test_pool(MIN_USEFUL_SIZE / 2);
+
+	/* A double free into a cache is caught by alloc_check. */
+	alloc_init(mem, POOL_SIZE);
+	c = alloc_cache_new(mem, POOL_SIZE, NULL, NULL, NULL);
+	p = alloc_cache_get(c, mem, POOL_SIZE, 16, 1);
+	alloc_cache_free(c, mem, POOL_SIZE, p);
+	ok1(alloc_check(mem, POOL_SIZE));
+	alloc_cache_free(c, mem, POOL_SIZE, p);
+	ok1(!alloc_check(mem, POOL_SIZE));
+	c->mag[size_to_bucket(16)].num--;
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	free(mem);
+	return exit_status();
+}
@@ -0,0 +1,83 @@
+#include <ccan/alloc/alloc.h>
+#include <ccan/tap/tap.h>
+#include <ccan/alloc/alloc.c>
+#include <ccan/alloc/bitops.c>
+#include <ccan/alloc/tiny.c>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <err.h>
+
+#define POOL_SIZE (64*1024*1024)
+#define MAX_HUGE 4096
+
+/* Count the nodes in the huge tree. */
+static unsigned long tree_count(struct header *head, unsigned long i)
+{
+	if (!i)
+		return 0;
+	return 1 + tree_count(head, to_huge(head, i)->left)
+		+ tree_count(head, to_huge(head, i)->right);
+}
+
+int main(int argc, char *argv[])
+{
+	void *mem = malloc(POOL_SIZE), *p[MAX_HUGE];
+	unsigned long sizes[MAX_HUGE];
+	unsigned int i, j, num;
+	bool sizes_ok = true;
+
+	plan_tests(11);
+
+	alloc_init(mem, POOL_SIZE);
+
+	/* Lots of huge allocations, in various sizes. */
+	srand(1);
+	for (num = 0; num < MAX_HUGE; num++) {
+		sizes[num] = 33*1024 + rand() % (100*1024);
+		p[num] = alloc_get(mem, POOL_SIZE, sizes[num], 1);
+		if (!p[num])
+			break;
+	}
+	ok1(num > 200);
+	ok1(alloc_check(mem, POOL_SIZE));
+	ok1(tree_count(mem, ((struct header *)mem)->huge) == num);
+
+	for (i = 0; i < num; i++)
+		if (alloc_size(mem, POOL_SIZE, p[i]) < sizes[i])
+			sizes_ok = false;
+	ok1(sizes_ok);
+
+	/* Free a random half. */
+	for (i = 0; i < num / 2; i++) {
+		j = rand() % (num - i);
+		alloc_free(mem, POOL_SIZE, p[j]);
+		p[j] = p[num - i - 1];
+		sizes[j] = sizes[num - i - 1];
+	}
+	ok1(alloc_check(mem, POOL_SIZE));
+	ok1(tree_count(mem, ((struct header *)mem)->huge) == num - num / 2);
+
+	sizes_ok = true;
+	for (i = 0; i < num - num / 2; i++)
+		if (alloc_size(mem, POOL_SIZE, p[i]) < sizes[i])
+			sizes_ok = false;
+	ok1(sizes_ok);
+
+	/* We can fill the gaps again. */
+	for (i = num - num / 2; i < num; i++) {
+		sizes[i] = 33*1024;
+		p[i] = alloc_get(mem, POOL_SIZE, sizes[i], 1);
+		if (!p[i])
+			break;
+	}
+	ok1(i == num);
+	ok1(alloc_check(mem, POOL_SIZE));
+
+	for (i = 0; i < num; i++)
+		alloc_free(mem, POOL_SIZE, p[i]);
+	ok1(alloc_check(mem, POOL_SIZE));
+	ok1(((struct header *)mem)->huge == 0);
+
+	free(mem);
+	return exit_status();
+}
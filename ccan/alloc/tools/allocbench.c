@@ -0,0 +1,544 @@
+/* Replay allocation traces against alloc, tiny_alloc, block_pool, talloc
+ * and malloc, and compare them.
+ *
+ * Traces are either generated (see usage) or read from a file with one
+ * operation per line:
+ *	a <id> <size>	allocate size bytes, call it id
+ *	f <id>		free id
+ * ids must be less than 2^24, and can be reused once freed.
+ */
+#include <ccan/alloc/alloc.h>
+#include <ccan/alloc/tiny.h>
+#include <ccan/block_pool/block_pool.h>
+#include <ccan/talloc/talloc.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+
+#define MAX_ID (1 << 24)
+
+struct op {
+	bool alloc;
+	uint32_t id;
+	uint32_t size;
+};
+
+struct trace {
+	struct op *ops;
+	unsigned long num, max_id;
+};
+
+struct pool {
+	void *mem;
+	unsigned long size;
+};
+
+struct allocator {
+	const char *name;
+	void *(*setup)(unsigned long poolsize);
+	void *(*get)(void *ctx, size_t size);
+	void (*free)(void *ctx, void *p);
+	/* NULL if the allocator can't tell us. */
+	size_t (*size)(void *ctx, void *p);
+	void (*visualize)(FILE *out, void *ctx);
+	void (*teardown)(void *ctx);
+};
+
+static void *pool_setup(unsigned long poolsize)
+{
+	struct pool *pool = malloc(sizeof(*pool));
+
+	pool->size = poolsize;
+	pool->mem = malloc(poolsize);
+	if (!pool->mem)
+		err(1, "Allocating %lu byte pool", poolsize);
+	alloc_init(pool->mem, poolsize);
+	return pool;
+}
+
+static void pool_teardown(void *ctx)
+{
+	struct pool *pool = ctx;
+
+	free(pool->mem);
+	free(pool);
+}
+
+static void *alloc_bench_get(void *ctx, size_t size)
+{
+	struct pool *pool = ctx;
+	return alloc_get(pool->mem, pool->size, size, 16);
+}
+
+static void alloc_bench_free(void *ctx, void *p)
+{
+	struct pool *pool = ctx;
+	alloc_free(pool->mem, pool->size, p);
+}
+
+static size_t alloc_bench_size(void *ctx, void *p)
+{
+	struct pool *pool = ctx;
+	return alloc_size(pool->mem, pool->size, p);
+}
+
+static void alloc_bench_visualize(FILE *out, void *ctx)
+{
+	struct pool *pool = ctx;
+	alloc_visualize(out, pool->mem, pool->size);
+}
+
+/* alloc only uses tiny_alloc for pools under 1MB: it isn't designed for
+ * more, so it gets at most that much. */
+#define TINY_POOL_MAX (1024 * 1024)
+
+static void *tiny_setup(unsigned long poolsize)
+{
+	struct pool *pool = malloc(sizeof(*pool));
+
+	if (poolsize > TINY_POOL_MAX)
+		poolsize = TINY_POOL_MAX;
+	pool->size = poolsize;
+	pool->mem = malloc(poolsize);
+	if (!pool->mem)
+		err(1, "Allocating %lu byte pool", poolsize);
+	tiny_alloc_init(pool->mem, poolsize);
+	return pool;
+}
+
+static void *tiny_bench_get(void *ctx, size_t size)
+{
+	struct pool *pool = ctx;
+	return tiny_alloc_get(pool->mem, pool->size, size, 16);
+}
+
+static void tiny_bench_free(void *ctx, void *p)
+{
+	struct pool *pool = ctx;
+	tiny_alloc_free(pool->mem, pool->size, p);
+}
+
+static size_t tiny_bench_size(void *ctx, void *p)
+{
+	struct pool *pool = ctx;
+	return tiny_alloc_size(pool->mem, pool->size, p);
+}
+
+static void tiny_bench_visualize(FILE *out, void *ctx)
+{
+	struct pool *pool = ctx;
+	tiny_alloc_visualize(out, pool->mem, pool->size);
+}
+
+static void *block_pool_setup(unsigned long poolsize)
+{
+	return block_pool_new(NULL);
+}
+
+static void *block_pool_get(void *ctx, size_t size)
+{
+	return block_pool_alloc(ctx, size);
+}
+
+/* block_pool can't free individual objects. */
+static void block_pool_nofree(void *ctx, void *p)
+{
+}
+
+static void block_pool_teardown(void *ctx)
+{
+	block_pool_free(ctx);
+}
+
+static void *talloc_setup(unsigned long poolsize)
+{
+	return talloc_named_const(NULL, 0, "allocbench");
+}
+
+static void *talloc_get(void *ctx, size_t size)
+{
+	return talloc_size(ctx, size);
+}
+
+static void talloc_bench_free(void *ctx, void *p)
+{
+	talloc_free(p);
+}
+
+static void talloc_teardown(void *ctx)
+{
+	talloc_free(ctx);
+}
+
+static void *malloc_setup(unsigned long poolsize)
+{
+	return NULL;
+}
+
+static void *malloc_get(void *ctx, size_t size)
+{
+	return malloc(size);
+}
+
+static void malloc_free(void *ctx, void *p)
+{
+	free(p);
+}
+
+static size_t malloc_size(void *ctx, void *p)
+{
+	return malloc_usable_size(p);
+}
+
+static void malloc_teardown(void *ctx)
+{
+}
+
+static const struct allocator allocators[] = {
+	{ "alloc", pool_setup, alloc_bench_get, alloc_bench_free,
+	  alloc_bench_size, alloc_bench_visualize, pool_teardown },
+	{ "tiny_alloc", tiny_setup, tiny_bench_get, tiny_bench_free,
+	  tiny_bench_size, tiny_bench_visualize, pool_teardown },
+	{ "block_pool", block_pool_setup, block_pool_get, block_pool_nofree,
+	  NULL, NULL, block_pool_teardown },
+	{ "talloc", talloc_setup, talloc_get, talloc_bench_free,
+	  NULL, NULL, talloc_teardown },
+	{ "malloc", malloc_setup, malloc_get, malloc_free,
+	  malloc_size, NULL, malloc_teardown },
+};
+
+static uint64_t time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add_op(struct trace *t, bool alloc, uint32_t id, uint32_t size)
+{
+	if (t->num % 1024 == 0) {
+		t->ops = realloc(t->ops, (t->num + 1024) * sizeof(t->ops[0]));
+		if (!t->ops)
+			err(1, "Allocating trace");
+	}
+	t->ops[t->num].alloc = alloc;
+	t->ops[t->num].id = id;
+	t->ops[t->num].size = size;
+	t->num++;
+	if (id > t->max_id)
+		t->max_id = id;
+}
+
+static void read_trace(struct trace *t, const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	char line[100];
+	unsigned long id, size, lineno = 0;
+
+	if (!f)
+		err(1, "Opening %s", filename);
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (sscanf(line, "a %lu %lu", &id, &size) == 2 && id < MAX_ID)
+			add_op(t, true, id, size);
+		else if (sscanf(line, "f %lu", &id) == 1 && id < MAX_ID)
+			add_op(t, false, id, 0);
+		else if (line[0] != '#' && line[0] != '\n')
+			errx(1, "%s:%lu: bad line '%s'", filename, lineno, line);
+	}
+	fclose(f);
+}
+
+enum lifetime { LIFO, FIFO, RANDOM };
+
+static uint32_t random_size(unsigned long min, unsigned long max, bool logdist)
+{
+	double r = random() / (RAND_MAX + 1.0);
+
+	/* Log distribution makes small allocations much more common. */
+	if (logdist)
+		return min * pow((double)max / min, r);
+	return min + (max - min + 1) * r;
+}
+
+/* Allocate num objects, keeping about live around, then free them all.
+ * FIFO is the producer/consumer pattern: the oldest object goes first. */
+static void gen_trace(struct trace *t, unsigned long num, unsigned long live,
+		      unsigned long min, unsigned long max, bool logdist,
+		      enum lifetime lifetime)
+{
+	uint32_t *ids = malloc(sizeof(ids[0]) * (num + 1));
+	unsigned long i, start = 0, end = 0, r;
+
+	for (i = 0; i < num; i++) {
+		/* Random walk around live, so sizes get mixed up. */
+		while (end - start > live || (end - start && random() % 2
+					      && end - start == live)) {
+			switch (lifetime) {
+			case LIFO:
+				add_op(t, false, ids[--end], 0);
+				break;
+			case FIFO:
+				add_op(t, false, ids[start++], 0);
+				break;
+			case RANDOM:
+				r = start + random() % (end - start);
+				add_op(t, false, ids[r], 0);
+				ids[r] = ids[--end];
+				break;
+			}
+		}
+		ids[end++] = i % MAX_ID;
+		add_op(t, true, i % MAX_ID, random_size(min, max, logdist));
+	}
+	while (end > start)
+		add_op(t, false, ids[--end], 0);
+	free(ids);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/* Where does the trace have the most objects live? */
+static unsigned long trace_peak(const struct trace *t)
+{
+	unsigned long i, live = 0, max_live = 0, peak = 0;
+
+	for (i = 0; i < t->num; i++) {
+		if (t->ops[i].alloc)
+			live++;
+		else
+			live--;
+		if (live > max_live) {
+			max_live = live;
+			peak = i;
+		}
+	}
+	return peak;
+}
+
+static void run(const struct allocator *a, const struct trace *t,
+		unsigned long poolsize, bool visualize)
+{
+	unsigned long peak = trace_peak(t);
+	void **ptrs = calloc(t->max_id + 1, sizeof(void *));
+	uint32_t *lat = malloc(t->num * sizeof(lat[0]));
+	uint32_t *sizes = malloc((t->max_id + 1) * sizeof(sizes[0]));
+	unsigned long i, failed = 0, live = 0, max_live = 0;
+	unsigned long requested = 0, used = 0, max_used = 0, max_requested = 0;
+	uint64_t start, elapsed;
+	struct rusage ru;
+	long base_rss;
+	void *ctx;
+
+	if (!ptrs || !lat || !sizes)
+		err(1, "Allocating trace state");
+
+	/* Touch our own memory so it's not blamed on the allocator. */
+	memset(lat, 0, t->num * sizeof(lat[0]));
+	memset(sizes, 0, (t->max_id + 1) * sizeof(sizes[0]));
+	getrusage(RUSAGE_SELF, &ru);
+	base_rss = ru.ru_maxrss;
+
+	/* First pass: raw throughput. */
+	ctx = a->setup(poolsize);
+	start = time_ns();
+	for (i = 0; i < t->num; i++) {
+		const struct op *op = &t->ops[i];
+		if (op->alloc)
+			ptrs[op->id] = a->get(ctx, op->size);
+		else if (ptrs[op->id]) {
+			a->free(ctx, ptrs[op->id]);
+			ptrs[op->id] = NULL;
+		}
+	}
+	elapsed = time_ns() - start;
+	a->teardown(ctx);
+	memset(ptrs, 0, (t->max_id + 1) * sizeof(void *));
+
+	/* Second pass: time each op, and track fragmentation. */
+	ctx = a->setup(poolsize);
+	for (i = 0; i < t->num; i++) {
+		const struct op *op = &t->ops[i];
+		uint64_t before = time_ns();
+		void *p;
+
+		if (op->alloc) {
+			p = ptrs[op->id] = a->get(ctx, op->size);
+			lat[i] = time_ns() - before;
+			if (!p) {
+				failed++;
+				continue;
+			}
+			live++;
+			sizes[op->id] = op->size;
+			requested += op->size;
+			if (a->size)
+				used += a->size(ctx, p);
+		} else if ((p = ptrs[op->id]) != NULL) {
+			size_t size = a->size ? a->size(ctx, p) : 0;
+
+			before = time_ns();
+			a->free(ctx, p);
+			lat[i] = time_ns() - before;
+			ptrs[op->id] = NULL;
+			live--;
+			used -= size;
+			requested -= sizes[op->id];
+		} else
+			lat[i] = 0;
+
+		if (live > max_live) {
+			max_live = live;
+			max_used = used;
+			max_requested = requested;
+		}
+		if (i == peak && visualize && a->visualize) {
+			printf("%s at peak (%lu live):\n", a->name, live);
+			a->visualize(stdout, ctx);
+		}
+	}
+	a->teardown(ctx);
+
+	qsort(lat, t->num, sizeof(lat[0]), cmp_u32);
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("%-11s %11.0f %7u %7u %8u %9u %7lu",
+	       a->name, t->num / (elapsed / 1e9),
+	       lat[t->num / 2], lat[t->num * 99 / 100],
+	       lat[t->num * 999 / 1000], lat[t->num - 1], failed);
+	if (a->size && max_used)
+		printf(" %7.1f%%",
+		       100.0 * (max_used - max_requested) / max_used);
+	else
+		printf(" %8s", "-");
+	printf(" %9lu\n", (unsigned long)(ru.ru_maxrss - base_rss));
+	free(ptrs);
+	free(lat);
+	free(sizes);
+}
+
+static void usage(void)
+{
+	errx(1, "Usage: allocbench [options] [allocator...]\n"
+	     "  -t <tracefile>     Replay this trace (otherwise generate one):\n"
+	     "  -n <num>           Allocations to generate (default 1000000)\n"
+	     "  -l <num>           Objects live at once (default 10000)\n"
+	     "  -s <min>-<max>     Size range (default 8-512)\n"
+	     "  -d uniform|log     Size distribution (default log)\n"
+	     "  -f lifo|fifo|random  Free order (default random)\n"
+	     "  -p <bytes>         Pool size for alloc (default 64M, 1M max for tiny)\n"
+	     "  -v                 Visualize pools at peak usage\n"
+	     "Allocators: alloc tiny_alloc block_pool talloc malloc");
+}
+
+int main(int argc, char *argv[])
+{
+	struct trace t = { NULL, 0, 0 };
+	const char *tracefile = NULL;
+	unsigned long num = 1000000, live = 10000, min = 8, max = 512;
+	unsigned long poolsize = 64 * 1024 * 1024;
+	enum lifetime lifetime = RANDOM;
+	bool logdist = true, visualize = false;
+	unsigned int i, j;
+	int c;
+
+	while ((c = getopt(argc, argv, "t:n:l:s:d:f:p:v")) != -1) {
+		switch (c) {
+		case 't':
+			tracefile = optarg;
+			break;
+		case 'n':
+			num = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			live = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (sscanf(optarg, "%lu-%lu", &min, &max) != 2
+			    || !min || min > max)
+				usage();
+			break;
+		case 'd':
+			if (strcmp(optarg, "uniform") == 0)
+				logdist = false;
+			else if (strcmp(optarg, "log") == 0)
+				logdist = true;
+			else
+				usage();
+			break;
+		case 'f':
+			if (strcmp(optarg, "lifo") == 0)
+				lifetime = LIFO;
+			else if (strcmp(optarg, "fifo") == 0)
+				lifetime = FIFO;
+			else if (strcmp(optarg, "random") == 0)
+				lifetime = RANDOM;
+			else
+				usage();
+			break;
+		case 'p':
+			poolsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			visualize = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (tracefile)
+		read_trace(&t, tracefile);
+	else
+		gen_trace(&t, num, live, min, max, logdist, lifetime);
+	if (!t.num)
+		errx(1, "Empty trace");
+
+	printf("%-11s %11s %7s %7s %8s %9s %7s %8s %9s\n",
+	       "allocator", "ops/sec", "p50ns", "p99ns", "p99.9ns", "maxns",
+	       "failed", "intfrag", "rssKB");
+	fflush(stdout);
+
+	for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+		int status;
+
+		/* Only run the ones they asked for. */
+		if (optind < argc) {
+			for (j = optind; j < argc; j++)
+				if (strcmp(argv[j], allocators[i].name) == 0)
+					break;
+			if (j == argc)
+				continue;
+		}
+
+		/* Each in its own process, so maxrss means something. */
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			run(&allocators[i], &t, poolsize, visualize);
+			exit(0);
+		}
+		if (wait(&status) < 0 || !WIFEXITED(status)
+		    || WEXITSTATUS(status))
+			printf("%-11s failed\n", allocators[i].name);
+		fflush(stdout);
+	}
+	return 0;
+}
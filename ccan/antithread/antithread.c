@@ -1,20 +1,35 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
 #include <errno.h>
 #include <assert.h>
 #include <err.h>
+#include "config.h"
 #include "antithread.h"
 #include <ccan/noerr/noerr.h>
 #include <ccan/talloc/talloc.h>
 #include <ccan/read_write_all/read_write_all.h>
 #include <ccan/alloc/alloc.h>
 #include <ccan/list/list.h>
+#if HAVE_LINUX_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#if !HAVE_BUILTIN_ATOMIC
+#error "antithread needs the __atomic builtins"
+#endif
 
 /* FIXME: Valgrind support should be possible for some cases.  Tricky
  * case is where another process allocates for you, but at worst we
@@ -23,15 +38,78 @@
 
 static LIST_HEAD(pools);
 
+/* Our pid, kept here since getpid() is a syscall (set in at_pool, fork
+ * and at_get_pool). */
+static pid_t my_pid;
+
+/* AT_SPIN, or 0 on a uniprocessor (set in at_pool and at_get_pool). */
+static unsigned int at_spin;
+
+/* A process-shared lock living in the pool.  word is 0 when unlocked,
+ * otherwise the holder's pid, with AT_LOCK_WAITERS set if someone may be
+ * asleep on it: keeping both in one word means there's no moment where
+ * it's held but we can't tell by whom.  Like the fcntl locks it replaces,
+ * a process can take it again while it holds it. */
+struct at_futex {
+	int word;
+	unsigned int depth;
+};
+
+/* Above any pid (Linux's PID_MAX_LIMIT is 2^22). */
+#define AT_LOCK_WAITERS (1 << 30)
+
+/* at_lock() hashes objects onto these. */
+#define AT_NUM_LOCKS 256
+
+/* Messages in flight to (or from) one antithread. */
+#define AT_CHAN_SIZE 1024
+
+/* Spin this many times on an empty channel before going to sleep. */
+#define AT_SPIN 1000
+
+/* How often (ms) sleepers check whether the other side has died. */
+#define AT_DEATH_CHECK_MS 10
+
+/* One direction of at_tell/at_read.  Until the reader asks for an fd to
+ * poll, messages go purely through the ring; afterwards each also has a
+ * byte written to the pipe, so poll() and EOF work as they always did. */
+struct at_channel {
+	struct at_futex lock;
+	/* Free-running: head is next to write, tail is next to read. */
+	unsigned int head, tail;
+	/* Bumped on every push and pop: sleepers futex wait on it. */
+	int seq;
+	int reader_waiting, writer_waiting;
+	int fd_mode;
+	const void *msg[AT_CHAN_SIZE];
+};
+
+/* This sits at the start of every pool; alloc gets the rest. */
+struct at_shared {
+	struct at_futex pool_lock;
+	struct at_futex locks[AT_NUM_LOCKS];
+};
+
+#define AT_SHARED_SIZE ((sizeof(struct at_shared) + 63) & ~63UL)
+
 /* Talloc destroys parents before children (damn Tridge's failing destructors!)
  * so we need the first child (ie. last-destroyed) to actually clean up. */
 struct at_pool_contents {
 	struct list_node list;
 	void *pool;
 	unsigned long poolsize;
+	struct at_shared *shared;
+	void *heap;
+	unsigned long heapsize;
 	int fd;
 	int parent_rfd, parent_wfd;
+	/* Write end of our own incoming pipe, until at_parent_fd(). */
+	int parent_self_wfd;
+	pid_t parent_pid;
+	struct at_channel *from_parent, *to_parent;
 	struct at_pool *atp;
+	/* The antithreads we've created on this pool. */
+	struct list_head athreads;
 };
 
 struct at_pool {
@@ -40,40 +118,101 @@ struct at_pool {
 };
 
 struct athread {
+	struct list_node list;
 	pid_t pid;
 	int rfd, wfd;
+	/* Write end of our own incoming pipe, until at_fd(). */
+	int self_wfd;
+	struct at_channel *to_child, *from_child;
+	struct at_pool_contents *pool;
 };
 
-/* FIXME: Better locking through futexes. */
-static void lock(int fd, unsigned long off)
+#if HAVE_LINUX_FUTEX
+/* Not FUTEX_PRIVATE: these words are shared between processes. */
+static void futex_wait(int *addr, int val, unsigned int ms)
+{
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(int *addr, int num)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, num, NULL, NULL, 0);
+}
+#else
+static void futex_wait(int *addr, int val, unsigned int ms)
+{
+	if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+		sched_yield();
+}
+
+static void futex_wake(int *addr, int num)
+{
+}
+#endif
+
+/* Has a process holding a lock died without releasing it? */
+static bool owner_died(pid_t owner)
 {
-	struct flock fl;
+	return owner && owner != my_pid && kill(owner, 0) != 0
+		&& errno == ESRCH;
+}
 
-	fl.l_type = F_WRLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = off;
-	fl.l_len = 1;
+static void lock(struct at_futex *f)
+{
+	int c = 0, mine = my_pid;
+	bool slept = false;
+
+	/* Only we ever store our pid here, so this can't race. */
+	if ((__atomic_load_n(&f->word, __ATOMIC_RELAXED) & ~AT_LOCK_WAITERS)
+	    == my_pid) {
+		f->depth++;
+		return;
+	}
 
-	while (fcntl(fd, F_SETLKW, &fl) < 0) {
-		if (errno != EINTR)
-			err(1, "Failure locking antithread file");
+	while (!__atomic_compare_exchange_n(&f->word, &c, mine, false,
+					    __ATOMIC_ACQUIRE,
+					    __ATOMIC_RELAXED)) {
+		/* Once we've had to wait, others may be asleep too. */
+		mine = my_pid | AT_LOCK_WAITERS;
+		/* fcntl locks died with their holder: emulate that. */
+		if (c == 0 || (slept && owner_died(c & ~AT_LOCK_WAITERS)))
+			continue;
+		if (!(c & AT_LOCK_WAITERS)
+		    && !__atomic_compare_exchange_n(&f->word, &c,
+						    c | AT_LOCK_WAITERS, false,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED))
+			continue;
+		futex_wait(&f->word, c | AT_LOCK_WAITERS,
+			   AT_DEATH_CHECK_MS * 10);
+		slept = true;
+		c = 0;
 	}
+	f->depth = 1;
 }
 
-static void unlock(int fd, unsigned long off)
+static void unlock(struct at_futex *f)
 {
-	struct flock fl;
 	int serrno = errno;
 
-	fl.l_type = F_UNLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = off;
-	fl.l_len = 1;
-
-	fcntl(fd, F_SETLK, &fl);
+	if (--f->depth)
+		return;
+	if (__atomic_exchange_n(&f->word, 0, __ATOMIC_RELEASE)
+	    & AT_LOCK_WAITERS)
+		futex_wake(&f->word, 1);
 	errno = serrno;
 }
 
+static struct at_futex *obj_lock(struct at_pool_contents *p, const void *obj)
+{
+	unsigned long off = (char *)obj - (char *)p->pool;
+
+	/* talloc pointers are 16-byte aligned. */
+	return &p->shared->locks[((off >> 4) * 0x9E3779B1U) % AT_NUM_LOCKS];
+}
+
 /* This pointer is in a pool.  Find which one. */
 static struct at_pool_contents *find_pool(const void *ptr)
 {
@@ -98,9 +237,19 @@ static int destroy_pool(struct at_pool_contents *p)
 	close(p->fd);
 	close(p->parent_rfd);
 	close(p->parent_wfd);
+	close(p->parent_self_wfd);
 	return 0;
 }
 
+/* The shared header comes first, alloc's heap after it. */
+static void setup_shared(struct at_pool_contents *p)
+{
+	at_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? AT_SPIN : 0;
+	p->shared = p->pool;
+	p->heap = (char *)p->pool + AT_SHARED_SIZE;
+	p->heapsize = p->poolsize - AT_SHARED_SIZE;
+}
+
 static void *at_realloc(const void *parent, void *ptr, size_t size)
 {
 	struct at_pool_contents *p = find_pool(parent);
@@ -108,20 +257,20 @@ static void *at_realloc(const void *parent, void *ptr, size_t size)
 	void *new;
 
 	if (size == 0) {
-		alloc_free(p->pool, p->poolsize, ptr);
+		alloc_free(p->heap, p->heapsize, ptr);
 		new = NULL;
 	} else if (ptr == NULL) {
 		/* FIXME: Alignment */
-		new = alloc_get(p->pool, p->poolsize, size, 16);
+		new = alloc_get(p->heap, p->heapsize, size, 16);
 	} else {
-		if (size <= alloc_size(p->pool, p->poolsize, ptr))
+		if (size <= alloc_size(p->heap, p->heapsize, ptr))
 			new = ptr;
 		else {
-			new = alloc_get(p->pool, p->poolsize, size, 16);
+			new = alloc_get(p->heap, p->heapsize, size, 16);
 			if (new) {
 				memcpy(new, ptr,
-				       alloc_size(p->pool, p->poolsize, ptr));
-				alloc_free(p->pool, p->poolsize, ptr);
+				       alloc_size(p->heap, p->heapsize, ptr));
+				alloc_free(p->heap, p->heapsize, ptr);
 			}
 		}
 	}
@@ -134,7 +283,7 @@ static void talloc_lock(const void *ptr)
 {
 	struct at_pool_contents *p = find_pool(ptr);
 
-	lock(p->fd, 0);
+	lock(&p->shared->pool_lock);
 	assert(!locked);
 	locked = p;
 }
@@ -144,7 +293,7 @@ static void talloc_unlock(void)
 	struct at_pool_contents *p = locked;
 
 	locked = NULL;
-	unlock(p->fd, 0);
+	unlock(&p->shared->pool_lock);
 }
 
 /* We add 16MB to size.  This compensates for address randomization. */
@@ -200,9 +349,13 @@ struct at_pool *at_pool(unsigned long size)
 
 	p->fd = fd;
 	p->poolsize = size;
-	p->parent_rfd = p->parent_wfd = -1;
+	p->parent_rfd = p->parent_wfd = p->parent_self_wfd = -1;
+	p->from_parent = p->to_parent = NULL;
 	p->atp = atp;
-	alloc_init(p->pool, p->poolsize);
+	list_head_init(&p->athreads);
+	my_pid = getpid();
+	setup_shared(p);
+	alloc_init(p->heap, p->heapsize);
 	list_add(&pools, &p->list);
 	talloc_set_destructor(p, destroy_pool);
 
@@ -235,19 +388,197 @@ static int cant_destroy_self(struct athread *at)
 
 static int destroy_at(struct athread *at)
 {
+	struct at_pool_contents *p = at->pool;
+
 	/* If it is already a zombie, this is harmless. */
 	kill(at->pid, SIGTERM);
 
+	list_del(&at->list);
 	close(at->rfd);
 	close(at->wfd);
+	if (at->self_wfd != -1)
+		close(at->self_wfd);
 
 	/* FIXME: Should we do SIGKILL if process doesn't exit soon? */
 	if (waitpid(at->pid, NULL, 0) != at->pid)
 		err(1, "Waiting for athread %p (pid %u)", at, at->pid);
 
+	/* It's dead, so it can't be holding the pool lock. */
+	lock(&p->shared->pool_lock);
+	alloc_free(p->heap, p->heapsize, at->to_child);
+	alloc_free(p->heap, p->heapsize, at->from_child);
+	unlock(&p->shared->pool_lock);
 	return 0;
 }
 
+static struct at_channel *new_channel(struct at_pool_contents *p)
+{
+	struct at_channel *ch;
+
+	lock(&p->shared->pool_lock);
+	ch = alloc_get(p->heap, p->heapsize, sizeof(*ch), 64);
+	unlock(&p->shared->pool_lock);
+	if (ch)
+		memset(ch, 0, sizeof(*ch));
+	return ch;
+}
+
+/* Wait for something to change on ch: false if peer died meanwhile. */
+static bool channel_wait(struct at_channel *ch, int seq, bool (*alive)(void *),
+			 void *arg)
+{
+	futex_wait(&ch->seq, seq, AT_DEATH_CHECK_MS);
+	return alive(arg);
+}
+
+static void channel_push(struct at_channel *ch, const void *msg, int wfd,
+			 bool (*alive)(void *), void *arg)
+{
+	bool wake;
+	int seq;
+
+	lock(&ch->lock);
+	while (ch->head - ch->tail == AT_CHAN_SIZE) {
+		/* Full: wait for the reader to make room. */
+		ch->writer_waiting = 1;
+		seq = ch->seq;
+		unlock(&ch->lock);
+		if (!channel_wait(ch, seq, alive, arg))
+			errx(1, "Antithread channel full, and reader died");
+		lock(&ch->lock);
+	}
+	ch->msg[ch->head++ % AT_CHAN_SIZE] = msg;
+	ch->seq++;
+	/* Once the reader polls, every message carries a byte, as before. */
+	if (ch->fd_mode && write(wfd, "", 1) != 1)
+		err(1, "Failure writing to antithread");
+	wake = ch->reader_waiting;
+	ch->reader_waiting = 0;
+	unlock(&ch->lock);
+
+	if (wake)
+		futex_wake(&ch->seq, INT_MAX);
+}
+
+/* NULL (and errno 0) if the writer died. */
+static void *channel_pop(struct at_channel *ch, int rfd,
+			 bool (*alive)(void *), void *arg)
+{
+	const void *msg;
+	unsigned int i;
+	bool wake;
+	int seq;
+	char c;
+
+	if (__atomic_load_n(&ch->fd_mode, __ATOMIC_ACQUIRE)) {
+		/* The pipe tells us there's a message, or EOF. */
+		switch (read(rfd, &c, 1)) {
+		case -1:
+			err(1, "Reading from antithread");
+		case 0:
+			return NULL;
+		}
+	}
+
+	/* Spinning only helps if the writer can run meanwhile. */
+	for (i = 0; i < at_spin; i++) {
+		if (__atomic_load_n(&ch->head, __ATOMIC_ACQUIRE) != ch->tail)
+			break;
+	}
+
+	lock(&ch->lock);
+	while (ch->head == ch->tail) {
+		ch->reader_waiting = 1;
+		seq = ch->seq;
+		unlock(&ch->lock);
+		if (!channel_wait(ch, seq, alive, arg)) {
+			/* It might have said something before it died. */
+			lock(&ch->lock);
+			if (ch->head != ch->tail)
+				break;
+			unlock(&ch->lock);
+			return NULL;
+		}
+		lock(&ch->lock);
+	}
+	msg = ch->msg[ch->tail++ % AT_CHAN_SIZE];
+	ch->seq++;
+	wake = ch->writer_waiting;
+	ch->writer_waiting = 0;
+	unlock(&ch->lock);
+
+	if (wake)
+		futex_wake(&ch->seq, INT_MAX);
+	return (void *)msg;
+}
+
+/* The reader wants to poll: give the pipe a byte per queued message, then
+ * drop our write end so the writer's exit gives EOF as it always did. */
+static int channel_fd(struct at_channel *ch, int rfd, int *self_wfd)
+{
+	unsigned int i;
+
+	if (*self_wfd == -1)
+		return rfd;
+
+	lock(&ch->lock);
+	for (i = ch->tail; i != ch->head; i++) {
+		if (write(*self_wfd, "", 1) != 1)
+			err(1, "Failure writing to own antithread pipe");
+	}
+	__atomic_store_n(&ch->fd_mode, 1, __ATOMIC_RELEASE);
+	unlock(&ch->lock);
+
+	close(*self_wfd);
+	*self_wfd = -1;
+	return rfd;
+}
+
+/* Is this child still running? (Don't reap it: destroy_at does that) */
+static bool child_alive(void *arg)
+{
+	struct athread *at = arg;
+	siginfo_t info;
+
+	info.si_pid = 0;
+	if (waitid(P_PID, at->pid, &info, WEXITED|WNOHANG|WNOWAIT) != 0)
+		return false;
+	return info.si_pid == 0;
+}
+
+static bool parent_alive(void *arg)
+{
+	struct at_pool_contents *p = arg;
+
+	return getppid() == p->parent_pid;
+}
+
+static void set_cloexec(int fd, bool on)
+{
+	fcntl(fd, F_SETFD, on ? FD_CLOEXEC : 0);
+}
+
+/* A new child mustn't keep the write ends of anyone else's incoming pipes
+ * open, or they won't see EOF when their peer exits. */
+static void close_inherited_self_wfds(void)
+{
+	struct at_pool_contents *p;
+	struct athread *at;
+
+	list_for_each(&pools, p, list) {
+		list_for_each(&p->athreads, at, list) {
+			if (at->self_wfd != -1) {
+				close(at->self_wfd);
+				at->self_wfd = -1;
+			}
+		}
+		if (p->parent_self_wfd != -1) {
+			close(p->parent_self_wfd);
+			p->parent_self_wfd = -1;
+		}
+	}
+}
+
 /* Sets up thread and forks it.  NULL on error. */
 static struct athread *fork_thread(struct at_pool *atp)
 {
@@ -261,30 +592,48 @@ static struct athread *fork_thread(struct at_pool *atp)
 
 	/* We don't want this allocated *in* the pool. */
 	at = talloc_steal(atp, talloc(NULL, struct athread));
+	at->pool = pool;
+
+	at->to_child = new_channel(pool);
+	at->from_child = new_channel(pool);
+	if (!at->to_child || !at->from_child)
+		goto free_channels;
 
 	if (pipe(p2c) != 0)
-		goto free;
+		goto free_channels;
 
 	if (pipe(c2p) != 0)
 		goto close_p2c;
 
+	/* Or the child will flush its copy of anything we buffered. */
+	fflush(stdout);
 	at->pid = fork();
 	if (at->pid == -1)
 		goto close_c2p;
 
+	/* Each side keeps the write end of its incoming pipe until it
+	 * wants to poll it: see channel_fd(). */
 	if (at->pid == 0) {
 		/* Child */
 		close(c2p[0]);
-		close(p2c[1]);
+		close_inherited_self_wfds();
+		set_cloexec(p2c[1], true);
+		pool->parent_pid = my_pid;
+		my_pid = getpid();
 		pool->parent_rfd = p2c[0];
 		pool->parent_wfd = c2p[1];
+		pool->parent_self_wfd = p2c[1];
+		pool->from_parent = at->to_child;
+		pool->to_parent = at->from_child;
 		talloc_set_destructor(at, cant_destroy_self);
 	} else {
 		/* Parent */
-		close(c2p[1]);
 		close(p2c[0]);
 		at->rfd = c2p[0];
 		at->wfd = p2c[1];
+		at->self_wfd = c2p[1];
+		set_cloexec(c2p[1], true);
+		list_add(&pool->athreads, &at->list);
 		talloc_set_destructor(at, destroy_at);
 	}
 
@@ -295,7 +644,13 @@ close_c2p:
 close_p2c:
 	close_noerr(p2c[0]);
 	close_noerr(p2c[1]);
-free:
+free_channels:
+	lock(&pool->shared->pool_lock);
+	if (at->to_child)
+		alloc_free(pool->heap, pool->heapsize, at->to_child);
+	if (at->from_child)
+		alloc_free(pool->heap, pool->heapsize, at->from_child);
+	unlock(&pool->shared->pool_lock);
 	talloc_free(at);
 	return NULL;
 }
@@ -342,12 +697,18 @@ struct athread *at_spawn(struct at_pool *atp, void *arg, char *cmdline[])
 		/* child */
 		char *argv[num_args(cmdline) + 2];
 		argv[0] = cmdline[0];
-		argv[1] = talloc_asprintf(NULL, "AT:%p/%lu/%i/%i/%i/%p",
+		argv[1] = talloc_asprintf(NULL,
+					  "AT:%p/%lu/%i/%i/%i/%i/%p/%p/%p",
 					  atp->p->pool, atp->p->poolsize,
 					  atp->p->fd, atp->p->parent_rfd,
-					  atp->p->parent_wfd, arg);
+					  atp->p->parent_wfd,
+					  atp->p->parent_self_wfd,
+					  atp->p->from_parent,
+					  atp->p->to_parent, arg);
 		/* Copy including NULL terminator. */
 		memcpy(&argv[2], &cmdline[1], num_args(cmdline)*sizeof(char *));
+		/* This one we do hand on: see at_get_pool(). */
+		set_cloexec(atp->p->parent_self_wfd, false);
 		execvp(argv[0], argv);
 
 		err = errno;
@@ -355,8 +716,19 @@ struct athread *at_spawn(struct at_pool *atp, void *arg, char *cmdline[])
 		exit(1);
 	}
 
-	/* Child should always write an error code (or 0). */
+	/* Child should always write an error code (or 0).  We hold the
+	 * pipe's write end too, so we can't rely on EOF if it dies. */
+	for (;;) {
+		struct pollfd pfd = { .fd = at->rfd, .events = POLLIN };
+
+		if (poll(&pfd, 1, AT_DEATH_CHECK_MS) == 1)
+			break;
+		/* It may have written its error just before exiting. */
+		if (!child_alive(at) && poll(&pfd, 1, 0) != 1)
+			goto died;
+	}
 	if (read(at->rfd, &err, sizeof(err)) != sizeof(err)) {
+	died:
 		errno = ECHILD;
 		talloc_free(at);
 		return NULL;
@@ -372,33 +744,19 @@ struct athread *at_spawn(struct at_pool *atp, void *arg, char *cmdline[])
 /* The fd to poll on */
 int at_fd(struct athread *at)
 {
-	return at->rfd;
+	return channel_fd(at->from_child, at->rfd, &at->self_wfd);
 }
 
-/* What's the antithread saying?  Blocks if fd not ready. */
+/* What's the antithread saying?  Blocks if nothing there yet. */
 void *at_read(struct athread *at)
 {
-	void *ret;
-
-	switch (read(at->rfd, &ret, sizeof(ret))) {
-	case -1:
-		err(1, "Reading from athread %p (pid %u)", at, at->pid);
-	case 0:
-		/* Thread died. */
-		return NULL;
-	case sizeof(ret):
-		return ret;
-	default:
-		/* Should never happen. */
-		err(1, "Short read from athread %p (pid %u)", at, at->pid);
-	}
+	return channel_pop(at->from_child, at->rfd, child_alive, at);
 }
 
 /* Say something to a child. */
 void at_tell(struct athread *at, const void *status)
 {
-	if (write(at->wfd, &status, sizeof(status)) != sizeof(status))
-		err(1, "Failure writing to athread %p (pid %u)", at, at->pid);
+	channel_push(at->to_child, status, at->wfd, child_alive, at);
 }
 
 /* For child to grab arguments from command line (removes them) */
@@ -420,12 +778,17 @@ struct at_pool *at_get_pool(int *argc, char *argv[], void **arg)
 
 	p = atp->p = talloc(atp, struct at_pool_contents);
 
-	if (sscanf(argv[1], "AT:%p/%lu/%i/%i/%i/%p", 
+	if (sscanf(argv[1], "AT:%p/%lu/%i/%i/%i/%i/%p/%p/%p",
 		   &p->pool, &p->poolsize, &p->fd,
-		   &p->parent_rfd, &p->parent_wfd, arg) != 6) {
+		   &p->parent_rfd, &p->parent_wfd, &p->parent_self_wfd,
+		   &p->from_parent, &p->to_parent, arg) != 9) {
 		errno = EINVAL;
 		goto fail;
 	}
+	list_head_init(&p->athreads);
+	my_pid = getpid();
+	p->parent_pid = getppid();
+	setup_shared(p);
 
 	/* FIXME: To try to adjust for address space randomization, we
 	 * could re-exec a few times. */
@@ -470,30 +833,18 @@ void at_tell_parent(struct at_pool *atp, const void *status)
 	if (atp->p->parent_wfd == -1)
 		errx(1, "This process is not an antithread of this pool");
 
-	if (write(atp->p->parent_wfd, &status, sizeof(status))!=sizeof(status))
-		err(1, "Failure writing to parent");
+	channel_push(atp->p->to_parent, status, atp->p->parent_wfd,
+		     parent_alive, atp->p);
 }
 
-/* What's the parent saying?  Blocks if fd not ready. */
+/* What's the parent saying?  Blocks if nothing there yet. */
 void *at_read_parent(struct at_pool *atp)
 {
-	void *ret;
-
 	if (atp->p->parent_rfd == -1)
 		errx(1, "This process is not an antithread of this pool");
 
-	switch (read(atp->p->parent_rfd, &ret, sizeof(ret))) {
-	case -1:
-		err(1, "Reading from parent");
-	case 0:
-		/* Parent died. */
-		return NULL;
-	case sizeof(ret):
-		return ret;
-	default:
-		/* Should never happen. */
-		err(1, "Short read from parent");
-	}
+	return channel_pop(atp->p->from_parent, atp->p->parent_rfd,
+			   parent_alive, atp->p);
 }
 
 /* The fd to poll on */
@@ -502,49 +853,365 @@ int at_parent_fd(struct at_pool *atp)
 	if (atp->p->parent_rfd == -1)
 		errx(1, "This process is not an antithread of this pool");
 
-	return atp->p->parent_rfd;
+	return channel_fd(atp->p->from_parent, atp->p->parent_rfd,
+			  &atp->p->parent_self_wfd);
 }
 
-/* FIXME: Futexme. */
 void at_lock(void *obj)
 {
 	struct at_pool *atp = talloc_find_parent_bytype(obj, struct at_pool);
-#if 0
-	unsigned int *l;
-
-	/* This isn't required yet, but ensures it's a talloc ptr */
-	l = talloc_lock_ptr(obj);
-#endif
 
-	lock(atp->p->fd, (char *)obj - (char *)atp->p->pool);
-
-#if 0
-	if (*l)
-		errx(1, "Object %p was already locked (something died?)", obj);
-	*l = 1;
-#endif
+	lock(obj_lock(atp->p, obj));
 }
 
 void at_unlock(void *obj)
 {
 	struct at_pool *atp = talloc_find_parent_bytype(obj, struct at_pool);
-#if 0
-	unsigned int *l;
 
-	l = talloc_lock_ptr(obj);
-	if (!*l)
-		errx(1, "Object %p was already unlocked", obj);
-	*l = 0;
-#endif
-	unlock(atp->p->fd, (char *)obj - (char *)atp->p->pool);
+	unlock(obj_lock(atp->p, obj));
 }
 
 void at_lock_all(struct at_pool *atp)
 {
-	lock(atp->p->fd, 0);
+	lock(&atp->p->shared->pool_lock);
 }
 	
 void at_unlock_all(struct at_pool *atp)
 {
-	unlock(atp->p->fd, 0);
+	unlock(&atp->p->shared->pool_lock);
+}
+
+/* Free-running indices into a ring of wq->size slots. */
+struct at_wq_ring {
+	unsigned int head, tail;
+};
+
+struct at_wq_done {
+	void *job, *result;
+};
+
+/* What each worker gets handed by at_run. */
+struct at_wq_worker {
+	struct at_wq_shared *sh;
+	unsigned int id;
+};
+
+/* The part of a workqueue which lives in the pool.  Nothing overflows:
+ * the parent never lets more than size jobs be outstanding. */
+struct at_wq_shared {
+	struct at_futex lock;
+	unsigned int size, num_workers;
+	int shutdown;
+	/* Bumped when jobs are queued (or on shutdown), and when done. */
+	int work_seq, done_seq;
+	unsigned int workers_idle;
+	int parent_waiting;
+	void *(*fn)(struct at_pool *, void *, void *);
+	void *arg;
+	struct at_wq_ring done;
+	struct at_wq_done *done_slot;
+	/* ring[0] is for anyone, ring[1+i] only for worker i. */
+	struct at_wq_ring *ring;
+	void **slot;
+	struct at_wq_worker *worker;
+};
+
+struct at_workqueue {
+	struct at_pool *atp;
+	struct at_wq_shared *sh;
+	struct athread **workers;
+	/* Submitted, and not yet taken off sh->done. */
+	unsigned int outstanding;
+	/* Results we took off sh->done to make room for a submit. */
+	struct at_wq_done *backlog;
+	unsigned int backlog_start, backlog_num;
+};
+
+static bool wq_empty(const struct at_wq_ring *r)
+{
+	return r->head == r->tail;
+}
+
+static void *wq_pop(struct at_wq_shared *sh, unsigned int ring)
+{
+	struct at_wq_ring *r = &sh->ring[ring];
+
+	if (wq_empty(r))
+		return NULL;
+	return sh->slot[ring * sh->size + r->tail++ % sh->size];
+}
+
+static void *wq_worker(struct at_pool *atp, struct at_wq_worker *w)
+{
+	struct at_wq_shared *sh = w->sh;
+	struct at_wq_done *d;
+	void *job, *result;
+	bool wake;
+	int seq;
+
+	lock(&sh->lock);
+	for (;;) {
+		/* Our own jobs first, then anyone's. */
+		if (wq_empty(&sh->ring[1 + w->id]) && wq_empty(&sh->ring[0])) {
+			if (sh->shutdown)
+				break;
+			sh->workers_idle++;
+			seq = sh->work_seq;
+			unlock(&sh->lock);
+			futex_wait(&sh->work_seq, seq, AT_DEATH_CHECK_MS);
+			lock(&sh->lock);
+			sh->workers_idle--;
+			if (!parent_alive(atp->p))
+				break;
+			continue;
+		}
+		job = wq_pop(sh, 1 + w->id);
+		if (!job)
+			job = wq_pop(sh, 0);
+		unlock(&sh->lock);
+
+		result = sh->fn(atp, job, sh->arg);
+
+		lock(&sh->lock);
+		d = &sh->done_slot[sh->done.head++ % sh->size];
+		d->job = job;
+		d->result = result;
+		sh->done_seq++;
+		wake = sh->parent_waiting;
+		sh->parent_waiting = 0;
+		if (wake) {
+			/* No need to hold the lock while we wake it. */
+			unlock(&sh->lock);
+			futex_wake(&sh->done_seq, 1);
+			lock(&sh->lock);
+		}
+	}
+	unlock(&sh->lock);
+	return NULL;
+}
+
+static bool wq_workers_alive(struct at_workqueue *wq)
+{
+	unsigned int i;
+
+	for (i = 0; i < wq->sh->num_workers; i++)
+		if (!child_alive(wq->workers[i]))
+			return false;
+	return true;
+}
+
+/* Takes up to max results off the shared ring, waiting for at least one.
+ * 0 if a worker died first. */
+static unsigned int wq_take_done(struct at_workqueue *wq,
+				 struct at_wq_done *done, unsigned int max)
+{
+	struct at_wq_shared *sh = wq->sh;
+	unsigned int num;
+	int seq;
+
+	lock(&sh->lock);
+	while (wq_empty(&sh->done)) {
+		sh->parent_waiting = 1;
+		seq = sh->done_seq;
+		unlock(&sh->lock);
+		futex_wait(&sh->done_seq, seq, AT_DEATH_CHECK_MS);
+		lock(&sh->lock);
+		if (wq_empty(&sh->done) && !wq_workers_alive(wq)) {
+			unlock(&sh->lock);
+			return 0;
+		}
+	}
+	for (num = 0; num < max && !wq_empty(&sh->done); num++)
+		done[num] = sh->done_slot[sh->done.tail++ % sh->size];
+	unlock(&sh->lock);
+
+	wq->outstanding -= num;
+	return num;
+}
+
+bool at_wq_submit_many(struct at_workqueue *wq, void *jobs[],
+		       unsigned int num, int worker)
+{
+	struct at_wq_shared *sh = wq->sh;
+	unsigned int ring, i, n;
+	struct at_wq_done *d, *backlog;
+	bool wake;
+
+	if (worker != AT_WQ_ANY && (unsigned)worker >= sh->num_workers)
+		errx(1, "No worker %i in workqueue %p", worker, wq);
+	ring = worker + 1;
+
+	while (num) {
+		/* Full?  Wait for a result, and stash it for at_wq_results. */
+		if (wq->outstanding == sh->size) {
+			if (wq->backlog_start + wq->backlog_num + sh->size
+			    > talloc_array_length(wq->backlog)) {
+				memmove(wq->backlog,
+					wq->backlog + wq->backlog_start,
+					wq->backlog_num * sizeof(*d));
+				wq->backlog_start = 0;
+				backlog = talloc_realloc(wq, wq->backlog,
+							 struct at_wq_done,
+							 wq->backlog_num
+							 + sh->size);
+				if (!backlog) {
+					errno = ENOMEM;
+					return false;
+				}
+				wq->backlog = backlog;
+			}
+			d = wq->backlog + wq->backlog_start + wq->backlog_num;
+			n = wq_take_done(wq, d, sh->size);
+			if (!n)
+				return false;
+			wq->backlog_num += n;
+		}
+
+		n = sh->size - wq->outstanding;
+		if (n > num)
+			n = num;
+
+		lock(&sh->lock);
+		for (i = 0; i < n; i++)
+			sh->slot[ring * sh->size + sh->ring[ring].head++
+				 % sh->size] = jobs[i];
+		sh->work_seq++;
+		wake = sh->workers_idle;
+		unlock(&sh->lock);
+
+		/* Only the right worker can take it, so wake them all. */
+		if (wake)
+			futex_wake(&sh->work_seq,
+				   worker == AT_WQ_ANY ? n : INT_MAX);
+		wq->outstanding += n;
+		jobs += n;
+		num -= n;
+	}
+	return true;
+}
+
+bool at_wq_submit(struct at_workqueue *wq, void *job, int worker)
+{
+	return at_wq_submit_many(wq, &job, 1, worker);
+}
+
+unsigned int at_wq_results(struct at_workqueue *wq, void *jobs[],
+			   void *results[], unsigned int max)
+{
+	struct at_wq_done done[64];
+	unsigned int i, n;
+
+	if (wq->backlog_num) {
+		n = max < wq->backlog_num ? max : wq->backlog_num;
+		for (i = 0; i < n; i++) {
+			jobs[i] = wq->backlog[wq->backlog_start + i].job;
+			results[i] = wq->backlog[wq->backlog_start + i].result;
+		}
+		wq->backlog_start += n;
+		wq->backlog_num -= n;
+		return n;
+	}
+
+	if (!wq->outstanding || !max)
+		return 0;
+
+	n = wq_take_done(wq, done, max < 64 ? max : 64);
+	for (i = 0; i < n; i++) {
+		jobs[i] = done[i].job;
+		results[i] = done[i].result;
+	}
+	return n;
+}
+
+bool at_wq_result(struct at_workqueue *wq, void **job, void **result)
+{
+	return at_wq_results(wq, job, result, 1) == 1;
+}
+
+static int destroy_wq(struct at_workqueue *wq)
+{
+	struct at_wq_shared *sh = wq->sh;
+	struct at_pool_contents *p = wq->atp->p;
+	unsigned int i;
+
+	lock(&sh->lock);
+	sh->shutdown = 1;
+	sh->work_seq++;
+	unlock(&sh->lock);
+	futex_wake(&sh->work_seq, INT_MAX);
+
+	/* Each says NULL as it exits (or we see it died). */
+	for (i = 0; i < sh->num_workers && wq->workers[i]; i++) {
+		at_read(wq->workers[i]);
+		talloc_free(wq->workers[i]);
+	}
+
+	lock(&p->shared->pool_lock);
+	alloc_free(p->heap, p->heapsize, sh);
+	unlock(&p->shared->pool_lock);
+	return 0;
+}
+
+struct at_workqueue *_at_workqueue(struct at_pool *atp,
+				   unsigned int num_workers,
+				   unsigned int max_pending,
+				   void *(*fn)(struct at_pool *, void *job,
+					       void *arg),
+				   void *arg)
+{
+	struct at_pool_contents *p = atp->p;
+	struct at_workqueue *wq;
+	struct at_wq_shared *sh;
+	unsigned long size;
+	unsigned int i;
+
+	if (!num_workers || !max_pending) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size = sizeof(*sh)
+		+ sizeof(sh->done_slot[0]) * max_pending
+		+ sizeof(sh->ring[0]) * (num_workers + 1)
+		+ sizeof(sh->slot[0]) * max_pending * (num_workers + 1)
+		+ sizeof(sh->worker[0]) * num_workers;
+
+	lock(&p->shared->pool_lock);
+	sh = alloc_get(p->heap, p->heapsize, size, 64);
+	unlock(&p->shared->pool_lock);
+	if (!sh) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(sh, 0, size);
+	sh->size = max_pending;
+	sh->num_workers = num_workers;
+	sh->fn = fn;
+	sh->arg = arg;
+	sh->done_slot = (void *)(sh + 1);
+	sh->ring = (void *)(sh->done_slot + max_pending);
+	sh->slot = (void *)(sh->ring + num_workers + 1);
+	sh->worker = (void *)(sh->slot + max_pending * (num_workers + 1));
+
+	wq = talloc(atp, struct at_workqueue);
+	wq->atp = atp;
+	wq->sh = sh;
+	wq->outstanding = 0;
+	wq->backlog = NULL;
+	wq->backlog_start = wq->backlog_num = 0;
+	wq->workers = talloc_zero_array(wq, struct athread *, num_workers);
+	talloc_set_destructor(wq, destroy_wq);
+
+	for (i = 0; i < num_workers; i++) {
+		sh->worker[i].sh = sh;
+		sh->worker[i].id = i;
+		wq->workers[i] = at_run(atp, wq_worker, &sh->worker[i]);
+		if (!wq->workers[i]) {
+			talloc_free(wq);
+			return NULL;
+		}
+		/* So freeing the pool doesn't kill them before destroy_wq. */
+		talloc_steal(wq, wq->workers[i]);
+	}
+	return wq;
 }
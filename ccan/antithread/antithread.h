@@ -1,5 +1,6 @@
 #ifndef ANTITHREAD_H
 #define ANTITHREAD_H
+#include <stdbool.h>
 #include <ccan/typesafe_cb/typesafe_cb.h>
 
 struct at_pool;
@@ -52,9 +53,52 @@ void at_unlock(void *obj);
 void at_lock_all(struct at_pool *pool);
 void at_unlock_all(struct at_pool *pool);
 
-/* Internal function */
+/* Workqueues: a set of antithreads which each run fn(pool, job, arg) on
+ * jobs handed to them, so a short job doesn't pay for a fork.  Jobs and
+ * results are pointers, usually into the pool: talloc results off
+ * at_pool_ctx() to hand them back.  At most max_pending jobs can be
+ * submitted and not yet collected: after that submitting blocks until a
+ * worker finishes one.  Returned queue is child of pool; freeing it
+ * waits for the workers to run any jobs already queued and exit, and
+ * discards uncollected results. */
+struct at_workqueue;
+
+#define at_workqueue(pool, num_workers, max_pending, fn, arg)		\
+	_at_workqueue(pool, num_workers, max_pending,			\
+		      typesafe_cb_preargs(void *, (fn), (arg),		\
+					  struct at_pool *, void *),	\
+		      (arg))
+
+/* Any worker may take the job, otherwise it's for that worker only. */
+#define AT_WQ_ANY -1
+
+/* Queue a job.  Returns false if a worker has died, or we ran out of
+ * memory waiting for room. */
+bool at_wq_submit(struct at_workqueue *wq, void *job, int worker);
+
+/* Queue num jobs at once (cheaper than one at a time). */
+bool at_wq_submit_many(struct at_workqueue *wq, void *jobs[],
+		       unsigned int num, int worker);
+
+/* Collect a finished job and its result, blocking until one is done.
+ * Returns false if none are outstanding, or a worker has died. */
+bool at_wq_result(struct at_workqueue *wq, void **job, void **result);
+
+/* Collect up to max finished jobs, blocking until at least one is done.
+ * Returns how many (0 as for at_wq_result() returning false). */
+unsigned int at_wq_results(struct at_workqueue *wq, void *jobs[],
+			   void *results[], unsigned int max);
+
+/* Internal functions */
 struct athread *_at_run(struct at_pool *pool,
 			void *(*fn)(struct at_pool *, void *arg),
 			void *arg);
 
+struct at_workqueue *_at_workqueue(struct at_pool *pool,
+				   unsigned int num_workers,
+				   unsigned int max_pending,
+				   void *(*fn)(struct at_pool *, void *job,
+					       void *arg),
+				   void *arg);
+
 #endif /* ANTITHREAD_H */
@@ -0,0 +1,99 @@
+/* Message round-trip latency between parent and antithread, and how
+ * fast two processes can take turns on the same at_lock(). */
+#include <ccan/antithread/antithread.h>
+#include <ccan/talloc/talloc.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+static unsigned int loops = 100000;
+
+static double timeval_diff(const struct timeval *start,
+			   const struct timeval *stop)
+{
+	return (stop->tv_sec - start->tv_sec)
+		+ (stop->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void *pong(struct at_pool *atp, void *unused)
+{
+	void *p;
+
+	while ((p = at_read_parent(atp)) != NULL)
+		at_tell_parent(atp, p);
+	return NULL;
+}
+
+static void *bump(struct at_pool *atp, unsigned int *counter)
+{
+	unsigned int i;
+
+	at_read_parent(atp);
+	for (i = 0; i < loops; i++) {
+		at_lock(counter);
+		(*(volatile unsigned int *)counter)++;
+		at_unlock(counter);
+	}
+	return counter;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread *at;
+	struct timeval start, stop;
+	unsigned int i, *counter;
+	double secs;
+
+	if (argc > 1)
+		loops = atoi(argv[1]);
+	if (!loops)
+		errx(1, "Usage: at_bench [<loops>]");
+
+	atp = at_pool(1024*1024);
+	if (!atp)
+		err(1, "Creating pool");
+
+	at = at_run(atp, pong, NULL);
+	if (!at)
+		err(1, "Creating antithread");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < loops; i++) {
+		at_tell(at, argv);
+		if (at_read(at) != argv)
+			errx(1, "Bad reply from antithread");
+	}
+	gettimeofday(&stop, NULL);
+	at_tell(at, NULL);
+	talloc_free(at);
+	secs = timeval_diff(&start, &stop);
+	printf("ping-pong: %.2f usec per round trip (%.2f secs)\n",
+	       secs * 1000000 / loops, secs);
+	/* Don't let the next antithread inherit that. */
+	fflush(stdout);
+
+	counter = talloc_zero(at_pool_ctx(atp), unsigned int);
+	at = at_run(atp, bump, counter);
+	if (!at)
+		err(1, "Creating antithread");
+	gettimeofday(&start, NULL);
+	at_tell(at, counter);
+	for (i = 0; i < loops; i++) {
+		at_lock(counter);
+		(*(volatile unsigned int *)counter)++;
+		at_unlock(counter);
+	}
+	if (at_read(at) != counter)
+		errx(1, "Bad reply from antithread");
+	gettimeofday(&stop, NULL);
+	talloc_free(at);
+	if (*counter != loops * 2)
+		errx(1, "Lost updates: %u not %u", *counter, loops * 2);
+	secs = timeval_diff(&start, &stop);
+	printf("at_lock: %.0f lock/unlock pairs/sec (%.2f secs)\n",
+	       loops * 2 / secs, secs);
+
+	talloc_free(atp);
+	return 0;
+}
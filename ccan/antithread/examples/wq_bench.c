@@ -0,0 +1,104 @@
+/* Short jobs: an antithread per job, against a workqueue of workers. */
+#include <ccan/antithread/antithread.h>
+#include <ccan/talloc/talloc.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+static double timeval_diff(const struct timeval *start,
+			   const struct timeval *stop)
+{
+	return (stop->tv_sec - start->tv_sec)
+		+ (stop->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* A few microseconds of work. */
+static unsigned long sum(unsigned long *n)
+{
+	unsigned long i, total = 0;
+
+	for (i = 0; i < *n; i++)
+		total += i * i;
+	return total;
+}
+
+static void *run_one(struct at_pool *atp, unsigned long *n)
+{
+	*n = sum(n);
+	return n;
+}
+
+static void *wq_one(struct at_pool *atp, void *job, void *unused)
+{
+	return run_one(atp, job);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, num_jobs = 10000, num_workers = 4, batch = 64;
+	struct at_pool *atp;
+	struct at_workqueue *wq;
+	struct timeval start, stop;
+	unsigned long *jobs;
+	void *job, *result;
+	double secs;
+
+	if (argc > 1)
+		num_jobs = atoi(argv[1]);
+	if (argc > 2)
+		num_workers = atoi(argv[2]);
+	if (!num_jobs || !num_workers)
+		errx(1, "Usage: wq_bench [<jobs> [<workers>]]");
+
+	atp = at_pool(1024*1024);
+	if (!atp)
+		err(1, "Creating pool");
+	jobs = talloc_array(at_pool_ctx(atp), unsigned long, num_jobs);
+
+	/* Keep num_workers in flight, as the workqueue does. */
+	for (i = 0; i < num_jobs; i++)
+		jobs[i] = 1000;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_jobs; i += num_workers) {
+		struct athread *at[num_workers];
+		unsigned int j;
+
+		for (j = 0; j < num_workers && i + j < num_jobs; j++)
+			if (!(at[j] = at_run(atp, run_one, &jobs[i + j])))
+				err(1, "Creating antithread");
+		for (j = 0; j < num_workers && i + j < num_jobs; j++) {
+			at_read(at[j]);
+			talloc_free(at[j]);
+		}
+	}
+	gettimeofday(&stop, NULL);
+	secs = timeval_diff(&start, &stop);
+	printf("at_run per job: %.0f jobs/sec (%.2f secs)\n",
+	       num_jobs / secs, secs);
+	fflush(stdout);
+
+	for (i = 0; i < num_jobs; i++)
+		jobs[i] = 1000;
+	wq = at_workqueue(atp, num_workers, batch * 4, wq_one, NULL);
+	if (!wq)
+		err(1, "Creating workqueue");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < num_jobs; i += batch) {
+		void *ptrs[batch];
+		unsigned int j;
+
+		for (j = 0; j < batch && i + j < num_jobs; j++)
+			ptrs[j] = &jobs[i + j];
+		if (!at_wq_submit_many(wq, ptrs, j, AT_WQ_ANY))
+			errx(1, "Worker died");
+	}
+	while (at_wq_result(wq, &job, &result));
+	gettimeofday(&stop, NULL);
+	secs = timeval_diff(&start, &stop);
+	printf("at_workqueue: %.0f jobs/sec (%.2f secs)\n",
+	       num_jobs / secs, secs);
+
+	talloc_free(atp);
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include <ccan/antithread/antithread.c>
+#include <assert.h>
+#include <ccan/tap/tap.h>
+
+/* More than fit in the ring at once. */
+#define NUM_MSGS (AT_CHAN_SIZE * 3)
+
+static void *test(struct at_pool *atp, void *arg)
+{
+	unsigned int i;
+	char *p = arg;
+
+	/* Parent isn't reading yet: we'll block when the ring fills. */
+	for (i = 0; i < NUM_MSGS; i++)
+		at_tell_parent(atp, p + i);
+
+	/* Now echo back whatever it says, until it says NULL. */
+	while ((p = at_read_parent(atp)) != NULL)
+		at_tell_parent(atp, p + 1);
+
+	/* Queue some more up before the parent polls. */
+	for (i = 0; i < 3; i++)
+		at_tell_parent(atp, arg);
+	return NULL;
+}
+
+static bool readable(int fd)
+{
+	struct timeval tv = { 5, 0 };
+	fd_set set;
+
+	FD_ZERO(&set);
+	FD_SET(fd, &set);
+	return select(fd + 1, &set, NULL, NULL, &tv) == 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread *at;
+	unsigned int i;
+	bool in_order = true;
+	int fd;
+
+	plan_tests(8);
+
+	atp = at_pool(1*1024*1024);
+	assert(atp);
+	at = at_run(atp, test, argv[0]);
+	assert(at);
+
+	/* Wraps the ring a couple of times, in order. */
+	sleep(1);
+	for (i = 0; i < NUM_MSGS; i++)
+		if (at_read(at) != argv[0] + i)
+			in_order = false;
+	ok1(in_order);
+
+	/* Ping-pong. */
+	for (i = 0; i < 1000; i++) {
+		at_tell(at, argv[0] + i);
+		if (at_read(at) != argv[0] + i + 1)
+			in_order = false;
+	}
+	ok1(in_order);
+	at_tell(at, NULL);
+
+	/* Messages queued before we ask for the fd still show up on it. */
+	sleep(1);
+	fd = at_fd(at);
+	ok1(fd == at->rfd);
+	ok1(at_fd(at) == fd);
+	for (i = 0; i < 3; i++) {
+		ok1(readable(fd));
+		at_read(at);
+	}
+
+	/* And once it exits we get EOF, then NULL. */
+	ok1(readable(fd) && at_read(at) == NULL);
+	talloc_free(at);
+
+	return exit_status();
+}
@@ -0,0 +1,53 @@
+#include <ccan/antithread/antithread.c>
+#include <assert.h>
+#include <poll.h>
+#include <ccan/tap/tap.h>
+
+static void *quick(struct at_pool *atp, void *arg)
+{
+	return arg;
+}
+
+static void *waiter(struct at_pool *atp, void *unused)
+{
+	at_read_parent(atp);
+	return NULL;
+}
+
+static bool readable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 5000) == 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct athread *a, *b;
+	int fd;
+
+	plan_tests(4);
+
+	atp = at_pool(1*1024*1024);
+	assert(atp);
+	a = at_run(atp, quick, argv[0]);
+	assert(a);
+	/* b must not keep a's pipe open just because it was forked later. */
+	b = at_run(atp, waiter, NULL);
+	assert(b);
+
+	fd = at_fd(a);
+	ok1(readable(fd));
+	ok1(at_read(a) == argv[0]);
+	/* a has exited: we should see EOF while b is still running. */
+	ok1(readable(fd));
+	ok1(at_read(a) == NULL);
+
+	at_tell(b, NULL);
+	talloc_free(a);
+	talloc_free(b);
+	talloc_free(atp);
+
+	return exit_status();
+}
@@ -26,13 +26,19 @@ static void *test(struct at_pool *atp, int *val)
 	return val;
 };
 
+static void *die_holding(struct at_pool *atp, int *val)
+{
+	at_lock(val);
+	return val;
+}
+
 int main(int argc, char *argv[])
 {
 	struct at_pool *atp;
 	struct athread *at;
 	int *val, i;
 
-	plan_tests(3);
+	plan_tests(5);
 
 	atp = at_pool(1*1024*1024);
 	assert(atp);
@@ -57,5 +63,13 @@ int main(int argc, char *argv[])
 
 	ok1(*val == NUM_RUNS*2);
 
+	/* A lock dies with its holder, as fcntl locks did. */
+	at = at_run(atp, die_holding, val);
+	ok1(at_read(at) == val);
+	talloc_free(at);
+	at_lock(val);
+	ok1(*val == NUM_RUNS*2);
+	at_unlock(val);
+
 	return exit_status();
 }
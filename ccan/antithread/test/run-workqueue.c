@@ -0,0 +1,100 @@
+#include <ccan/antithread/antithread.c>
+#include <assert.h>
+#include <ccan/tap/tap.h>
+
+#define NUM_JOBS 100
+
+struct job {
+	int val;
+	pid_t pid;
+};
+
+/* Results are allocated in the pool, so the parent can see them. */
+static void *double_it(struct at_pool *atp, void *job, int *scale)
+{
+	struct job *j = job;
+	int *ret = talloc(at_pool_ctx(atp), int);
+
+	j->pid = getpid();
+	*ret = j->val * *scale;
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at_pool *atp;
+	struct at_workqueue *wq;
+	struct job *jobs;
+	void *ptrs[NUM_JOBS], *res[NUM_JOBS];
+	bool all_ok = true, seen[NUM_JOBS] = { false };
+	int *scale, *r;
+	unsigned int i, n, total, blocks;
+	void *job;
+
+	plan_tests(11);
+
+	atp = at_pool(1*1024*1024);
+	assert(atp);
+	scale = talloc(at_pool_ctx(atp), int);
+	*scale = 2;
+	jobs = talloc_zero_array(at_pool_ctx(atp), struct job, NUM_JOBS);
+	for (i = 0; i < NUM_JOBS; i++) {
+		jobs[i].val = i;
+		ptrs[i] = &jobs[i];
+	}
+
+	blocks = talloc_total_blocks(atp);
+	ok1(at_workqueue(atp, 0, 8, double_it, scale) == NULL);
+	wq = at_workqueue(atp, 3, 8, double_it, scale);
+	ok1(wq);
+
+	/* Nothing outstanding. */
+	ok1(!at_wq_result(wq, &job, (void **)&r));
+
+	/* Far more than max_pending, without collecting: we block, not fail */
+	for (i = 0; i < NUM_JOBS; i++)
+		if (!at_wq_submit(wq, &jobs[i], AT_WQ_ANY))
+			all_ok = false;
+	ok1(all_ok);
+
+	/* Every job comes back exactly once, with its result. */
+	for (i = 0; i < NUM_JOBS; i++) {
+		if (!at_wq_result(wq, &job, (void **)&r)) {
+			all_ok = false;
+			break;
+		}
+		n = (struct job *)job - jobs;
+		if (n >= NUM_JOBS || seen[n] || *r != 2 * n)
+			all_ok = false;
+		seen[n] = true;
+		talloc_free(r);
+	}
+	ok1(all_ok);
+	ok1(!at_wq_result(wq, &job, (void **)&r));
+
+	/* Batched, and all for worker 1. */
+	memset(jobs, 0, sizeof(*jobs) * NUM_JOBS);
+	ok1(at_wq_submit_many(wq, ptrs, NUM_JOBS, 1));
+	for (total = 0; total < NUM_JOBS; total += n) {
+		n = at_wq_results(wq, ptrs, res, NUM_JOBS);
+		if (!n)
+			break;
+		for (i = 0; i < n; i++)
+			talloc_free(res[i]);
+	}
+	ok1(total == NUM_JOBS);
+	ok1(at_wq_results(wq, ptrs, res, NUM_JOBS) == 0);
+	for (i = 1; i < NUM_JOBS; i++)
+		if (jobs[i].pid != jobs[0].pid)
+			all_ok = false;
+	ok1(all_ok && jobs[0].pid != 0 && jobs[0].pid != getpid());
+
+	/* Workers exit, finishing (at most) the jobs they've started. */
+	for (i = 0; i < 5; i++)
+		at_wq_submit(wq, &jobs[i], AT_WQ_ANY);
+	talloc_free(wq);
+	n = talloc_total_blocks(atp);
+	ok1(n >= blocks && n <= blocks + 5);
+
+	return exit_status();
+}
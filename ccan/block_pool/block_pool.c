@@ -29,9 +29,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <assert.h>
 
 //must be a power of 2
-#define BLOCK_SIZE 4096
+#define DEFAULT_BLOCK_SIZE 4096
 
 struct block {
 	size_t remaining;
@@ -42,6 +43,7 @@ struct block {
 struct block_pool {
 	size_t count;
 	size_t alloc; //2^n - 1, where n is an integer > 1
+	size_t block_size; //a power of 2
 	struct block *block;
 	
 	//blocks are arranged in a max-heap by the .remaining field
@@ -59,30 +61,36 @@ static int destructor(struct block_pool *bp) {
 	return 0;
 }
 
-struct block_pool *block_pool_new(void *ctx) {
+struct block_pool *block_pool_new_size(void *ctx, size_t block_size) {
 	struct block_pool *bp = talloc(ctx, struct block_pool);
 	talloc_set_destructor(bp, destructor);
 	
+	assert(block_size && !(block_size & (block_size-1)));
 	bp->count = 0;
 	bp->alloc = 7;
+	bp->block_size = block_size;
 	bp->block = malloc(bp->alloc * sizeof(struct block));
 	
 	return bp;
 }
 
-static void *new_block(struct block *b, size_t needed) {
-	b->size = (needed+(BLOCK_SIZE-1)) & ~(BLOCK_SIZE-1);
+struct block_pool *block_pool_new(void *ctx) {
+	return block_pool_new_size(ctx, DEFAULT_BLOCK_SIZE);
+}
+
+static void *new_block(struct block_pool *bp, struct block *b, size_t needed) {
+	b->size = (needed+(bp->block_size-1)) & ~(bp->block_size-1);
 	b->remaining = b->size - needed;
 	b->data = malloc(b->size);
 	return b->data;
 }
 
 //for the first block, keep the memory usage low in case it's the only block.
-static void *new_block_tiny(struct block *b, size_t needed) {
-	if (needed < 256)
+static void *new_block_tiny(struct block_pool *bp, struct block *b, size_t needed) {
+	if (needed < 256 && bp->block_size > 256)
 		b->size = 256;
 	else
-		b->size = (needed+(BLOCK_SIZE-1)) & ~(BLOCK_SIZE-1);
+		b->size = (needed+(bp->block_size-1)) & ~(bp->block_size-1);
 	b->remaining = b->size - needed;
 	b->data = malloc(b->size);
 	return b->data;
@@ -153,7 +161,7 @@ void *block_pool_alloc_align(struct block_pool *bp, size_t size, size_t align) {
 	//if there aren't any blocks, make a new one
 	if (!bp->count) {
 		bp->count = 1;
-		return new_block_tiny(bp->block, size);
+		return new_block_tiny(bp, bp->block, size);
 	}
 	
 	//try the root block
@@ -174,7 +182,7 @@ void *block_pool_alloc_align(struct block_pool *bp, size_t size, size_t align) {
 		bp->alloc++;
 		bp->block = realloc(bp->block, bp->alloc * sizeof(struct block));
 	}
-	ret = new_block(bp->block+(bp->count++), size);
+	ret = new_block(bp, bp->block+(bp->count++), size);
 	
 	//fix the heap after adding the new block
 	percolate_up(bp, bp->count-1);
@@ -182,6 +190,27 @@ void *block_pool_alloc_align(struct block_pool *bp, size_t size, size_t align) {
 	return ret;
 }
 
+void block_pool_reset(struct block_pool *bp) {
+	size_t i, kept = 0;
+	
+	//keep the normal blocks; ones made for a single big allocation would
+	//be nibbled by small allocations next time, so we'd need another.
+	for (i = 0; i < bp->count; i++) {
+		if (bp->block[i].size > bp->block_size) {
+			free(bp->block[i].data);
+			continue;
+		}
+		bp->block[kept] = bp->block[i];
+		bp->block[kept].remaining = bp->block[kept].size;
+		kept++;
+	}
+	bp->count = kept;
+	
+	//rebuild the heap, so the root is the biggest block again
+	for (i = bp->count/2; i--;)
+		percolate_down(bp, i);
+}
+
 #undef L
 #undef R
 #undef P
@@ -194,3 +223,40 @@ char *block_pool_strdup(struct block_pool *bp, const char *str) {
 	memcpy(ret, str, size);
 	return ret;
 }
+
+struct block_pool_cache {
+	size_t block_size;
+	unsigned int count, max;
+	struct block_pool **pools;
+};
+
+struct block_pool_cache *block_pool_cache_new(void *ctx, size_t block_size,
+                                              unsigned int max) {
+	struct block_pool_cache *cache = talloc(ctx, struct block_pool_cache);
+	
+	cache->block_size = block_size;
+	cache->count = 0;
+	cache->max = max;
+	cache->pools = talloc_array(cache, struct block_pool *, max);
+	
+	return cache;
+}
+
+struct block_pool *block_pool_cache_get(struct block_pool_cache *cache,
+                                        void *ctx) {
+	if (!cache->count)
+		return block_pool_new_size(ctx, cache->block_size);
+	
+	return talloc_steal(ctx, cache->pools[--cache->count]);
+}
+
+void block_pool_cache_put(struct block_pool_cache *cache,
+                          struct block_pool *bp) {
+	if (cache->count == cache->max || bp->block_size != cache->block_size) {
+		block_pool_free(bp);
+		return;
+	}
+	
+	block_pool_reset(bp);
+	cache->pools[cache->count++] = talloc_steal(cache, bp);
+}
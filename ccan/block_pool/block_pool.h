@@ -37,6 +37,11 @@ struct block_pool;
    ctx is a talloc context (or NULL if you don't know what talloc is ;) ) */
 struct block_pool *block_pool_new(void *ctx);
 
+/* Construct a new block pool which mallocs blocks of block_size bytes
+   (or a multiple, for big allocations).  block_size must be a power of two.
+   block_pool_new uses 4096. */
+struct block_pool *block_pool_new_size(void *ctx, size_t block_size);
+
 /* Same as block_pool_alloc, but allows you to manually specify alignment.
    For instance, strings need not be aligned, so set align=1 for them.
    align must be a power of two. */
@@ -56,6 +61,31 @@ static inline void block_pool_free(struct block_pool *bp) {
 	talloc_free(bp);
 }
 
+/* Forget everything allocated from the pool, but keep its blocks for
+   reuse.  Previously returned pointers become invalid; a pool which is
+   reset and reused for similar work will not need to call malloc.
+   Blocks bigger than the block size (made for big allocations) are
+   freed, so pick a block size which fits your usual allocations. */
+void block_pool_reset(struct block_pool *bp);
+
+/* A cache of reset pools, for using a pool per request without mallocing
+   a new one each time.  It does no locking: use one per thread.
+   It holds up to max pools of the given block_size; talloc_free it to free
+   them. */
+struct block_pool_cache;
+
+struct block_pool_cache *block_pool_cache_new(void *ctx, size_t block_size,
+                                              unsigned int max);
+
+/* Take a pool from the cache (or make a new one), as a child of ctx. */
+struct block_pool *block_pool_cache_get(struct block_pool_cache *cache,
+                                        void *ctx);
+
+/* Reset a pool and return it to the cache (or free it, if the cache is
+   full). */
+void block_pool_cache_put(struct block_pool_cache *cache,
+                          struct block_pool *bp);
+
 
 char *block_pool_strdup(struct block_pool *bp, const char *str);
 
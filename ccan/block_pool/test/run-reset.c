@@ -0,0 +1,100 @@
+#include <ccan/block_pool/block_pool.h>
+#include <ccan/block_pool/block_pool.c>
+#include <ccan/tap/tap.h>
+
+#define V(node) (bp->block[node].remaining)
+
+//unlike run.c, the root must be the biggest too, right after a reset
+static int check_heap(struct block_pool *bp) {
+	size_t i;
+	
+	for (i = 1; i < bp->count; i++)
+		if (V(i) > V((i-1)>>1))
+			return 0;
+	return 1;
+}
+
+//every block is entirely free
+static int all_free(struct block_pool *bp) {
+	size_t i;
+	
+	for (i = 0; i < bp->count; i++)
+		if (bp->block[i].remaining != bp->block[i].size)
+			return 0;
+	return 1;
+}
+
+//allocate the same things from the pool; returns number of blocks
+static size_t fill(struct block_pool *bp, unsigned int seed) {
+	unsigned int i;
+	size_t size;
+	
+	srandom(seed);
+	for (i = 0; i < 1000; i++) {
+		size = random() % 300;
+		memset(block_pool_alloc(bp, size), 0x55, size);
+	}
+	block_pool_alloc(bp, 10000);
+	return bp->count;
+}
+
+int main(void)
+{
+	struct block_pool *bp;
+	struct block_pool_cache *cache;
+	size_t blocks, i;
+	void *ctx;
+	
+	plan_tests(15);
+	
+	bp = block_pool_new(NULL);
+	blocks = fill(bp, 1);
+	block_pool_reset(bp);
+	//the 10000 byte block is gone
+	ok1(bp->count == blocks - 1);
+	ok1(all_free(bp));
+	ok1(check_heap(bp));
+	//the blocks get packed differently the second time, but then
+	//the same allocations always fit in the same blocks
+	blocks = fill(bp, 1);
+	block_pool_reset(bp);
+	ok1(fill(bp, 1) == blocks);
+	block_pool_reset(bp);
+	ok1(fill(bp, 1) == blocks);
+	block_pool_free(bp);
+	
+	//bigger blocks mean fewer of them
+	bp = block_pool_new_size(NULL, 65536);
+	ok1(bp->block_size == 65536);
+	ok1(fill(bp, 1) < blocks);
+	for (i = 1; i < bp->count; i++)
+		if (bp->block[i].size % 65536)
+			break;
+	ok1(i == bp->count);
+	block_pool_free(bp);
+	
+	//a cache hands back the same (reset) pool
+	ctx = talloc_strdup(NULL, "ctx");
+	cache = block_pool_cache_new(NULL, 4096, 2);
+	bp = block_pool_cache_get(cache, ctx);
+	ok1(talloc_parent(bp) == ctx);
+	fill(bp, 2);
+	block_pool_cache_put(cache, bp);
+	ok1(talloc_parent(bp) == cache);
+	ok1(all_free(bp));
+	ok1(block_pool_cache_get(cache, ctx) == bp);
+	ok1(talloc_parent(bp) == ctx);
+	
+	//but not more than max of them
+	block_pool_cache_put(cache, block_pool_cache_get(cache, NULL));
+	block_pool_cache_put(cache, block_pool_new(NULL));
+	block_pool_cache_put(cache, block_pool_new(NULL));
+	ok1(cache->count == 2);
+	//nor pools of the wrong block size
+	block_pool_cache_put(cache, block_pool_new_size(NULL, 1024));
+	ok1(cache->count == 2);
+	
+	talloc_free(cache);
+	talloc_free(ctx);
+	return exit_status();
+}
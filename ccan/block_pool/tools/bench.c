@@ -0,0 +1,106 @@
+/* Requests per second using a block pool as a per-request arena:
+ * a fresh pool each request, one pool reset between requests, or pools
+ * from a block_pool_cache. */
+#include <ccan/block_pool/block_pool.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static double timeval_diff(const struct timeval *start,
+			   const struct timeval *stop)
+{
+	return (stop->tv_sec - start->tv_sec)
+		+ (stop->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* What a request does with its pool. */
+static unsigned long request(struct block_pool *bp, const size_t sizes[],
+			     unsigned int allocs)
+{
+	unsigned long sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < allocs; i++) {
+		char *p = block_pool_alloc(bp, sizes[i]);
+		memset(p, i, sizes[i]);
+		sum += (unsigned long)p[0];
+	}
+	return sum;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int requests = 100000, allocs = 100, i;
+	size_t block_size = 4096, *sizes;
+	struct block_pool *bp;
+	struct block_pool_cache *cache;
+	struct timeval start, stop;
+	unsigned long sum = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:a:b:")) != -1) {
+		switch (opt) {
+		case 'r':
+			requests = atoi(optarg);
+			break;
+		case 'a':
+			allocs = atoi(optarg);
+			break;
+		case 'b':
+			block_size = atol(optarg);
+			break;
+		default:
+			errx(1, "Usage: bench [-r requests] [-a allocs-per-request]"
+			     " [-b blocksize]");
+		}
+	}
+	if (!requests || !block_size || (block_size & (block_size - 1)))
+		errx(1, "Need requests, and a power of 2 block size");
+
+	/* Mostly small, like strings and structs in a request. */
+	sizes = malloc(allocs * sizeof(sizes[0]));
+	for (i = 0; i < allocs; i++)
+		sizes[i] = 8 + random() % (random() % 8 ? 64 : 512);
+
+	printf("%u requests of %u allocations, blocksize %zu\n",
+	       requests, allocs, block_size);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < requests; i++) {
+		bp = block_pool_new_size(NULL, block_size);
+		sum += request(bp, sizes, allocs);
+		block_pool_free(bp);
+	}
+	gettimeofday(&stop, NULL);
+	printf("%-8s %12.0f req/s\n", "fresh",
+	       requests / timeval_diff(&start, &stop));
+
+	bp = block_pool_new_size(NULL, block_size);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < requests; i++) {
+		sum += request(bp, sizes, allocs);
+		block_pool_reset(bp);
+	}
+	gettimeofday(&stop, NULL);
+	block_pool_free(bp);
+	printf("%-8s %12.0f req/s\n", "reset",
+	       requests / timeval_diff(&start, &stop));
+
+	cache = block_pool_cache_new(NULL, block_size, 4);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < requests; i++) {
+		bp = block_pool_cache_get(cache, NULL);
+		sum += request(bp, sizes, allocs);
+		block_pool_cache_put(cache, bp);
+	}
+	gettimeofday(&stop, NULL);
+	talloc_free(cache);
+	printf("%-8s %12.0f req/s\n", "cache",
+	       requests / timeval_diff(&start, &stop));
+
+	/* Make sure the compiler can't discard the work. */
+	return sum == 42;
+}
@@ -24,9 +24,11 @@
  */
 
 #include "crc.h"
+#include "config.h"
 #include <ccan/array_size/array_size.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 /*
  * This is the CRC-32C table
@@ -107,7 +109,7 @@ static const uint32_t crc32c_tab[] = {
  * Steps through buffer one byte at at time, calculates reflected
  * crc using table.
  */
-uint32_t crc32c(uint32_t crc, const void *buf, size_t size)
+static uint32_t crc32c_bytes(uint32_t crc, const void *buf, size_t size)
 {
 	const uint8_t *p = buf;
 
@@ -168,17 +170,15 @@ static const uint32_t crc32_ieee_tab[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-uint32_t crc32_ieee(uint32_t crc, const void *buf, size_t size)
+/* Without the pre- and post-inversion: that's done in crc32_ieee(). */
+static uint32_t crc32_ieee_bytes(uint32_t crc, const void *buf, size_t size)
 {
-	const uint8_t *p;
-
-	p = buf;
-	crc ^= ~0U;
+	const uint8_t *p = buf;
 
 	while (size--)
 		crc = crc32_ieee_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
 
-	return crc ^ ~0U;
+	return crc;
 }
 
 const uint32_t *crc32_ieee_table(void)
@@ -276,7 +276,7 @@ static uint16_t crc64_tab[] = {
     0x9090
 };
 
-uint64_t crc64_iso(uint64_t crc, const void *buf, size_t size)
+static uint64_t crc64_iso_bytes(uint64_t crc, const void *buf, size_t size)
 {
 	const uint8_t *p = buf;
 
@@ -305,3 +305,458 @@ const uint64_t *crc64_iso_table(void)
 
 	return fulltab;
 }
+
+/*
+ * Faster versions: slicing-by-8 tables (anywhere), the SSE4.2 crc32
+ * instruction for crc32c and PCLMULQDQ folding for the others (x86-64).
+ * The byte-at-a-time versions above are used for short buffers.
+ */
+#define CRC_SHORT 16
+
+/* Slice n is the effect of a byte followed by n zero bytes. */
+static uint32_t crc32c_slice[8][256], crc32_ieee_slice[8][256];
+static uint64_t crc64_slice[8][256];
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8)
+		| ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+		| ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40)
+		| ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static void init_slice32(uint32_t slice[8][256], const uint32_t tab[256])
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 256; i++) {
+		slice[0][i] = tab[i];
+		for (j = 1; j < 8; j++)
+			slice[j][i] = (slice[j-1][i] >> 8)
+				^ tab[slice[j-1][i] & 0xFF];
+	}
+}
+
+static void init_slice64(uint64_t slice[8][256])
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 256; i++) {
+		slice[0][i] = (uint64_t)crc64_tab[i] << 48;
+		for (j = 1; j < 8; j++)
+			slice[j][i] = (slice[j-1][i] >> 8)
+				^ ((uint64_t)crc64_tab[slice[j-1][i] & 0xFF]
+				   << 48);
+	}
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t size,
+			     uint32_t t[8][256])
+{
+	uint64_t v;
+
+	while (size >= 8) {
+		v = get_le64(p) ^ crc;
+		crc = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF]
+			^ t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF]
+			^ t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF]
+			^ t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+		p += 8;
+		size -= 8;
+	}
+	while (size--)
+		crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static uint64_t crc64_slice8(uint64_t crc, const uint8_t *p, size_t size)
+{
+	uint64_t (*t)[256] = crc64_slice;
+
+	while (size >= 8) {
+		crc ^= get_le64(p);
+		crc = t[7][crc & 0xFF] ^ t[6][(crc >> 8) & 0xFF]
+			^ t[5][(crc >> 16) & 0xFF] ^ t[4][(crc >> 24) & 0xFF]
+			^ t[3][(crc >> 32) & 0xFF] ^ t[2][(crc >> 40) & 0xFF]
+			^ t[1][(crc >> 48) & 0xFF] ^ t[0][crc >> 56];
+		p += 8;
+		size -= 8;
+	}
+	while (size--)
+		crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static uint32_t crc32c_sliced(uint32_t crc, const void *buf, size_t size)
+{
+	return crc32_slice8(crc, buf, size, crc32c_slice);
+}
+
+static uint32_t crc32_ieee_sliced(uint32_t crc, const void *buf, size_t size)
+{
+	return crc32_slice8(crc, buf, size, crc32_ieee_slice);
+}
+
+static uint64_t crc64_iso_sliced(uint64_t crc, const void *buf, size_t size)
+{
+	return crc64_slice8(crc, buf, size);
+}
+
+/*
+ * These crcs are reflected: bit 0 of the first byte is the highest power
+ * of x.  In a 32-bit crc, 0x80000000 is x^0, and multiplying by x is a
+ * right shift, subtracting (xoring) the polynomial when x^32 falls out.
+ */
+#define CRC32C_POLY 0x82F63B78U
+
+/* a * b mod poly (a must not be 0). */
+static uint32_t multmodp(uint32_t a, uint32_t b, uint32_t poly)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+	}
+	return p;
+}
+
+/* x^(2^n) mod CRC32C_POLY: it repeats after 31. */
+static const uint32_t crc32c_x2n[31] = {
+	0x40000000, 0x20000000, 0x08000000, 0x00800000,
+	0x00008000, 0x82F63B78, 0x6EA2D55C, 0x18B8EA18,
+	0x510AC59A, 0xB82BE955, 0xB8FDB1E7, 0x88E56F72,
+	0x74C360A4, 0xE4172B16, 0x0D65762A, 0x35D73A62,
+	0x28461564, 0xBF455269, 0xE2EA32DC, 0xFE7740E6,
+	0xF946610B, 0x3C204F8F, 0x538586E3, 0x59726915,
+	0x734D5309, 0xBC1AC763, 0x7D0722CC, 0xD289CABE,
+	0xE94CA9BC, 0x05B74F3F, 0xA51E1F42
+};
+
+/* x^(8 * len) mod CRC32C_POLY: the effect of appending len zero bytes. */
+static uint32_t crc32c_zeros(size_t len)
+{
+	uint32_t p = 1U << 31;
+	unsigned int k = 3;
+
+	while (len) {
+		if (len & 1)
+			p = multmodp(crc32c_x2n[k % 31], p, CRC32C_POLY);
+		len >>= 1;
+		k++;
+	}
+	return p;
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	return multmodp(crc32c_zeros(len2), crc1, CRC32C_POLY) ^ crc2;
+}
+
+#if HAVE_BUILTIN_CPU_SUPPORTS && defined(__x86_64__)
+#if HAVE_SSE4_2_INTRINSICS
+#include <nmmintrin.h>
+
+/* The crc32 instruction has a latency of 3 but a throughput of 1, so we
+ * run three lanes of this many bytes and combine them. */
+#define CRC32C_LANE 4096
+
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_sse42(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint64_t c0 = crc, c1, c2, v[3];
+	size_t i;
+
+	while (size >= 3 * CRC32C_LANE) {
+		c1 = c2 = 0;
+		for (i = 0; i < CRC32C_LANE; i += 8) {
+			memcpy(&v[0], p + i, 8);
+			memcpy(&v[1], p + CRC32C_LANE + i, 8);
+			memcpy(&v[2], p + 2 * CRC32C_LANE + i, 8);
+			c0 = _mm_crc32_u64(c0, v[0]);
+			c1 = _mm_crc32_u64(c1, v[1]);
+			c2 = _mm_crc32_u64(c2, v[2]);
+		}
+		c0 = multmodp(crc32c_zeros(2 * CRC32C_LANE), c0, CRC32C_POLY)
+			^ multmodp(crc32c_zeros(CRC32C_LANE), c1, CRC32C_POLY)
+			^ c2;
+		p += 3 * CRC32C_LANE;
+		size -= 3 * CRC32C_LANE;
+	}
+	while (size >= 8) {
+		memcpy(&v[0], p, 8);
+		c0 = _mm_crc32_u64(c0, v[0]);
+		p += 8;
+		size -= 8;
+	}
+	while (size--)
+		c0 = _mm_crc32_u8(c0, *p++);
+	return c0;
+}
+#endif /* HAVE_SSE4_2_INTRINSICS */
+
+#if HAVE_PCLMUL_INTRINSICS
+#include <wmmintrin.h>
+
+/*
+ * Folding: a 16-byte chunk D bits before another can be replaced by
+ * something congruent mod the polynomial, and xored into it.  The first
+ * 8 bytes hold the high powers: they get multiplied by x^(64+D), the
+ * last 8 bytes by x^D.  The product of two 64-bit reflected values lands
+ * one bit low, so we use one power of x less in the constants.
+ *
+ * Each set of constants is { x^(63+512), x^511, x^(63+128), x^127 }.
+ */
+static uint64_t crc32c_fold[4], crc32_ieee_fold[4], crc64_fold[4];
+
+static uint32_t xpow32(unsigned int n, uint32_t poly)
+{
+	uint32_t r = 1U << 31;
+
+	while (n--)
+		r = r & 1 ? (r >> 1) ^ poly : r >> 1;
+	return r;
+}
+
+static uint64_t xpow64(unsigned int n, uint64_t poly)
+{
+	uint64_t r = 1ULL << 63;
+
+	while (n--)
+		r = r & 1 ? (r >> 1) ^ poly : r >> 1;
+	return r;
+}
+
+static void init_fold_consts(void)
+{
+	/* A reflected 32-bit value sits in the top of a 64-bit one. */
+	crc32c_fold[0] = (uint64_t)xpow32(63 + 512, CRC32C_POLY) << 32;
+	crc32c_fold[1] = (uint64_t)xpow32(511, CRC32C_POLY) << 32;
+	crc32c_fold[2] = (uint64_t)xpow32(63 + 128, CRC32C_POLY) << 32;
+	crc32c_fold[3] = (uint64_t)xpow32(127, CRC32C_POLY) << 32;
+	crc32_ieee_fold[0] = (uint64_t)xpow32(63 + 512, 0xEDB88320U) << 32;
+	crc32_ieee_fold[1] = (uint64_t)xpow32(511, 0xEDB88320U) << 32;
+	crc32_ieee_fold[2] = (uint64_t)xpow32(63 + 128, 0xEDB88320U) << 32;
+	crc32_ieee_fold[3] = (uint64_t)xpow32(127, 0xEDB88320U) << 32;
+
+	/* The polynomial is in the table entry for x^0 * x^8 (0x80). */
+	crc64_fold[0] = xpow64(63 + 512, (uint64_t)crc64_tab[0x80] << 48);
+	crc64_fold[1] = xpow64(511, (uint64_t)crc64_tab[0x80] << 48);
+	crc64_fold[2] = xpow64(63 + 128, (uint64_t)crc64_tab[0x80] << 48);
+	crc64_fold[3] = xpow64(127, (uint64_t)crc64_tab[0x80] << 48);
+}
+
+static inline __m128i __attribute__((target("pclmul")))
+fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+			     _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+/* Fold size (>= 64) bytes down to 16 with the same crc; returns bytes
+ * used (the rest is < 16 bytes). */
+static size_t __attribute__((target("pclmul")))
+pclmul_fold(uint64_t crc, const uint8_t *p, size_t size,
+	    const uint64_t k[4], uint8_t out[16])
+{
+	__m128i x0, x1, x2, x3;
+	__m128i k512 = _mm_set_epi64x(k[1], k[0]);
+	__m128i k128 = _mm_set_epi64x(k[3], k[2]);
+	size_t done = 64;
+
+	/* Starting crc is the same as xoring it into the first bytes. */
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p),
+			   _mm_cvtsi64_si128(crc));
+	x1 = _mm_loadu_si128((const __m128i *)(p + 16));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 32));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 48));
+
+	while (size - done >= 64) {
+		x0 = _mm_xor_si128(fold(x0, k512), _mm_loadu_si128(
+					   (const __m128i *)(p + done)));
+		x1 = _mm_xor_si128(fold(x1, k512), _mm_loadu_si128(
+					   (const __m128i *)(p + done + 16)));
+		x2 = _mm_xor_si128(fold(x2, k512), _mm_loadu_si128(
+					   (const __m128i *)(p + done + 32)));
+		x3 = _mm_xor_si128(fold(x3, k512), _mm_loadu_si128(
+					   (const __m128i *)(p + done + 48)));
+		done += 64;
+	}
+
+	x0 = _mm_xor_si128(fold(x0, k128), x1);
+	x0 = _mm_xor_si128(fold(x0, k128), x2);
+	x0 = _mm_xor_si128(fold(x0, k128), x3);
+	while (size - done >= 16) {
+		x0 = _mm_xor_si128(fold(x0, k128), _mm_loadu_si128(
+					   (const __m128i *)(p + done)));
+		done += 16;
+	}
+	_mm_storeu_si128((__m128i *)out, x0);
+	return done;
+}
+
+static uint32_t crc32_ieee_pclmul(uint32_t crc, const void *buf, size_t size)
+{
+	uint8_t folded[16];
+	size_t done;
+
+	if (size < 64)
+		return crc32_slice8(crc, buf, size, crc32_ieee_slice);
+
+	done = pclmul_fold(crc, buf, size, crc32_ieee_fold, folded);
+	crc = crc32_slice8(0, folded, 16, crc32_ieee_slice);
+	return crc32_slice8(crc, (const uint8_t *)buf + done, size - done,
+			    crc32_ieee_slice);
+}
+
+#if HAVE_SSE4_2_INTRINSICS
+/* Folding beats even three crc32 instruction lanes. */
+static uint32_t crc32c_pclmul(uint32_t crc, const void *buf, size_t size)
+{
+	uint8_t folded[16];
+	size_t done;
+
+	if (size < 64)
+		return crc32c_sse42(crc, buf, size);
+
+	done = pclmul_fold(crc, buf, size, crc32c_fold, folded);
+	crc = crc32c_sse42(0, folded, 16);
+	return crc32c_sse42(crc, (const uint8_t *)buf + done, size - done);
+}
+#endif
+
+static uint64_t crc64_iso_pclmul(uint64_t crc, const void *buf, size_t size)
+{
+	uint8_t folded[16];
+	size_t done;
+
+	if (size < 64)
+		return crc64_slice8(crc, buf, size);
+
+	done = pclmul_fold(crc, buf, size, crc64_fold, folded);
+	crc = crc64_slice8(0, folded, 16);
+	return crc64_slice8(crc, (const uint8_t *)buf + done, size - done);
+}
+#endif /* HAVE_PCLMUL_INTRINSICS */
+#endif /* HAVE_BUILTIN_CPU_SUPPORTS && __x86_64__ */
+
+/* The first call to any of them builds the tables and picks the
+ * implementations.  One thread does that while any others racing it spin;
+ * the pointers are only published (with release semantics) once the
+ * tables are complete, so a caller which sees a new pointer sees its
+ * tables too.  Without atomics, make one call before starting threads. */
+#if HAVE_BUILTIN_ATOMIC
+#define crc_load(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define crc_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define crc_load(p)	(*(p))
+#define crc_store(p, v)	(*(p) = (v))
+#endif
+
+static uint32_t crc32c_init(uint32_t crc, const void *buf, size_t size);
+static uint32_t crc32_ieee_init(uint32_t crc, const void *buf, size_t size);
+static uint64_t crc64_iso_init(uint64_t crc, const void *buf, size_t size);
+
+static uint32_t (*crc32c_fn)(uint32_t, const void *, size_t) = crc32c_init;
+static uint32_t (*crc32_ieee_fn)(uint32_t, const void *, size_t)
+	= crc32_ieee_init;
+static uint64_t (*crc64_iso_fn)(uint64_t, const void *, size_t)
+	= crc64_iso_init;
+
+/* 0: untouched, 1: being built, 2: ready. */
+static int crc_state;
+
+static void crc_pick_fns(void)
+{
+	uint32_t (*c_fn)(uint32_t, const void *, size_t) = crc32c_sliced;
+	uint32_t (*ieee_fn)(uint32_t, const void *, size_t)
+		= crc32_ieee_sliced;
+	uint64_t (*iso_fn)(uint64_t, const void *, size_t) = crc64_iso_sliced;
+
+#if HAVE_BUILTIN_ATOMIC
+	int untouched = 0;
+
+	if (!__atomic_compare_exchange_n(&crc_state, &untouched, 1, false,
+					 __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		/* Built, or about to be: it only takes microseconds. */
+		while (__atomic_load_n(&crc_state, __ATOMIC_ACQUIRE) != 2);
+		return;
+	}
+#else
+	if (crc_state == 2)
+		return;
+#endif
+
+	init_slice32(crc32c_slice, crc32c_tab);
+	init_slice32(crc32_ieee_slice, crc32_ieee_tab);
+	init_slice64(crc64_slice);
+
+#if HAVE_BUILTIN_CPU_SUPPORTS && defined(__x86_64__)
+	__builtin_cpu_init();
+#if HAVE_SSE4_2_INTRINSICS
+	if (__builtin_cpu_supports("sse4.2"))
+		c_fn = crc32c_sse42;
+#endif
+#if HAVE_PCLMUL_INTRINSICS
+	if (__builtin_cpu_supports("pclmul")) {
+		init_fold_consts();
+		ieee_fn = crc32_ieee_pclmul;
+		iso_fn = crc64_iso_pclmul;
+#if HAVE_SSE4_2_INTRINSICS
+		if (__builtin_cpu_supports("sse4.2"))
+			c_fn = crc32c_pclmul;
+#endif
+	}
+#endif
+#endif
+
+	crc_store(&crc32c_fn, c_fn);
+	crc_store(&crc32_ieee_fn, ieee_fn);
+	crc_store(&crc64_iso_fn, iso_fn);
+	crc_store(&crc_state, 2);
+}
+
+static uint32_t crc32c_init(uint32_t crc, const void *buf, size_t size)
+{
+	crc_pick_fns();
+	return crc_load(&crc32c_fn)(crc, buf, size);
+}
+
+static uint32_t crc32_ieee_init(uint32_t crc, const void *buf, size_t size)
+{
+	crc_pick_fns();
+	return crc_load(&crc32_ieee_fn)(crc, buf, size);
+}
+
+static uint64_t crc64_iso_init(uint64_t crc, const void *buf, size_t size)
+{
+	crc_pick_fns();
+	return crc_load(&crc64_iso_fn)(crc, buf, size);
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t size)
+{
+	if (size < CRC_SHORT)
+		return crc32c_bytes(crc, buf, size);
+	return crc_load(&crc32c_fn)(crc, buf, size);
+}
+
+uint32_t crc32_ieee(uint32_t crc, const void *buf, size_t size)
+{
+	if (size < CRC_SHORT)
+		return crc32_ieee_bytes(crc ^ ~0U, buf, size) ^ ~0U;
+	return crc_load(&crc32_ieee_fn)(crc ^ ~0U, buf, size) ^ ~0U;
+}
+
+uint64_t crc64_iso(uint64_t crc, const void *buf, size_t size)
+{
+	if (size < CRC_SHORT)
+		return crc64_iso_bytes(crc, buf, size);
+	return crc_load(&crc64_iso_fn)(crc, buf, size);
+}
@@ -44,6 +44,26 @@
  */
 uint32_t crc32c(uint32_t start_crc, const void *buf, size_t size);
 
+/**
+ * crc32c_combine - crc32c of two buffers, from the crc32c of each
+ * @crc1: the crc32c of the first buffer
+ * @crc2: the crc32c of the second buffer (with a @start_crc of 0)
+ * @len2: the length of the second buffer
+ *
+ * Returns what crc32c(@crc1, second buffer, @len2) would.  This lets you
+ * calculate the crcs of chunks in parallel, and combine them afterwards.
+ *
+ * Example:
+ *	// Same as crc32c(0, buf, len).
+ *	static uint32_t crc_in_halves(const char *buf, size_t len)
+ *	{
+ *		uint32_t crc1 = crc32c(0, buf, len / 2);
+ *		uint32_t crc2 = crc32c(0, buf + len / 2, len - len / 2);
+ *		return crc32c_combine(crc1, crc2, len - len / 2);
+ *	}
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
 /**
  * crc32c_table - Get the Castagnoli CRC table
  *
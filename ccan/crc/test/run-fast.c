@@ -0,0 +1,87 @@
+#include <ccan/crc/crc.h>
+#include <ccan/crc/crc.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Big enough for the three-lane crc32c path, and some. */
+#define BUF_SIZE (3 * 4096 * 2 + 200)
+
+int main(int argc, char *argv[])
+{
+	static uint8_t buf[BUF_SIZE + 8];
+	unsigned int i, off;
+	size_t len;
+	bool c_ok = true, ieee_ok = true, iso_ok = true;
+	bool c_slice = true, ieee_slice = true, iso_slice = true;
+	bool combine_ok = true, sse42_ok = true;
+
+	plan_tests(11);
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = random();
+
+	/* We call the table versions directly, so build tables now. */
+	crc_pick_fns();
+
+	/* Every length up to 300, then a few big ones, at every alignment. */
+	for (off = 0; off < 8; off++) {
+		for (len = 0; len < BUF_SIZE; len += (len < 300 ? 1 : 997)) {
+			uint32_t c = crc32c_bytes(0x12345678, buf + off, len);
+			uint32_t ieee = crc32_ieee_bytes(0x87654321,
+							 buf + off, len);
+			uint64_t iso = crc64_iso_bytes(0x123456789ULL,
+						       buf + off, len);
+
+			if (crc32c(0x12345678, buf + off, len) != c)
+				c_ok = false;
+			if (crc32_ieee(0x87654321 ^ ~0U, buf + off, len)
+			    != (ieee ^ ~0U))
+				ieee_ok = false;
+			if (crc64_iso(0x123456789ULL, buf + off, len) != iso)
+				iso_ok = false;
+
+			/* The table versions, even if hardware was chosen. */
+			if (crc32c_sliced(0x12345678, buf + off, len) != c)
+				c_slice = false;
+			if (crc32_ieee_sliced(0x87654321, buf + off, len)
+			    != ieee)
+				ieee_slice = false;
+			if (crc64_iso_sliced(0x123456789ULL, buf + off, len)
+			    != iso)
+				iso_slice = false;
+#if HAVE_BUILTIN_CPU_SUPPORTS && defined(__x86_64__) && HAVE_SSE4_2_INTRINSICS
+			/* Three-lane path isn't used if we have pclmul. */
+			if (__builtin_cpu_supports("sse4.2")
+			    && crc32c_sse42(0x12345678, buf + off, len) != c)
+				sse42_ok = false;
+#endif
+		}
+	}
+	ok1(c_ok);
+	ok1(ieee_ok);
+	ok1(iso_ok);
+	ok1(c_slice);
+	ok1(ieee_slice);
+	ok1(iso_slice);
+	ok1(sse42_ok);
+
+	for (len = 0; len < BUF_SIZE; len += (len < 100 ? 1 : 1009)) {
+		uint32_t crc1 = crc32c(7, buf, len);
+		uint32_t crc2 = crc32c(0, buf + len, BUF_SIZE - len);
+
+		if (crc32c_combine(crc1, crc2, BUF_SIZE - len)
+		    != crc32c(7, buf, BUF_SIZE))
+			combine_ok = false;
+	}
+	ok1(combine_ok);
+	ok1(crc32c_combine(0x12345678, 0, 0) == 0x12345678);
+	/* Huge lengths: the same as combining twice. */
+	ok1(crc32c_combine(crc32c_combine(1, 0, 1UL << 30), 0, 1UL << 30)
+	    == crc32c_combine(1, 0, 1UL << 31));
+	ok1(crc64_iso(0, "123456789 123456789 123456789", 29)
+	    == crc64_iso(crc64_iso(0, "123456789 ", 10),
+			 "123456789 123456789", 19));
+
+	return exit_status();
+}
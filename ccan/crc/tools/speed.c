@@ -0,0 +1,95 @@
+/* Simple speed test for the crc functions: GB/s by buffer length.
+ * "bytewise" is the classic one-table-lookup-per-byte crc32c loop. */
+#include <ccan/crc/crc.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+/* Checksum about this many bytes for each test. */
+#define TOTAL_BYTES (256 * 1024 * 1024)
+
+static uint64_t do_bytewise(const void *buf, size_t len, uint64_t crc)
+{
+	const uint32_t *tab = crc32c_table();
+	const unsigned char *p = buf;
+	uint32_t c = crc;
+
+	while (len--)
+		c = tab[(c ^ *p++) & 0xFF] ^ (c >> 8);
+	return c;
+}
+
+static uint64_t do_crc32c(const void *buf, size_t len, uint64_t crc)
+{
+	return crc32c(crc, buf, len);
+}
+
+static uint64_t do_crc32_ieee(const void *buf, size_t len, uint64_t crc)
+{
+	return crc32_ieee(crc, buf, len);
+}
+
+static uint64_t do_crc64_iso(const void *buf, size_t len, uint64_t crc)
+{
+	return crc64_iso(crc, buf, len);
+}
+
+static const struct {
+	const char *name;
+	uint64_t (*fn)(const void *buf, size_t len, uint64_t crc);
+} crcs[] = {
+	{ "bytewise", do_bytewise },
+	{ "crc32c", do_crc32c },
+	{ "crc32_ieee", do_crc32_ieee },
+	{ "crc64_iso", do_crc64_iso },
+};
+
+static double timeval_diff(const struct timeval *start,
+			   const struct timeval *stop)
+{
+	return (stop->tv_sec - start->tv_sec)
+		+ (stop->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len, maxlen = 1024 * 1024, i, j, n;
+	unsigned char *buf;
+	uint64_t result = 0;
+
+	if (argc > 2)
+		errx(1, "Usage: speed [maxlen]");
+	if (argc == 2)
+		maxlen = atol(argv[1]);
+
+	buf = malloc(maxlen);
+	if (!buf)
+		err(1, "allocating %zu bytes", maxlen);
+	for (i = 0; i < maxlen; i++)
+		buf[i] = random();
+
+	printf("%8s", "len");
+	for (j = 0; j < sizeof(crcs) / sizeof(crcs[0]); j++)
+		printf(" %15s", crcs[j].name);
+	printf("\n");
+
+	for (len = 16; len <= maxlen; len *= 4) {
+		n = TOTAL_BYTES / len;
+		printf("%8zu", len);
+		for (j = 0; j < sizeof(crcs) / sizeof(crcs[0]); j++) {
+			struct timeval start, stop;
+
+			gettimeofday(&start, NULL);
+			for (i = 0; i < n; i++)
+				result += crcs[j].fn(buf, len, result);
+			gettimeofday(&stop, NULL);
+			printf(" %10.2f GB/s", (double)n * len
+			       / timeval_diff(&start, &stop) / 1e9);
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+	/* Make sure the compiler can't discard the work. */
+	return result == 42;
+}
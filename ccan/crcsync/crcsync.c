@@ -1,8 +1,13 @@
 #include "crcsync.h"
 #include <ccan/crc/crc.h>
+#include <ccan/md4/md4.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 
 /* FIXME: That 64-bit CRC takes a while to warm the lower bits.  Do
  * some quantitative tests and replace it?  Meanwhile, use upper bits. */
@@ -27,6 +32,286 @@ void crc_of_blocks(const void *data, size_t len, unsigned int block_size,
 		crc[i] = (crc64_iso(0, buf, len) & crcmask);
 }
 
+static void strong_of(const void *data, size_t len, struct crc_strong *strong)
+{
+	struct md4_ctx mctx;
+
+	md4_init(&mctx);
+	md4_hash(&mctx, data, len);
+	md4_finish(&mctx);
+	memcpy(strong->digest, mctx.hash.bytes, sizeof(strong->digest));
+}
+
+/* Full blocks go through md4_many() this many at a time. */
+#define STRONG_BATCH 64
+
+void crc_strong_of_blocks(const void *data, size_t len, unsigned int block_size,
+			  struct crc_strong strong[])
+{
+	unsigned int i, j, n;
+	const uint8_t *buf = data;
+	const void *blocks[STRONG_BATCH];
+	unsigned char hash[STRONG_BATCH][16];
+
+	for (i = 0; len >= block_size; i += n) {
+		for (n = 0; n < STRONG_BATCH && len >= block_size; n++) {
+			blocks[n] = buf;
+			buf += block_size;
+			len -= block_size;
+		}
+		md4_many(blocks, block_size, n, hash);
+		for (j = 0; j < n; j++)
+			memcpy(strong[i + j].digest, hash[j],
+			       sizeof(strong[i + j].digest));
+	}
+	if (len)
+		strong_of(buf, len, &strong[i]);
+}
+
+/* Each thread does a contiguous run of blocks within the chunk. */
+struct crc_work {
+	const void *data;
+	size_t len;
+	unsigned int block_size, crcbits;
+	uint64_t *crc;
+	struct crc_strong *strong;
+};
+
+static void crc_work_do(struct crc_work *w)
+{
+	crc_of_blocks(w->data, w->len, w->block_size, w->crcbits, w->crc);
+	if (w->strong)
+		crc_strong_of_blocks(w->data, w->len, w->block_size, w->strong);
+}
+
+/* The workers live for one crc_of_blocks_fd() call: the reader posts
+ * each chunk's pieces here, and waits for them all to be finished. */
+struct crc_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t more, done;
+	struct crc_work *work;
+	unsigned int next, num, finished;
+	bool exiting;
+	unsigned int num_threads;
+	pthread_t *threads;
+};
+
+static void *crc_worker(void *arg)
+{
+	struct crc_pool *pool = arg;
+	struct crc_work *w;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->next == pool->num && !pool->exiting)
+			pthread_cond_wait(&pool->more, &pool->lock);
+		if (pool->next == pool->num)
+			break;
+		w = &pool->work[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		crc_work_do(w);
+
+		pthread_mutex_lock(&pool->lock);
+		if (++pool->finished == pool->num)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Start up to num workers; with none, crc_pool_run() does the work. */
+static void crc_pool_start(struct crc_pool *pool, struct crc_work *work,
+			   unsigned int num)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->more, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->work = work;
+	pool->next = pool->num = pool->finished = 0;
+	pool->exiting = false;
+	pool->num_threads = 0;
+	pool->threads = num > 1 ? malloc(num * sizeof(pthread_t)) : NULL;
+	if (!pool->threads)
+		return;
+	while (pool->num_threads < num
+	       && pthread_create(&pool->threads[pool->num_threads], NULL,
+				 crc_worker, pool) == 0)
+		pool->num_threads++;
+}
+
+/* Hand the first num entries of work to the workers. */
+static void crc_pool_post(struct crc_pool *pool, unsigned int num)
+{
+	unsigned int i;
+
+	if (!pool->num_threads) {
+		for (i = 0; i < num; i++)
+			crc_work_do(&pool->work[i]);
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->next = pool->finished = 0;
+	pool->num = num;
+	pthread_cond_broadcast(&pool->more);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void crc_pool_wait(struct crc_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->finished != pool->num)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void crc_pool_stop(struct crc_pool *pool)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->exiting = true;
+	pthread_cond_broadcast(&pool->more);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->more);
+	pthread_cond_destroy(&pool->done);
+}
+
+/* Fill the buffer unless we hit EOF: returns bytes read, or -1. */
+static ssize_t read_chunk(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = read(fd, (char *)buf + done, len - done);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+/* Read 1MB or so per thread at a time. */
+#define CRC_CHUNK_SIZE (1024 * 1024)
+
+long crc_of_blocks_fd(int fd, unsigned int block_size, unsigned int crcbits,
+		      unsigned int threads, uint64_t **crc,
+		      struct crc_strong **strong)
+{
+	size_t chunk, len, next_len, max_blocks = 0, num_blocks = 0, i, n;
+	struct crc_work *work;
+	struct crc_pool pool;
+	void *buf[2] = { NULL, NULL };
+	uint64_t *crcs = NULL;
+	struct crc_strong *strongs = NULL;
+	unsigned int cur = 0;
+	ssize_t r = 0;
+	int saved_errno;
+
+	assert(block_size > 0);
+	assert(threads > 0);
+
+	/* Every chunk but the last is a whole number of blocks. */
+	chunk = CRC_CHUNK_SIZE - CRC_CHUNK_SIZE % block_size;
+	if (chunk == 0)
+		chunk = block_size;
+
+	work = calloc(threads, sizeof(*work));
+	buf[0] = malloc(chunk * threads);
+	buf[1] = malloc(chunk * threads);
+	if (!work || !buf[0] || !buf[1])
+		goto fail_free;
+
+	r = read_chunk(fd, buf[cur], chunk * threads);
+	if (r < 0)
+		goto fail_free;
+	len = r;
+
+	crc_pool_start(&pool, work, threads);
+
+	while (len) {
+		n = (len + block_size - 1) / block_size;
+		if (num_blocks + n > max_blocks) {
+			void *newcrcs, *newstrongs;
+
+			max_blocks = (num_blocks + n) * 2;
+			newcrcs = realloc(crcs, max_blocks * sizeof(*crcs));
+			if (!newcrcs)
+				goto fail;
+			crcs = newcrcs;
+			if (strong) {
+				newstrongs = realloc(strongs, max_blocks
+						     * sizeof(*strongs));
+				if (!newstrongs)
+					goto fail;
+				strongs = newstrongs;
+			}
+		}
+
+		/* Hand out the chunk; this thread reads the next one. */
+		for (i = 0; i < threads && i * chunk < len; i++) {
+			work[i].data = (char *)buf[cur] + i * chunk;
+			work[i].len = len - i * chunk < chunk
+				? len - i * chunk : chunk;
+			work[i].block_size = block_size;
+			work[i].crcbits = crcbits;
+			work[i].crc = crcs + num_blocks + i * chunk / block_size;
+			work[i].strong = strong
+				? strongs + num_blocks + i * chunk / block_size
+				: NULL;
+		}
+		crc_pool_post(&pool, i);
+
+		/* A short chunk means we hit EOF. */
+		next_len = 0;
+		if (len == chunk * threads) {
+			r = read_chunk(fd, buf[!cur], chunk * threads);
+			next_len = r < 0 ? 0 : r;
+		}
+
+		crc_pool_wait(&pool);
+		if (r < 0)
+			goto fail;
+
+		num_blocks += n;
+		cur = !cur;
+		len = next_len;
+	}
+
+	crc_pool_stop(&pool);
+	free(work);
+	free(buf[0]);
+	free(buf[1]);
+	*crc = crcs;
+	if (strong)
+		*strong = strongs;
+	return num_blocks;
+
+fail:
+	saved_errno = errno;
+	crc_pool_stop(&pool);
+	errno = saved_errno;
+fail_free:
+	saved_errno = errno;
+	free(work);
+	free(buf[0]);
+	free(buf[1]);
+	free(crcs);
+	free(strongs);
+	errno = saved_errno;
+	return -1;
+}
+
 struct crc_context {
 	size_t block_size;
 	uint64_t crcmask;
@@ -45,9 +330,20 @@ struct crc_context {
 	size_t tail_size;
 	uint64_t tail_crc;
 
+	/* Strong digests to confirm crc matches (including tail), or NULL. */
+	struct crc_strong *strong;
+
 	/* Uncrc tab. */
 	uint64_t uncrc_tab[256];
 
+	/* Hash of crc -> index + 1 (0 == empty), 1 << index_bits entries. */
+	unsigned int index_bits;
+	unsigned int *index;
+
+	/* One bit per hash: cheap "definitely not here" before the index. */
+	unsigned int filter_bits;
+	uint64_t *filter;
+
 	/* This doesn't count the last CRC. */
 	unsigned int num_crcs;
 	uint64_t crc[];
@@ -71,9 +367,82 @@ static void init_uncrc_tab(uint64_t uncrc_tab[], unsigned int wsize)
 	}
 }
 
+/* Multiplicative hashing: the top bits of the product depend on all
+ * bits of the crc, so this works however few crcbits we keep. */
+static unsigned int index_hash(uint64_t crc, unsigned int bits)
+{
+	return (crc * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+static unsigned int filter_hash(uint64_t crc, unsigned int bits)
+{
+	return (crc * 0xC2B2AE3D27D4EB4FULL) >> (64 - bits);
+}
+
+static bool filter_test(const struct crc_context *ctx, uint64_t crc)
+{
+	unsigned int h = filter_hash(crc, ctx->filter_bits);
+
+	return ctx->filter[h / 64] & (1ULL << (h % 64));
+}
+
+/* Index is at least twice num_crcs, so probe chains stay short. */
+static bool build_index(struct crc_context *ctx)
+{
+	unsigned int i, h, mask;
+
+	for (ctx->index_bits = 1;
+	     (1ULL << ctx->index_bits) < 2ULL * ctx->num_crcs;
+	     ctx->index_bits++);
+	/* Filter has 2 bits per index entry: at least 4 per crc. */
+	ctx->filter_bits = ctx->index_bits + 2;
+	if (ctx->filter_bits < 6)
+		ctx->filter_bits = 6;
+
+	ctx->index = calloc(1U << ctx->index_bits, sizeof(ctx->index[0]));
+	ctx->filter = calloc(1U << (ctx->filter_bits - 6),
+			     sizeof(ctx->filter[0]));
+	if (!ctx->index || !ctx->filter) {
+		free(ctx->index);
+		free(ctx->filter);
+		return false;
+	}
+
+	mask = (1U << ctx->index_bits) - 1;
+	for (i = 0; i < ctx->num_crcs; i++) {
+		h = filter_hash(ctx->crc[i], ctx->filter_bits);
+		ctx->filter[h / 64] |= (1ULL << (h % 64));
+
+		/* Keep the first of any duplicates: that's what we report. */
+		for (h = index_hash(ctx->crc[i], ctx->index_bits);
+		     ctx->index[h];
+		     h = (h + 1) & mask) {
+			if (ctx->crc[ctx->index[h]-1] == ctx->crc[i]
+			    && (!ctx->strong
+				|| memcmp(&ctx->strong[ctx->index[h]-1],
+					  &ctx->strong[i],
+					  sizeof(ctx->strong[i])) == 0))
+				break;
+		}
+		if (!ctx->index[h])
+			ctx->index[h] = i + 1;
+	}
+	return true;
+}
+
 struct crc_context *crc_context_new(size_t block_size, unsigned crcbits,
 				    const uint64_t crc[], unsigned num_crcs,
 				    size_t tail_size)
+{
+	return crc_context_new_strong(block_size, crcbits, crc, NULL,
+				      num_crcs, tail_size);
+}
+
+struct crc_context *crc_context_new_strong(size_t block_size, unsigned crcbits,
+					   const uint64_t crc[],
+					   const struct crc_strong strong[],
+					   unsigned num_crcs,
+					   size_t tail_size)
 {
 	struct crc_context *ctx;
 
@@ -85,6 +454,13 @@ struct crc_context *crc_context_new(size_t block_size, unsigned crcbits,
 	if (ctx) {
 		ctx->block_size = block_size;
 		ctx->tail_size = tail_size;
+		ctx->strong = NULL;
+		if (strong) {
+			ctx->strong = malloc(sizeof(strong[0]) * num_crcs);
+			if (ctx->strong)
+				memcpy(ctx->strong, strong,
+				       sizeof(strong[0]) * num_crcs);
+		}
 		if (tail_size)
 			ctx->tail_crc = crc[--num_crcs];
 
@@ -99,7 +475,10 @@ struct crc_context *crc_context_new(size_t block_size, unsigned crcbits,
 		ctx->have_match = -1;
 		init_uncrc_tab(ctx->uncrc_tab, block_size);
 		ctx->buffer = malloc(block_size);
-		if (!ctx->buffer) {
+		if (!ctx->buffer || (strong && !ctx->strong)
+		    || !build_index(ctx)) {
+			free(ctx->strong);
+			free(ctx->buffer);
 			free(ctx);
 			ctx = NULL;
 		}
@@ -107,26 +486,81 @@ struct crc_context *crc_context_new(size_t block_size, unsigned crcbits,
 	return ctx;
 }
 
+static size_t buffer_size(const struct crc_context *ctx)
+{
+	return ctx->buffer_end - ctx->buffer_start;
+}
+
+/* Strong digest of the last len bytes we've seen: the start may still be
+ * in our saved buffer, the rest is in the first consumed bytes of buf. */
+static void window_strong(const struct crc_context *ctx,
+			  const uint8_t *buf, size_t consumed, size_t len,
+			  struct crc_strong *strong)
+{
+	struct md4_ctx mctx;
+	size_t in_buf = consumed < len ? consumed : len;
+	size_t in_old = len - in_buf;
+
+	assert(in_old <= buffer_size(ctx));
+	md4_init(&mctx);
+	md4_hash(&mctx, (uint8_t *)ctx->buffer + ctx->buffer_end - in_old,
+		 in_old);
+	md4_hash(&mctx, buf + consumed - in_buf, in_buf);
+	md4_finish(&mctx);
+	memcpy(strong->digest, mctx.hash.bytes, sizeof(strong->digest));
+}
+
 /* Return -1 or index into matching crc. */
-static int crc_matches(const struct crc_context *ctx)
+static int crc_matches(const struct crc_context *ctx,
+		       const uint8_t *buf, size_t consumed)
 {
-	unsigned int i;
+	unsigned int h, mask;
+	uint64_t crc;
+	struct crc_strong strong;
+	bool have_strong = false;
 
 	if (ctx->literal_bytes < ctx->block_size)
 		return -1;
 
-	for (i = 0; i < ctx->num_crcs; i++)
-		if ((ctx->running_crc & ctx->crcmask) == ctx->crc[i])
-			return i;
+	crc = ctx->running_crc & ctx->crcmask;
+	if (!filter_test(ctx, crc))
+		return -1;
+
+	mask = (1U << ctx->index_bits) - 1;
+	for (h = index_hash(crc, ctx->index_bits);
+	     ctx->index[h];
+	     h = (h + 1) & mask) {
+		if (ctx->crc[ctx->index[h]-1] != crc)
+			continue;
+		if (!ctx->strong)
+			return ctx->index[h]-1;
+		if (!have_strong) {
+			window_strong(ctx, buf, consumed, ctx->block_size,
+				      &strong);
+			have_strong = true;
+		}
+		if (memcmp(&strong, &ctx->strong[ctx->index[h]-1],
+			   sizeof(strong)) == 0)
+			return ctx->index[h]-1;
+	}
 	return -1;
 }
 
-static bool tail_matches(const struct crc_context *ctx)
+static bool tail_matches(const struct crc_context *ctx,
+			 const uint8_t *buf, size_t consumed)
 {
+	struct crc_strong strong;
+
 	if (ctx->literal_bytes != ctx->tail_size)
 		return false;
 
-	return (ctx->running_crc & ctx->crcmask) == ctx->tail_crc;
+	if ((ctx->running_crc & ctx->crcmask) != ctx->tail_crc)
+		return false;
+
+	if (!ctx->strong)
+		return true;
+	window_strong(ctx, buf, consumed, ctx->tail_size, &strong);
+	return memcmp(&strong, &ctx->strong[ctx->num_crcs], sizeof(strong)) == 0;
 }
 
 static uint64_t crc_add_byte(uint64_t crc, uint8_t newbyte)
@@ -146,11 +580,6 @@ static uint64_t crc_roll(uint64_t crc, uint8_t oldbyte, uint8_t newbyte,
 	return crc_add_byte(crc_remove_byte(crc, oldbyte, uncrc_tab), newbyte);
 }
 
-static size_t buffer_size(const struct crc_context *ctx)
-{
-	return ctx->buffer_end - ctx->buffer_start;
-}
-
 size_t crc_read_block(struct crc_context *ctx, long *result,
 		      const void *buf, size_t buflen)
 {
@@ -171,7 +600,7 @@ size_t crc_read_block(struct crc_context *ctx, long *result,
 		old = NULL;
 
 	while (ctx->literal_bytes < ctx->block_size
-	       || (crcmatch = crc_matches(ctx)) < 0) {
+	       || (crcmatch = crc_matches(ctx, buf, consumed)) < 0) {
 		if (consumed == buflen)
 			break;
 
@@ -195,7 +624,7 @@ size_t crc_read_block(struct crc_context *ctx, long *result,
 				old = buf;
 			/* We don't roll this csum, we only look for it after
 			 * a block match.  It's simpler and faster. */
-			if (tail_matches(ctx)) {
+			if (tail_matches(ctx, buf, consumed)) {
 				crcmatch = ctx->num_crcs;
 				goto have_match;
 			}
@@ -286,6 +715,9 @@ long crc_read_flush(struct crc_context *ctx)
  */
 void crc_context_free(struct crc_context *ctx)
 {
+	free(ctx->index);
+	free(ctx->filter);
+	free(ctx->strong);
 	free(ctx->buffer);
 	free(ctx);
 }
@@ -17,6 +17,44 @@
 void crc_of_blocks(const void *data, size_t len, unsigned int blocksize,
 		   unsigned int crcbits, uint64_t crc[]);
 
+/**
+ * struct crc_strong - strong (md4) digest of a block.
+ * @digest: the md4 of the block.
+ *
+ * A crc match is only probable; comparing these makes it near-certain.
+ */
+struct crc_strong {
+	unsigned char digest[16];
+};
+
+/**
+ * crc_strong_of_blocks - calculate the strong digest of the blocks.
+ * @data: pointer to the buffer to digest
+ * @len: length of the buffer
+ * @blocksize: size of each block (final block may be shorter)
+ * @strong: the digests (array will have (len + blocksize-1)/blocksize entries).
+ */
+void crc_strong_of_blocks(const void *data, size_t len, unsigned int blocksize,
+			  struct crc_strong strong[]);
+
+/**
+ * crc_of_blocks_fd - calculate the crcs of the blocks of a file.
+ * @fd: the file descriptor to read (until EOF).
+ * @blocksize: size of each block (final block may be shorter)
+ * @crcbits: the number of bits of crc you want (currently 64 maximum)
+ * @threads: the number of threads to use for calculation (>= 1).
+ * @crc: set to a malloc'ed array of crcs.
+ * @strong: if non-NULL, set to a malloc'ed array of strong digests.
+ *
+ * Like crc_of_blocks(), but reads @fd in large chunks and shares the
+ * blocks of each chunk between @threads threads, while the next chunk
+ * is read.  Returns the number of blocks, or -1 on error (with errno
+ * set, and nothing allocated).
+ */
+long crc_of_blocks_fd(int fd, unsigned int blocksize, unsigned int crcbits,
+		      unsigned int threads, uint64_t **crc,
+		      struct crc_strong **strong);
+
 /**
  * crc_context_new - allocate and initialize state for crc_find_block
  * @blocksize: the size of each block
@@ -32,6 +70,25 @@ struct crc_context *crc_context_new(size_t blocksize, unsigned crcbits,
 				    const uint64_t crc[], unsigned num_crcs,
 				    size_t final_size);
 
+/**
+ * crc_context_new_strong - crc_context_new with strong digest checking
+ * @blocksize: the size of each block
+ * @crcbits: the bits valid in the CRCs (<= 64)
+ * @crc: array of block crcs (including final block, if any)
+ * @strong: array of block strong digests (including final block, if any)
+ * @num_crcs: number of block crcs
+ * @tail_size: the size of final partial block, if any (< blocksize).
+ *
+ * As crc_context_new(), but crc_read_block() only reports a block match
+ * if the strong digest of the data also matches, so a crc collision is
+ * treated as literal data.  Makes a copy of @strong.
+ */
+struct crc_context *crc_context_new_strong(size_t blocksize, unsigned crcbits,
+					   const uint64_t crc[],
+					   const struct crc_strong strong[],
+					   unsigned num_crcs,
+					   size_t final_size);
+
 /**
  * crc_read_block - search for block matches in the buffer.
  * @ctx: struct crc_context from crc_context_new.
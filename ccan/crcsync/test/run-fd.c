@@ -0,0 +1,74 @@
+#include <ccan/crcsync/crcsync.h>
+#include <ccan/crcsync/crcsync.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+
+/* Not a multiple of the block size, and several chunks long. */
+#define LEN (3 * 1024 * 1024 + 1000)
+
+static bool check_fd(const char *file, const unsigned char *data, size_t len,
+		     unsigned int block_size, unsigned int threads)
+{
+	size_t n = (len + block_size - 1) / block_size;
+	uint64_t *crcs, *expect = malloc(n * sizeof(*expect));
+	struct crc_strong *strong, *expect_strong = malloc(n * sizeof(*strong));
+	bool ret;
+	long num;
+	int fd;
+
+	crc_of_blocks(data, len, block_size, 64, expect);
+	crc_strong_of_blocks(data, len, block_size, expect_strong);
+
+	fd = open(file, O_RDONLY);
+	num = crc_of_blocks_fd(fd, block_size, 64, threads, &crcs, &strong);
+	close(fd);
+
+	ret = (num == n
+	       && memcmp(crcs, expect, n * sizeof(*expect)) == 0
+	       && memcmp(strong, expect_strong, n * sizeof(*strong)) == 0);
+	if (num >= 0) {
+		free(crcs);
+		free(strong);
+	}
+	free(expect);
+	free(expect_strong);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char *data = malloc(LEN);
+	uint64_t *crcs;
+	unsigned int i;
+	int fd;
+
+	plan_tests(7);
+
+	for (i = 0; i < LEN; i++)
+		data[i] = random();
+	fd = open("run-fd.data", O_RDWR|O_CREAT|O_TRUNC, 0600);
+	ok1(write(fd, data, LEN) == LEN);
+	close(fd);
+
+	ok1(check_fd("run-fd.data", data, LEN, 1000, 1));
+	ok1(check_fd("run-fd.data", data, LEN, 1000, 4));
+	ok1(check_fd("run-fd.data", data, LEN, 4096, 3));
+	/* Blocks bigger than a chunk. */
+	ok1(check_fd("run-fd.data", data, LEN, 3 * 1024 * 1024 - 1, 2));
+
+	/* Empty file. */
+	fd = open("run-fd.data", O_RDWR|O_TRUNC);
+	ok1(crc_of_blocks_fd(fd, 1000, 64, 2, &crcs, NULL) == 0);
+	close(fd);
+	free(crcs);
+
+	/* Bad fd. */
+	ok1(crc_of_blocks_fd(-1, 1000, 64, 2, &crcs, NULL) == -1);
+
+	unlink("run-fd.data");
+	free(data);
+	return exit_status();
+}
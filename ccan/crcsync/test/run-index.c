@@ -0,0 +1,82 @@
+#include <ccan/crcsync/crcsync.h>
+#include <ccan/crcsync/crcsync.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define BLOCK_SIZE 16
+#define NUM_BLOCKS 2000
+
+/* What the old linear scan would have answered. */
+static long first_match(const uint64_t crcs[], unsigned int num,
+			uint64_t crc)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		if (crcs[i] == crc)
+			return i;
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	static char data1[NUM_BLOCKS * BLOCK_SIZE];
+	static char data2[NUM_BLOCKS * (BLOCK_SIZE + 3)];
+	uint64_t crcs[NUM_BLOCKS];
+	struct crc_context *ctx;
+	unsigned int i, b, matches = 0, literal = 0;
+	size_t used, len2 = 0;
+	long res;
+	bool all_first = true;
+
+	plan_tests(4);
+
+	/* Every 10th block is a duplicate of an earlier one. */
+	srand(2);
+	for (i = 0; i < NUM_BLOCKS; i++) {
+		if (i > 0 && i % 10 == 0)
+			memcpy(data1 + i*BLOCK_SIZE,
+			       data1 + (rand() % i)*BLOCK_SIZE, BLOCK_SIZE);
+		else
+			for (b = 0; b < BLOCK_SIZE; b++)
+				data1[i*BLOCK_SIZE + b] = rand();
+	}
+	crc_of_blocks(data1, sizeof(data1), BLOCK_SIZE, 64, crcs);
+
+	/* New file: random old blocks, separated by 3 literal bytes. */
+	for (i = 0; i < NUM_BLOCKS; i++) {
+		memcpy(data2 + len2, data1 + (rand() % NUM_BLOCKS)*BLOCK_SIZE,
+		       BLOCK_SIZE);
+		len2 += BLOCK_SIZE;
+		for (b = 0; b < 3; b++)
+			data2[len2++] = rand();
+	}
+
+	ctx = crc_context_new(BLOCK_SIZE, 64, crcs, NUM_BLOCKS, 0);
+	ok1(ctx);
+
+	for (used = 0; used < len2; ) {
+		used += crc_read_block(ctx, &res, data2+used, len2-used);
+		if (res < 0) {
+			matches++;
+			if (first_match(crcs, NUM_BLOCKS, crcs[-res-1])
+			    != -res-1)
+				all_first = false;
+		} else
+			literal += res;
+	}
+	while ((res = crc_read_flush(ctx)) != 0) {
+		if (res < 0)
+			matches++;
+		else
+			literal += res;
+	}
+	ok1(matches == NUM_BLOCKS);
+	ok1(literal == NUM_BLOCKS * 3);
+	ok1(all_first);
+	crc_context_free(ctx);
+
+	return exit_status();
+}
@@ -0,0 +1,79 @@
+#include <ccan/crcsync/crcsync.h>
+#include <ccan/crcsync/crcsync.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define BLOCK_SIZE 64
+#define NUM_BLOCKS 200
+#define NEW_LEN (64 * 1024)
+/* So few bits that random data collides all the time. */
+#define CRCBITS 8
+
+static void do_sync(struct crc_context *ctx, const char *data, size_t len,
+		 unsigned int *matches, unsigned int *literal)
+{
+	size_t used;
+	long res;
+
+	*matches = *literal = 0;
+	for (used = 0; used < len; ) {
+		used += crc_read_block(ctx, &res, data+used, len-used);
+		if (res < 0)
+			(*matches)++;
+		else
+			*literal += res;
+	}
+	while ((res = crc_read_flush(ctx)) != 0) {
+		if (res < 0)
+			(*matches)++;
+		else
+			*literal += res;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static char data1[NUM_BLOCKS * BLOCK_SIZE + 10], data2[NEW_LEN];
+	uint64_t crcs[NUM_BLOCKS + 1];
+	struct crc_strong strong[NUM_BLOCKS + 1];
+	struct crc_context *ctx;
+	unsigned int i, matches, literal;
+
+	plan_tests(8);
+
+	for (i = 0; i < sizeof(data1); i++)
+		data1[i] = random();
+	for (i = 0; i < sizeof(data2); i++)
+		data2[i] = random();
+	crc_of_blocks(data1, sizeof(data1), BLOCK_SIZE, CRCBITS, crcs);
+	crc_strong_of_blocks(data1, sizeof(data1), BLOCK_SIZE, strong);
+
+	/* Weak crcs alone find lots of bogus matches. */
+	ctx = crc_context_new(BLOCK_SIZE, CRCBITS, crcs, NUM_BLOCKS + 1, 10);
+	ok1(ctx);
+	do_sync(ctx, data2, sizeof(data2), &matches, &literal);
+	ok1(matches > 0);
+	crc_context_free(ctx);
+
+	/* Strong digests reject them. */
+	ctx = crc_context_new_strong(BLOCK_SIZE, CRCBITS, crcs, strong,
+				     NUM_BLOCKS + 1, 10);
+	ok1(ctx);
+	do_sync(ctx, data2, sizeof(data2), &matches, &literal);
+	ok1(matches == 0);
+	ok1(literal == sizeof(data2));
+	crc_context_free(ctx);
+
+	/* But real matches (including the tail) are still found. */
+	ctx = crc_context_new_strong(BLOCK_SIZE, CRCBITS, crcs, strong,
+				     NUM_BLOCKS + 1, 10);
+	ok1(ctx);
+	do_sync(ctx, data1, sizeof(data1), &matches, &literal);
+	ok1(matches == NUM_BLOCKS + 1);
+	ok1(literal == 0);
+	crc_context_free(ctx);
+
+	return exit_status();
+}
@@ -0,0 +1,70 @@
+/* Delta scanning speed (MB/s) as the number of known blocks grows.
+ *
+ * The scanned data matches no block, which is the worst case: we roll
+ * the crc and look it up at every byte. */
+#include <ccan/crcsync/crcsync.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+static double timeval_diff(const struct timeval *start,
+			   const struct timeval *stop)
+{
+	return (stop->tv_sec - start->tv_sec)
+		+ (stop->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t blocksize = 4096, scanlen = 64 * 1024 * 1024, used, i;
+	unsigned long maxblocks = 4 * 1024 * 1024, nblocks;
+	unsigned char *buf;
+	uint64_t *crcs;
+	struct timeval start, stop;
+	struct crc_context *ctx;
+	long res;
+
+	if (argc > 4)
+		errx(1, "Usage: crcbench [blocksize [scan-MB [maxblocks]]]");
+	if (argc > 1)
+		blocksize = atol(argv[1]);
+	if (argc > 2)
+		scanlen = atol(argv[2]) * 1024 * 1024;
+	if (argc > 3)
+		maxblocks = atol(argv[3]);
+	if (!blocksize || !scanlen || !maxblocks)
+		errx(1, "Arguments must be non-zero");
+
+	buf = malloc(scanlen);
+	crcs = malloc(maxblocks * sizeof(crcs[0]));
+	if (!buf || !crcs)
+		err(1, "allocating buffers");
+	for (i = 0; i < scanlen; i++)
+		buf[i] = random();
+	/* The old file's blocks: we only need their crcs. */
+	for (i = 0; i < maxblocks; i++)
+		crcs[i] = ((uint64_t)random() << 62) ^ ((uint64_t)random() << 31)
+			^ random();
+
+	printf("blocksize %zu, scanning %zu MB\n", blocksize, scanlen >> 20);
+	printf("%10s %10s\n", "blocks", "MB/s");
+	for (nblocks = 1; nblocks <= maxblocks; nblocks *= 4) {
+		ctx = crc_context_new(blocksize, 64, crcs, nblocks, 0);
+		if (!ctx)
+			errx(1, "crc_context_new failed for %lu blocks",
+			     nblocks);
+
+		gettimeofday(&start, NULL);
+		for (used = 0; used < scanlen; )
+			used += crc_read_block(ctx, &res, buf + used,
+					       scanlen - used);
+		while (crc_read_flush(ctx) != 0);
+		gettimeofday(&stop, NULL);
+
+		crc_context_free(ctx);
+		printf("%10lu %10.1f\n", nblocks,
+		       scanlen / timeval_diff(&start, &stop) / 1048576);
+	}
+	return 0;
+}
@@ -43,6 +43,7 @@ on 1 byte), but shoehorning those bytes into integers efficiently is messy.
 #endif
 
 #include "hash.h"
+#include <string.h>
 #ifdef linux
 # include <endian.h>    /* attempt to define endianness */
 #endif
@@ -700,6 +701,309 @@ uint64_t hash64_any(const void *key, size_t length, uint64_t base)
 	return ((uint64_t)b32 << 32) | lower;
 }
 
+/* hashlittle() and hashbig() both consume native-endian words (or
+ * little-endian words on mixed-endian machines): we do the same, so the
+ * streaming hash gives identical results to hash_any() and hash64_any(). */
+static uint32_t load_word(const unsigned char *p)
+{
+	uint32_t w;
+
+	if (HASH_LITTLE_ENDIAN || HASH_BIG_ENDIAN) {
+		memcpy(&w, p, sizeof(w));
+		return w;
+	}
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+		| ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void hash_block(struct hash_state *s, const unsigned char *p)
+{
+	uint32_t a = s->a, b = s->b, c = s->c;
+
+	a += load_word(p);
+	b += load_word(p + 4);
+	c += load_word(p + 8);
+	mix(a,b,c);
+	s->a = a;
+	s->b = b;
+	s->c = c;
+}
+
+void hash_init(struct hash_state *s, size_t length, uint32_t base)
+{
+	s->a = s->b = s->c = 0xdeadbeef + ((uint32_t)length) + base;
+	s->base = base;
+	s->left = length;
+	s->buflen = 0;
+}
+
+void hash64_init(struct hash_state *s, size_t length, uint64_t base)
+{
+	hash_init(s, length, base + (base >> 32));
+}
+
+void hash_update(struct hash_state *s, const void *key, size_t length)
+{
+	const unsigned char *p = key;
+
+	/* The last block (even if it's a whole one) is kept for final(). */
+	if (s->buflen) {
+		size_t n = sizeof(s->buf) - s->buflen;
+
+		if (n > length)
+			n = length;
+		memcpy(s->buf + s->buflen, p, n);
+		s->buflen += n;
+		p += n;
+		length -= n;
+		if (s->buflen < sizeof(s->buf) || s->left <= sizeof(s->buf))
+			return;
+		hash_block(s, s->buf);
+		s->left -= sizeof(s->buf);
+		s->buflen = 0;
+	}
+
+	while (length >= sizeof(s->buf) && s->left > sizeof(s->buf)) {
+		hash_block(s, p);
+		s->left -= sizeof(s->buf);
+		p += sizeof(s->buf);
+		length -= sizeof(s->buf);
+	}
+
+	memcpy(s->buf, p, length);
+	s->buflen = length;
+}
+
+static uint32_t hash_finish(struct hash_state *s)
+{
+	uint32_t a = s->a, b = s->b, c = s->c;
+
+	/* Zero length keys require no mixing. */
+	if (s->buflen == 0)
+		return c;
+
+	memset(s->buf + s->buflen, 0, sizeof(s->buf) - s->buflen);
+	a += load_word(s->buf);
+	b += load_word(s->buf + 4);
+	c += load_word(s->buf + 8);
+	final(a,b,c);
+	s->b = b;
+	return c;
+}
+
+uint32_t hash_final(struct hash_state *s)
+{
+	return hash_finish(s);
+}
+
+uint64_t hash64_final(struct hash_state *s)
+{
+	uint32_t lower = hash_finish(s);
+
+	/* Like hashlittle(), zero-length leaves val2 as the base. */
+	if (s->buflen == 0)
+		return ((uint64_t)s->base << 32) | lower;
+	return ((uint64_t)s->b << 32) | lower;
+}
+
+uint32_t hash_iov(const struct iovec *iov, int iovcnt, uint32_t base)
+{
+	struct hash_state s;
+	size_t length = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		length += iov[i].iov_len;
+
+	hash_init(&s, length, base);
+	for (i = 0; i < iovcnt; i++)
+		hash_update(&s, iov[i].iov_base, iov[i].iov_len);
+	return hash_final(&s);
+}
+
+uint64_t hash64_iov(const struct iovec *iov, int iovcnt, uint64_t base)
+{
+	struct hash_state s;
+	size_t length = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		length += iov[i].iov_len;
+
+	hash64_init(&s, length, base);
+	for (i = 0; i < iovcnt; i++)
+		hash_update(&s, iov[i].iov_base, iov[i].iov_len);
+	return hash64_final(&s);
+}
+
+/* The fast hashes below are a multiply-mix design (it's Yann Collet's
+ * xxHash64, which is BSD licensed and has published test vectors), and
+ * an SSE4.2 crc32c variant which we use instead when the CPU has it. */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define rot64(x,k) (((x)<<(k)) | ((x)>>(64-(k))))
+
+/* Always little-endian, so hash64_fast_stable() is the same everywhere. */
+static uint64_t read_le64(const unsigned char *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8)
+		| ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+		| ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40)
+		| ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint32_t read_le32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+		| ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rot64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t fmix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t hash64_fast_stable(const void *key, size_t length, uint64_t base)
+{
+	const unsigned char *p = key, *end = p + length;
+	uint64_t h;
+
+	if (length >= 32) {
+		uint64_t v1 = base + PRIME64_1 + PRIME64_2;
+		uint64_t v2 = base + PRIME64_2;
+		uint64_t v3 = base;
+		uint64_t v4 = base - PRIME64_1;
+
+		do {
+			v1 = xxh_round(v1, read_le64(p));
+			v2 = xxh_round(v2, read_le64(p+8));
+			v3 = xxh_round(v3, read_le64(p+16));
+			v4 = xxh_round(v4, read_le64(p+24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = rot64(v1, 1) + rot64(v2, 7) + rot64(v3, 12) + rot64(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	} else
+		h = base + PRIME64_5;
+
+	h += length;
+
+	while (p + 8 <= end) {
+		h ^= xxh_round(0, read_le64(p));
+		h = rot64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read_le32(p) * PRIME64_1;
+		h = rot64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= *p * PRIME64_5;
+		h = rot64(h, 11) * PRIME64_1;
+		p++;
+	}
+	return fmix64(h);
+}
+
+#if HAVE_SSE4_2_INTRINSICS && HAVE_BUILTIN_CPU_SUPPORTS && defined(__x86_64__)
+#include <nmmintrin.h>
+
+/* crc32c is one instruction per 8 bytes, with a latency of three cycles:
+ * three independent lanes keep the unit busy.  The crc is linear, so we
+ * finish with a multiply mix to get proper avalanche. */
+static uint64_t __attribute__((target("sse4.2")))
+hash64_crc32c(const void *key, size_t length, uint64_t base)
+{
+	const unsigned char *p = key, *end = p + length;
+	uint64_t h1 = base, h2 = base >> 32, h3 = ~base, w[3];
+
+	while (p + 24 <= end) {
+		memcpy(w, p, 24);
+		h1 = _mm_crc32_u64(h1, w[0]);
+		h2 = _mm_crc32_u64(h2, w[1]);
+		h3 = _mm_crc32_u64(h3, w[2]);
+		p += 24;
+	}
+	while (p + 8 <= end) {
+		memcpy(w, p, 8);
+		h1 = _mm_crc32_u64(h1, w[0]);
+		p += 8;
+	}
+	/* Tail of 1-7 bytes: overlapping loads avoid a variable memcpy
+	 * (the length is mixed in below, so the overlap is harmless). */
+	if (p + 4 <= end) {
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, end - 4, 4);
+		h2 = _mm_crc32_u64(h2, ((uint64_t)hi << 32) | lo);
+	} else if (p < end) {
+		h2 = _mm_crc32_u64(h2, p[0] | (p[(end - p) / 2] << 8)
+				   | (end[-1] << 16));
+	}
+
+	return fmix64((h1 | (h2 << 32)) + h3 * PRIME64_1
+		      + (uint64_t)length * PRIME64_5);
+}
+
+static uint64_t hash64_fast_init(const void *key, size_t length,
+				 uint64_t base);
+static uint64_t (*hash64_fast_fn)(const void *, size_t, uint64_t)
+	= hash64_fast_init;
+
+/* First call picks the implementation.  Racing threads may all do so, and
+ * store the same pointer; neither function depends on any other state, so
+ * relaxed atomics are enough to make that well-defined. */
+static uint64_t hash64_fast_init(const void *key, size_t length,
+				 uint64_t base)
+{
+	uint64_t (*fn)(const void *, size_t, uint64_t) = hash64_fast_stable;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		fn = hash64_crc32c;
+	__atomic_store_n(&hash64_fast_fn, fn, __ATOMIC_RELAXED);
+	return fn(key, length, base);
+}
+
+uint64_t hash64_fast_any(const void *key, size_t length, uint64_t base)
+{
+	return __atomic_load_n(&hash64_fast_fn, __ATOMIC_RELAXED)(key, length,
+								  base);
+}
+#else
+uint64_t hash64_fast_any(const void *key, size_t length, uint64_t base)
+{
+	return hash64_fast_stable(key, length, base);
+}
+#endif
+
 #ifdef SELF_TEST
 
 /* used for timings */
@@ -0,0 +1,63 @@
+#include <ccan/hash/hash.h>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define MAX_LEN 100
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, j;
+	unsigned char array[MAX_LEN + 1], array2[MAX_LEN + 1];
+	uint64_t results[MAX_LEN];
+	bool unaligned_ok, distinct, flips;
+
+	for (i = 0; i < sizeof(array); i++)
+		array[i] = i;
+
+	plan_tests(10);
+
+	/* hash64_fast_stable is API-guaranteed (these are xxHash64 vectors). */
+	ok1(hash64_fast_stable("", 0, 0) == 0xef46db3751d8e999ULL);
+	ok1(hash64_fast_stable("a", 1, 0) == 0xd24ec4f1a98c6e5bULL);
+	ok1(hash64_fast_stable("abc", 3, 0) == 0x44bc2cf5ad770999ULL);
+	ok1(hash64_fast_stable(array, 12, 0) == 0x424af23f1f08dca5ULL);
+	ok1(hash64_fast_stable(array, 101, 0) == 0xe99038495f85381eULL);
+	ok1(hash64_fast_stable(array, 101, 1) == 0x436499928c06f890ULL);
+
+	/* Whatever implementation we're using, alignment doesn't matter. */
+	unaligned_ok = true;
+	for (i = 0; i < MAX_LEN; i++) {
+		memcpy(array2 + 1, array, i);
+		if (hash64_fast(array, i, 0) != hash64_fast(array2 + 1, i, 0))
+			unaligned_ok = false;
+	}
+	ok1(unaligned_ok);
+
+	/* Every length gives a different answer. */
+	distinct = true;
+	for (i = 0; i < MAX_LEN; i++) {
+		results[i] = hash64_fast(array, i, 0);
+		for (j = 0; j < i; j++)
+			if (results[j] == results[i])
+				distinct = false;
+	}
+	ok1(distinct);
+
+	/* Flipping any bit in any length changes the hash. */
+	flips = true;
+	for (i = 1; i < MAX_LEN; i++) {
+		for (j = 0; j < i * 8; j++) {
+			array[j / 8] ^= (1 << (j % 8));
+			if (hash64_fast(array, i, 0) == results[i])
+				flips = false;
+			array[j / 8] ^= (1 << (j % 8));
+		}
+	}
+	ok1(flips);
+
+	/* And the base matters. */
+	ok1(hash64_fast(array, MAX_LEN, 0) != hash64_fast(array, MAX_LEN, 1));
+
+	return exit_status();
+}
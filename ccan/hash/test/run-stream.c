@@ -0,0 +1,65 @@
+#include <ccan/hash/hash.h>
+#include <ccan/tap/tap.h>
+#include <ccan/hash/hash.c>
+#include <stdbool.h>
+#include <string.h>
+
+#define MAX_LEN 64
+
+int main(int argc, char *argv[])
+{
+	unsigned char array[MAX_LEN + 1];
+	unsigned int len, split, split2;
+	bool same32 = true, same64 = true, sameiov = true;
+
+	for (len = 0; len < sizeof(array); len++)
+		array[len] = len * 7 + 3;
+
+	plan_tests(5);
+
+	/* Every way of cutting a key into three pieces gives the same hash. */
+	for (len = 0; len <= MAX_LEN; len++) {
+		uint32_t h32 = hash_any(array + 1, len, 17);
+		uint64_t h64 = hash64_any(array + 1, len, 0x100000017ULL);
+
+		for (split = 0; split <= len; split++) {
+			for (split2 = split; split2 <= len; split2++) {
+				struct hash_state s;
+				struct iovec iov[3];
+
+				hash_init(&s, len, 17);
+				hash_update(&s, array + 1, split);
+				hash_update(&s, array + 1 + split, split2 - split);
+				hash_update(&s, array + 1 + split2, len - split2);
+				if (hash_final(&s) != h32)
+					same32 = false;
+
+				hash64_init(&s, len, 0x100000017ULL);
+				hash_update(&s, array + 1, split);
+				hash_update(&s, array + 1 + split, split2 - split);
+				hash_update(&s, array + 1 + split2, len - split2);
+				if (hash64_final(&s) != h64)
+					same64 = false;
+
+				iov[0].iov_base = array + 1;
+				iov[0].iov_len = split;
+				iov[1].iov_base = array + 1 + split;
+				iov[1].iov_len = split2 - split;
+				iov[2].iov_base = array + 1 + split2;
+				iov[2].iov_len = len - split2;
+				if (hash_iov(iov, 3, 17) != h32
+				    || hash64_iov(iov, 3, 0x100000017ULL) != h64)
+					sameiov = false;
+			}
+		}
+	}
+	ok1(same32);
+	ok1(same64);
+	ok1(sameiov);
+
+	/* Empty iovec is the same as hashing nothing. */
+	ok1(hash_iov(NULL, 0, 7) == hash_any(array, 0, 7));
+	ok1(hash64_iov(NULL, 0, 7) == hash64_any(array, 0, 7));
+
+	return exit_status();
+}
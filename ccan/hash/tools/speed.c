@@ -0,0 +1,85 @@
+/* Simple speed test for the hash functions: GB/s by key length. */
+#include <ccan/hash/hash.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+/* Hash about this many bytes for each test. */
+#define TOTAL_BYTES (256 * 1024 * 1024)
+
+static uint64_t do_hash(const void *key, size_t len, uint64_t base)
+{
+	return hash_any(key, len, base);
+}
+
+static uint64_t do_hash64(const void *key, size_t len, uint64_t base)
+{
+	return hash64_any(key, len, base);
+}
+
+static uint64_t do_hash64_stable(const void *key, size_t len, uint64_t base)
+{
+	return hash64_stable_8(key, len, base);
+}
+
+static const struct {
+	const char *name;
+	uint64_t (*fn)(const void *key, size_t len, uint64_t base);
+} hashes[] = {
+	{ "hash", do_hash },
+	{ "hash64", do_hash64 },
+	{ "hash64_stable", do_hash64_stable },
+	{ "hash64_fast", hash64_fast_any },
+	{ "hash64_fast_stable", hash64_fast_stable },
+};
+
+static double timeval_diff(const struct timeval *start,
+			   const struct timeval *stop)
+{
+	return (stop->tv_sec - start->tv_sec)
+		+ (stop->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len, maxlen = 65536, i, j, n;
+	unsigned char *buf;
+	uint64_t result = 0;
+
+	if (argc > 2)
+		errx(1, "Usage: speed [maxlen]");
+	if (argc == 2)
+		maxlen = atol(argv[1]);
+
+	buf = malloc(maxlen);
+	if (!buf)
+		err(1, "allocating %zu bytes", maxlen);
+	for (i = 0; i < maxlen; i++)
+		buf[i] = random();
+
+	printf("%8s", "len");
+	for (j = 0; j < sizeof(hashes) / sizeof(hashes[0]); j++)
+		printf(" %18s", hashes[j].name);
+	printf("\n");
+
+	for (len = 4; len <= maxlen; len *= 2) {
+		n = TOTAL_BYTES / len;
+		printf("%8zu", len);
+		for (j = 0; j < sizeof(hashes) / sizeof(hashes[0]); j++) {
+			struct timeval start, stop;
+
+			gettimeofday(&start, NULL);
+			for (i = 0; i < n; i++)
+				result += hashes[j].fn(buf, len, result);
+			gettimeofday(&stop, NULL);
+			printf(" %13.2f GB/s", (double)n * len
+			       / timeval_diff(&start, &stop) / 1e9);
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+	/* Make sure the compiler can't discard the work. */
+	return result == 42;
+}
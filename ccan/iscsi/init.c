@@ -49,6 +49,10 @@ struct iscsi_context *iscsi_create_context(const char *initiator_name)
 
 	iscsi->fd = -1;
 
+	/* what we offer at login, see iscsi_login_async() */
+	iscsi->first_burst_length = 262144;
+	iscsi->max_burst_length   = 262144;
+
 	/* use a "random" isid */
 	srandom(getpid() ^ time(NULL));
 	iscsi_set_random_isid(iscsi);
@@ -118,9 +122,31 @@ int iscsi_set_targetname(struct iscsi_context *iscsi, const char *target_name)
 	return 0;
 }
 
+int iscsi_queue_length(struct iscsi_context *iscsi)
+{
+	return iscsi->cmdqueue_len + iscsi->outqueue_len + iscsi->waitpdu_len;
+}
+
+int iscsi_set_max_transfer_length(struct iscsi_context *iscsi, int max_blocks)
+{
+	if (iscsi == NULL) {
+		printf("Context is NULL when setting max transfer length\n");
+		return -1;
+	}
+	if (max_blocks < 0) {
+		printf("Invalid max transfer length %d\n", max_blocks);
+		return -2;
+	}
+
+	iscsi->max_transfer_length = max_blocks;
+
+	return 0;
+}
+
 int iscsi_destroy_context(struct iscsi_context *iscsi)
 {
 	struct iscsi_pdu *pdu;
+	int i;
 
 	if (iscsi == NULL) {
 		return 0;
@@ -152,8 +178,15 @@ int iscsi_destroy_context(struct iscsi_context *iscsi)
 		pdu->callback(iscsi, ISCSI_STATUS_CANCELLED, NULL, pdu->private_data);
 		iscsi_free_pdu(iscsi, pdu);
 	}
-	while ((pdu = iscsi->waitpdu)) {
-	      	DLIST_REMOVE(iscsi->waitpdu, pdu);
+	for (i = 0; i < ISCSI_WAITPDU_HASHES; i++) {
+		while ((pdu = iscsi->waitpdu[i])) {
+		      	DLIST_REMOVE(iscsi->waitpdu[i], pdu);
+			pdu->callback(iscsi, ISCSI_STATUS_CANCELLED, NULL, pdu->private_data);
+			iscsi_free_pdu(iscsi, pdu);
+		}
+	}
+	while ((pdu = iscsi->cmdqueue)) {
+	      	DLIST_REMOVE(iscsi->cmdqueue, pdu);
 		pdu->callback(iscsi, ISCSI_STATUS_CANCELLED, NULL, pdu->private_data);
 		iscsi_free_pdu(iscsi, pdu);
 	}
@@ -23,6 +23,10 @@
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 #endif
 
+#define ISCSI_HEADER_SIZE			48
+
+#define ISCSI_WAITPDU_HASHES			1024
+
 struct iscsi_context {
        const char *initiator_name;
        const char *target_name;
@@ -33,6 +37,15 @@ struct iscsi_context {
        uint32_t cmdsn;
        uint32_t statsn;
 
+       /* the command window the target gave us in its last response */
+       uint32_t expcmdsn;
+       uint32_t maxcmdsn;
+
+       /* limits used when splitting block i/o into commands */
+       int first_burst_length;
+       int max_burst_length;
+       int max_transfer_length;
+
        int fd;
        int is_connected;
        int is_loggedin;
@@ -41,14 +54,35 @@ struct iscsi_context {
        void *connect_data;
 
        struct iscsi_pdu *outqueue;
-       struct iscsi_pdu *waitpdu;
+       int outqueue_len;
+       struct iscsi_pdu *waitpdu[ISCSI_WAITPDU_HASHES];
+       int waitpdu_len;
+
+       /* commands held back until MaxCmdSN lets them through */
+       struct iscsi_pdu *cmdqueue;
+       int cmdqueue_len;
 
        int insize;
        int inpos;
+       int inbuflen;
        unsigned char *inbuf;
+
+       /* Data-In whose data segment is being read straight into the
+        * caller's buffer. inhdr is processed once in_direct and in_pad
+        * have both dropped to zero.
+        */
+       unsigned char inhdr[ISCSI_HEADER_SIZE];
+       unsigned char *in_direct_ptr;
+       int in_direct;
+       int in_pad;
 };
 
-#define ISCSI_HEADER_SIZE			48
+/* initial size of the receive buffer. It only grows past this when a
+ * single pdu does not fit. */
+#define ISCSI_INBUF_SIZE			16384
+
+/* max number of iovecs handed to a single writev() */
+#define ISCSI_MAX_IOV				64
 
 #define ISCSI_PDU_IMMEDIATE		       0x40
 
@@ -108,6 +142,13 @@ struct iscsi_pdu {
        struct iscsi_data outdata;
        struct iscsi_data indata;
 
+       /* data segment sent straight from the caller's buffer after outdata */
+       struct iscsi_data payload;
+
+       /* caller buffer Data-In is placed into, and how much of it was filled */
+       struct iscsi_data datain;
+       int datain_len;
+
        struct iscsi_scsi_cbdata *scsi_cbdata;
 };
 
@@ -123,6 +164,10 @@ void iscsi_pdu_set_lun(struct iscsi_pdu *pdu, uint32_t lun);
 void iscsi_pdu_set_expstatsn(struct iscsi_pdu *pdu, uint32_t expstatsnsn);
 void iscsi_pdu_set_expxferlen(struct iscsi_pdu *pdu, uint32_t expxferlen);
 int iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu, unsigned char *dptr, int dsize);
+int iscsi_pdu_set_payload(struct iscsi_pdu *pdu, unsigned char *dptr, int dsize);
+int iscsi_pdu_total_size(struct iscsi_pdu *pdu);
+struct iscsi_pdu *iscsi_find_waitpdu(struct iscsi_context *iscsi, uint32_t itt);
+void iscsi_update_cmdsn_window(struct iscsi_context *iscsi, const unsigned char *hdr);
 int iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 int iscsi_add_data(struct iscsi_data *data, unsigned char *dptr, int dsize, int pdualignment);
 int iscsi_set_random_isid(struct iscsi_context *iscsi);
@@ -140,4 +185,15 @@ int iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 int iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu, const unsigned char *hdr, int size, int *is_finished);
 int iscsi_process_nop_out_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu, const unsigned char *hdr, int size);
 
+static inline unsigned int iscsi_hash_itt(uint32_t itt)
+{
+	return itt % ISCSI_WAITPDU_HASHES;
+}
+
+/* serial number arithmetic for CmdSN, as in RFC 1982 */
+static inline int iscsi_serial_lt(uint32_t s1, uint32_t s2)
+{
+	return (int32_t)(s1 - s2) < 0;
+}
+
 #endif /* CCAN_ISCSI_PRIVATE_H */
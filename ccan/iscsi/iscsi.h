@@ -17,6 +17,8 @@
 #ifndef CCAN_ISCSI_H
 #define CCAN_ISCSI_H
 
+#include <stdint.h>
+
 struct iscsi_context;
 struct sockaddr;
 
@@ -37,6 +39,15 @@ int iscsi_which_events(struct iscsi_context *iscsi);
 int iscsi_service(struct iscsi_context *iscsi, int revents);
 
 
+/*
+ * Returns the number of commands queued or in flight on this context.
+ *
+ * Commands can be issued faster than the target accepts them. Those beyond
+ * the target's MaxCmdSN are held back locally and sent, in order, as the
+ * target opens its command window.
+ */
+int iscsi_queue_length(struct iscsi_context *iscsi);
+
 
 /*
  * Create a context for an ISCSI session.
@@ -251,14 +262,65 @@ struct iscsi_data {
 
 /*
  * Async commands for SCSI
+ *
+ * The data passed to iscsi_write10_async() is not copied, it is written to
+ * the socket straight from the caller's buffer. The buffer must stay valid
+ * until the callback has been invoked.
+ *
+ * iscsi_read10_into_async() is like iscsi_read10_async() but Data-In is
+ * placed directly into buf, which must hold at least datalen bytes and stay
+ * valid until the callback has been invoked. task->datain then points into buf.
  */
 int iscsi_reportluns_async(struct iscsi_context *iscsi, iscsi_command_cb cb, int report_type, int alloc_len, void *private_data);
 int iscsi_testunitready_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, void *private_data);
 int iscsi_inquiry_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, int evpd, int page_code, int maxsize, void *private_data);
 int iscsi_readcapacity10_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, int lba, int pmi, void *private_data);
 int iscsi_read10_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, int lba, int datalen, int blocksize, void *private_data);
+int iscsi_read10_into_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *buf, int datalen, int lba, int blocksize, void *private_data);
 int iscsi_write10_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *data, int datalen, int lba, int fua, int fuanv, int blocksize, void *private_data);
 int iscsi_modesense6_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, int dbd, int pc, int page_code, int sub_page_code, unsigned char alloc_len, void *private_data);
+int iscsi_read16_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, uint64_t lba, int datalen, int blocksize, void *private_data);
+int iscsi_write16_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *data, int datalen, uint64_t lba, int fua, int fuanv, int blocksize, void *private_data);
+
+
+/*
+ * Async block I/O
+ *
+ * Read or write num_blocks blocks starting at lba, to or from buf. The
+ * request is split into as many READ/WRITE commands as needed, which are all
+ * issued at once. READ10/WRITE10 are used where they suffice and
+ * READ16/WRITE16 otherwise.
+ * Reads are split at MaxBurstLength and writes at FirstBurstLength, and
+ * neither is larger than the max transfer length set with
+ * iscsi_set_max_transfer_length().
+ *
+ * buf is used in place and must stay valid until the callback has been invoked.
+ *
+ * Returns:
+ *  0 if the commands were queued. The callback is invoked once, when all of them are done.
+ * <0 if there was an error. The callback function will not be invoked.
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    ISCSI_STATUS_GOOD     : All of the i/o completed. Command_data is NULL.
+ *    ISCSI_STATUS_CHECK_CONDITION : Some of the i/o failed. Command_data is the
+ *                            struct scsi_sense of the first command that failed.
+ *    ISCSI_STATUS_CANCELLED: The i/o was aborted. Command_data is NULL.
+ *    ISCSI_STATUS_ERROR    : The i/o failed. Command_data is NULL.
+ */
+int iscsi_read_blocks_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *buf, uint64_t lba, int num_blocks, int blocksize, void *private_data);
+int iscsi_write_blocks_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *buf, uint64_t lba, int num_blocks, int blocksize, int fua, void *private_data);
+
+/*
+ * Set the largest number of blocks the block I/O functions will put in a
+ * single command, as reported in the target's Block Limits VPD page.
+ * 0, the default, means no limit other than the burst lengths.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+int iscsi_set_max_transfer_length(struct iscsi_context *iscsi, int max_blocks);
 
 
 #endif /* CCAN_ISCSI_H */
@@ -222,6 +222,10 @@ int iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu
 
 	iscsi->statsn = ntohs(*(uint16_t *)&hdr[24]);
 
+	/* the session starts out with whatever window the target offers */
+	iscsi->expcmdsn = ntohl(*(uint32_t *)&hdr[28]);
+	iscsi->maxcmdsn = ntohl(*(uint32_t *)&hdr[32]);
+
 	iscsi->is_loggedin = 1;
 	pdu->callback(iscsi, ISCSI_STATUS_GOOD, NULL, pdu->private_data);
 
@@ -61,6 +61,10 @@ struct iscsi_pdu *iscsi_allocate_pdu(struct iscsi_context *iscsi, enum iscsi_opc
 	pdu->itt = iscsi->itt;
 
 	iscsi->itt++;
+	/* 0xffffffff is the reserved tag */
+	if (iscsi->itt == 0xffffffff) {
+		iscsi->itt = 0;
+	}
 
 	return pdu;
 }
@@ -140,11 +144,41 @@ int iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu, unsig
 	}
 
 	/* update data segment length */
-	*(uint32_t *)&pdu->outdata.data[4] = htonl(pdu->outdata.size-ISCSI_HEADER_SIZE);
+	*(uint32_t *)&pdu->outdata.data[4] = htonl(pdu->outdata.size-ISCSI_HEADER_SIZE+pdu->payload.size);
+
+	return 0;
+}
+
+/* Like iscsi_pdu_add_data() but the data is not copied. It is written to
+ * the socket straight out of dptr, which must stay valid until the pdu
+ * has been completed.
+ */
+int iscsi_pdu_set_payload(struct iscsi_pdu *pdu, unsigned char *dptr, int dsize)
+{
+	if (pdu == NULL) {
+		printf("trying to set payload for NULL pdu\n");
+		return -1;
+	}
+	if (pdu->payload.data != NULL) {
+		printf("pdu already has a payload\n");
+		return -2;
+	}
+
+	pdu->payload.data = dptr;
+	pdu->payload.size = dsize;
+
+	/* update data segment length */
+	*(uint32_t *)&pdu->outdata.data[4] = htonl(pdu->outdata.size-ISCSI_HEADER_SIZE+pdu->payload.size);
 
 	return 0;
 }
 
+/* number of bytes this pdu takes on the wire, including padding */
+int iscsi_pdu_total_size(struct iscsi_pdu *pdu)
+{
+	return (pdu->outdata.size + pdu->payload.size + 3) & 0xfffffffc;
+}
+
 int iscsi_get_pdu_size(const unsigned char *hdr)
 {
 	int size;
@@ -156,12 +190,70 @@ int iscsi_get_pdu_size(const unsigned char *hdr)
 }
 
 
+struct iscsi_pdu *iscsi_find_waitpdu(struct iscsi_context *iscsi, uint32_t itt)
+{
+	struct iscsi_pdu *pdu;
+
+	for (pdu = iscsi->waitpdu[iscsi_hash_itt(itt)]; pdu; pdu = pdu->next) {
+		if (pdu->itt == itt) {
+			return pdu;
+		}
+	}
+	return NULL;
+}
+
+static void iscsi_remove_waitpdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	DLIST_REMOVE(iscsi->waitpdu[iscsi_hash_itt(pdu->itt)], pdu);
+	iscsi->waitpdu_len--;
+}
+
+/* Every pdu from the target carries ExpCmdSN and MaxCmdSN. Once MaxCmdSN
+ * moves on, commands we held back can be sent.
+ */
+void iscsi_update_cmdsn_window(struct iscsi_context *iscsi, const unsigned char *hdr)
+{
+	uint32_t expcmdsn, maxcmdsn;
+	struct iscsi_pdu *pdu;
+
+	expcmdsn = ntohl(*(uint32_t *)&hdr[28]);
+	maxcmdsn = ntohl(*(uint32_t *)&hdr[32]);
+
+	/* MaxCmdSN < ExpCmdSN-1 means the target wants us to ignore both */
+	if (iscsi_serial_lt(maxcmdsn, expcmdsn - 1)) {
+		return;
+	}
+	/* and responses may arrive out of order, so never move backwards */
+	if (iscsi_serial_lt(iscsi->expcmdsn, expcmdsn)) {
+		iscsi->expcmdsn = expcmdsn;
+	}
+	if (iscsi_serial_lt(iscsi->maxcmdsn, maxcmdsn)) {
+		iscsi->maxcmdsn = maxcmdsn;
+	}
+
+	while ((pdu = iscsi->cmdqueue) != NULL) {
+		if (iscsi_serial_lt(iscsi->maxcmdsn, pdu->cmdsn)) {
+			break;
+		}
+		DLIST_REMOVE(iscsi->cmdqueue, pdu);
+		iscsi->cmdqueue_len--;
+
+		/* it may have been waiting a while */
+		iscsi_pdu_set_expstatsn(pdu, iscsi->statsn+1);
+
+		DLIST_ADD_END(iscsi->outqueue, pdu, NULL);
+		iscsi->outqueue_len++;
+	}
+}
+
 int iscsi_process_pdu(struct iscsi_context *iscsi, const unsigned char *hdr, int size)
 {
 	uint32_t itt;
 	enum iscsi_opcode opcode;
 	struct iscsi_pdu *pdu;
 	uint8_t	ahslen;
+	enum iscsi_opcode expected_response;
+	int is_finished = 1;
 
 	opcode = hdr[0] & 0x3f;
 	ahslen = hdr[4];
@@ -172,86 +264,84 @@ int iscsi_process_pdu(struct iscsi_context *iscsi, const unsigned char *hdr, int
 		return -1;
 	}
 
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		enum iscsi_opcode expected_response = pdu->response_opcode;
-		int is_finished = 1;
+	iscsi_update_cmdsn_window(iscsi, hdr);
 
-		if (pdu->itt != itt) {
-			continue;
-		}
+	pdu = iscsi_find_waitpdu(iscsi, itt);
+	if (pdu == NULL) {
+		return 0;
+	}
+	expected_response = pdu->response_opcode;
 
-		/* we have a special case with scsi-command opcodes, the are replied to by either a scsi-response
-		 * or a data-in, or a combination of both.
-		 */
-		if (opcode == ISCSI_PDU_DATA_IN && expected_response == ISCSI_PDU_SCSI_RESPONSE) {
-			expected_response = ISCSI_PDU_DATA_IN;
-		}
-				
-		if (opcode != expected_response) {
-			printf("Got wrong opcode back for itt:%d  got:%d expected %d\n", itt, opcode, pdu->response_opcode);
-			return -1;
+	/* we have a special case with scsi-command opcodes, the are replied to by either a scsi-response
+	 * or a data-in, or a combination of both.
+	 */
+	if (opcode == ISCSI_PDU_DATA_IN && expected_response == ISCSI_PDU_SCSI_RESPONSE) {
+		expected_response = ISCSI_PDU_DATA_IN;
+	}
+			
+	if (opcode != expected_response) {
+		printf("Got wrong opcode back for itt:%d  got:%d expected %d\n", itt, opcode, pdu->response_opcode);
+		return -1;
+	}
+	switch (opcode) {
+	case ISCSI_PDU_LOGIN_RESPONSE:
+		if (iscsi_process_login_reply(iscsi, pdu, hdr, size) != 0) {
+			iscsi_remove_waitpdu(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			printf("iscsi login reply failed\n");
+			return -2;
 		}
-		switch (opcode) {
-		case ISCSI_PDU_LOGIN_RESPONSE:
-			if (iscsi_process_login_reply(iscsi, pdu, hdr, size) != 0) {
-				DLIST_REMOVE(iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				printf("iscsi login reply failed\n");
-				return -2;
-			}
-			break;
-		case ISCSI_PDU_TEXT_RESPONSE:
-			if (iscsi_process_text_reply(iscsi, pdu, hdr, size) != 0) {
-				DLIST_REMOVE(iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				printf("iscsi text reply failed\n");
-				return -2;
-			}
-			break;
-		case ISCSI_PDU_LOGOUT_RESPONSE:
-			if (iscsi_process_logout_reply(iscsi, pdu, hdr, size) != 0) {
-				DLIST_REMOVE(iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				printf("iscsi logout reply failed\n");
-				return -3;
-			}
-			break;
-		case ISCSI_PDU_SCSI_RESPONSE:
-			if (iscsi_process_scsi_reply(iscsi, pdu, hdr, size) != 0) {
-				DLIST_REMOVE(iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				printf("iscsi response reply failed\n");
-				return -4;
-			}
-			break;
-		case ISCSI_PDU_DATA_IN:
-			if (iscsi_process_scsi_data_in(iscsi, pdu, hdr, size, &is_finished) != 0) {
-				DLIST_REMOVE(iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				printf("iscsi data in failed\n");
-				return -4;
-			}
-			break;
-		case ISCSI_PDU_NOP_IN:
-			if (iscsi_process_nop_out_reply(iscsi, pdu, hdr, size) != 0) {
-				DLIST_REMOVE(iscsi->waitpdu, pdu);
-				iscsi_free_pdu(iscsi, pdu);
-				printf("iscsi nop-in failed\n");
-				return -5;
-			}
-			break;
-		default:
-			printf("Don't know how to handle opcode %d\n", opcode);
+		break;
+	case ISCSI_PDU_TEXT_RESPONSE:
+		if (iscsi_process_text_reply(iscsi, pdu, hdr, size) != 0) {
+			iscsi_remove_waitpdu(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			printf("iscsi text reply failed\n");
 			return -2;
 		}
-
-		if (is_finished) {
-			DLIST_REMOVE(iscsi->waitpdu, pdu);
+		break;
+	case ISCSI_PDU_LOGOUT_RESPONSE:
+		if (iscsi_process_logout_reply(iscsi, pdu, hdr, size) != 0) {
+			iscsi_remove_waitpdu(iscsi, pdu);
 			iscsi_free_pdu(iscsi, pdu);
-		} else {
-			printf("pdu is not yet finished, let it remain\n");
+			printf("iscsi logout reply failed\n");
+			return -3;
 		}
-		return 0;
+		break;
+	case ISCSI_PDU_SCSI_RESPONSE:
+		if (iscsi_process_scsi_reply(iscsi, pdu, hdr, size) != 0) {
+			iscsi_remove_waitpdu(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			printf("iscsi response reply failed\n");
+			return -4;
+		}
+		break;
+	case ISCSI_PDU_DATA_IN:
+		if (iscsi_process_scsi_data_in(iscsi, pdu, hdr, size, &is_finished) != 0) {
+			iscsi_remove_waitpdu(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			printf("iscsi data in failed\n");
+			return -4;
+		}
+		break;
+	case ISCSI_PDU_NOP_IN:
+		if (iscsi_process_nop_out_reply(iscsi, pdu, hdr, size) != 0) {
+			iscsi_remove_waitpdu(iscsi, pdu);
+			iscsi_free_pdu(iscsi, pdu);
+			printf("iscsi nop-in failed\n");
+			return -5;
+		}
+		break;
+	default:
+		printf("Don't know how to handle opcode %d\n", opcode);
+		return -2;
+	}
+
+	if (is_finished) {
+		iscsi_remove_waitpdu(iscsi, pdu);
+		iscsi_free_pdu(iscsi, pdu);
+	} else {
+		printf("pdu is not yet finished, let it remain\n");
 	}
 
 	return 0;
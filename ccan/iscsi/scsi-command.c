@@ -64,6 +64,11 @@ static void iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status, void
 }
 
 
+/* For SCSI_XFER_WRITE, data is what is sent to the target. It is not copied
+ * and must stay valid until the callback has been invoked.
+ * For SCSI_XFER_READ, data is optional and is the buffer Data-In is placed
+ * into, instead of one we allocate ourselves.
+ */
 static int iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun, struct scsi_task *task, iscsi_command_cb cb, struct iscsi_data *data, void *private_data)
 {
 	struct iscsi_pdu *pdu;
@@ -114,6 +119,14 @@ static int iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun, struct
 		break;
 	case SCSI_XFER_READ:
 		flags |= ISCSI_PDU_SCSI_READ;
+		if (data != NULL) {
+			if (data->size < task->expxferlen) {
+				printf("data-in buffer size:%d is smaller than expected data transfer length:%d\n", data->size, task->expxferlen);
+				iscsi_free_pdu(iscsi, pdu);
+				return -7;
+			}
+			pdu->datain = *data;
+		}
 		break;
 	case SCSI_XFER_WRITE:
 		flags |= ISCSI_PDU_SCSI_WRITE;
@@ -127,7 +140,7 @@ static int iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun, struct
 			iscsi_free_pdu(iscsi, pdu);
 			return -7;
 		}
-		if (iscsi_pdu_add_data(iscsi, pdu, data->data, data->size) != 0) {
+		if (iscsi_pdu_set_payload(pdu, data->data, data->size) != 0) {
 			printf("Failed to add outdata to the pdu\n");
 			iscsi_free_pdu(iscsi, pdu);
 			return -6;
@@ -167,6 +180,17 @@ static int iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun, struct
 }
 
 
+static void iscsi_set_task_datain(struct iscsi_pdu *pdu, struct scsi_task *task)
+{
+	if (pdu->datain.data != NULL) {
+		task->datain.data = pdu->datain.data;
+		task->datain.size = pdu->datain_len;
+	} else {
+		task->datain.data = pdu->indata.data;
+		task->datain.size = pdu->indata.size;
+	}
+}
+
 int iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu, const unsigned char *hdr, int size)
 {
 	int statsn, flags, response, status;
@@ -215,10 +239,9 @@ int iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 
 	switch (status) {
 	case ISCSI_STATUS_GOOD:
-		task->datain.data = pdu->indata.data;
-		task->datain.size = pdu->indata.size;
+		iscsi_set_task_datain(pdu, task);
 
-		pdu->callback(iscsi, ISCSI_STATUS_GOOD, &pdu->indata, pdu->private_data);
+		pdu->callback(iscsi, ISCSI_STATUS_GOOD, task, pdu->private_data);
 		break;
 	case ISCSI_STATUS_CHECK_CONDITION:
 		task->datain.data = discard_const(hdr + ISCSI_HEADER_SIZE);
@@ -270,11 +293,28 @@ int iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 
 	dsl = ntohl(*(uint32_t *)&hdr[4])&0x00ffffff;
 
-	if (dsl > size - ISCSI_HEADER_SIZE) {
+	if (dsl > size - ISCSI_HEADER_SIZE && pdu->datain.data == NULL) {
 		printf ("dsl is :%d, while buffser size if %d\n", dsl, size - ISCSI_HEADER_SIZE);
 	}
 
-	if (iscsi_add_data(&pdu->indata, discard_const(hdr + ISCSI_HEADER_SIZE), dsl, 0) != 0) {
+	if (pdu->datain.data != NULL) {
+		int offset = ntohl(*(uint32_t *)&hdr[40]);
+
+		if (offset < 0 || offset + dsl > pdu->datain.size) {
+			printf("data-in offset:%d len:%d is outside the %d byte buffer\n", offset, dsl, pdu->datain.size);
+			pdu->callback(iscsi, ISCSI_STATUS_ERROR, task, pdu->private_data);
+			return -3;
+		}
+		/* If we only got the header, the socket layer has already read
+		 * the data segment straight into the buffer.
+		 */
+		if (size > ISCSI_HEADER_SIZE) {
+			memcpy(pdu->datain.data + offset, hdr + ISCSI_HEADER_SIZE, dsl);
+		}
+		if (offset + dsl > pdu->datain_len) {
+			pdu->datain_len = offset + dsl;
+		}
+	} else if (iscsi_add_data(&pdu->indata, discard_const(hdr + ISCSI_HEADER_SIZE), dsl, 0) != 0) {
 		printf("failed to add data to pdu in buffer\n");
 		return -3;
 	}
@@ -298,8 +338,7 @@ int iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 	 * callback.
 	 */
 	status = hdr[3];
-	task->datain.data = pdu->indata.data;
-	task->datain.size = pdu->indata.size;
+	iscsi_set_task_datain(pdu, task);
 
 	pdu->callback(iscsi, status, task, pdu->private_data);
 
@@ -395,6 +434,29 @@ int iscsi_read10_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb
 	return ret;
 }
 
+int iscsi_read10_into_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *buf, int datalen, int lba, int blocksize, void *private_data)
+{
+	struct scsi_task *task;
+	struct iscsi_data indata;
+	int ret;
+
+	if (datalen % blocksize != 0) {
+		printf("datalen:%d is not a multiple of the blocksize:%d\n", datalen, blocksize);
+		return -1;
+	}
+
+	if ((task = scsi_cdb_read10(lba, datalen, blocksize)) == NULL) {
+		printf("Failed to create read10 cdb\n");
+		return -2;
+	}
+
+	indata.data = buf;
+	indata.size = datalen;
+
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, &indata, private_data);
+
+	return ret;
+}
 
 int iscsi_write10_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *data, int datalen, int lba, int fua, int fuanv, int blocksize, void *private_data)
 {
@@ -434,3 +496,187 @@ int iscsi_modesense6_async(struct iscsi_context *iscsi, int lun, iscsi_command_c
 	return ret;
 }
 
+int iscsi_read16_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, uint64_t lba, int datalen, int blocksize, void *private_data)
+{
+	struct scsi_task *task;
+	int ret;
+
+	if (datalen % blocksize != 0) {
+		printf("datalen:%d is not a multiple of the blocksize:%d\n", datalen, blocksize);
+		return -1;
+	}
+
+	if ((task = scsi_cdb_read16(lba, datalen, blocksize)) == NULL) {
+		printf("Failed to create read16 cdb\n");
+		return -2;
+	}
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, NULL, private_data);
+
+	return ret;
+}
+
+int iscsi_write16_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *data, int datalen, uint64_t lba, int fua, int fuanv, int blocksize, void *private_data)
+{
+	struct scsi_task *task;
+	struct iscsi_data outdata;
+	int ret;
+
+	if (datalen % blocksize != 0) {
+		printf("datalen:%d is not a multiple of the blocksize:%d\n", datalen, blocksize);
+		return -1;
+	}
+
+	if ((task = scsi_cdb_write16(lba, datalen, fua, fuanv, blocksize)) == NULL) {
+		printf("Failed to create write16 cdb\n");
+		return -2;
+	}
+
+	outdata.data = data;
+	outdata.size = datalen;
+
+	ret = iscsi_scsi_command_async(iscsi, lun, task, cb, &outdata, private_data);
+
+	return ret;
+}
+
+
+/*
+ * Block I/O, split into several commands
+ */
+struct iscsi_block_io {
+       iscsi_command_cb  callback;
+       void             *private_data;
+       int               outstanding;
+       int               issuing;
+       int               status;
+       struct scsi_sense sense;
+};
+
+static void iscsi_block_io_done(struct iscsi_context *iscsi, struct iscsi_block_io *io)
+{
+	if (io->outstanding > 0 || io->issuing) {
+		return;
+	}
+
+	if (io->status == ISCSI_STATUS_CHECK_CONDITION) {
+		io->callback(iscsi, io->status, &io->sense, io->private_data);
+	} else {
+		io->callback(iscsi, io->status, NULL, io->private_data);
+	}
+	free(io);
+}
+
+static void iscsi_block_io_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	struct iscsi_block_io *io = private_data;
+	struct scsi_task *task = command_data;
+
+	/* report the first failure */
+	if (status != ISCSI_STATUS_GOOD && io->status == ISCSI_STATUS_GOOD) {
+		io->status = status;
+		if (status == ISCSI_STATUS_CHECK_CONDITION && task != NULL) {
+			io->sense = task->sense;
+		}
+	}
+
+	io->outstanding--;
+	iscsi_block_io_done(iscsi, io);
+}
+
+static int iscsi_block_io_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, int is_write, unsigned char *buf, uint64_t lba, int num_blocks, int blocksize, int fua, void *private_data)
+{
+	struct iscsi_block_io *io;
+	int max_blocks;
+
+	if (iscsi == NULL) {
+		printf("trying to do block i/o on NULL context\n");
+		return -1;
+	}
+	if (num_blocks <= 0 || blocksize <= 0) {
+		printf("invalid block i/o of %d blocks of %d bytes\n", num_blocks, blocksize);
+		return -2;
+	}
+
+	/* Without R2T support all write data goes as immediate data, so
+	 * writes are also bounded by FirstBurstLength.
+	 */
+	max_blocks = (is_write ? iscsi->first_burst_length : iscsi->max_burst_length) / blocksize;
+	if (iscsi->max_transfer_length != 0 && max_blocks > iscsi->max_transfer_length) {
+		max_blocks = iscsi->max_transfer_length;
+	}
+	if (max_blocks == 0) {
+		printf("blocksize:%d is larger than the burst length\n", blocksize);
+		return -3;
+	}
+
+	io = malloc(sizeof(struct iscsi_block_io));
+	if (io == NULL) {
+		printf("failed to allocate block io structure\n");
+		return -4;
+	}
+	bzero(io, sizeof(struct iscsi_block_io));
+	io->callback     = cb;
+	io->private_data = private_data;
+	io->status       = ISCSI_STATUS_GOOD;
+
+	/* don't let an early completion fire the callback while we're still
+	 * issuing commands */
+	io->issuing = 1;
+	while (num_blocks > 0) {
+		struct scsi_task *task;
+		struct iscsi_data data;
+		int n = num_blocks < max_blocks ? num_blocks : max_blocks;
+
+		/* READ10/WRITE10 reach 2^32 blocks, 65535 at a time */
+		if (lba + n <= 0x100000000ULL && n <= 0xffff) {
+			if (is_write) {
+				task = scsi_cdb_write10(lba, n * blocksize, fua, 0, blocksize);
+			} else {
+				task = scsi_cdb_read10(lba, n * blocksize, blocksize);
+			}
+		} else {
+			if (is_write) {
+				task = scsi_cdb_write16(lba, n * blocksize, fua, 0, blocksize);
+			} else {
+				task = scsi_cdb_read16(lba, n * blocksize, blocksize);
+			}
+		}
+		if (task == NULL) {
+			printf("Failed to create block i/o cdb\n");
+			io->status = ISCSI_STATUS_ERROR;
+			break;
+		}
+
+		data.data = buf;
+		data.size = n * blocksize;
+		if (iscsi_scsi_command_async(iscsi, lun, task, iscsi_block_io_cb, &data, io) != 0) {
+			printf("Failed to queue block i/o command\n");
+			io->status = ISCSI_STATUS_ERROR;
+			break;
+		}
+		io->outstanding++;
+
+		buf        += n * blocksize;
+		lba        += n;
+		num_blocks -= n;
+	}
+	io->issuing = 0;
+
+	/* if nothing went out there is nothing left to call us back */
+	if (io->outstanding == 0) {
+		free(io);
+		return -5;
+	}
+
+	return 0;
+}
+
+int iscsi_read_blocks_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *buf, uint64_t lba, int num_blocks, int blocksize, void *private_data)
+{
+	return iscsi_block_io_async(iscsi, lun, cb, 0, buf, lba, num_blocks, blocksize, 0, private_data);
+}
+
+int iscsi_write_blocks_async(struct iscsi_context *iscsi, int lun, iscsi_command_cb cb, unsigned char *buf, uint64_t lba, int num_blocks, int blocksize, int fua, void *private_data)
+{
+	return iscsi_block_io_async(iscsi, lun, cb, 1, buf, lba, num_blocks, blocksize, fua, private_data);
+}
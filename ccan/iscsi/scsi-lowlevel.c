@@ -375,6 +375,67 @@ struct scsi_task *scsi_cdb_write10(int lba, int xferlen, int fua, int fuanv, int
 }
 
 
+/*
+ * READ16
+ */
+struct scsi_task *scsi_cdb_read16(uint64_t lba, int xferlen, int blocksize)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		printf("Failed to allocate scsi task structure\n");
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_READ16;
+
+	*(uint32_t *)&task->cdb[2]  = htonl(lba >> 32);
+	*(uint32_t *)&task->cdb[6]  = htonl(lba & 0xffffffff);
+	*(uint32_t *)&task->cdb[10] = htonl(xferlen/blocksize);
+
+	task->cdb_size = 16;
+	task->xfer_dir = SCSI_XFER_READ;
+	task->expxferlen = xferlen;
+
+	return task;
+}
+
+/*
+ * WRITE16
+ */
+struct scsi_task *scsi_cdb_write16(uint64_t lba, int xferlen, int fua, int fuanv, int blocksize)
+{
+	struct scsi_task *task;
+
+	task = malloc(sizeof(struct scsi_task));
+	if (task == NULL) {
+		printf("Failed to allocate scsi task structure\n");
+		return NULL;
+	}
+
+	bzero(task, sizeof(struct scsi_task));
+	task->cdb[0]   = SCSI_OPCODE_WRITE16;
+
+	if (fua) {
+		task->cdb[1] |= 0x08;
+	}
+	if (fuanv) {
+		task->cdb[1] |= 0x02;
+	}
+
+	*(uint32_t *)&task->cdb[2]  = htonl(lba >> 32);
+	*(uint32_t *)&task->cdb[6]  = htonl(lba & 0xffffffff);
+	*(uint32_t *)&task->cdb[10] = htonl(xferlen/blocksize);
+
+	task->cdb_size = 16;
+	task->xfer_dir = SCSI_XFER_WRITE;
+	task->expxferlen = xferlen;
+
+	return task;
+}
+
 
 /*
  * MODESENSE6
@@ -25,6 +25,8 @@ enum scsi_opcode {SCSI_OPCODE_TESTUNITREADY=0x00,
 		  SCSI_OPCODE_READCAPACITY10=0x25,
 		  SCSI_OPCODE_READ10=0x28,
 		  SCSI_OPCODE_WRITE10=0x2A,
+		  SCSI_OPCODE_READ16=0x88,
+		  SCSI_OPCODE_WRITE16=0x8A,
 		  SCSI_OPCODE_REPORTLUNS=0xA0};
 
 /* sense keys */
@@ -189,5 +191,7 @@ void *scsi_datain_unmarshall(struct scsi_task *task);
 
 struct scsi_task *scsi_cdb_read10(int lba, int xferlen, int blocksize);
 struct scsi_task *scsi_cdb_write10(int lba, int xferlen, int fua, int fuanv, int blocksize);
+struct scsi_task *scsi_cdb_read16(uint64_t lba, int xferlen, int blocksize);
+struct scsi_task *scsi_cdb_write16(uint64_t lba, int xferlen, int fua, int fuanv, int blocksize);
 
 #endif /* CCAN_ISCSI_SCSI_LOWLEVEL_H */
@@ -24,7 +24,7 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <poll.h>
-#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
@@ -136,6 +136,10 @@ int iscsi_disconnect(struct iscsi_context *iscsi)
 	iscsi->fd  = -1;
 
 	iscsi->is_connected = 0;
+	iscsi->insize    = 0;
+	iscsi->inpos     = 0;
+	iscsi->in_direct = 0;
+	iscsi->in_pad    = 0;
 
 	return 0;
 }
@@ -164,80 +168,209 @@ int iscsi_which_events(struct iscsi_context *iscsi)
 	return events;
 }
 
-static int iscsi_read_from_socket(struct iscsi_context *iscsi)
+/* Make room for at least "need" more bytes after the data we already have.
+ * Only the (partial) pdu we're part way through is ever moved. */
+static int iscsi_make_room(struct iscsi_context *iscsi, int need)
 {
-	int available;
-	int size;
 	unsigned char *buf;
-	ssize_t count;
+	int size;
 
-	if (ioctl(iscsi->fd, FIONREAD, &available) != 0) {
-		printf("ioctl FIONREAD returned error : %d\n", errno);
-		return -1;
+	if (iscsi->inpos > 0 && iscsi->inbuflen - iscsi->insize < need) {
+		memmove(iscsi->inbuf, iscsi->inbuf + iscsi->inpos, iscsi->insize - iscsi->inpos);
+		iscsi->insize -= iscsi->inpos;
+		iscsi->inpos   = 0;
 	}
-	if (available == 0) {
-		printf("no data readable in socket, socket is closed\n");
-		return -2;
+	if (iscsi->inbuflen - iscsi->insize >= need) {
+		return 0;
 	}
-	size = iscsi->insize - iscsi->inpos + available;
-	buf = malloc(size);
+
+	size = iscsi->inbuflen ? iscsi->inbuflen : ISCSI_INBUF_SIZE;
+	while (size - iscsi->insize < need) {
+		size *= 2;
+	}
+	buf = realloc(iscsi->inbuf, size);
 	if (buf == NULL) {
 		printf("failed to allocate %d bytes for input buffer\n", size);
-		return -3;
+		return -1;
 	}
-	if (iscsi->insize > iscsi->inpos) {
-		memcpy(buf, iscsi->inbuf + iscsi->inpos, iscsi->insize - iscsi->inpos);
-		iscsi->insize -= iscsi->inpos;
-		iscsi->inpos   = 0;
+	iscsi->inbuf    = buf;
+	iscsi->inbuflen = size;
+	return 0;
+}
+
+/* We have the header of a pdu but not all of its data. If it is a Data-In
+ * for a command with a caller supplied buffer, copy what we already have
+ * and arrange for the rest of the data segment to be read straight into
+ * that buffer.
+ *
+ * Returns 1 if the pdu was taken over, 0 if it should be buffered as usual.
+ */
+static int iscsi_start_direct_read(struct iscsi_context *iscsi)
+{
+	unsigned char *hdr = iscsi->inbuf + iscsi->inpos;
+	struct iscsi_pdu *pdu;
+	int dsl, offset, avail, copied;
+
+	if ((hdr[0] & 0x3f) != ISCSI_PDU_DATA_IN || hdr[4] != 0) {
+		return 0;
+	}
+	pdu = iscsi_find_waitpdu(iscsi, ntohl(*(uint32_t *)&hdr[16]));
+	if (pdu == NULL || pdu->datain.data == NULL) {
+		return 0;
 	}
+	dsl    = ntohl(*(uint32_t *)&hdr[4])&0x00ffffff;
+	offset = ntohl(*(uint32_t *)&hdr[40]);
+	if (offset < 0 || offset + dsl > pdu->datain.size) {
+		/* leave it to iscsi_process_scsi_data_in() to complain */
+		return 0;
+	}
+
+	/* we may already have some of the data, and even part of the padding */
+	avail = iscsi->insize - iscsi->inpos - ISCSI_HEADER_SIZE;
+	copied = avail < dsl ? avail : dsl;
+	memcpy(pdu->datain.data + offset, hdr + ISCSI_HEADER_SIZE, copied);
+	memcpy(iscsi->inhdr, hdr, ISCSI_HEADER_SIZE);
 
-	count = read(iscsi->fd, buf + iscsi->insize, available);
+	iscsi->in_direct_ptr = pdu->datain.data + offset + copied;
+	iscsi->in_direct     = dsl - copied;
+	iscsi->in_pad        = ((dsl + 3) & 0xfffffffc) - dsl - (avail - copied);
+
+	iscsi->insize = 0;
+	iscsi->inpos  = 0;
+	return 1;
+}
+
+static int iscsi_read_direct(struct iscsi_context *iscsi)
+{
+	unsigned char pad[4];
+	ssize_t count;
+
+	if (iscsi->in_direct > 0) {
+		count = read(iscsi->fd, iscsi->in_direct_ptr, iscsi->in_direct);
+	} else {
+		count = read(iscsi->fd, pad, iscsi->in_pad);
+	}
 	if (count == -1) {
-		if (errno == EINTR) {
-			free(buf);
-			buf = NULL;
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
 			return 0;
 		}
 		printf("read from socket failed, errno:%d\n", errno);
-		free(buf);
-		buf = NULL;
 		return -4;
 	}
+	if (count == 0) {
+		printf("no data readable in socket, socket is closed\n");
+		return -2;
+	}
 
-	if (iscsi->inbuf != NULL) {
-		free(iscsi->inbuf);
+	if (iscsi->in_direct > 0) {
+		iscsi->in_direct_ptr += count;
+		iscsi->in_direct     -= count;
+	} else {
+		iscsi->in_pad        -= count;
+	}
+	if (iscsi->in_direct > 0 || iscsi->in_pad > 0) {
+		return 0;
 	}
-	iscsi->inbuf   = buf;
-	iscsi->insize += count;
 
-	while (1) {
-		if (iscsi->insize - iscsi->inpos < 48) {
+	/* the data is already in place, only the header is left to process */
+	if (iscsi_process_pdu(iscsi, iscsi->inhdr, ISCSI_HEADER_SIZE) != 0) {
+		printf("failed to process pdu\n");
+		return -5;
+	}
+	return 0;
+}
+
+static int iscsi_read_from_socket(struct iscsi_context *iscsi)
+{
+	ssize_t count;
+	int need, len;
+
+	if (iscsi->in_direct > 0 || iscsi->in_pad > 0) {
+		return iscsi_read_direct(iscsi);
+	}
+
+	/* If we know how big the pdu we're reading is, make room for all
+	 * of it so it arrives in one piece.
+	 */
+	need = ISCSI_HEADER_SIZE - (iscsi->insize - iscsi->inpos);
+	if (need <= 0) {
+		need = iscsi_get_pdu_size(iscsi->inbuf + iscsi->inpos) - (iscsi->insize - iscsi->inpos);
+	}
+	if (iscsi_make_room(iscsi, need) != 0) {
+		return -3;
+	}
+
+	/* Don't read much further than the pdu we're on, so the data segment
+	 * of a big Data-In can go straight to the caller's buffer.
+	 */
+	len = iscsi->inbuflen - iscsi->insize;
+	if (len > ISCSI_INBUF_SIZE && len > need) {
+		len = need > ISCSI_INBUF_SIZE ? need : ISCSI_INBUF_SIZE;
+	}
+
+	count = read(iscsi->fd, iscsi->inbuf + iscsi->insize, len);
+	if (count == -1) {
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
 			return 0;
 		}
+		printf("read from socket failed, errno:%d\n", errno);
+		return -4;
+	}
+	if (count == 0) {
+		printf("no data readable in socket, socket is closed\n");
+		return -2;
+	}
+	iscsi->insize += count;
+
+	while (iscsi->insize - iscsi->inpos >= ISCSI_HEADER_SIZE) {
 		count = iscsi_get_pdu_size(iscsi->inbuf + iscsi->inpos);
-		if (iscsi->insize + iscsi->inpos < count) {
-			return 0;
+		if (iscsi->insize - iscsi->inpos < count) {
+			iscsi_start_direct_read(iscsi);
+			break;
 		}
 		if (iscsi_process_pdu(iscsi, iscsi->inbuf + iscsi->inpos, count) != 0) {
 			printf("failed to process pdu\n");
 			return -5;
 		}
 		iscsi->inpos += count;
-		if (iscsi->inpos == iscsi->insize) {
-			free(iscsi->inbuf);
-			iscsi->inbuf = NULL;
-			iscsi->insize = 0;
-			iscsi->inpos = 0;
-		}
-		if (iscsi->inpos > iscsi->insize) {
-			printf("inpos > insize. bug!\n");
-			return -6;
-		}
+	}
+	if (iscsi->inpos == iscsi->insize) {
+		iscsi->insize = 0;
+		iscsi->inpos  = 0;
 	}
 
 	return 0;
 }
 
+static const unsigned char iscsi_pad[4];
+
+/* Fill in iovecs for the part of the pdu that has not been written yet:
+ * the header and any data kept in outdata, the caller's payload and the
+ * padding up to a multiple of 4 bytes.
+ */
+static int iscsi_pdu_to_iov(struct iscsi_pdu *pdu, struct iovec *iov, int niov)
+{
+	struct iscsi_data seg[3];
+	int i, n = 0, skip = pdu->written;
+
+	seg[0] = pdu->outdata;
+	seg[1] = pdu->payload;
+	seg[2].data = discard_const(iscsi_pad);
+	seg[2].size = iscsi_pdu_total_size(pdu) - pdu->outdata.size - pdu->payload.size;
+
+	for (i = 0; i < 3 && n < niov; i++) {
+		if (skip >= seg[i].size) {
+			skip -= seg[i].size;
+			continue;
+		}
+		iov[n].iov_base = seg[i].data + skip;
+		iov[n].iov_len  = seg[i].size - skip;
+		skip = 0;
+		n++;
+	}
+	return n;
+}
+
 static int iscsi_write_to_socket(struct iscsi_context *iscsi)
 {
 	ssize_t count;
@@ -252,27 +385,40 @@ static int iscsi_write_to_socket(struct iscsi_context *iscsi)
 	}
 
 	while (iscsi->outqueue != NULL) {
-		ssize_t total;
+		struct iovec iov[ISCSI_MAX_IOV];
+		struct iscsi_pdu *pdu;
+		int niov = 0;
 
-		total = iscsi->outqueue->outdata.size;
-		total = (total +3) & 0xfffffffc;
+		/* gather as many queued pdus as we can into a single writev */
+		for (pdu = iscsi->outqueue; pdu != NULL && niov < ISCSI_MAX_IOV; pdu = pdu->next) {
+			niov += iscsi_pdu_to_iov(pdu, &iov[niov], ISCSI_MAX_IOV - niov);
+		}
 
-		count = write(iscsi->fd, iscsi->outqueue->outdata.data + iscsi->outqueue->written, total - iscsi->outqueue->written);
+		count = writev(iscsi->fd, iov, niov);
 		if (count == -1) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				printf("socket would block, return from write to socket\n");
 				return 0;
 			}
 			printf("Error when writing to socket :%d\n", errno);
 			return -3;
 		}
 
-		iscsi->outqueue->written += count;
-		if (iscsi->outqueue->written == total) {
-			struct iscsi_pdu *pdu = iscsi->outqueue;
+		while (count > 0) {
+			int remaining;
+
+			pdu = iscsi->outqueue;
+			remaining = iscsi_pdu_total_size(pdu) - pdu->written;
+			if (count < remaining) {
+				pdu->written += count;
+				break;
+			}
+			pdu->written += remaining;
+			count        -= remaining;
 
 	       	    	DLIST_REMOVE(iscsi->outqueue, pdu);
-			DLIST_ADD_END(iscsi->waitpdu, pdu, NULL);
+			iscsi->outqueue_len--;
+			DLIST_ADD_END(iscsi->waitpdu[iscsi_hash_itt(pdu->itt)], pdu, NULL);
+			iscsi->waitpdu_len++;
 		}
 	}
 	return 0;
@@ -323,7 +469,19 @@ int iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		printf("trying to queue NULL pdu\n");
 		return -2;
 	}
+
+	/* Commands that use up a CmdSN may only go out while they are inside
+	 * the window the target gave us. Until then they wait here, in order.
+	 */
+	if ((pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) == 0
+	    && (iscsi->cmdqueue != NULL || iscsi_serial_lt(iscsi->maxcmdsn, pdu->cmdsn))) {
+		DLIST_ADD_END(iscsi->cmdqueue, pdu, NULL);
+		iscsi->cmdqueue_len++;
+		return 0;
+	}
+
 	DLIST_ADD_END(iscsi->outqueue, pdu, NULL);
+	iscsi->outqueue_len++;
 
 	return 0;
 }
@@ -0,0 +1,425 @@
+#include <ccan/iscsi/iscsi.h>
+#include <ccan/iscsi/discovery.c>
+#include <ccan/iscsi/socket.c>
+#include <ccan/iscsi/init.c>
+#include <ccan/iscsi/pdu.c>
+#include <ccan/iscsi/scsi-lowlevel.c>
+#include <ccan/iscsi/nop.c>
+#include <ccan/iscsi/login.c>
+#include <ccan/iscsi/scsi-command.c>
+#include <ccan/tap/tap.h>
+#include <sys/socket.h>
+
+/* We play the target on the other end of a socketpair. */
+static int target;
+static struct iscsi_context *initiator;
+static uint32_t expcmdsn, maxcmdsn;
+
+struct result {
+	int done;
+	int status;
+	struct scsi_task *task;
+	unsigned char data[100000];
+	int size;
+};
+
+static void command_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	struct result *r = private_data;
+	struct scsi_task *task = command_data;
+
+	r->done++;
+	r->status = status;
+	r->task = task;
+	if (task == NULL) {
+		return;
+	}
+	if (task->datain.data != NULL && task->datain.data != r->data) {
+		memcpy(r->data, task->datain.data, task->datain.size);
+	}
+	r->size = task->datain.size;
+}
+
+static struct iscsi_context *connected_context(uint32_t window)
+{
+	struct iscsi_context *iscsi;
+	int fds[2];
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	set_nonblocking(fds[0]);
+	target = fds[1];
+
+	iscsi = iscsi_create_context("iqn.initiator");
+	iscsi->fd = fds[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->maxcmdsn = window;
+	maxcmdsn = window;
+	initiator = iscsi;
+	return iscsi;
+}
+
+static void flush(struct iscsi_context *iscsi)
+{
+	while (iscsi->outqueue != NULL) {
+		iscsi_service(iscsi, POLLOUT);
+	}
+}
+
+static void read_all(int fd, unsigned char *buf, int len)
+{
+	while (len > 0) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int count;
+
+		/* more than fits in the socket, keep the initiator writing */
+		if (poll(&pfd, 1, 0) == 0) {
+			if (initiator->outqueue == NULL) {
+				abort();
+			}
+			iscsi_service(initiator, POLLOUT);
+			continue;
+		}
+		count = read(fd, buf, len);
+		if (count <= 0) {
+			abort();
+		}
+		buf += count;
+		len -= count;
+	}
+}
+
+/* read the next pdu the initiator sent, returns its data segment length */
+static int read_pdu(unsigned char *hdr, unsigned char *data)
+{
+	int dsl;
+
+	read_all(target, hdr, ISCSI_HEADER_SIZE);
+	dsl = ntohl(*(uint32_t *)&hdr[4])&0x00ffffff;
+	read_all(target, data, (dsl + 3) & 0xfffffffc);
+	return dsl;
+}
+
+/* send a data-in pdu to the initiator, dribbling it through the socket in
+ * pieces so it arrives split across many reads.
+ */
+static void send_data_in(struct iscsi_context *iscsi, uint32_t itt, unsigned char *data, int offset, int len, int last, int piece)
+{
+	unsigned char *buf;
+	int total, pos;
+
+	total = ISCSI_HEADER_SIZE + ((len + 3) & 0xfffffffc);
+	buf = calloc(1, total);
+	buf[0] = ISCSI_PDU_DATA_IN;
+	buf[1] = last ? ISCSI_PDU_DATA_FINAL|ISCSI_PDU_DATA_CONTAINS_STATUS : 0;
+	*(uint32_t *)&buf[4]  = htonl(len);
+	*(uint32_t *)&buf[16] = htonl(itt);
+	*(uint32_t *)&buf[28] = htonl(expcmdsn);
+	*(uint32_t *)&buf[32] = htonl(maxcmdsn);
+	*(uint32_t *)&buf[40] = htonl(offset);
+	memcpy(buf + ISCSI_HEADER_SIZE, data + offset, len);
+
+	for (pos = 0; pos < total; pos += piece) {
+		int count = total - pos < piece ? total - pos : piece;
+
+		if (write(target, buf + pos, count) != count) {
+			abort();
+		}
+		iscsi_service(iscsi, POLLIN);
+	}
+	free(buf);
+
+	/* and let the initiator read whatever is left */
+	while (1) {
+		struct pollfd pfd = { iscsi->fd, POLLIN, 0 };
+
+		if (poll(&pfd, 1, 0) == 0) {
+			break;
+		}
+		iscsi_service(iscsi, POLLIN);
+	}
+}
+
+/* send a scsi response, with sense data for a check condition */
+static void send_response(uint32_t itt, int status)
+{
+	unsigned char buf[ISCSI_HEADER_SIZE + 20];
+	int len = ISCSI_HEADER_SIZE;
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = ISCSI_PDU_SCSI_RESPONSE;
+	buf[1] = ISCSI_PDU_SCSI_FINAL;
+	buf[3] = status;
+	*(uint32_t *)&buf[16] = htonl(itt);
+	*(uint32_t *)&buf[28] = htonl(expcmdsn);
+	*(uint32_t *)&buf[32] = htonl(maxcmdsn);
+	if (status == ISCSI_STATUS_CHECK_CONDITION) {
+		*(uint32_t *)&buf[4] = htonl(20);
+		*(uint16_t *)&buf[ISCSI_HEADER_SIZE] = htons(18);
+		buf[ISCSI_HEADER_SIZE + 2] = 0x70;
+		buf[ISCSI_HEADER_SIZE + 4] = SCSI_SENSE_KEY_ILLEGAL_REQUEST;
+		*(uint16_t *)&buf[ISCSI_HEADER_SIZE + 14] = htons(SCSI_SENSE_ASCQ_INVALID_FIELD_IN_CDB);
+		len += 20;
+	}
+	if (write(target, buf, len) != len) {
+		abort();
+	}
+}
+
+/* block i/o completes once, however many commands it took */
+static int block_done, block_status;
+static struct scsi_sense block_sense;
+
+static void block_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	block_done++;
+	block_status = status;
+	if (command_data != NULL) {
+		block_sense = *(struct scsi_sense *)command_data;
+	}
+}
+
+/* lots of small reads, all of which should see the same data */
+static int small_done;
+static unsigned char small_in[512];
+
+static void small_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	struct scsi_task *task = command_data;
+
+	if (status == ISCSI_STATUS_GOOD && task->datain.data == private_data
+	    && task->datain.size == 512 && memcmp(private_data, small_in, 512) == 0) {
+		small_done++;
+	}
+}
+
+int main(void)
+{
+	struct iscsi_context *iscsi;
+	static unsigned char out[3][70000], in[614400], big[614400], hdr[ISCSI_HEADER_SIZE];
+	static struct result r[3];
+	static unsigned char small[200][512];
+	static uint32_t itts[200];
+	int sizes[3] = { 512, 1001, 70000 };
+	int i, dsl, ok;
+	uint32_t itt, cdb_lba_hi, cdb_lba, cdb_len;
+	uint64_t lba;
+
+	plan_tests(47);
+
+	for (i = 0; i < (int)sizeof(in); i++) {
+		in[i] = i * 7 + 3;
+	}
+	for (i = 0; i < 3; i++) {
+		memset(out[i], 'a' + i, sizeof(out[i]));
+	}
+
+	iscsi = connected_context(1000);
+
+	/* writes go out in one writev straight from our buffers, padded */
+	for (i = 0; i < 3; i++) {
+		iscsi_write10_async(iscsi, 0, command_cb, out[i], sizes[i], i, 0, 0, 1, &r[i]);
+	}
+	ok1(iscsi_service(iscsi, POLLOUT) == 0);
+	flush(iscsi);
+	ok1(iscsi->waitpdu_len == 3 && iscsi->outqueue_len == 0);
+
+	for (i = 0; i < 3; i++) {
+		static unsigned char data[70004];
+
+		dsl = read_pdu(hdr, data);
+		ok1(dsl == sizes[i] && memcmp(data, out[i], dsl) == 0
+		    && memcmp(data + dsl, "\0\0\0", ((dsl + 3) & 0xfffffffc) - dsl) == 0);
+	}
+
+	/* read into our own buffer, data segments dribbled in small pieces and
+	 * some of them not a multiple of 4 */
+	iscsi_read10_into_async(iscsi, 0, command_cb, r[0].data, 100000, 0, 1, &r[0]);
+	flush(iscsi);
+	dsl = read_pdu(hdr, NULL);
+	itt = ntohl(*(uint32_t *)&hdr[16]);
+	ok1(dsl == 0 && (hdr[1] & ISCSI_PDU_SCSI_READ));
+
+	send_data_in(iscsi, itt, in, 0, 39999, 0, 50);
+	send_data_in(iscsi, itt, in, 39999, 40001, 0, 30000);
+	ok1(r[0].done == 0);
+	ok1(iscsi->inbuflen == ISCSI_INBUF_SIZE);
+	send_data_in(iscsi, itt, in, 80000, 20000, 1, 47);
+	ok1(r[0].done == 1 && r[0].status == ISCSI_STATUS_GOOD);
+	ok1(r[0].task->datain.data == r[0].data && r[0].size == 100000);
+	ok1(memcmp(r[0].data, in, 100000) == 0);
+	ok1(iscsi_find_waitpdu(iscsi, itt) == NULL);
+
+	/* a whole pdu arriving in one go is copied out of the input buffer */
+	iscsi_read10_into_async(iscsi, 0, command_cb, r[1].data, 4096, 0, 512, &r[1]);
+	flush(iscsi);
+	read_pdu(hdr, NULL);
+	itt = ntohl(*(uint32_t *)&hdr[16]);
+	send_data_in(iscsi, itt, in, 0, 4096, 1, 4096 + ISCSI_HEADER_SIZE);
+	ok1(r[1].done == 1 && r[1].size == 4096 && memcmp(r[1].data, in, 4096) == 0);
+
+	/* data-in outside the buffer is refused */
+	iscsi_read10_into_async(iscsi, 0, command_cb, r[1].data, 4096, 0, 512, &r[1]);
+	flush(iscsi);
+	read_pdu(hdr, NULL);
+	itt = ntohl(*(uint32_t *)&hdr[16]);
+	send_data_in(iscsi, itt, in, 4096, 512, 1, 600);
+	ok1(r[1].done == 2 && r[1].status == ISCSI_STATUS_ERROR);
+
+	/* reads without a buffer of ours still work */
+	iscsi_read10_async(iscsi, 0, command_cb, 0, 100000, 1, &r[2]);
+	flush(iscsi);
+	read_pdu(hdr, NULL);
+	itt = ntohl(*(uint32_t *)&hdr[16]);
+	send_data_in(iscsi, itt, in, 0, 60001, 0, 1000);
+	send_data_in(iscsi, itt, in, 60001, 39999, 1, 1000);
+	ok1(r[2].done == 1 && r[2].status == ISCSI_STATUS_GOOD);
+	ok1(r[2].size == 100000 && memcmp(r[2].data, in, 100000) == 0);
+	ok1(iscsi->inbuflen > ISCSI_INBUF_SIZE);
+	ok1(iscsi->in_direct == 0 && iscsi->in_pad == 0);
+
+	/* there are still three writes waiting for a response */
+	ok1(iscsi_destroy_context(iscsi) == 0);
+	close(target);
+
+	/* The target starts out only letting us send a single command, so the
+	 * other 199 have to wait for it to open up the window.
+	 */
+	memcpy(small_in, in, 512);
+	iscsi = connected_context(0);
+	for (i = 0; i < 200; i++) {
+		iscsi_read10_into_async(iscsi, 0, small_cb, small[i], 512, i, 512, small[i]);
+	}
+	flush(iscsi);
+	ok1(iscsi_queue_length(iscsi) == 200);
+	ok1(iscsi->waitpdu_len == 1 && iscsi->cmdqueue_len == 199);
+	ok1((iscsi_which_events(iscsi) & POLLOUT) == 0);
+
+	read_pdu(hdr, NULL);
+	itt = ntohl(*(uint32_t *)&hdr[16]);
+	expcmdsn = 1;
+	maxcmdsn = 128;
+	send_data_in(iscsi, itt, in, 0, 512, 1, 600);
+	ok1(small_done == 1 && (iscsi_which_events(iscsi) & POLLOUT));
+	flush(iscsi);
+	ok1(iscsi->waitpdu_len == 128 && iscsi->cmdqueue_len == 71);
+
+	ok = 1;
+	for (i = 1; i <= 128; i++) {
+		read_pdu(hdr, NULL);
+		itts[i] = ntohl(*(uint32_t *)&hdr[16]);
+		if (ntohl(*(uint32_t *)&hdr[24]) != (uint32_t)i) {
+			ok = 0;
+		}
+	}
+	ok1(ok);
+
+	/* a stale window from an earlier response does not shrink it */
+	expcmdsn = 1;
+	maxcmdsn = 100;
+	send_data_in(iscsi, itts[128], in, 0, 512, 1, 600);
+	ok1(iscsi->maxcmdsn == 128 && iscsi->cmdqueue_len == 71);
+
+	/* complete the rest in reverse, which lets the last 71 through */
+	expcmdsn = 129;
+	maxcmdsn = 256;
+	for (i = 127; i >= 1; i--) {
+		send_data_in(iscsi, itts[i], in, 0, 512, 1, 600);
+	}
+	flush(iscsi);
+	ok1(small_done == 129 && iscsi->waitpdu_len == 71 && iscsi->cmdqueue_len == 0);
+
+	for (i = 129; i < 200; i++) {
+		read_pdu(hdr, NULL);
+		itts[i] = ntohl(*(uint32_t *)&hdr[16]);
+	}
+	for (i = 129; i < 200; i++) {
+		send_data_in(iscsi, itts[i], in, 0, 512, 1, 600);
+	}
+	ok1(small_done == 200 && iscsi_queue_length(iscsi) == 0);
+	iscsi->is_loggedin = 0;
+	ok1(iscsi_destroy_context(iscsi) == 0);
+	close(target);
+
+	/* READ10/READ16 cdbs */
+	{
+		struct scsi_task *task = scsi_cdb_read16(0x123456789aULL, 8192, 512);
+
+		ok1(task->cdb[0] == SCSI_OPCODE_READ16 && task->cdb_size == 16 && task->expxferlen == 8192);
+		ok1(task->cdb[5] == 0x12 && task->cdb[9] == 0x9a && ntohl(*(uint32_t *)&task->cdb[10]) == 16);
+		scsi_free_scsi_task(task);
+		task = scsi_cdb_write16(1, 512, 1, 0, 512);
+		ok1(task->cdb[0] == SCSI_OPCODE_WRITE16 && task->cdb[1] == 0x08 && task->xfer_dir == SCSI_XFER_WRITE);
+		scsi_free_scsi_task(task);
+	}
+
+	/* A read straddling the 2^32 block boundary, no more than 128 blocks
+	 * per command: READ10 for the first, READ16 for the rest.
+	 */
+	iscsi = connected_context(1000);
+	ok1(iscsi_set_max_transfer_length(iscsi, 128) == 0);
+	ok1(iscsi_read_blocks_async(iscsi, 0, block_cb, big, 0x100000000ULL - 200, 400, 512, NULL) == 0);
+	flush(iscsi);
+	ok1(iscsi_queue_length(iscsi) == 4);
+
+	ok = 1;
+	lba = 0x100000000ULL - 200;
+	for (i = 0; i < 4; i++) {
+		read_pdu(hdr, NULL);
+		itts[i] = ntohl(*(uint32_t *)&hdr[16]);
+		if (i == 0) {
+			cdb_lba_hi = 0;
+			cdb_lba = ntohl(*(uint32_t *)&hdr[32 + 2]);
+			cdb_len = ntohs(*(uint16_t *)&hdr[32 + 7]);
+			ok &= hdr[32] == SCSI_OPCODE_READ10;
+		} else {
+			cdb_lba_hi = ntohl(*(uint32_t *)&hdr[32 + 2]);
+			cdb_lba = ntohl(*(uint32_t *)&hdr[32 + 6]);
+			cdb_len = ntohl(*(uint32_t *)&hdr[32 + 10]);
+			ok &= hdr[32] == SCSI_OPCODE_READ16;
+		}
+		ok &= (((uint64_t)cdb_lba_hi << 32) | cdb_lba) == lba;
+		ok &= cdb_len == (i < 3 ? 128 : 16);
+		ok &= ntohl(*(uint32_t *)&hdr[20]) == cdb_len * 512;
+		lba += cdb_len;
+	}
+	ok1(ok);
+
+	for (i = 3; i >= 0; i--) {
+		send_data_in(iscsi, itts[i], in + i * 65536, 0, i < 3 ? 65536 : 8192, 1, 70000);
+		if (i > 0) {
+			ok1(block_done == 0);
+		}
+	}
+	ok1(block_done == 1 && block_status == ISCSI_STATUS_GOOD);
+	ok1(memcmp(big, in, 400 * 512) == 0);
+
+	/* writes are split at FirstBurstLength and report the first failure */
+	ok1(iscsi_set_max_transfer_length(iscsi, 0) == 0);
+	ok1(iscsi_write_blocks_async(iscsi, 0, block_cb, in, 7, 1200, 512, 1, NULL) == 0);
+	ok = 1;
+	for (i = 0; i < 3; i++) {
+		dsl = read_pdu(hdr, big);
+		itts[i] = ntohl(*(uint32_t *)&hdr[16]);
+		ok &= hdr[32] == SCSI_OPCODE_WRITE10 && hdr[33] == 0x08;
+		ok &= ntohl(*(uint32_t *)&hdr[32 + 2]) == (uint32_t)(7 + i * 512);
+		ok &= dsl == (i < 2 ? 262144 : 176 * 512);
+		ok &= memcmp(big, in + i * 262144, dsl) == 0;
+	}
+	ok1(ok);
+	send_response(itts[0], ISCSI_STATUS_GOOD);
+	send_response(itts[1], ISCSI_STATUS_CHECK_CONDITION);
+	send_response(itts[2], ISCSI_STATUS_GOOD);
+	while (iscsi_queue_length(iscsi) > 0) {
+		iscsi_service(iscsi, POLLIN);
+	}
+	ok1(block_done == 2 && block_status == ISCSI_STATUS_CHECK_CONDITION);
+	ok1(block_sense.key == SCSI_SENSE_KEY_ILLEGAL_REQUEST && block_sense.ascq == SCSI_SENSE_ASCQ_INVALID_FIELD_IN_CDB);
+
+	iscsi->is_loggedin = 0;
+	ok1(iscsi_destroy_context(iscsi) == 0);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
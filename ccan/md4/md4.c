@@ -20,8 +20,10 @@
  * (at your option) any later version.
  */
 #include "md4.h"
+#include "config.h"
 #include <ccan/endian/endian.h>
 #include <ccan/array_size/array_size.h>
+#include <stdbool.h>
 #include <string.h>
 
 static inline uint32_t lshift(uint32_t x, unsigned int s)
@@ -198,3 +200,112 @@ void md4_finish(struct md4_ctx *mctx)
 	md4_transform(mctx->hash.words, mctx->block);
 	cpu_to_le32_array(mctx->hash.words, ARRAY_SIZE(mctx->hash.words));
 }
+
+/*
+ * Multi-buffer version: the same md4 steps, on vectors where each lane
+ * is a separate buffer.  The lane count 1 version is the fallback.
+ */
+static const uint32_t md4_iv[4] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+};
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32_to_cpu(v);
+}
+
+static inline void put_le32(unsigned char *p, uint32_t v)
+{
+	v = cpu_to_le32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_le64(unsigned char *p, uint64_t v)
+{
+	v = cpu_to_le64(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+/* These work on scalars and gcc vectors alike. */
+#define MD4_F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD4_G(x, y, z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD4_R1(a, b, c, d, k, s) \
+	((a) = MD4_ROL((a) + MD4_F(b, c, d) + (k), s))
+#define MD4_R2(a, b, c, d, k, s) \
+	((a) = MD4_ROL((a) + MD4_G(b, c, d) + (k) + 0x5A827999U, s))
+#define MD4_R3(a, b, c, d, k, s) \
+	((a) = MD4_ROL((a) + MD4_H(b, c, d) + (k) + 0x6ED9EBA1U, s))
+
+#define MD4_LANES 1
+#define MD4_VEC uint32_t
+#define MD4_FN md4_lanes1
+#define MD4_ATTR
+#include "md4_lanes.h"
+#undef MD4_LANES
+#undef MD4_VEC
+#undef MD4_FN
+#undef MD4_ATTR
+
+#if HAVE_BUILTIN_CPU_SUPPORTS && defined(__x86_64__)
+/* SSE2 is always there on x86-64; AVX2 we have to check for. */
+typedef uint32_t md4_v4 __attribute__((vector_size(16)));
+typedef uint32_t md4_v8 __attribute__((vector_size(32)));
+
+#define MD4_LANES 4
+#define MD4_VEC md4_v4
+#define MD4_FN md4_lanes4
+#define MD4_ATTR
+#include "md4_lanes.h"
+#undef MD4_LANES
+#undef MD4_VEC
+#undef MD4_FN
+#undef MD4_ATTR
+
+#define MD4_LANES 8
+#define MD4_VEC md4_v8
+#define MD4_FN md4_lanes8
+#define MD4_ATTR __attribute__((target("avx2")))
+#include "md4_lanes.h"
+#undef MD4_LANES
+#undef MD4_VEC
+#undef MD4_FN
+#undef MD4_ATTR
+
+/* md4_many() is called from several threads at once (crcsync's workers
+ * do), so the cached answer is read and written atomically: at worst a
+ * few callers ask the cpu themselves before one result sticks. */
+static bool md4_have_avx2(void)
+{
+	static int have_avx2 = -1;
+	int have = __atomic_load_n(&have_avx2, __ATOMIC_RELAXED);
+
+	if (have < 0) {
+		__builtin_cpu_init();
+		have = __builtin_cpu_supports("avx2") ? 1 : 0;
+		__atomic_store_n(&have_avx2, have, __ATOMIC_RELAXED);
+	}
+	return have;
+}
+#endif
+
+void md4_many(const void *const data[], size_t len, size_t num,
+	      unsigned char hash[][16])
+{
+	size_t i = 0;
+
+#if HAVE_BUILTIN_CPU_SUPPORTS && defined(__x86_64__)
+	if (md4_have_avx2()) {
+		for (; i + 8 <= num; i += 8)
+			md4_lanes8(data + i, len, hash + i);
+	}
+	for (; i + 4 <= num; i += 4)
+		md4_lanes4(data + i, len, hash + i);
+#endif
+	for (; i < num; i++)
+		md4_lanes1(data + i, len, hash + i);
+}
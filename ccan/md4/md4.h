@@ -61,4 +61,31 @@ void md4_hash(struct md4_ctx *mctx, const void *p, size_t len);
  */
 void md4_finish(struct md4_ctx *mctx);
 
+/**
+ * md4_many - md4 of many buffers of the same length at once
+ * @data: array of @num pointers to buffers
+ * @len: the number of bytes in each buffer
+ * @num: the number of buffers
+ * @hash: array of @num results (the same as md4_ctx's hash.bytes)
+ *
+ * The buffers are hashed side by side, four or eight at a time where
+ * SSE2 or AVX2 is available, so this is much faster than calling
+ * md4_hash() on each in turn.
+ *
+ * Example:
+ *	// md4 of each 1k block of a buffer.
+ *	static void md4_blocks(const char *buf, size_t num,
+ *			       unsigned char hash[][16])
+ *	{
+ *		const void *blocks[num];
+ *		size_t i;
+ *
+ *		for (i = 0; i < num; i++)
+ *			blocks[i] = buf + i * 1024;
+ *		md4_many(blocks, 1024, num, hash);
+ *	}
+ */
+void md4_many(const void *const data[], size_t len, size_t num,
+	      unsigned char hash[][16]);
+
 #endif /* CCAN_MD4_H */
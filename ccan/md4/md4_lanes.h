@@ -0,0 +1,127 @@
+/*
+ * md4 of MD4_LANES buffers of the same length at once, each lane of an
+ * MD4_VEC holding the state for one buffer.  md4.c includes this once
+ * for each vector type, after defining MD4_LANES, MD4_VEC, MD4_FN and
+ * MD4_ATTR.
+ */
+static void MD4_ATTR MD4_FN(const void *const data[], size_t len,
+			    unsigned char hash[][16])
+{
+	MD4_VEC a, b, c, d, sa, sb, sc, sd, in[16];
+	uint32_t w[MD4_LANES];
+	unsigned char pad[MD4_LANES][128];
+	const unsigned char *src[MD4_LANES];
+	size_t blk, full = len / 64, tail = len % 64, padlen;
+	unsigned int i, l;
+
+	/* The final (padded) block or two of each buffer. */
+	padlen = tail < 56 ? 64 : 128;
+	for (l = 0; l < MD4_LANES; l++) {
+		memcpy(pad[l], (const unsigned char *)data[l] + full * 64, tail);
+		pad[l][tail] = 0x80;
+		memset(pad[l] + tail + 1, 0, padlen - tail - 1 - 8);
+		put_le64(pad[l] + padlen - 8, (uint64_t)len << 3);
+	}
+
+	for (l = 0; l < MD4_LANES; l++)
+		w[l] = md4_iv[0];
+	memcpy(&a, w, sizeof(a));
+	for (l = 0; l < MD4_LANES; l++)
+		w[l] = md4_iv[1];
+	memcpy(&b, w, sizeof(b));
+	for (l = 0; l < MD4_LANES; l++)
+		w[l] = md4_iv[2];
+	memcpy(&c, w, sizeof(c));
+	for (l = 0; l < MD4_LANES; l++)
+		w[l] = md4_iv[3];
+	memcpy(&d, w, sizeof(d));
+
+	for (blk = 0; blk < full + padlen / 64; blk++) {
+		for (l = 0; l < MD4_LANES; l++) {
+			if (blk < full)
+				src[l] = (const unsigned char *)data[l]
+					+ blk * 64;
+			else
+				src[l] = pad[l] + (blk - full) * 64;
+		}
+		for (i = 0; i < 16; i++) {
+			for (l = 0; l < MD4_LANES; l++)
+				w[l] = get_le32(src[l] + i * 4);
+			memcpy(&in[i], w, sizeof(in[i]));
+		}
+
+		sa = a;
+		sb = b;
+		sc = c;
+		sd = d;
+
+		MD4_R1(a, b, c, d, in[0], 3);
+		MD4_R1(d, a, b, c, in[1], 7);
+		MD4_R1(c, d, a, b, in[2], 11);
+		MD4_R1(b, c, d, a, in[3], 19);
+		MD4_R1(a, b, c, d, in[4], 3);
+		MD4_R1(d, a, b, c, in[5], 7);
+		MD4_R1(c, d, a, b, in[6], 11);
+		MD4_R1(b, c, d, a, in[7], 19);
+		MD4_R1(a, b, c, d, in[8], 3);
+		MD4_R1(d, a, b, c, in[9], 7);
+		MD4_R1(c, d, a, b, in[10], 11);
+		MD4_R1(b, c, d, a, in[11], 19);
+		MD4_R1(a, b, c, d, in[12], 3);
+		MD4_R1(d, a, b, c, in[13], 7);
+		MD4_R1(c, d, a, b, in[14], 11);
+		MD4_R1(b, c, d, a, in[15], 19);
+
+		MD4_R2(a, b, c, d, in[0], 3);
+		MD4_R2(d, a, b, c, in[4], 5);
+		MD4_R2(c, d, a, b, in[8], 9);
+		MD4_R2(b, c, d, a, in[12], 13);
+		MD4_R2(a, b, c, d, in[1], 3);
+		MD4_R2(d, a, b, c, in[5], 5);
+		MD4_R2(c, d, a, b, in[9], 9);
+		MD4_R2(b, c, d, a, in[13], 13);
+		MD4_R2(a, b, c, d, in[2], 3);
+		MD4_R2(d, a, b, c, in[6], 5);
+		MD4_R2(c, d, a, b, in[10], 9);
+		MD4_R2(b, c, d, a, in[14], 13);
+		MD4_R2(a, b, c, d, in[3], 3);
+		MD4_R2(d, a, b, c, in[7], 5);
+		MD4_R2(c, d, a, b, in[11], 9);
+		MD4_R2(b, c, d, a, in[15], 13);
+
+		MD4_R3(a, b, c, d, in[0], 3);
+		MD4_R3(d, a, b, c, in[8], 9);
+		MD4_R3(c, d, a, b, in[4], 11);
+		MD4_R3(b, c, d, a, in[12], 15);
+		MD4_R3(a, b, c, d, in[2], 3);
+		MD4_R3(d, a, b, c, in[10], 9);
+		MD4_R3(c, d, a, b, in[6], 11);
+		MD4_R3(b, c, d, a, in[14], 15);
+		MD4_R3(a, b, c, d, in[1], 3);
+		MD4_R3(d, a, b, c, in[9], 9);
+		MD4_R3(c, d, a, b, in[5], 11);
+		MD4_R3(b, c, d, a, in[13], 15);
+		MD4_R3(a, b, c, d, in[3], 3);
+		MD4_R3(d, a, b, c, in[11], 9);
+		MD4_R3(c, d, a, b, in[7], 11);
+		MD4_R3(b, c, d, a, in[15], 15);
+
+		a += sa;
+		b += sb;
+		c += sc;
+		d += sd;
+	}
+
+	memcpy(w, &a, sizeof(a));
+	for (l = 0; l < MD4_LANES; l++)
+		put_le32(hash[l], w[l]);
+	memcpy(w, &b, sizeof(b));
+	for (l = 0; l < MD4_LANES; l++)
+		put_le32(hash[l] + 4, w[l]);
+	memcpy(w, &c, sizeof(c));
+	for (l = 0; l < MD4_LANES; l++)
+		put_le32(hash[l] + 8, w[l]);
+	memcpy(w, &d, sizeof(d));
+	for (l = 0; l < MD4_LANES; l++)
+		put_le32(hash[l] + 12, w[l]);
+}
@@ -0,0 +1,72 @@
+#include <ccan/md4/md4.h>
+#include <ccan/md4/md4.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define MAX_NUM 19
+#define MAX_LEN 300
+
+static void md4_one(const void *data, size_t len, unsigned char hash[16])
+{
+	struct md4_ctx ctx;
+
+	md4_init(&ctx);
+	md4_hash(&ctx, data, len);
+	md4_finish(&ctx);
+	memcpy(hash, ctx.hash.bytes, 16);
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char buf[MAX_NUM][MAX_LEN];
+	const void *data[MAX_NUM];
+	unsigned char hash[MAX_NUM][16], expect[MAX_NUM][16];
+	size_t len, num, i;
+	bool many_ok = true, lanes_ok = true;
+
+	plan_tests(3);
+
+	for (i = 0; i < MAX_NUM; i++) {
+		for (len = 0; len < MAX_LEN; len++)
+			buf[i][len] = random();
+		data[i] = buf[i];
+	}
+
+	/* Every padding case, and every mix of 8, 4 and 1 lanes. */
+	for (len = 0; len < MAX_LEN; len++) {
+		for (i = 0; i < MAX_NUM; i++)
+			md4_one(buf[i], len, expect[i]);
+		for (num = 0; num <= MAX_NUM; num++) {
+			memset(hash, 0, sizeof(hash));
+			md4_many(data, len, num, hash);
+			if (memcmp(hash, expect, num * 16) != 0)
+				many_ok = false;
+		}
+
+		/* Each implementation, whatever md4_many would choose. */
+		md4_lanes1(data, len, hash);
+		if (memcmp(hash, expect, 16) != 0)
+			lanes_ok = false;
+#if HAVE_BUILTIN_CPU_SUPPORTS && defined(__x86_64__)
+		md4_lanes4(data, len, hash);
+		if (memcmp(hash, expect, 4 * 16) != 0)
+			lanes_ok = false;
+		if (md4_have_avx2()) {
+			md4_lanes8(data, len, hash);
+			if (memcmp(hash, expect, 8 * 16) != 0)
+				lanes_ok = false;
+		}
+#endif
+	}
+	ok1(many_ok);
+	ok1(lanes_ok);
+
+	/* RFC test vector, through md4_many. */
+	data[0] = "message digest";
+	md4_many(data, strlen("message digest"), 1, hash);
+	ok1(memcmp(hash[0], "\xd9\x13\x0a\x81\x64\x54\x9f\xe8"
+		   "\x18\x87\x48\x06\xe1\xc7\x01\x4b", 16) == 0);
+
+	return exit_status();
+}
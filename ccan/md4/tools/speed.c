@@ -0,0 +1,73 @@
+/* Blocks per second: md4_hash() on each block in turn vs md4_many(). */
+#include <ccan/md4/md4.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+/* Hash about this many bytes for each test. */
+#define TOTAL_BYTES (256 * 1024 * 1024)
+/* Blocks per md4_many() call. */
+#define BATCH 64
+
+static double timeval_diff(const struct timeval *start,
+			   const struct timeval *stop)
+{
+	return (stop->tv_sec - start->tv_sec)
+		+ (stop->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len, maxlen = 16384, i, j, n;
+	unsigned char *buf, hash[BATCH][16];
+	const void *blocks[BATCH];
+	struct timeval start, stop;
+	struct md4_ctx ctx;
+	unsigned int result = 0;
+	double one, many;
+
+	if (argc > 2)
+		errx(1, "Usage: speed [maxlen]");
+	if (argc == 2)
+		maxlen = atol(argv[1]);
+
+	buf = malloc(maxlen * BATCH);
+	if (!buf)
+		err(1, "allocating %zu bytes", maxlen * BATCH);
+	for (i = 0; i < maxlen * BATCH; i++)
+		buf[i] = random();
+
+	printf("%8s %18s %18s\n", "len", "md4_hash", "md4_many");
+	for (len = 64; len <= maxlen; len *= 4) {
+		n = TOTAL_BYTES / len / BATCH;
+		for (i = 0; i < BATCH; i++)
+			blocks[i] = buf + i * len;
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < BATCH; j++) {
+				md4_init(&ctx);
+				md4_hash(&ctx, blocks[j], len);
+				md4_finish(&ctx);
+				result += ctx.hash.bytes[0];
+			}
+		}
+		gettimeofday(&stop, NULL);
+		one = n * BATCH / timeval_diff(&start, &stop);
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < n; i++) {
+			md4_many(blocks, len, BATCH, hash);
+			result += hash[0][0];
+		}
+		gettimeofday(&stop, NULL);
+		many = n * BATCH / timeval_diff(&start, &stop);
+
+		printf("%8zu %11.0f blk/s %11.0f blk/s (%.1fx)\n",
+		       len, one, many, many / one);
+	}
+	/* Make sure the compiler can't discard the work. */
+	return result == 42;
+}
@@ -38,7 +38,7 @@ struct rpc_context *rpc_init_context(void)
 	}
 	bzero(rpc, sizeof(struct rpc_context));
 
-	rpc->encodebuflen = 65536;
+	rpc->encodebuflen = RPC_ENCODEBUF_SIZE;
 	rpc->encodebuf = malloc(rpc->encodebuflen);
 	if (rpc->encodebuf == NULL) {
 		printf("Failed to allocate a buffer for rpc encoding\n");
@@ -88,19 +88,29 @@ char *rpc_get_error(struct rpc_context *rpc)
 	return rpc->error_string;
 }
 
+int rpc_queue_length(struct rpc_context *rpc)
+{
+	return rpc->outqueue_len + rpc->waitpdu_len;
+}
+
 void rpc_error_all_pdus(struct rpc_context *rpc, char *error)
 {
 	struct rpc_pdu *pdu;
+	int i;
 
 	while((pdu = rpc->outqueue) != NULL) {
 		pdu->cb(rpc, RPC_STATUS_ERROR, error, pdu->private_data);
 		DLIST_REMOVE(rpc->outqueue, pdu);
+		rpc->outqueue_len--;
 		rpc_free_pdu(rpc, pdu);
 	}
-	while((pdu = rpc->waitpdu) != NULL) {
-		pdu->cb(rpc, RPC_STATUS_ERROR, error, pdu->private_data);
-		DLIST_REMOVE(rpc->waitpdu, pdu);
-		rpc_free_pdu(rpc, pdu);
+	for (i = 0; i < RPC_WAITPDU_HASHES; i++) {
+		while((pdu = rpc->waitpdu[i]) != NULL) {
+			pdu->cb(rpc, RPC_STATUS_ERROR, error, pdu->private_data);
+			DLIST_REMOVE(rpc->waitpdu[i], pdu);
+			rpc->waitpdu_len--;
+			rpc_free_pdu(rpc, pdu);
+		}
 	}
 }
 
@@ -108,20 +118,27 @@ void rpc_error_all_pdus(struct rpc_context *rpc, char *error)
 void rpc_destroy_context(struct rpc_context *rpc)
 {
 	struct rpc_pdu *pdu;
+	int i;
 
 	while((pdu = rpc->outqueue) != NULL) {
 		pdu->cb(rpc, RPC_STATUS_CANCEL, NULL, pdu->private_data);
 		DLIST_REMOVE(rpc->outqueue, pdu);
+		rpc->outqueue_len--;
 		rpc_free_pdu(rpc, pdu);
 	}
-	while((pdu = rpc->waitpdu) != NULL) {
-		pdu->cb(rpc, RPC_STATUS_CANCEL, NULL, pdu->private_data);
-		DLIST_REMOVE(rpc->waitpdu, pdu);
-		rpc_free_pdu(rpc, pdu);
+	for (i = 0; i < RPC_WAITPDU_HASHES; i++) {
+		while((pdu = rpc->waitpdu[i]) != NULL) {
+			pdu->cb(rpc, RPC_STATUS_CANCEL, NULL, pdu->private_data);
+			DLIST_REMOVE(rpc->waitpdu[i], pdu);
+			rpc->waitpdu_len--;
+			rpc_free_pdu(rpc, pdu);
+		}
 	}
 
-	auth_destroy(rpc->auth);
-	rpc->auth =NULL;
+	if (rpc->auth != NULL) {
+		auth_destroy(rpc->auth);
+		rpc->auth =NULL;
+	}
 
 	if (rpc->fd != -1) {
 		close(rpc->fd);
@@ -132,6 +149,11 @@ void rpc_destroy_context(struct rpc_context *rpc)
 		rpc->encodebuf = NULL;
 	}
 
+	if (rpc->inbuf != NULL) {
+		free(rpc->inbuf);
+		rpc->inbuf = NULL;
+	}
+
 	if (rpc->error_string != NULL) {
 		free(rpc->error_string);
 		rpc->error_string = NULL;
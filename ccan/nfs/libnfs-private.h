@@ -19,6 +19,9 @@
 
 #include <rpc/auth.h>
 
+/* xids are handed out sequentially, so they spread evenly over these */
+#define RPC_WAITPDU_HASHES 1024
+
 struct rpc_context {
 	int fd;
 	int is_connected;
@@ -36,13 +39,31 @@ struct rpc_context {
        int encodebuflen;
 
        struct rpc_pdu *outqueue;
-       struct rpc_pdu *waitpdu;
+       int outqueue_len;
+
+       /* pdus sent and waiting for a reply, hashed by xid */
+       struct rpc_pdu *waitpdu[RPC_WAITPDU_HASHES];
+       int waitpdu_len;
 
+       /* receive buffer: inbuf[inpos..insize] is not yet processed */
        int insize;
        int inpos;
        char *inbuf;
+       size_t inbuflen;
 };
 
+/* initial size of the receive buffer, which grows to fit the largest pdu */
+#define RPC_INBUF_SIZE 65536
+
+/* largest READ/WRITE payload we use, whatever the server offers.
+ * The encode buffer has room for a WRITE this size plus its headers. */
+#define NFS_MAX_XFER_SIZE (1024 * 1024)
+#define RPC_ENCODEBUF_SIZE (NFS_MAX_XFER_SIZE + 4096)
+
+/* largest reply we accept: a READ (or READDIRPLUS) of NFS_MAX_XFER_SIZE
+ * and its headers.  Anything bigger is garbage and drops the connection. */
+#define RPC_MAX_PDU_SIZE (NFS_MAX_XFER_SIZE + 4096)
+
 struct rpc_pdu {
 	struct rpc_pdu *prev, *next;
 
@@ -68,4 +89,9 @@ int rpc_get_pdu_size(char *buf);
 int rpc_process_pdu(struct rpc_context *rpc, char *buf, int size);
 void rpc_error_all_pdus(struct rpc_context *rpc, char *error);
 
+static inline unsigned int rpc_hash_xid(unsigned long xid)
+{
+	return xid % RPC_WAITPDU_HASHES;
+}
+
 #endif /* CCAN_NFS_LIBNFS_PRIVATE_H */
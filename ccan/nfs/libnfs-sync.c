@@ -46,21 +46,21 @@ struct sync_cb_data {
 
 static void wait_for_reply(struct nfs_context *nfs, struct sync_cb_data *cb_data)
 {
-	struct pollfd pfd;
+	struct pollfd pfds[NFS_MAX_CONNECTIONS];
+	int count;
 
 	for (;;) {
 		if (cb_data->is_finished) {
 			break;
 		}
-		pfd.fd = nfs_get_fd(nfs);
-		pfd.events = nfs_which_events(nfs);
+		count = nfs_get_pollfds(nfs, pfds, NFS_MAX_CONNECTIONS);
 
-		if (poll(&pfd, 1, -1) < 0) {
+		if (poll(pfds, count, -1) < 0) {
 			printf("Poll failed");
 			cb_data->status = -EIO;
 			break;
 		}
-		if (nfs_service(nfs, pfd.revents) < 0) {
+		if (nfs_service_pollfds(nfs, pfds, count) < 0) {
 			printf("nfs_service failed\n");
 			cb_data->status = -EIO;
 			break;
@@ -200,8 +200,11 @@ static void pread_cb(int status, struct nfs_context *nfs UNUSED, void *data, voi
 		return;
 	}
 
+	/* read straight into place by nfs_pread_into_async() */
 	buffer = cb_data->return_data;
-	memcpy(buffer, (char *)data, status);
+	if (buffer != data) {
+		memcpy(buffer, (char *)data, status);
+	}
 }
 
 int nfs_pread_sync(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buffer)
@@ -211,8 +214,8 @@ int nfs_pread_sync(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offse
 	cb_data.is_finished = 0;
 	cb_data.return_data = buffer;
 
-	if (nfs_pread_async(nfs, nfsfh, offset, count, pread_cb, &cb_data) != 0) {
-		printf("nfs_pread_async failed\n");
+	if (nfs_pread_into_async(nfs, nfsfh, offset, count, buffer, pread_cb, &cb_data) != 0) {
+		printf("nfs_pread_into_async failed\n");
 		return -1;
 	}
 
@@ -608,6 +611,82 @@ int nfs_opendir_sync(struct nfs_context *nfs, const char *path, struct nfsdir **
 }
 
 
+/*
+ * opendirplus()
+ */
+static void opendirplus_cb(int status, struct nfs_context *nfs UNUSED, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+	struct nfsdirplus **nfsdir;
+
+	cb_data->is_finished = 1;
+	cb_data->status = status;
+
+	if (status < 0) {
+		printf("opendirplus call failed with \"%s\"\n", (char *)data);
+		return;
+	}
+
+	nfsdir  = cb_data->return_data;
+	*nfsdir = data;
+}
+
+int nfs_opendirplus_sync(struct nfs_context *nfs, const char *path, struct nfsdirplus **nfsdir)
+{
+	struct sync_cb_data cb_data;
+
+	cb_data.is_finished = 0;
+	cb_data.return_data = nfsdir;
+
+	if (nfs_opendirplus_async(nfs, path, opendirplus_cb, &cb_data) != 0) {
+		printf("nfs_opendirplus_async failed\n");
+		return -1;
+	}
+
+	wait_for_reply(nfs, &cb_data);
+
+	return cb_data.status;
+}
+
+
+/*
+ * readdirplus()
+ */
+static void readdirplus_cb(int status, struct nfs_context *nfs UNUSED, void *data, void *private_data)
+{
+	struct sync_cb_data *cb_data = private_data;
+	struct nfsdirentplus **entries;
+
+	cb_data->is_finished = 1;
+	cb_data->status = status;
+
+	if (status < 0) {
+		printf("readdirplus call failed with \"%s\"\n", (char *)data);
+		return;
+	}
+
+	entries  = cb_data->return_data;
+	*entries = data;
+}
+
+int nfs_readdirplus_sync(struct nfs_context *nfs, struct nfsdirplus *nfsdir, struct nfsdirentplus **entries)
+{
+	struct sync_cb_data cb_data;
+
+	cb_data.is_finished = 0;
+	cb_data.return_data = entries;
+
+	if (nfs_readdirplus_async(nfs, nfsdir, readdirplus_cb, &cb_data) != 0) {
+		printf("nfs_readdirplus_async failed\n");
+		return -1;
+	}
+
+	wait_for_reply(nfs, &cb_data);
+
+	return cb_data.status;
+}
+
+
 /*
  * lseek()
  */
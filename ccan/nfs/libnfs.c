@@ -29,16 +29,97 @@
 #include <utime.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <poll.h>
 #include <ccan/compiler/compiler.h>
 #include "nfs.h"
 #include "libnfs-raw.h"
+#include "libnfs-private.h"
 #include "rpc/mount.h"
 #include "rpc/nfs.h"
+#include "dlinklist.h"
+
+struct nfsfh;
+
+/* a block of read-ahead data */
+struct nfs_ra_block {
+       struct nfsfh *nfsfh;
+       nfs_off_t offset;
+       int state;
+       /* the file changed under us: don't hand this out to new reads */
+       int stale;
+       /* reads waiting to be served from this block */
+       int users;
+       /* trusted until then, like cached attributes */
+       time_t expires;
+       size_t len;
+       char *buf;
+};
+
+#define NFS_RA_EMPTY   0
+#define NFS_RA_LOADING 1
+#define NFS_RA_VALID   2
+
+/* a read being served from read-ahead blocks */
+struct nfs_ra_read {
+       struct nfs_ra_read *prev, *next;
+       nfs_off_t offset;
+       size_t count;
+       char *buf;
+       nfs_cb cb;
+       void *private_data;
+};
+
+/* work held back to run from nfs_service(), so that callbacks never fire
+ * inside the call which started the operation */
+struct nfs_deferred {
+       struct nfs_deferred *prev, *next;
+       void (*fn)(struct nfs_context *nfs, void *arg);
+       void *arg;
+       int queued;
+};
+
+/* something waiting for buffered writes to reach the server */
+struct nfs_flush_waiter {
+       struct nfs_flush_waiter *prev, *next;
+       void (*fn)(struct nfsfh *nfsfh, void *arg);
+       void *arg;
+};
+
+/* read-ahead blocks kept per file handle */
+#define NFS_RA_SLOTS 6
 
 struct nfsfh {
        struct nfs_fh3 fh;
        int is_sync;
        nfs_off_t offset;
+
+       struct nfs_context *nfs;
+       /* read-ahead and write-behind calls in flight: we can't be freed
+        * until they are back */
+       int pending;
+       int is_closing;
+
+       /* read-ahead, in blocks of ra_bsize bytes */
+       nfs_off_t ra_next;
+       int ra_seq;
+       size_t ra_bsize;
+       struct nfs_ra_block ra[NFS_RA_SLOTS];
+       struct nfs_ra_read *ra_reads;
+       /* completes ra_reads from nfs_service() */
+       struct nfs_deferred ra_deferred;
+       /* mtime in the last READ reply, to notice other clients' changes */
+       nfstime3 ra_mtime;
+       int ra_have_mtime;
+
+       /* write-behind: wb_len bytes at wb_offset not sent yet */
+       char *wb_buf;
+       size_t wb_bufsize;
+       nfs_off_t wb_offset;
+       size_t wb_len;
+       int wb_inflight;
+       int wb_error;
+       struct nfs_flush_waiter *wb_waiters;
 };
 
 struct nfsdir {
@@ -59,14 +140,77 @@ static void nfs_free_nfsdir(struct nfsdir *nfsdir)
 	free(nfsdir);
 }
 
+/* cached attributes of a filehandle */
+struct nfs_attr_entry {
+       struct nfs_attr_entry *prev, *next;
+       struct nfs_fh3 fh;
+       fattr3 attr;
+       time_t expires;
+};
+
+/* cached result of LOOKUP of name in directory dir */
+struct nfs_dentry {
+       struct nfs_dentry *prev, *next;
+       struct nfs_fh3 dir;
+       char *name;
+       struct nfs_fh3 fh;
+       time_t expires;
+};
+
+/* each bucket holds at most NFS_CACHE_BUCKET_MAX entries: the least
+ * recently used one is dropped to make room */
+#define NFS_CACHE_HASHES 1024
+#define NFS_CACHE_BUCKET_MAX 8
+
 struct nfs_context {
        struct rpc_context *rpc;
+
+       /* READs and WRITEs are spread over these connections to the nfs
+        * server. xprt[0] is rpc, the others are opened at mount time */
+       struct rpc_context *xprt[NFS_MAX_CONNECTIONS];
+       int num_xprts;
+       int connections;
+       int xprt_connecting;
+       struct nfs_cb_data *xprt_mount_data;
+
        char *server;
        char *export;
        struct nfs_fh3 rootfh;
        int acl_support;
+
+       /* largest READ/WRITE to send, and how many chunks of one
+        * pread/pwrite may be in flight at once */
+       size_t readmax;
+       size_t writemax;
+       int io_window;
+
+       /* read-ahead blocks per file handle, and whether writes may be
+        * buffered */
+       int readahead;
+       int writebehind;
+
+       /* attribute and lookup caches, with timeouts in seconds */
+       struct nfs_attr_entry *attrcache[NFS_CACHE_HASHES];
+       struct nfs_dentry *dentrycache[NFS_CACHE_HASHES];
+       int acregmin, acregmax;
+       int acdirmin, acdirmax;
+       struct nfs_cache_stats cache_stats;
+
+       /* results already in hand, waiting for nfs_service() */
+       struct nfs_deferred *deferred;
 };
 
+/* transfer sizes to use if the server does not tell us in FSINFO */
+#define NFS_DEFAULT_XFER_SIZE 32768
+#define NFS_DEFAULT_IO_WINDOW 8
+#define NFS_DEFAULT_READAHEAD 0
+
+/* the usual NFS client defaults for how long attributes are trusted */
+#define NFS_DEFAULT_ACREGMIN 3
+#define NFS_DEFAULT_ACREGMAX 60
+#define NFS_DEFAULT_ACDIRMIN 30
+#define NFS_DEFAULT_ACDIRMAX 60
+
 struct nfs_cb_data;
 typedef int (*continue_func)(struct nfs_context *nfs, struct nfs_cb_data *data);
 
@@ -84,14 +228,26 @@ struct nfs_cb_data {
        int continue_int;
 
        struct nfs_fh3 fh;
+
+       /* directory and name of the LOOKUP in flight, for the cache */
+       struct nfs_fh3 lookup_dir;
+       char *lookup_name;
 };
 
 static int nfs_lookup_path_async_internal(struct nfs_context *nfs, struct nfs_cb_data *data, struct nfs_fh3 *fh);
+static void free_nfs_cb_data(struct nfs_cb_data *data);
 
 
 void nfs_set_auth(struct nfs_context *nfs, struct AUTH *auth)
 {
-	return rpc_set_auth(nfs->rpc, auth);
+	int i;
+
+	rpc_set_auth(nfs->rpc, auth);
+
+	/* the other connections borrow the credentials of the first */
+	for (i = 1; i < nfs->num_xprts; i++) {
+		nfs->xprt[i]->auth = nfs->rpc->auth;
+	}
 }
 
 int nfs_get_fd(struct nfs_context *nfs)
@@ -99,21 +255,183 @@ int nfs_get_fd(struct nfs_context *nfs)
 	return rpc_get_fd(nfs->rpc);
 }
 
+static void nfs_defer(struct nfs_context *nfs, struct nfs_deferred *deferred)
+{
+	if (deferred->queued) {
+		return;
+	}
+	deferred->queued = 1;
+	DLIST_ADD_END(nfs->deferred, deferred, NULL);
+}
+
+/* anything deferred by these callbacks waits for the next round */
+static void nfs_run_deferred(struct nfs_context *nfs)
+{
+	struct nfs_deferred *list = nfs->deferred, *deferred;
+
+	nfs->deferred = NULL;
+	while (list != NULL) {
+		deferred = list;
+		DLIST_REMOVE(list, deferred);
+		deferred->queued = 0;
+		deferred->fn(nfs, deferred->arg);
+	}
+}
+
+/* the socket is writable, so asking for POLLOUT brings the caller
+ * straight back to run what we deferred */
+static int nfs_deferred_events(struct nfs_context *nfs)
+{
+	return nfs->deferred != NULL ? POLLOUT : 0;
+}
+
 int nfs_which_events(struct nfs_context *nfs)
 {
-	return rpc_which_events(nfs->rpc);
+	return rpc_which_events(nfs->rpc) | nfs_deferred_events(nfs);
 }
 
 int nfs_service(struct nfs_context *nfs, int revents)
 {
+	nfs_run_deferred(nfs);
 	return rpc_service(nfs->rpc, revents);
 }
 
+int nfs_get_pollfds(struct nfs_context *nfs, struct pollfd *pfds, int count)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nfs->num_xprts && n < count; i++) {
+		pfds[n].fd      = rpc_get_fd(nfs->xprt[i]);
+		pfds[n].events  = rpc_which_events(nfs->xprt[i]);
+		if (i == 0) {
+			pfds[n].events |= nfs_deferred_events(nfs);
+		}
+		pfds[n].revents = 0;
+		n++;
+	}
+	return n;
+}
+
+int nfs_service_pollfds(struct nfs_context *nfs, struct pollfd *pfds, int count)
+{
+	int i;
+
+	nfs_run_deferred(nfs);
+	for (i = 0; i < nfs->num_xprts && i < count; i++) {
+		struct rpc_context *rpc = nfs->xprt[i];
+
+		if (pfds[i].revents == 0 || pfds[i].fd != rpc_get_fd(rpc)) {
+			continue;
+		}
+		if (i == 0) {
+			if (rpc_service(rpc, pfds[i].revents) < 0) {
+				return -1;
+			}
+			continue;
+		}
+		/* losing one of the extra connections only fails the calls
+		 * on it, the rest go to the connections we have left */
+		if (rpc_service(rpc, pfds[i].revents) < 0 && rpc_get_fd(rpc) != -1) {
+			rpc_disconnect(rpc, rpc_get_error(rpc));
+		}
+	}
+	return 0;
+}
+
+int nfs_queue_length(struct nfs_context *nfs)
+{
+	int i, len = rpc_queue_length(nfs->rpc);
+
+	for (i = 1; i < nfs->num_xprts; i++) {
+		len += rpc_queue_length(nfs->xprt[i]);
+	}
+	return len;
+}
+
+void nfs_set_connections(struct nfs_context *nfs, int count)
+{
+	if (count > NFS_MAX_CONNECTIONS) {
+		count = NFS_MAX_CONNECTIONS;
+	}
+	if (count < 1) {
+		count = 1;
+	}
+	nfs->connections = count;
+}
+
+int nfs_get_connections(struct nfs_context *nfs)
+{
+	int i, count = 0;
+
+	for (i = 0; i < nfs->num_xprts; i++) {
+		if (nfs->xprt[i]->is_connected) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/* the connection with the fewest calls outstanding, for READ and WRITE */
+static struct rpc_context *nfs_data_rpc(struct nfs_context *nfs)
+{
+	struct rpc_context *best = nfs->rpc;
+	int i, len, best_len = rpc_queue_length(nfs->rpc);
+
+	for (i = 1; i < nfs->num_xprts; i++) {
+		struct rpc_context *rpc = nfs->xprt[i];
+
+		if (!rpc->is_connected) {
+			continue;
+		}
+		len = rpc_queue_length(rpc);
+		if (len < best_len) {
+			best     = rpc;
+			best_len = len;
+		}
+	}
+	return best;
+}
+
 char *nfs_get_error(struct nfs_context *nfs)
 {
 	return rpc_get_error(nfs->rpc);
 };
 
+size_t nfs_get_readmax(struct nfs_context *nfs)
+{
+	return nfs->readmax;
+}
+
+size_t nfs_get_writemax(struct nfs_context *nfs)
+{
+	return nfs->writemax;
+}
+
+void nfs_set_io_window(struct nfs_context *nfs, int window)
+{
+	if (window < 1) {
+		window = 1;
+	}
+	nfs->io_window = window;
+}
+
+void nfs_set_readahead(struct nfs_context *nfs, int blocks)
+{
+	/* leave room for the blocks being read from */
+	if (blocks > NFS_RA_SLOTS - 2) {
+		blocks = NFS_RA_SLOTS - 2;
+	}
+	if (blocks < 0) {
+		blocks = 0;
+	}
+	nfs->readahead = blocks;
+}
+
+void nfs_set_writebehind(struct nfs_context *nfs, int enable)
+{
+	nfs->writebehind = enable;
+}
+
 struct nfs_context *nfs_init_context(void)
 {
 	struct nfs_context *nfs;
@@ -123,21 +441,56 @@ struct nfs_context *nfs_init_context(void)
 		printf("Failed to allocate nfs context\n");
 		return NULL;
 	}
+	bzero(nfs, sizeof(struct nfs_context));
+	nfs->readmax   = NFS_DEFAULT_XFER_SIZE;
+	nfs->writemax  = NFS_DEFAULT_XFER_SIZE;
+	nfs->io_window = NFS_DEFAULT_IO_WINDOW;
+	nfs->readahead = NFS_DEFAULT_READAHEAD;
+	nfs->acregmin  = NFS_DEFAULT_ACREGMIN;
+	nfs->acregmax  = NFS_DEFAULT_ACREGMAX;
+	nfs->acdirmin  = NFS_DEFAULT_ACDIRMIN;
+	nfs->acdirmax  = NFS_DEFAULT_ACDIRMAX;
+	nfs->connections = 1;
+
 	nfs->rpc = rpc_init_context();
 	if (nfs->rpc == NULL) {
 		printf("Failed to allocate rpc sub-context\n");
 		free(nfs);
 		return NULL;
 	}
+	nfs->xprt[0]   = nfs->rpc;
+	nfs->num_xprts = 1;
 
 	return nfs;
 }
 
 void nfs_destroy_context(struct nfs_context *nfs)
 {
+	/* these already have their answers: hand them over */
+	while (nfs->deferred != NULL) {
+		nfs_run_deferred(nfs);
+	}
+
+	/* the extra connections go first, their callbacks may still
+	 * want the main one */
+	while (nfs->num_xprts > 1) {
+		struct rpc_context *rpc = nfs->xprt[--nfs->num_xprts];
+
+		rpc->auth = NULL;
+		rpc_destroy_context(rpc);
+	}
+	if (nfs->xprt_mount_data != NULL) {
+		struct nfs_cb_data *data = nfs->xprt_mount_data;
+
+		nfs->xprt_mount_data = NULL;
+		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
+		free_nfs_cb_data(data);
+	}
 	rpc_destroy_context(nfs->rpc);
 	nfs->rpc = NULL;
 
+	nfs_flush_cache(nfs);
+
 	if (nfs->server) {
 		free(nfs->server);
 		nfs->server = NULL;
@@ -173,158 +526,544 @@ static void free_nfs_cb_data(struct nfs_cb_data *data)
 		data->fh.data.data_val = NULL;
 	}
 
+	if (data->lookup_dir.data.data_val != NULL) {
+		free(data->lookup_dir.data.data_val);
+		data->lookup_dir.data.data_val = NULL;
+	}
+
 	free(data);
 }
 
 
 
 
-
-static void nfs_mount_10_cb(struct rpc_context *rpc UNUSED, int status, void *command_data, void *private_data)
+/*
+ * Attribute and lookup cache.
+ *
+ * Attributes are trusted for longer the longer ago the object was last
+ * modified, between acregmin and acregmax seconds for files and acdirmin
+ * and acdirmax for directories, as other NFS clients do.  A LOOKUP result
+ * is trusted as long as the attributes that came with it.  Anything we
+ * change ourselves is dropped from the cache straight away.
+ */
+static unsigned int nfs_cache_hash(struct nfs_fh3 *fh, const char *name)
 {
-	struct nfs_cb_data *data = private_data;
-	struct nfs_context *nfs = data->nfs;
+	unsigned int hash = 2166136261U;
+	u_int i;
 
-	if (status == RPC_STATUS_ERROR) {
-		data->cb(-EFAULT, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
-		return;
+	for (i = 0; i < fh->data.data_len; i++) {
+		hash = (hash ^ (unsigned char)fh->data.data_val[i]) * 16777619U;
 	}
-	if (status == RPC_STATUS_CANCEL) {
-		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
-		free_nfs_cb_data(data);
-		return;
+	while (name != NULL && *name != 0) {
+		hash = (hash ^ (unsigned char)*name++) * 16777619U;
 	}
+	return hash % NFS_CACHE_HASHES;
+}
 
-	data->cb(0, nfs, NULL, data->private_data);
-	free_nfs_cb_data(data);
+static int nfs_fh_equal(struct nfs_fh3 *a, struct nfs_fh3 *b)
+{
+	return a->data.data_len == b->data.data_len
+		&& memcmp(a->data.data_val, b->data.data_val, a->data.data_len) == 0;
 }
 
-static void nfs_mount_9_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+static int nfs_fh_copy(struct nfs_fh3 *dst, struct nfs_fh3 *src)
 {
-	struct nfs_cb_data *data = private_data;
-	struct nfs_context *nfs = data->nfs;
+	dst->data.data_len = src->data.data_len;
+	dst->data.data_val = malloc(src->data.data_len);
+	if (dst->data.data_val == NULL) {
+		return -1;
+	}
+	memcpy(dst->data.data_val, src->data.data_val, src->data.data_len);
+	return 0;
+}
 
-	nfs->acl_support = 1;
-	if (status == RPC_STATUS_ERROR) {
-		nfs->acl_support = 0;
+static time_t nfs_cache_expiry(struct nfs_context *nfs, fattr3 *attr)
+{
+	time_t now = time(NULL);
+	long age = (now - (time_t)attr->mtime.seconds) / 10;
+	int acmin = nfs->acregmin, acmax = nfs->acregmax;
+
+	if (attr->type == NF3DIR) {
+		acmin = nfs->acdirmin;
+		acmax = nfs->acdirmax;
 	}
-	if (status == RPC_STATUS_CANCEL) {
-		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
-		free_nfs_cb_data(data);
-		return;
+	if (age < acmin) {
+		age = acmin;
 	}
-
-	if (rpc_nfs_getattr_async(rpc, nfs_mount_10_cb, &nfs->rootfh, data) != 0) {
-		data->cb(-ENOMEM, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
-		return;
+	if (age > acmax) {
+		age = acmax;
 	}
+	return now + age;
 }
 
-static void nfs_mount_8_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+static void nfs_free_attr_entry(struct nfs_attr_entry *entry)
 {
-	struct nfs_cb_data *data = private_data;
-	struct nfs_context *nfs = data->nfs;
+	free(entry->fh.data.data_val);
+	free(entry);
+}
 
-	if (status == RPC_STATUS_ERROR) {
-		data->cb(-EFAULT, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
-		return;
+static void nfs_free_dentry(struct nfs_dentry *dentry)
+{
+	free(dentry->dir.data.data_val);
+	free(dentry->fh.data.data_val);
+	free(dentry->name);
+	free(dentry);
+}
+
+static struct nfs_attr_entry *nfs_find_attr_entry(struct nfs_context *nfs, struct nfs_fh3 *fh, unsigned int hash)
+{
+	struct nfs_attr_entry *entry;
+
+	for (entry = nfs->attrcache[hash]; entry != NULL; entry = entry->next) {
+		if (nfs_fh_equal(&entry->fh, fh)) {
+			return entry;
+		}
 	}
-	if (status == RPC_STATUS_CANCEL) {
-		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
-		free_nfs_cb_data(data);
-		return;
+	return NULL;
+}
+
+static struct nfs_dentry *nfs_find_dentry(struct nfs_context *nfs, struct nfs_fh3 *dir, const char *name, unsigned int hash)
+{
+	struct nfs_dentry *dentry;
+
+	for (dentry = nfs->dentrycache[hash]; dentry != NULL; dentry = dentry->next) {
+		if (nfs_fh_equal(&dentry->dir, dir) && strcmp(dentry->name, name) == 0) {
+			return dentry;
+		}
 	}
+	return NULL;
+}
 
-	if (rpc_nfsacl_null_async(rpc, nfs_mount_9_cb, data) != 0) {
-		data->cb(-ENOMEM, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
-		return;
+static fattr3 *nfs_cache_get_attr(struct nfs_context *nfs, struct nfs_fh3 *fh)
+{
+	unsigned int hash = nfs_cache_hash(fh, NULL);
+	struct nfs_attr_entry *entry;
+
+	entry = nfs_find_attr_entry(nfs, fh, hash);
+	if (entry != NULL && entry->expires <= time(NULL)) {
+		DLIST_REMOVE(nfs->attrcache[hash], entry);
+		nfs_free_attr_entry(entry);
+		entry = NULL;
+	}
+	if (entry == NULL) {
+		nfs->cache_stats.attr_misses++;
+		return NULL;
 	}
+	nfs->cache_stats.attr_hits++;
+	DLIST_PROMOTE(nfs->attrcache[hash], entry);
+	return &entry->attr;
 }
 
-static void nfs_mount_7_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+static void nfs_cache_set_attr(struct nfs_context *nfs, struct nfs_fh3 *fh, fattr3 *attr)
 {
-	struct nfs_cb_data *data = private_data;
-	struct nfs_context *nfs = data->nfs;
+	unsigned int hash = nfs_cache_hash(fh, NULL);
+	struct nfs_attr_entry *entry, *tail;
+	int count = 0;
 
-	if (status == RPC_STATUS_ERROR) {
-		data->cb(-EFAULT, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
+	if (nfs->acregmax == 0 && nfs->acdirmax == 0) {
 		return;
 	}
-	if (status == RPC_STATUS_CANCEL) {
-		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
-		free_nfs_cb_data(data);
-		return;
+
+	entry = nfs_find_attr_entry(nfs, fh, hash);
+	if (entry == NULL) {
+		entry = malloc(sizeof(struct nfs_attr_entry));
+		if (entry == NULL) {
+			return;
+		}
+		if (nfs_fh_copy(&entry->fh, fh) != 0) {
+			free(entry);
+			return;
+		}
+		for (tail = nfs->attrcache[hash]; tail != NULL; tail = tail->next) {
+			count++;
+		}
+		if (count >= NFS_CACHE_BUCKET_MAX) {
+			tail = DLIST_TAIL(nfs->attrcache[hash]);
+			DLIST_REMOVE(nfs->attrcache[hash], tail);
+			nfs_free_attr_entry(tail);
+		}
+		DLIST_ADD(nfs->attrcache[hash], entry);
 	}
+	entry->attr    = *attr;
+	entry->expires = nfs_cache_expiry(nfs, attr);
+}
 
-	if (rpc_nfs_null_async(rpc, nfs_mount_8_cb, data) != 0) {
-		data->cb(-ENOMEM, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
-		return;
+static void nfs_cache_drop_attr(struct nfs_context *nfs, struct nfs_fh3 *fh)
+{
+	unsigned int hash = nfs_cache_hash(fh, NULL);
+	struct nfs_attr_entry *entry;
+
+	entry = nfs_find_attr_entry(nfs, fh, hash);
+	if (entry != NULL) {
+		DLIST_REMOVE(nfs->attrcache[hash], entry);
+		nfs_free_attr_entry(entry);
 	}
 }
 
+static struct nfs_fh3 *nfs_cache_lookup(struct nfs_context *nfs, struct nfs_fh3 *dir, const char *name)
+{
+	unsigned int hash = nfs_cache_hash(dir, name);
+	struct nfs_dentry *dentry;
+
+	/* an expired entry is left for the next LOOKUP to replace: the
+	 * caller may still be using a filehandle we handed out earlier */
+	dentry = nfs_find_dentry(nfs, dir, name, hash);
+	if (dentry == NULL || dentry->expires <= time(NULL)) {
+		nfs->cache_stats.lookup_misses++;
+		return NULL;
+	}
+	nfs->cache_stats.lookup_hits++;
+	DLIST_PROMOTE(nfs->dentrycache[hash], dentry);
+	return &dentry->fh;
+}
 
-static void nfs_mount_6_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+static void nfs_cache_add_lookup(struct nfs_context *nfs, struct nfs_fh3 *dir, const char *name, LOOKUP3resok *res)
 {
-	struct nfs_cb_data *data = private_data;
-	struct nfs_context *nfs = data->nfs;
-	mountres3 *res;
+	unsigned int hash = nfs_cache_hash(dir, name);
+	struct nfs_dentry *dentry, *tail;
+	int count = 0;
 
-	if (status == RPC_STATUS_ERROR) {
-		data->cb(-EFAULT, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
+	/* without attributes we have no idea how long to keep it for */
+	if (!res->obj_attributes.attributes_follow) {
 		return;
 	}
-	if (status == RPC_STATUS_CANCEL) {
-		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
-		free_nfs_cb_data(data);
+	nfs_cache_set_attr(nfs, &res->object, &res->obj_attributes.post_op_attr_u.attributes);
+	if (nfs->acdirmax == 0) {
 		return;
 	}
 
-	res = command_data;
-	if (res->fhs_status != MNT3_OK) {
-		rpc_set_error(rpc, "RPC error: Mount failed with error %s(%d) %s(%d)", mountstat3_to_str(res->fhs_status), res->fhs_status, strerror(-mountstat3_to_errno(res->fhs_status)), -mountstat3_to_errno(res->fhs_status));
-		data->cb(mountstat3_to_errno(res->fhs_status), nfs, rpc_get_error(rpc), data->private_data);
-		free_nfs_cb_data(data);
-		return;
+	dentry = nfs_find_dentry(nfs, dir, name, hash);
+	if (dentry != NULL) {
+		DLIST_REMOVE(nfs->dentrycache[hash], dentry);
+		nfs_free_dentry(dentry);
 	}
 
-	nfs->rootfh.data.data_len = res->mountres3_u.mountinfo.fhandle.fhandle3_len;
-	nfs->rootfh.data.data_val = malloc(nfs->rootfh.data.data_len);
-	if (nfs->rootfh.data.data_val == NULL) {
-		rpc_set_error(rpc, "Out of memory. Could not allocate memory to store root filehandle");
-		data->cb(-ENOMEM, nfs, rpc_get_error(rpc), data->private_data);
-		free_nfs_cb_data(data);
+	dentry = malloc(sizeof(struct nfs_dentry));
+	if (dentry == NULL) {
 		return;
 	}
-	memcpy(nfs->rootfh.data.data_val, res->mountres3_u.mountinfo.fhandle.fhandle3_val, nfs->rootfh.data.data_len);
-
-	rpc_disconnect(rpc, "normal disconnect");
-	if (rpc_connect_async(rpc, nfs->server, 2049, 1, nfs_mount_7_cb, data) != 0) {
-		data->cb(-ENOMEM, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
+	bzero(dentry, sizeof(struct nfs_dentry));
+	dentry->name = strdup(name);
+	if (dentry->name == NULL || nfs_fh_copy(&dentry->dir, dir) != 0 || nfs_fh_copy(&dentry->fh, &res->object) != 0) {
+		nfs_free_dentry(dentry);
 		return;
 	}
-}
+	dentry->expires = nfs_cache_expiry(nfs, &res->obj_attributes.post_op_attr_u.attributes);
 
+	for (tail = nfs->dentrycache[hash]; tail != NULL; tail = tail->next) {
+		count++;
+	}
+	if (count >= NFS_CACHE_BUCKET_MAX) {
+		tail = DLIST_TAIL(nfs->dentrycache[hash]);
+		DLIST_REMOVE(nfs->dentrycache[hash], tail);
+		nfs_free_dentry(tail);
+	}
+	DLIST_ADD(nfs->dentrycache[hash], dentry);
+}
 
-static void nfs_mount_5_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+/* name in dir was created, removed or renamed: forget it, what it
+ * pointed to, and the directory's own attributes */
+static void nfs_cache_drop_name(struct nfs_context *nfs, struct nfs_fh3 *dir, const char *name)
 {
-	struct nfs_cb_data *data = private_data;
-	struct nfs_context *nfs = data->nfs;
+	unsigned int hash = nfs_cache_hash(dir, name);
+	struct nfs_dentry *dentry;
 
-	if (status == RPC_STATUS_ERROR) {
-		data->cb(-EFAULT, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
-		return;
+	dentry = nfs_find_dentry(nfs, dir, name, hash);
+	if (dentry != NULL) {
+		nfs_cache_drop_attr(nfs, &dentry->fh);
+		DLIST_REMOVE(nfs->dentrycache[hash], dentry);
+		nfs_free_dentry(dentry);
 	}
-	if (status == RPC_STATUS_CANCEL) {
-		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
+	nfs_cache_drop_attr(nfs, dir);
+}
+
+void nfs_flush_cache(struct nfs_context *nfs)
+{
+	int i;
+
+	for (i = 0; i < NFS_CACHE_HASHES; i++) {
+		while (nfs->attrcache[i] != NULL) {
+			struct nfs_attr_entry *entry = nfs->attrcache[i];
+
+			DLIST_REMOVE(nfs->attrcache[i], entry);
+			nfs_free_attr_entry(entry);
+		}
+		while (nfs->dentrycache[i] != NULL) {
+			struct nfs_dentry *dentry = nfs->dentrycache[i];
+
+			DLIST_REMOVE(nfs->dentrycache[i], dentry);
+			nfs_free_dentry(dentry);
+		}
+	}
+}
+
+void nfs_set_cache_timeouts(struct nfs_context *nfs, int acregmin, int acregmax, int acdirmin, int acdirmax)
+{
+	nfs->acregmin = acregmin;
+	nfs->acregmax = acregmax < acregmin ? acregmin : acregmax;
+	nfs->acdirmin = acdirmin;
+	nfs->acdirmax = acdirmax < acdirmin ? acdirmin : acdirmax;
+	nfs_flush_cache(nfs);
+}
+
+void nfs_get_cache_stats(struct nfs_context *nfs, struct nfs_cache_stats *stats)
+{
+	*stats = nfs->cache_stats;
+}
+
+
+
+
+
+static void nfs_mount_xprt_cb(struct rpc_context *rpc, int status, void *command_data UNUSED, void *private_data)
+{
+	struct nfs_context *nfs = private_data;
+	struct nfs_cb_data *data;
+
+	/* we are also called if the connection fails later on */
+	if (status != RPC_STATUS_SUCCESS) {
+		if (rpc_get_fd(rpc) != -1) {
+			rpc_disconnect(rpc, rpc_get_error(rpc));
+		}
+	}
+	if (nfs->xprt_connecting == 0 || --nfs->xprt_connecting > 0) {
+		return;
+	}
+
+	/* the mount succeeds with however many we got, the first one is
+	 * all we really need */
+	data = nfs->xprt_mount_data;
+	nfs->xprt_mount_data = NULL;
+	data->cb(0, nfs, NULL, data->private_data);
+	free_nfs_cb_data(data);
+}
+
+/* open the extra connections READ and WRITE are spread over, then
+ * complete the mount */
+static void nfs_mount_connect_xprts(struct nfs_context *nfs, struct nfs_cb_data *data)
+{
+	int i;
+
+	nfs->xprt_mount_data = data;
+	nfs->xprt_connecting = 1;
+	for (i = nfs->num_xprts; i < nfs->connections; i++) {
+		struct rpc_context *rpc;
+
+		rpc = rpc_init_context();
+		if (rpc == NULL) {
+			break;
+		}
+		auth_destroy(rpc->auth);
+		rpc->auth = nfs->rpc->auth;
+		nfs->xprt[nfs->num_xprts++] = rpc;
+
+		nfs->xprt_connecting++;
+		if (rpc_connect_async(rpc, nfs->server, 2049, 1, nfs_mount_xprt_cb, nfs) != 0) {
+			nfs->xprt_connecting--;
+			if (rpc_get_fd(rpc) != -1) {
+				rpc_disconnect(rpc, rpc_get_error(rpc));
+			}
+		}
+	}
+	/* drop our own reference, completing the mount if nothing is
+	 * left to wait for */
+	nfs_mount_xprt_cb(nfs->rpc, RPC_STATUS_SUCCESS, NULL, nfs);
+}
+
+/* clamp a transfer size from FSINFO to what we can handle */
+static size_t nfs_xfer_size(uint32 pref, uint32 max, size_t dflt)
+{
+	size_t size = pref;
+
+	if (size == 0 || (max != 0 && size > max)) {
+		size = max;
+	}
+	if (size == 0) {
+		return dflt;
+	}
+	if (size > NFS_MAX_XFER_SIZE) {
+		size = NFS_MAX_XFER_SIZE;
+	}
+	return size;
+}
+
+static void nfs_mount_11_cb(struct rpc_context *rpc UNUSED, int status, void *command_data, void *private_data)
+{
+	struct nfs_cb_data *data = private_data;
+	struct nfs_context *nfs = data->nfs;
+	FSINFO3res *res;
+
+	if (status == RPC_STATUS_ERROR) {
+		data->cb(-EFAULT, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+	if (status == RPC_STATUS_CANCEL) {
+		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+
+	/* if the server won't say, we just keep the defaults */
+	res = command_data;
+	if (res->status == NFS3_OK) {
+		FSINFO3resok *ok = &res->FSINFO3res_u.resok;
+
+		nfs->readmax  = nfs_xfer_size(ok->rtpref, ok->rtmax, NFS_DEFAULT_XFER_SIZE);
+		nfs->writemax = nfs_xfer_size(ok->wtpref, ok->wtmax, NFS_DEFAULT_XFER_SIZE);
+	}
+
+	nfs_mount_connect_xprts(nfs, data);
+}
+
+static void nfs_mount_10_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+{
+	struct nfs_cb_data *data = private_data;
+	struct nfs_context *nfs = data->nfs;
+
+	if (status == RPC_STATUS_ERROR) {
+		data->cb(-EFAULT, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+	if (status == RPC_STATUS_CANCEL) {
+		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+
+	if (rpc_nfs_fsinfo_async(rpc, nfs_mount_11_cb, &nfs->rootfh, data) != 0) {
+		data->cb(-ENOMEM, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+}
+
+static void nfs_mount_9_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+{
+	struct nfs_cb_data *data = private_data;
+	struct nfs_context *nfs = data->nfs;
+
+	nfs->acl_support = 1;
+	if (status == RPC_STATUS_ERROR) {
+		nfs->acl_support = 0;
+	}
+	if (status == RPC_STATUS_CANCEL) {
+		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+
+	if (rpc_nfs_getattr_async(rpc, nfs_mount_10_cb, &nfs->rootfh, data) != 0) {
+		data->cb(-ENOMEM, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+}
+
+static void nfs_mount_8_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+{
+	struct nfs_cb_data *data = private_data;
+	struct nfs_context *nfs = data->nfs;
+
+	if (status == RPC_STATUS_ERROR) {
+		data->cb(-EFAULT, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+	if (status == RPC_STATUS_CANCEL) {
+		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+
+	if (rpc_nfsacl_null_async(rpc, nfs_mount_9_cb, data) != 0) {
+		data->cb(-ENOMEM, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+}
+
+static void nfs_mount_7_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+{
+	struct nfs_cb_data *data = private_data;
+	struct nfs_context *nfs = data->nfs;
+
+	if (status == RPC_STATUS_ERROR) {
+		data->cb(-EFAULT, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+	if (status == RPC_STATUS_CANCEL) {
+		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+
+	if (rpc_nfs_null_async(rpc, nfs_mount_8_cb, data) != 0) {
+		data->cb(-ENOMEM, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+}
+
+
+static void nfs_mount_6_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+{
+	struct nfs_cb_data *data = private_data;
+	struct nfs_context *nfs = data->nfs;
+	mountres3 *res;
+
+	if (status == RPC_STATUS_ERROR) {
+		data->cb(-EFAULT, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+	if (status == RPC_STATUS_CANCEL) {
+		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+
+	res = command_data;
+	if (res->fhs_status != MNT3_OK) {
+		rpc_set_error(rpc, "RPC error: Mount failed with error %s(%d) %s(%d)", mountstat3_to_str(res->fhs_status), res->fhs_status, strerror(-mountstat3_to_errno(res->fhs_status)), -mountstat3_to_errno(res->fhs_status));
+		data->cb(mountstat3_to_errno(res->fhs_status), nfs, rpc_get_error(rpc), data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+
+	nfs->rootfh.data.data_len = res->mountres3_u.mountinfo.fhandle.fhandle3_len;
+	nfs->rootfh.data.data_val = malloc(nfs->rootfh.data.data_len);
+	if (nfs->rootfh.data.data_val == NULL) {
+		rpc_set_error(rpc, "Out of memory. Could not allocate memory to store root filehandle");
+		data->cb(-ENOMEM, nfs, rpc_get_error(rpc), data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+	memcpy(nfs->rootfh.data.data_val, res->mountres3_u.mountinfo.fhandle.fhandle3_val, nfs->rootfh.data.data_len);
+
+	rpc_disconnect(rpc, "normal disconnect");
+	if (rpc_connect_async(rpc, nfs->server, 2049, 1, nfs_mount_7_cb, data) != 0) {
+		data->cb(-ENOMEM, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+}
+
+
+static void nfs_mount_5_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data)
+{
+	struct nfs_cb_data *data = private_data;
+	struct nfs_context *nfs = data->nfs;
+
+	if (status == RPC_STATUS_ERROR) {
+		data->cb(-EFAULT, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+	if (status == RPC_STATUS_CANCEL) {
+		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
 		free_nfs_cb_data(data);
 		return;
 	}
@@ -499,6 +1238,8 @@ static void nfs_lookup_path_1_cb(struct rpc_context *rpc UNUSED, int status, voi
 		return;
 	}
 
+	nfs_cache_add_lookup(nfs, &data->lookup_dir, data->lookup_name, &res->LOOKUP3res_u.resok);
+
 	if (nfs_lookup_path_async_internal(nfs, data, &res->LOOKUP3res_u.resok.object) != 0) {
 		rpc_set_error(nfs->rpc, "Failed to create lookup pdu");
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -510,7 +1251,9 @@ static void nfs_lookup_path_1_cb(struct rpc_context *rpc UNUSED, int status, voi
 static int nfs_lookup_path_async_internal(struct nfs_context *nfs, struct nfs_cb_data *data, struct nfs_fh3 *fh)
 {
 	char *path, *str;
+	struct nfs_fh3 *cached;
 
+next_component:
 	while (*data->path == '/') {
 	      data->path++;
 	}
@@ -540,6 +1283,25 @@ static int nfs_lookup_path_async_internal(struct nfs_context *nfs, struct nfs_cb
 		return 0;
 	}
 
+	cached = nfs_cache_lookup(nfs, fh, path);
+	if (cached != NULL) {
+		fh = cached;
+		goto next_component;
+	}
+
+	/* remember where we looked, so the answer can be cached */
+	if (data->lookup_dir.data.data_val != NULL) {
+		free(data->lookup_dir.data.data_val);
+	}
+	if (nfs_fh_copy(&data->lookup_dir, fh) != 0) {
+		data->lookup_dir.data.data_val = NULL;
+		rpc_set_error(nfs->rpc, "Out of memory: Failed to allocate fh for %s", path);
+		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
+		free_nfs_cb_data(data);
+		return -1;
+	}
+	data->lookup_name = path;
+
 	if (rpc_nfs_lookup_async(nfs->rpc, nfs_lookup_path_1_cb, fh, path, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send lookup call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -597,6 +1359,23 @@ static int nfs_lookuppath_async(struct nfs_context *nfs, const char *path, nfs_c
 /*
  * Async stat()
  */
+static void nfs_fattr_to_stat(fattr3 *attr, struct stat *st)
+{
+        st->st_dev     = -1;
+        st->st_ino     = attr->fileid;
+        st->st_mode    = attr->mode;
+        st->st_nlink   = attr->nlink;
+        st->st_uid     = attr->uid;
+        st->st_gid     = attr->gid;
+        st->st_rdev    = 0;
+        st->st_size    = attr->size;
+        st->st_blksize = 4096;
+        st->st_blocks  = attr->size / 4096;
+        st->st_atime   = attr->atime.seconds;
+        st->st_mtime   = attr->mtime.seconds;
+        st->st_ctime   = attr->ctime.seconds;
+}
+
 static void nfs_stat_1_cb(struct rpc_context *rpc UNUSED, int status, void *command_data, void *private_data)
 {
 	GETATTR3res *res;
@@ -623,26 +1402,48 @@ static void nfs_stat_1_cb(struct rpc_context *rpc UNUSED, int status, void *comm
 		return;
 	}
 
-        st.st_dev     = -1;
-        st.st_ino     = res->GETATTR3res_u.resok.obj_attributes.fileid;
-        st.st_mode    = res->GETATTR3res_u.resok.obj_attributes.mode;
-        st.st_nlink   = res->GETATTR3res_u.resok.obj_attributes.nlink;
-        st.st_uid     = res->GETATTR3res_u.resok.obj_attributes.uid;
-        st.st_gid     = res->GETATTR3res_u.resok.obj_attributes.gid;
-        st.st_rdev    = 0;
-        st.st_size    = res->GETATTR3res_u.resok.obj_attributes.size;
-        st.st_blksize = 4096;
-        st.st_blocks  = res->GETATTR3res_u.resok.obj_attributes.size / 4096;
-        st.st_atime   = res->GETATTR3res_u.resok.obj_attributes.atime.seconds;
-        st.st_mtime   = res->GETATTR3res_u.resok.obj_attributes.mtime.seconds;
-        st.st_ctime   = res->GETATTR3res_u.resok.obj_attributes.ctime.seconds;
+	nfs_cache_set_attr(nfs, &data->fh, &res->GETATTR3res_u.resok.obj_attributes);
+	nfs_fattr_to_stat(&res->GETATTR3res_u.resok.obj_attributes, &st);
 
 	data->cb(0, nfs, &st, data->private_data);
 	free_nfs_cb_data(data);
 }
 
+/* a stat answered from the cache, waiting to be delivered */
+struct nfs_stat_done {
+       struct nfs_deferred deferred;
+       struct stat st;
+       nfs_cb cb;
+       void *private_data;
+};
+
+static void nfs_stat_deliver(struct nfs_context *nfs, void *arg)
+{
+	struct nfs_stat_done *done = arg;
+
+	done->cb(0, nfs, &done->st, done->private_data);
+	free(done);
+}
+
 static int nfs_stat_continue_internal(struct nfs_context *nfs, struct nfs_cb_data *data)
 {
+	struct nfs_stat_done *done;
+	fattr3 *attr;
+
+	/* without memory to hold the answer, ask the server again */
+	attr = nfs_cache_get_attr(nfs, &data->fh);
+	if (attr != NULL && (done = malloc(sizeof(struct nfs_stat_done))) != NULL) {
+		bzero(done, sizeof(struct nfs_stat_done));
+		nfs_fattr_to_stat(attr, &done->st);
+		done->cb               = data->cb;
+		done->private_data     = data->private_data;
+		done->deferred.fn      = nfs_stat_deliver;
+		done->deferred.arg     = done;
+		nfs_defer(nfs, &done->deferred);
+		free_nfs_cb_data(data);
+		return 0;
+	}
+
 	if (rpc_nfs_getattr_async(nfs->rpc, nfs_stat_1_cb, &data->fh, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send STAT GETATTR call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -728,6 +1529,7 @@ static void nfs_open_cb(struct rpc_context *rpc UNUSED, int status, void *comman
 		return;
 	}
 	bzero(nfsfh, sizeof(struct nfsfh));
+	nfsfh->nfs = nfs;
 
 	if (data->continue_int & O_SYNC) {
 		nfsfh->is_sync = 1;
@@ -780,21 +1582,696 @@ int nfs_open_async(struct nfs_context *nfs, const char *path, int mode, nfs_cb c
 
 
 /*
- * Async pread()
+ * A pread or pwrite larger than the server's rsize/wsize is split into
+ * chunks, and up to io_window of them are kept in flight at once.  Each
+ * READ chunk decodes straight into its slot of the buffer, so the data
+ * is reassembled in order however the replies arrive.  The caller gets a
+ * single callback once every chunk is back.
  */
-static void nfs_pread_cb(struct rpc_context *rpc UNUSED, int status, void *command_data, void *private_data)
-{
-	struct nfs_cb_data *data = private_data;
-	struct nfs_context *nfs = data->nfs;
-	READ3res *res;
+struct nfs_mcb_data {
+       struct nfs_cb_data *data;
+       int is_write;
+       char *buf;
+       /* our copy of the tail of a write, or our buffer for a read */
+       char *tmpbuf;
+       size_t tmpstart;
+       nfs_off_t offset;
+       size_t count;
+       size_t chunksize;
+       /* next chunk to send, and where the data ends if it came up short */
+       size_t next;
+       size_t end;
+       int outstanding;
+       int error;
+       char *error_string;
+};
 
-	if (status == RPC_STATUS_ERROR) {
-		data->cb(-EFAULT, nfs, command_data, data->private_data);
-		free_nfs_cb_data(data);
-		return;
+struct nfs_chunk_data {
+       struct nfs_mcb_data *mdata;
+       size_t pos;
+       size_t len;
+};
+
+static void free_nfs_mcb_data(struct nfs_mcb_data *mdata)
+{
+	free_nfs_cb_data(mdata->data);
+	if (mdata->tmpbuf != NULL) {
+		free(mdata->tmpbuf);
 	}
-	if (status == RPC_STATUS_CANCEL) {
-		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
+	if (mdata->error_string != NULL) {
+		free(mdata->error_string);
+	}
+	free(mdata);
+}
+
+/* only the first error is reported, and no more chunks are sent after it */
+static void nfs_mcb_set_error(struct nfs_mcb_data *mdata, int error, const char *error_string)
+{
+	if (mdata->error == 0) {
+		mdata->error = error;
+		mdata->error_string = strdup(error_string);
+	}
+	mdata->next = mdata->count;
+}
+
+static void nfs_chunk_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data);
+
+static void nfs_send_chunks(struct nfs_mcb_data *mdata)
+{
+	struct nfs_context *nfs = mdata->data->nfs;
+	struct nfsfh *nfsfh = mdata->data->nfsfh;
+
+	while (mdata->next < mdata->end && mdata->outstanding < nfs->io_window) {
+		struct nfs_chunk_data *chunk;
+		struct rpc_context *rpc;
+		char *buf;
+		int ret;
+
+		chunk = malloc(sizeof(struct nfs_chunk_data));
+		if (chunk == NULL) {
+			rpc_set_error(nfs->rpc, "out of memory: failed to allocate nfs_chunk_data structure");
+			nfs_mcb_set_error(mdata, -ENOMEM, rpc_get_error(nfs->rpc));
+			return;
+		}
+		chunk->mdata = mdata;
+		chunk->pos   = mdata->next;
+		chunk->len   = mdata->end - mdata->next;
+		if (chunk->len > mdata->chunksize) {
+			chunk->len = mdata->chunksize;
+		}
+
+		if (chunk->pos >= mdata->tmpstart) {
+			buf = mdata->tmpbuf + chunk->pos - mdata->tmpstart;
+		} else {
+			buf = mdata->buf + chunk->pos;
+		}
+		rpc = nfs_data_rpc(nfs);
+		if (mdata->is_write) {
+			ret = rpc_nfs_write_async(rpc, nfs_chunk_cb, &nfsfh->fh, buf, mdata->offset + chunk->pos, chunk->len, nfsfh->is_sync?FILE_SYNC:UNSTABLE, chunk);
+		} else {
+			ret = rpc_nfs_read_into_async(rpc, nfs_chunk_cb, &nfsfh->fh, mdata->offset + chunk->pos, chunk->len, buf, chunk);
+		}
+		if (ret != 0) {
+			free(chunk);
+			nfs_mcb_set_error(mdata, -ENOMEM, rpc_get_error(rpc));
+			return;
+		}
+		mdata->outstanding++;
+		mdata->next += chunk->len;
+	}
+}
+
+static void nfs_finish_chunks(struct nfs_mcb_data *mdata)
+{
+	struct nfs_cb_data *data = mdata->data;
+	struct nfs_context *nfs = data->nfs;
+
+	if (mdata->is_write) {
+		nfs_cache_drop_attr(nfs, &data->nfsfh->fh);
+	}
+	if (mdata->error != 0) {
+		data->cb(mdata->error, nfs, mdata->error_string, data->private_data);
+		free_nfs_mcb_data(mdata);
+		return;
+	}
+
+	data->nfsfh->offset = mdata->offset + mdata->end;
+	data->cb(mdata->end, nfs, mdata->is_write ? NULL : mdata->buf, data->private_data);
+	free_nfs_mcb_data(mdata);
+}
+
+static void nfs_chunk_cb(struct rpc_context *rpc UNUSED, int status, void *command_data, void *private_data)
+{
+	struct nfs_chunk_data *chunk = private_data;
+	struct nfs_mcb_data *mdata = chunk->mdata;
+	struct nfs_context *nfs = mdata->data->nfs;
+	size_t pos = chunk->pos, len = chunk->len, done = 0;
+	int nfs_status;
+
+	free(chunk);
+	mdata->outstanding--;
+
+	if (status == RPC_STATUS_ERROR) {
+		nfs_mcb_set_error(mdata, -EFAULT, command_data);
+	} else if (status == RPC_STATUS_CANCEL) {
+		nfs_mcb_set_error(mdata, -EINTR, "Command was cancelled");
+	} else {
+		if (mdata->is_write) {
+			WRITE3res *res = command_data;
+
+			nfs_status = res->status;
+			if (nfs_status == NFS3_OK) {
+				done = res->WRITE3res_u.resok.count;
+			}
+		} else {
+			READ3res *res = command_data;
+
+			nfs_status = res->status;
+			if (nfs_status == NFS3_OK) {
+				done = res->READ3res_u.resok.count;
+			}
+		}
+		if (nfs_status != NFS3_OK) {
+			rpc_set_error(nfs->rpc, "NFS: %s failed with %s(%d)", mdata->is_write ? "Write" : "Read", nfsstat3_to_str(nfs_status), nfsstat3_to_errno(nfs_status));
+			nfs_mcb_set_error(mdata, nfsstat3_to_errno(nfs_status), rpc_get_error(nfs->rpc));
+		} else if (done < len && pos + done < mdata->end) {
+			/* eof, or a short write: everything after this is
+			 * not part of the result */
+			mdata->end = pos + done;
+		}
+	}
+
+	nfs_send_chunks(mdata);
+	if (mdata->outstanding == 0) {
+		nfs_finish_chunks(mdata);
+	}
+}
+
+/*
+ * Start a chunked pread/pwrite.  For a write we only borrow the caller's
+ * buffer for the chunks we send straight away; the rest is copied, since
+ * the caller is free to reuse the buffer as soon as we return.
+ */
+static int nfs_chunked_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, size_t chunksize, int is_write, nfs_cb cb, void *private_data)
+{
+	struct nfs_mcb_data *mdata;
+	struct nfs_cb_data *data;
+
+	mdata = malloc(sizeof(struct nfs_mcb_data));
+	data = malloc(sizeof(struct nfs_cb_data));
+	if (mdata == NULL || data == NULL) {
+		rpc_set_error(nfs->rpc, "out of memory: failed to allocate nfs_mcb_data structure");
+		printf("failed to allocate memory for nfs cb data\n");
+		free(mdata);
+		free(data);
+		return -1;
+	}
+	bzero(mdata, sizeof(struct nfs_mcb_data));
+	bzero(data, sizeof(struct nfs_cb_data));
+	data->nfs          = nfs;
+	data->cb           = cb;
+	data->private_data = private_data;
+	data->nfsfh        = nfsfh;
+
+	mdata->data      = data;
+	mdata->is_write  = is_write;
+	mdata->buf       = buf;
+	mdata->offset    = offset;
+	mdata->count     = count;
+	mdata->end       = count;
+	mdata->chunksize = chunksize;
+	mdata->tmpstart  = count;
+
+	if (!is_write && buf == NULL) {
+		mdata->tmpbuf = malloc(count);
+		mdata->buf = mdata->tmpbuf;
+		mdata->tmpstart = 0;
+	} else if (is_write && count > chunksize * nfs->io_window) {
+		mdata->tmpstart = chunksize * nfs->io_window;
+		mdata->tmpbuf = malloc(count - mdata->tmpstart);
+		if (mdata->tmpbuf != NULL) {
+			memcpy(mdata->tmpbuf, buf + mdata->tmpstart, count - mdata->tmpstart);
+		}
+	}
+	if (mdata->tmpbuf == NULL && mdata->tmpstart != count) {
+		rpc_set_error(nfs->rpc, "out of memory: failed to allocate a %s buffer", is_write ? "write" : "read");
+		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
+		free_nfs_mcb_data(mdata);
+		return -1;
+	}
+
+	nfsfh->offset = offset;
+	if (is_write) {
+		nfs_cache_drop_attr(nfs, &nfsfh->fh);
+	}
+	nfs_send_chunks(mdata);
+	if (mdata->outstanding == 0) {
+		data->cb(mdata->error, nfs, mdata->error_string, data->private_data);
+		free_nfs_mcb_data(mdata);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+
+/*
+ * Read-ahead and write-behind.
+ *
+ * Once a file handle is being read sequentially, reads are served from
+ * blocks of rsize bytes and the next few blocks are fetched in the
+ * background.  A read waits on the blocks it covers and completes as soon
+ * as they are all in, so several small reads share one READ.
+ *
+ * With write-behind, small sequential writes are gathered in a wsize
+ * buffer which is sent when it is full, when a write doesn't follow on,
+ * or before anything that needs the server to see the data.  Errors are
+ * kept and reported by the next write, fsync or close.
+ */
+static int nfs_pread_direct(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, nfs_cb cb, void *private_data);
+
+static void nfs_free_nfsfh(struct nfsfh *nfsfh)
+{
+	int i;
+
+	for (i = 0; i < NFS_RA_SLOTS; i++) {
+		if (nfsfh->ra[i].buf != NULL) {
+			free(nfsfh->ra[i].buf);
+		}
+	}
+	if (nfsfh->wb_buf != NULL) {
+		free(nfsfh->wb_buf);
+	}
+	if (nfsfh->fh.data.data_val != NULL) {
+		free(nfsfh->fh.data.data_val);
+		nfsfh->fh.data.data_val = NULL;
+	}
+	free(nfsfh);
+}
+
+/* closed, and the last call on our behalf is back */
+static void nfs_fh_check_closed(struct nfsfh *nfsfh)
+{
+	if (nfsfh->is_closing && nfsfh->pending == 0) {
+		nfs_free_nfsfh(nfsfh);
+	}
+}
+
+static void nfs_wb_cb(struct rpc_context *rpc UNUSED, int status, void *command_data, void *private_data)
+{
+	struct nfsfh *nfsfh = private_data;
+	struct nfs_context *nfs = nfsfh->nfs;
+	WRITE3res *res = command_data;
+	int error = 0;
+
+	nfsfh->wb_inflight--;
+
+	if (status == RPC_STATUS_ERROR) {
+		error = -EFAULT;
+	} else if (status == RPC_STATUS_CANCEL) {
+		error = -EINTR;
+	} else if (res->status != NFS3_OK) {
+		error = nfsstat3_to_errno(res->status);
+	}
+	if (error != 0 && nfsfh->wb_error == 0) {
+		nfsfh->wb_error = error;
+	}
+	nfs_cache_drop_attr(nfs, &nfsfh->fh);
+
+	while (nfsfh->wb_inflight == 0 && nfsfh->wb_waiters != NULL) {
+		struct nfs_flush_waiter *waiter = nfsfh->wb_waiters;
+
+		DLIST_REMOVE(nfsfh->wb_waiters, waiter);
+		waiter->fn(nfsfh, waiter->arg);
+		free(waiter);
+	}
+
+	/* only now, a waiter may have closed the file */
+	nfsfh->pending--;
+	nfs_fh_check_closed(nfsfh);
+}
+
+/* send whatever is buffered */
+static void nfs_wb_flush(struct nfs_context *nfs, struct nfsfh *nfsfh)
+{
+	if (nfsfh->wb_len == 0) {
+		return;
+	}
+
+	nfs_cache_drop_attr(nfs, &nfsfh->fh);
+	if (rpc_nfs_write_async(nfs_data_rpc(nfs), nfs_wb_cb, &nfsfh->fh, nfsfh->wb_buf, nfsfh->wb_offset, nfsfh->wb_len, UNSTABLE, nfsfh) != 0) {
+		if (nfsfh->wb_error == 0) {
+			nfsfh->wb_error = -ENOMEM;
+		}
+	} else {
+		nfsfh->pending++;
+		nfsfh->wb_inflight++;
+	}
+	nfsfh->wb_len = 0;
+}
+
+/* call fn once everything written so far has reached the server.
+ * Returns -1, without calling fn, if we can't wait: going ahead could
+ * overtake WRITEs still in flight on another connection */
+static int nfs_wb_wait(struct nfs_context *nfs, struct nfsfh *nfsfh, void (*fn)(struct nfsfh *nfsfh, void *arg), void *arg)
+{
+	struct nfs_flush_waiter *waiter;
+
+	nfs_wb_flush(nfs, nfsfh);
+	if (nfsfh->wb_inflight == 0) {
+		fn(nfsfh, arg);
+		return 0;
+	}
+
+	waiter = malloc(sizeof(struct nfs_flush_waiter));
+	if (waiter == NULL) {
+		rpc_set_error(nfs->rpc, "out of memory: failed to allocate flush waiter");
+		return -1;
+	}
+	waiter->fn  = fn;
+	waiter->arg = arg;
+	DLIST_ADD_END(nfsfh->wb_waiters, waiter, NULL);
+	return 0;
+}
+
+/* returns, and clears, the error from an earlier buffered write */
+static int nfs_wb_take_error(struct nfs_context *nfs, struct nfsfh *nfsfh)
+{
+	int error = nfsfh->wb_error;
+
+	if (error != 0) {
+		rpc_set_error(nfs->rpc, "NFS: A buffered write failed with %s(%d)", strerror(-error), error);
+		nfsfh->wb_error = 0;
+	}
+	return error;
+}
+
+/* the file is changing: read-ahead data can no longer be trusted */
+static void nfs_ra_invalidate(struct nfsfh *nfsfh)
+{
+	int i;
+
+	for (i = 0; i < NFS_RA_SLOTS; i++) {
+		struct nfs_ra_block *block = &nfsfh->ra[i];
+
+		if (block->state == NFS_RA_LOADING || block->users > 0) {
+			block->stale = 1;
+		} else {
+			block->state = NFS_RA_EMPTY;
+		}
+	}
+}
+
+static struct nfs_ra_block *nfs_ra_slot(struct nfsfh *nfsfh, nfs_off_t offset)
+{
+	return &nfsfh->ra[(offset / nfsfh->ra_bsize) % NFS_RA_SLOTS];
+}
+
+/* can reads at offset use this block, now or once it is loaded? */
+static int nfs_ra_usable(struct nfs_ra_block *block, nfs_off_t offset)
+{
+	if (block->stale || block->offset != offset) {
+		return 0;
+	}
+	if (block->state == NFS_RA_LOADING) {
+		return 1;
+	}
+	return block->state == NFS_RA_VALID && block->expires > time(NULL);
+}
+
+static void nfs_ra_release(struct nfs_ra_block *block)
+{
+	block->users--;
+	if (block->stale && block->users == 0 && block->state != NFS_RA_LOADING) {
+		block->state = NFS_RA_EMPTY;
+		block->stale = 0;
+	}
+}
+
+static void nfs_ra_service(struct nfs_context *nfs, struct nfsfh *nfsfh);
+
+static void nfs_ra_cb(struct rpc_context *rpc UNUSED, int status, void *command_data, void *private_data)
+{
+	struct nfs_ra_block *block = private_data;
+	struct nfsfh *nfsfh = block->nfsfh;
+	struct nfs_context *nfs = nfsfh->nfs;
+	READ3res *res = command_data;
+
+	nfsfh->pending--;
+
+	/* if it failed, the reads waiting for it go to the server
+	 * themselves and report the error */
+	block->state = NFS_RA_EMPTY;
+	if (status == RPC_STATUS_SUCCESS && res->status == NFS3_OK) {
+		post_op_attr *attr = &res->READ3res_u.resok.file_attributes;
+
+		block->expires = time(NULL) + nfs->acregmin;
+		if (attr->attributes_follow) {
+			fattr3 *fattr = &attr->post_op_attr_u.attributes;
+			int stale = block->stale;
+
+			/* someone else changed the file: our other blocks
+			 * are out of date, this one is not */
+			if (nfsfh->ra_have_mtime && (fattr->mtime.seconds != nfsfh->ra_mtime.seconds || fattr->mtime.nseconds != nfsfh->ra_mtime.nseconds)) {
+				nfs_ra_invalidate(nfsfh);
+				block->stale = stale;
+			}
+			nfsfh->ra_mtime      = fattr->mtime;
+			nfsfh->ra_have_mtime = 1;
+			block->expires = nfs_cache_expiry(nfs, fattr);
+		}
+		block->state = NFS_RA_VALID;
+		block->len   = res->READ3res_u.resok.count;
+	}
+	if (block->stale && block->users == 0) {
+		block->state = NFS_RA_EMPTY;
+		block->stale = 0;
+	}
+
+	nfs_ra_service(nfs, nfsfh);
+}
+
+/* find the block at offset, or start reading it */
+static struct nfs_ra_block *nfs_ra_load(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset)
+{
+	struct nfs_ra_block *block = nfs_ra_slot(nfsfh, offset);
+
+	if (nfs_ra_usable(block, offset)) {
+		return block;
+	}
+	if (block->state == NFS_RA_LOADING || block->users > 0) {
+		return NULL;
+	}
+
+	if (block->buf == NULL) {
+		block->buf = malloc(nfsfh->ra_bsize);
+		if (block->buf == NULL) {
+			return NULL;
+		}
+	}
+	if (rpc_nfs_read_into_async(nfs_data_rpc(nfs), nfs_ra_cb, &nfsfh->fh, offset, nfsfh->ra_bsize, block->buf, block) != 0) {
+		block->state = NFS_RA_EMPTY;
+		return NULL;
+	}
+	block->nfsfh  = nfsfh;
+	block->offset = offset;
+	block->state  = NFS_RA_LOADING;
+	block->stale  = 0;
+	block->len    = 0;
+	nfsfh->pending++;
+	return block;
+}
+
+/* complete read if all its blocks are in: returns 0 if it has to wait */
+static int nfs_ra_complete(struct nfs_context *nfs, struct nfsfh *nfsfh, struct nfs_ra_read *read)
+{
+	nfs_off_t first = read->offset - read->offset % nfsfh->ra_bsize;
+	nfs_off_t last  = read->offset + read->count - 1;
+	nfs_off_t offset;
+	int failed = 0;
+	size_t len = 0;
+	char *data = NULL, *tmpbuf = NULL;
+
+	last -= last % nfsfh->ra_bsize;
+	for (offset = first; offset <= last; offset += nfsfh->ra_bsize) {
+		struct nfs_ra_block *block = nfs_ra_slot(nfsfh, offset);
+
+		if (block->state == NFS_RA_LOADING) {
+			return 0;
+		}
+		if (block->state != NFS_RA_VALID) {
+			failed = 1;
+		}
+	}
+
+	DLIST_REMOVE(nfsfh->ra_reads, read);
+	if (failed) {
+		for (offset = first; offset <= last; offset += nfsfh->ra_bsize) {
+			nfs_ra_release(nfs_ra_slot(nfsfh, offset));
+		}
+		nfs_pread_direct(nfs, nfsfh, read->offset, read->count, read->buf, read->cb, read->private_data);
+		free(read);
+		return 1;
+	}
+
+	if (first == last && read->buf == NULL) {
+		/* all in one block: hand out the block itself */
+		struct nfs_ra_block *block = nfs_ra_slot(nfsfh, first);
+		size_t skip = read->offset - first;
+
+		data = block->buf + skip;
+		len = block->len > skip ? block->len - skip : 0;
+		if (len > read->count) {
+			len = read->count;
+		}
+	} else {
+		data = read->buf;
+		if (data == NULL) {
+			data = tmpbuf = malloc(read->count);
+		}
+		for (offset = first; data != NULL && offset <= last; offset += nfsfh->ra_bsize) {
+			struct nfs_ra_block *block = nfs_ra_slot(nfsfh, offset);
+			nfs_off_t start = offset > read->offset ? offset : read->offset;
+			nfs_off_t end = offset + block->len;
+
+			if (end > read->offset + read->count) {
+				end = read->offset + read->count;
+			}
+			if (end <= start) {
+				break;
+			}
+			memcpy(data + (start - read->offset), block->buf + (start - offset), end - start);
+			len = end - read->offset;
+			/* a short block is the end of the file */
+			if (block->len < nfsfh->ra_bsize) {
+				break;
+			}
+		}
+	}
+
+	for (offset = first; offset <= last; offset += nfsfh->ra_bsize) {
+		nfs_ra_release(nfs_ra_slot(nfsfh, offset));
+	}
+	if (data == NULL) {
+		rpc_set_error(nfs->rpc, "out of memory: failed to allocate read buffer");
+		read->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), read->private_data);
+	} else {
+		nfsfh->offset = read->offset + len;
+		read->cb(len, nfs, data, read->private_data);
+	}
+	if (tmpbuf != NULL) {
+		free(tmpbuf);
+	}
+	free(read);
+	return 1;
+}
+
+/* the callbacks may close the file, so the handle can be gone once
+ * this returns */
+static void nfs_ra_service(struct nfs_context *nfs, struct nfsfh *nfsfh)
+{
+	struct nfs_ra_read *read;
+
+	nfsfh->pending++;
+
+	/* callbacks may start or complete other reads, so start over
+	 * after each one */
+again:
+	for (read = nfsfh->ra_reads; read != NULL; read = read->next) {
+		if (nfs_ra_complete(nfs, nfsfh, read)) {
+			goto again;
+		}
+	}
+
+	nfsfh->pending--;
+	nfs_fh_check_closed(nfsfh);
+}
+
+static void nfs_ra_deferred(struct nfs_context *nfs, void *arg)
+{
+	struct nfsfh *nfsfh = arg;
+
+	nfsfh->pending--;
+	nfs_ra_service(nfs, nfsfh);
+}
+
+/* returns -1 if the read should go straight to the server instead */
+static int nfs_ra_pread(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, nfs_cb cb, void *private_data)
+{
+	struct nfs_ra_read *read;
+	nfs_off_t first, last, next;
+	int i;
+
+	if (offset == nfsfh->ra_next) {
+		nfsfh->ra_seq++;
+	} else {
+		nfsfh->ra_seq = 0;
+	}
+	nfsfh->ra_next = offset + count;
+
+	if (nfsfh->ra_bsize == 0) {
+		nfsfh->ra_bsize = nfs->readmax;
+	}
+	if (count == 0 || count > nfsfh->ra_bsize) {
+		return -1;
+	}
+
+	first = offset - offset % nfsfh->ra_bsize;
+	last  = offset + count - 1;
+	last -= last % nfsfh->ra_bsize;
+	if (nfsfh->ra_seq == 0) {
+		/* only random reads that happen to hit a block we have */
+		for (next = first; next <= last; next += nfsfh->ra_bsize) {
+			if (!nfs_ra_usable(nfs_ra_slot(nfsfh, next), next)) {
+				return -1;
+			}
+		}
+	}
+
+	for (next = first; next <= last; next += nfsfh->ra_bsize) {
+		if (nfs_ra_load(nfs, nfsfh, next) == NULL) {
+			return -1;
+		}
+	}
+
+	read = malloc(sizeof(struct nfs_ra_read));
+	if (read == NULL) {
+		return -1;
+	}
+	bzero(read, sizeof(struct nfs_ra_read));
+	read->offset       = offset;
+	read->count        = count;
+	read->buf          = buf;
+	read->cb           = cb;
+	read->private_data = private_data;
+	for (next = first; next <= last; next += nfsfh->ra_bsize) {
+		nfs_ra_slot(nfsfh, next)->users++;
+	}
+	DLIST_ADD_END(nfsfh->ra_reads, read, NULL);
+
+	if (nfsfh->ra_seq > 0) {
+		for (i = 1; i <= nfs->readahead; i++) {
+			struct nfs_ra_block *block = nfs_ra_slot(nfsfh, last + (i - 1) * nfsfh->ra_bsize);
+
+			/* no point reading past the end of the file */
+			if (block->state == NFS_RA_VALID && block->len < nfsfh->ra_bsize) {
+				break;
+			}
+			nfs_ra_load(nfs, nfsfh, last + i * nfsfh->ra_bsize);
+		}
+	}
+
+	/* even if the blocks are in, answer from nfs_service() rather
+	 * than before our caller gets its return value */
+	if (!nfsfh->ra_deferred.queued) {
+		nfsfh->ra_deferred.fn  = nfs_ra_deferred;
+		nfsfh->ra_deferred.arg = nfsfh;
+		nfsfh->pending++;
+		nfs_defer(nfs, &nfsfh->ra_deferred);
+	}
+	return 0;
+}
+
+
+
+
+/*
+ * Async pread()
+ */
+static void nfs_pread_cb(struct rpc_context *rpc UNUSED, int status, void *command_data, void *private_data)
+{
+	struct nfs_cb_data *data = private_data;
+	struct nfs_context *nfs = data->nfs;
+	READ3res *res;
+
+	if (status == RPC_STATUS_ERROR) {
+		data->cb(-EFAULT, nfs, command_data, data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+	if (status == RPC_STATUS_CANCEL) {
+		data->cb(-EINTR, nfs, "Command was cancelled", data->private_data);
 		free_nfs_cb_data(data);
 		return;
 	}
@@ -812,33 +2289,128 @@ static void nfs_pread_cb(struct rpc_context *rpc UNUSED, int status, void *comma
 	free_nfs_cb_data(data);
 }
 
-int nfs_pread_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, nfs_cb cb, void *private_data)
+static int nfs_pread_direct(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, nfs_cb cb, void *private_data)
+{
+	struct nfs_cb_data *data;
+
+	if (count > nfs->readmax) {
+		return nfs_chunked_async(nfs, nfsfh, offset, count, buf, nfs->readmax, 0, cb, private_data);
+	}
+
+	data = malloc(sizeof(struct nfs_cb_data));
+	if (data == NULL) {
+		rpc_set_error(nfs->rpc, "out of memory: failed to allocate nfs_cb_data structure");
+		printf("failed to allocate memory for nfs cb data\n");
+		free_nfs_cb_data(data);
+		return -1;
+	}
+	bzero(data, sizeof(struct nfs_cb_data));
+	data->nfs          = nfs;
+	data->cb           = cb;
+	data->private_data = private_data;
+	data->nfsfh        = nfsfh;
+
+	nfsfh->offset = offset;
+	if (rpc_nfs_read_into_async(nfs_data_rpc(nfs), nfs_pread_cb, &nfsfh->fh, offset, count, buf, data) != 0) {
+		rpc_set_error(nfs->rpc, "RPC error: Failed to send READ call for %s", data->path);
+		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
+		free_nfs_cb_data(data);
+		return -1;
+	}
+	return 0;
+}
+
+static int nfs_pread_start(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, nfs_cb cb, void *private_data)
+{
+	if (nfs->readahead > 0 && nfs_ra_pread(nfs, nfsfh, offset, count, buf, cb, private_data) == 0) {
+		return 0;
+	}
+	return nfs_pread_direct(nfs, nfsfh, offset, count, buf, cb, private_data);
+}
+
+/* a read held back until the writes before it are done */
+struct nfs_pread_waiter {
+       nfs_off_t offset;
+       size_t count;
+       char *buf;
+       nfs_cb cb;
+       void *private_data;
+       /* inside nfs_pread_start(), and whether it answered already */
+       int starting;
+       int answered;
+};
+
+static void nfs_pread_waiter_cb(int status, struct nfs_context *nfs, void *data, void *private_data)
+{
+	struct nfs_pread_waiter *waiter = private_data;
+
+	waiter->cb(status, nfs, data, waiter->private_data);
+	if (waiter->starting) {
+		waiter->answered = 1;
+		return;
+	}
+	free(waiter);
+}
+
+static void nfs_pread_flushed(struct nfsfh *nfsfh, void *arg)
+{
+	struct nfs_pread_waiter *waiter = arg;
+	struct nfs_context *nfs = nfsfh->nfs;
+	int ret;
+
+	/* nobody is left to see a return value, so a failure has to go
+	 * to the callback; some failures have called it already */
+	waiter->starting = 1;
+	ret = nfs_pread_start(nfs, nfsfh, waiter->offset, waiter->count, waiter->buf, nfs_pread_waiter_cb, waiter);
+	waiter->starting = 0;
+	if (ret != 0 && !waiter->answered) {
+		waiter->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), waiter->private_data);
+	}
+	if (ret != 0 || waiter->answered) {
+		free(waiter);
+	}
+}
+
+static int nfs_pread_internal(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, nfs_cb cb, void *private_data)
 {
-	struct nfs_cb_data *data;
+	struct nfs_pread_waiter *waiter;
 
-	data = malloc(sizeof(struct nfs_cb_data));
-	if (data == NULL) {
-		rpc_set_error(nfs->rpc, "out of memory: failed to allocate nfs_cb_data structure");
-		printf("failed to allocate memory for nfs cb data\n");
-		free_nfs_cb_data(data);
+	/* the WRITEs may go out on another connection, so the READ has
+	 * to wait for their replies or it could overtake them */
+	nfs_wb_flush(nfs, nfsfh);
+	if (nfsfh->wb_inflight == 0) {
+		return nfs_pread_start(nfs, nfsfh, offset, count, buf, cb, private_data);
+	}
+
+	waiter = malloc(sizeof(struct nfs_pread_waiter));
+	if (waiter == NULL) {
+		rpc_set_error(nfs->rpc, "out of memory: failed to allocate pread waiter");
 		return -1;
 	}
-	bzero(data, sizeof(struct nfs_cb_data));
-	data->nfs          = nfs;
-	data->cb           = cb;
-	data->private_data = private_data;
-	data->nfsfh        = nfsfh;
+	bzero(waiter, sizeof(struct nfs_pread_waiter));
+	waiter->offset       = offset;
+	waiter->count        = count;
+	waiter->buf          = buf;
+	waiter->cb           = cb;
+	waiter->private_data = private_data;
 
-	nfsfh->offset = offset;
-	if (rpc_nfs_read_async(nfs->rpc, nfs_pread_cb, &nfsfh->fh, offset, count, data) != 0) {
-		rpc_set_error(nfs->rpc, "RPC error: Failed to send READ call for %s", data->path);
-		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
-		free_nfs_cb_data(data);
+	if (nfs_wb_wait(nfs, nfsfh, nfs_pread_flushed, waiter) != 0) {
+		free(waiter);
 		return -1;
 	}
 	return 0;
 }
 
+int nfs_pread_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, nfs_cb cb, void *private_data)
+{
+	return nfs_pread_internal(nfs, nfsfh, offset, count, NULL, cb, private_data);
+}
+
+int nfs_pread_into_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, nfs_cb cb, void *private_data)
+{
+	return nfs_pread_internal(nfs, nfsfh, offset, count, buf, cb, private_data);
+}
+
 /*
  * Async read()
  */
@@ -877,15 +2449,67 @@ static void nfs_pwrite_cb(struct rpc_context *rpc UNUSED, int status, void *comm
 		return;
 	}
 
+	nfs_cache_drop_attr(nfs, &data->nfsfh->fh);
 	data->nfsfh->offset += res->WRITE3res_u.resok.count;
 	data->cb(res->WRITE3res_u.resok.count, nfs, NULL, data->private_data);
 	free_nfs_cb_data(data);
 }
 
+/* returns -1 if the write should go straight to the server instead */
+static int nfs_wb_pwrite(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, nfs_cb cb, void *private_data)
+{
+	int error;
+
+	if (nfsfh->wb_buf == NULL) {
+		nfsfh->wb_buf = malloc(nfs->writemax);
+		if (nfsfh->wb_buf == NULL) {
+			return -1;
+		}
+		nfsfh->wb_bufsize = nfs->writemax;
+	}
+	if (count >= nfsfh->wb_bufsize) {
+		return -1;
+	}
+
+	error = nfs_wb_take_error(nfs, nfsfh);
+	if (error != 0) {
+		cb(error, nfs, rpc_get_error(nfs->rpc), private_data);
+		return 0;
+	}
+
+	if (nfsfh->wb_len > 0 && (offset != nfsfh->wb_offset + nfsfh->wb_len || nfsfh->wb_len + count > nfsfh->wb_bufsize)) {
+		nfs_wb_flush(nfs, nfsfh);
+	}
+	if (nfsfh->wb_len == 0) {
+		nfsfh->wb_offset = offset;
+	}
+	memcpy(nfsfh->wb_buf + nfsfh->wb_len, buf, count);
+	nfsfh->wb_len += count;
+	if (nfsfh->wb_len == nfsfh->wb_bufsize) {
+		nfs_wb_flush(nfs, nfsfh);
+	}
+
+	nfs_cache_drop_attr(nfs, &nfsfh->fh);
+	nfsfh->offset = offset + count;
+	cb(count, nfs, NULL, private_data);
+	return 0;
+}
+
 int nfs_pwrite_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, nfs_cb cb, void *private_data)
 {
 	struct nfs_cb_data *data;
 
+	nfs_ra_invalidate(nfsfh);
+	if (nfs->writebehind && !nfsfh->is_sync && nfs_wb_pwrite(nfs, nfsfh, offset, count, buf, cb, private_data) == 0) {
+		return 0;
+	}
+	/* anything buffered goes first */
+	nfs_wb_flush(nfs, nfsfh);
+
+	if (count > nfs->writemax) {
+		return nfs_chunked_async(nfs, nfsfh, offset, count, buf, nfs->writemax, 1, cb, private_data);
+	}
+
 	data = malloc(sizeof(struct nfs_cb_data));
 	if (data == NULL) {
 		rpc_set_error(nfs->rpc, "out of memory: failed to allocate nfs_cb_data structure");
@@ -900,7 +2524,8 @@ int nfs_pwrite_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t off
 	data->nfsfh        = nfsfh;
 
 	nfsfh->offset = offset;
-	if (rpc_nfs_write_async(nfs->rpc, nfs_pwrite_cb, &nfsfh->fh, buf, offset, count, nfsfh->is_sync?FILE_SYNC:UNSTABLE, data) != 0) {
+	nfs_cache_drop_attr(nfs, &nfsfh->fh);
+	if (rpc_nfs_write_async(nfs_data_rpc(nfs), nfs_pwrite_cb, &nfsfh->fh, buf, offset, count, nfsfh->is_sync?FILE_SYNC:UNSTABLE, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send WRITE call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
 		free_nfs_cb_data(data);
@@ -924,15 +2549,39 @@ int nfs_write_async(struct nfs_context *nfs, struct nfsfh *nfsfh, size_t count,
  * close
  */
  
+static void nfs_close_flushed(struct nfsfh *nfsfh, void *arg)
+{
+	struct nfs_cb_data *data = arg;
+	struct nfs_context *nfs = data->nfs;
+	int error;
+
+	/* anything still reading ahead frees us when it gets back */
+	nfsfh->is_closing = 1;
+	error = nfs_wb_take_error(nfs, nfsfh);
+	data->cb(error, nfs, error ? rpc_get_error(nfs->rpc) : NULL, data->private_data);
+	free_nfs_cb_data(data);
+	nfs_fh_check_closed(nfsfh);
+}
+
 int nfs_close_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_cb cb, void *private_data)
 {
-	if (nfsfh->fh.data.data_val != NULL){
-		free(nfsfh->fh.data.data_val);
-		nfsfh->fh.data.data_val = NULL;
+	struct nfs_cb_data *data;
+
+	data = malloc(sizeof(struct nfs_cb_data));
+	if (data == NULL) {
+		rpc_set_error(nfs->rpc, "out of memory: failed to allocate nfs_cb_data structure");
+		printf("failed to allocate memory for nfs cb data\n");
+		return -1;
 	}
-	free(nfsfh);
+	bzero(data, sizeof(struct nfs_cb_data));
+	data->nfs          = nfs;
+	data->cb           = cb;
+	data->private_data = private_data;
 
-	cb(0, nfs, NULL, private_data);
+	if (nfs_wb_wait(nfs, nfsfh, nfs_close_flushed, data) != 0) {
+		free_nfs_cb_data(data);
+		return -1;
+	}
 	return 0;
 };
 
@@ -943,6 +2592,13 @@ int nfs_close_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_cb cb, voi
 /*
  * Async fstat()
  */
+static void nfs_fstat_flushed(struct nfsfh *nfsfh UNUSED, void *arg)
+{
+	struct nfs_cb_data *data = arg;
+
+	nfs_stat_continue_internal(data->nfs, data);
+}
+
 int nfs_fstat_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_cb cb, void *private_data)
 {
 	struct nfs_cb_data *data;
@@ -959,9 +2615,19 @@ int nfs_fstat_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_cb cb, voi
 	data->cb           = cb;
 	data->private_data = private_data;
 
-	if (rpc_nfs_getattr_async(nfs->rpc, nfs_stat_1_cb, &nfsfh->fh, data) != 0) {
-		rpc_set_error(nfs->rpc, "RPC error: Failed to send STAT GETATTR call for %s", data->path);
-		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
+	if (nfs_fh_copy(&data->fh, &nfsfh->fh) != 0) {
+		data->fh.data.data_val = NULL;
+		rpc_set_error(nfs->rpc, "out of memory: failed to copy filehandle");
+		free_nfs_cb_data(data);
+		return -1;
+	}
+
+	/* the size and times must include our writes */
+	nfs_wb_flush(nfs, nfsfh);
+	if (nfsfh->wb_inflight == 0) {
+		return nfs_stat_continue_internal(nfs, data);
+	}
+	if (nfs_wb_wait(nfs, nfsfh, nfs_fstat_flushed, data) != 0) {
 		free_nfs_cb_data(data);
 		return -1;
 	}
@@ -1002,6 +2668,27 @@ static void nfs_fsync_cb(struct rpc_context *rpc UNUSED, int status, void *comma
 	free_nfs_cb_data(data);
 }
 
+/* COMMIT once the buffered writes are all in */
+static void nfs_fsync_flushed(struct nfsfh *nfsfh, void *arg)
+{
+	struct nfs_cb_data *data = arg;
+	struct nfs_context *nfs = data->nfs;
+	int error;
+
+	error = nfs_wb_take_error(nfs, nfsfh);
+	if (error != 0) {
+		data->cb(error, nfs, rpc_get_error(nfs->rpc), data->private_data);
+		free_nfs_cb_data(data);
+		return;
+	}
+
+	if (rpc_nfs_commit_async(nfs->rpc, nfs_fsync_cb, &nfsfh->fh, data) != 0) {
+		rpc_set_error(nfs->rpc, "RPC error: Failed to send COMMIT call for %s", data->path);
+		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
+		free_nfs_cb_data(data);
+	}
+}
+
 int nfs_fsync_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_cb cb, void *private_data)
 {
 	struct nfs_cb_data *data;
@@ -1018,9 +2705,7 @@ int nfs_fsync_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_cb cb, voi
 	data->cb           = cb;
 	data->private_data = private_data;
 
-	if (rpc_nfs_commit_async(nfs->rpc, nfs_fsync_cb, &nfsfh->fh, data) != 0) {
-		rpc_set_error(nfs->rpc, "RPC error: Failed to send COMMIT call for %s", data->path);
-		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
+	if (nfs_wb_wait(nfs, nfsfh, nfs_fsync_flushed, data) != 0) {
 		free_nfs_cb_data(data);
 		return -1;
 	}
@@ -1085,6 +2770,9 @@ int nfs_ftruncate_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t
 	args.new_attributes.size.set_it = 1;
 	args.new_attributes.size.set_size3_u.size = length;
 
+	nfs_wb_flush(nfs, nfsfh);
+	nfs_ra_invalidate(nfsfh);
+	nfs_cache_drop_attr(nfs, &nfsfh->fh);
 	if (rpc_nfs_setattr_async(nfs->rpc, nfs_ftruncate_cb, &args, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send SETATTR call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -1174,6 +2862,7 @@ static int nfs_mkdir_continue_internal(struct nfs_context *nfs, struct nfs_cb_da
 	
 	str = &str[strlen(str) + 1];
 
+	nfs_cache_drop_name(nfs, &data->fh, str);
 	if (rpc_nfs_mkdir_async(nfs->rpc, nfs_mkdir_cb, &data->fh, str, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send MKDIR call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -1255,6 +2944,7 @@ static int nfs_rmdir_continue_internal(struct nfs_context *nfs, struct nfs_cb_da
 	
 	str = &str[strlen(str) + 1];
 
+	nfs_cache_drop_name(nfs, &data->fh, str);
 	if (rpc_nfs_rmdir_async(nfs->rpc, nfs_rmdir_cb, &data->fh, str, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send RMDIR call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -1333,6 +3023,7 @@ static void nfs_create_2_cb(struct rpc_context *rpc UNUSED, int status, void *co
 		return;
 	}
 	bzero(nfsfh, sizeof(struct nfsfh));
+	nfsfh->nfs = nfs;
 
 	/* steal the filehandle */
 	nfsfh->fh.data.data_len = data->fh.data.data_len;
@@ -1387,6 +3078,7 @@ static int nfs_creat_continue_internal(struct nfs_context *nfs, struct nfs_cb_da
 	
 	str = &str[strlen(str) + 1];
 
+	nfs_cache_drop_name(nfs, &data->fh, str);
 	if (rpc_nfs_create_async(nfs->rpc, nfs_creat_1_cb, &data->fh, str, data->continue_int, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send CREATE call for %s/%s", data->path, str);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -1467,6 +3159,7 @@ static int nfs_unlink_continue_internal(struct nfs_context *nfs, struct nfs_cb_d
 	
 	str = &str[strlen(str) + 1];
 
+	nfs_cache_drop_name(nfs, &data->fh, str);
 	if (rpc_nfs_remove_async(nfs->rpc, nfs_unlink_cb, &data->fh, str, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send REMOVE call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -1645,6 +3338,343 @@ void nfs_closedir(struct nfs_context *nfs UNUSED, struct nfsdir *nfsdir)
 
 
 
+/*
+ * Streaming READDIRPLUS
+ *
+ * Cookies make the calls for one directory strictly sequential, so what
+ * we can do is keep the next call in flight while the caller works on
+ * the batch it has, and buffer up to NFS_DIRPLUS_AHEAD batches ahead.
+ */
+#define NFS_DIRPLUS_AHEAD 2
+#define NFS_DIRPLUS_DIRCOUNT 8192
+
+struct nfs_dirplus_batch {
+       struct nfs_dirplus_batch *prev, *next;
+       struct nfsdirentplus *entries;
+       int count;
+};
+
+struct nfsdirplus {
+       struct nfs_context *nfs;
+       struct nfs_fh3 fh;
+       char *path;
+
+       cookie3 cookie;
+       cookieverf3 cookieverf;
+       int in_flight;
+       int eof;
+       int error;
+
+       /* batches read ahead, and the one the caller has now */
+       struct nfs_dirplus_batch *batches;
+       int num_batches;
+       struct nfs_dirplus_batch *current;
+
+       /* whoever is waiting for the open or the next batch */
+       nfs_cb cb;
+       void *private_data;
+       int is_opening;
+
+       /* we are inside a callback to the caller, and whether they have
+        * closed the stream meanwhile */
+       int busy;
+       int is_closing;
+};
+
+static void nfs_free_dirplus_batch(struct nfs_dirplus_batch *batch)
+{
+	while (batch->entries != NULL) {
+		struct nfsdirentplus *entry = batch->entries;
+
+		batch->entries = entry->next;
+		free(entry->name);
+		free(entry);
+	}
+	free(batch);
+}
+
+static void nfs_free_nfsdirplus(struct nfsdirplus *dir)
+{
+	while (dir->batches != NULL) {
+		struct nfs_dirplus_batch *batch = dir->batches;
+
+		DLIST_REMOVE(dir->batches, batch);
+		nfs_free_dirplus_batch(batch);
+	}
+	if (dir->current != NULL) {
+		nfs_free_dirplus_batch(dir->current);
+	}
+	if (dir->fh.data.data_val != NULL) {
+		free(dir->fh.data.data_val);
+	}
+	free(dir->path);
+	free(dir);
+}
+
+/* nothing of ours is running any more: see if we can go */
+static int nfs_dirplus_check_closed(struct nfsdirplus *dir)
+{
+	if (dir->is_closing && !dir->in_flight && dir->busy == 0) {
+		nfs_free_nfsdirplus(dir);
+		return 1;
+	}
+	return 0;
+}
+
+static void nfs_dirplus_cb(struct rpc_context *rpc, int status, void *command_data, void *private_data);
+
+static void nfs_dirplus_fetch(struct nfsdirplus *dir)
+{
+	struct nfs_context *nfs = dir->nfs;
+
+	if (dir->in_flight || dir->eof || dir->error != 0 || dir->is_closing) {
+		return;
+	}
+	if (dir->num_batches >= NFS_DIRPLUS_AHEAD) {
+		return;
+	}
+	if (rpc_nfs_readdirplus_async(nfs->rpc, nfs_dirplus_cb, &dir->fh, dir->cookie, dir->cookieverf, NFS_DIRPLUS_DIRCOUNT, nfs->readmax, dir) != 0) {
+		rpc_set_error(nfs->rpc, "RPC error: Failed to send READDIRPLUS call for %s", dir->path);
+		dir->error = -ENOMEM;
+		return;
+	}
+	dir->in_flight = 1;
+}
+
+/* hand the next batch, the end or an error to a waiting caller */
+static void nfs_dirplus_deliver(struct nfsdirplus *dir)
+{
+	struct nfs_context *nfs = dir->nfs;
+	nfs_cb cb = dir->cb;
+	void *private_data = dir->private_data;
+
+	if (cb == NULL || dir->is_opening) {
+		return;
+	}
+
+	if (dir->batches != NULL) {
+		dir->current = dir->batches;
+		DLIST_REMOVE(dir->batches, dir->current);
+		dir->num_batches--;
+		/* get the next one going before the caller looks at this */
+		nfs_dirplus_fetch(dir);
+		dir->cb = NULL;
+		cb(dir->current->count, nfs, dir->current->entries, private_data);
+		return;
+	}
+	if (dir->error != 0) {
+		dir->cb = NULL;
+		cb(dir->error, nfs, rpc_get_error(nfs->rpc), private_data);
+		return;
+	}
+	if (dir->eof && !dir->in_flight) {
+		dir->cb = NULL;
+		cb(0, nfs, NULL, private_data);
+		return;
+	}
+}
+
+static int nfs_dirplus_add_batch(struct nfsdirplus *dir, READDIRPLUS3resok *res)
+{
+	struct nfs_context *nfs = dir->nfs;
+	struct nfs_dirplus_batch *batch;
+	struct nfsdirentplus **last;
+	entryplus3 *entry;
+
+	batch = malloc(sizeof(struct nfs_dirplus_batch));
+	if (batch == NULL) {
+		return -1;
+	}
+	bzero(batch, sizeof(struct nfs_dirplus_batch));
+	last = &batch->entries;
+
+	for (entry = res->reply.entries; entry != NULL; entry = entry->nextentry) {
+		struct nfsdirentplus *nfsdirent;
+
+		nfsdirent = malloc(sizeof(struct nfsdirentplus));
+		if (nfsdirent == NULL) {
+			nfs_free_dirplus_batch(batch);
+			return -1;
+		}
+		bzero(nfsdirent, sizeof(struct nfsdirentplus));
+		nfsdirent->name = strdup(entry->name);
+		if (nfsdirent->name == NULL) {
+			free(nfsdirent);
+			nfs_free_dirplus_batch(batch);
+			return -1;
+		}
+		nfsdirent->inode = entry->fileid;
+		if (entry->name_attributes.attributes_follow) {
+			nfsdirent->has_attr = 1;
+			nfs_fattr_to_stat(&entry->name_attributes.post_op_attr_u.attributes, &nfsdirent->st);
+		}
+		*last = nfsdirent;
+		last  = &nfsdirent->next;
+		batch->count++;
+
+		/* what we got is as good as a LOOKUP */
+		if (entry->name_handle.handle_follows && strcmp(entry->name, ".") && strcmp(entry->name, "..")) {
+			LOOKUP3resok lookup;
+
+			bzero(&lookup, sizeof(LOOKUP3resok));
+			lookup.object         = entry->name_handle.post_op_fh3_u.handle;
+			lookup.obj_attributes = entry->name_attributes;
+			nfs_cache_add_lookup(nfs, &dir->fh, entry->name, &lookup);
+		}
+		dir->cookie = entry->cookie;
+	}
+	memcpy(dir->cookieverf, res->cookieverf, sizeof(cookieverf3));
+	dir->eof = res->reply.eof;
+
+	if (batch->count == 0) {
+		nfs_free_dirplus_batch(batch);
+		return 0;
+	}
+	DLIST_ADD_END(dir->batches, batch, NULL);
+	dir->num_batches++;
+	return 0;
+}
+
+static void nfs_dirplus_cb(struct rpc_context *rpc UNUSED, int status, void *command_data, void *private_data)
+{
+	struct nfsdirplus *dir = private_data;
+	struct nfs_context *nfs = dir->nfs;
+	READDIRPLUS3res *res = command_data;
+
+	dir->in_flight = 0;
+	if (dir->is_closing) {
+		nfs_dirplus_check_closed(dir);
+		return;
+	}
+
+	if (status == RPC_STATUS_ERROR) {
+		rpc_set_error(nfs->rpc, "%s", (char *)command_data);
+		dir->error = -EFAULT;
+	} else if (status == RPC_STATUS_CANCEL) {
+		rpc_set_error(nfs->rpc, "Command was cancelled");
+		dir->error = -EINTR;
+	} else if (res->status != NFS3_OK) {
+		rpc_set_error(nfs->rpc, "NFS: READDIRPLUS of %s failed with %s(%d)", dir->path, nfsstat3_to_str(res->status), nfsstat3_to_errno(res->status));
+		dir->error = nfsstat3_to_errno(res->status);
+	} else if (nfs_dirplus_add_batch(dir, &res->READDIRPLUS3res_u.resok) != 0) {
+		rpc_set_error(nfs->rpc, "Out of memory: failed to allocate directory entries");
+		dir->error = -ENOMEM;
+	}
+
+	dir->busy++;
+	if (dir->is_opening) {
+		nfs_cb cb = dir->cb;
+
+		dir->is_opening = 0;
+		dir->cb         = NULL;
+		if (dir->error != 0) {
+			/* the caller never sees the stream, so it is ours to free */
+			cb(dir->error, nfs, rpc_get_error(nfs->rpc), dir->private_data);
+			dir->is_closing = 1;
+		} else {
+			cb(0, nfs, dir, dir->private_data);
+		}
+	}
+	if (!dir->is_closing) {
+		nfs_dirplus_fetch(dir);
+		nfs_dirplus_deliver(dir);
+	}
+	dir->busy--;
+	nfs_dirplus_check_closed(dir);
+}
+
+static int nfs_opendirplus_continue_internal(struct nfs_context *nfs, struct nfs_cb_data *data)
+{
+	struct nfsdirplus *dir = data->continue_data;
+
+	/* from here on the stream looks after itself */
+	data->continue_data = NULL;
+	if (nfs_fh_copy(&dir->fh, &data->fh) != 0) {
+		rpc_set_error(nfs->rpc, "Out of memory: failed to copy filehandle for %s", data->path);
+		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
+		free_nfs_cb_data(data);
+		nfs_free_nfsdirplus(dir);
+		return -1;
+	}
+	dir->cb           = data->cb;
+	dir->private_data = data->private_data;
+	free_nfs_cb_data(data);
+
+	nfs_dirplus_fetch(dir);
+	if (dir->error != 0) {
+		dir->cb(dir->error, nfs, rpc_get_error(nfs->rpc), dir->private_data);
+		nfs_free_nfsdirplus(dir);
+		return -1;
+	}
+	return 0;
+}
+
+static void nfs_opendirplus_free(void *continue_data)
+{
+	nfs_free_nfsdirplus(continue_data);
+}
+
+int nfs_opendirplus_async(struct nfs_context *nfs, const char *path, nfs_cb cb, void *private_data)
+{
+	struct nfsdirplus *dir;
+
+	dir = malloc(sizeof(struct nfsdirplus));
+	if (dir == NULL) {
+		rpc_set_error(nfs->rpc, "out of memory: failed to allocate nfsdirplus");
+		return -1;
+	}
+	bzero(dir, sizeof(struct nfsdirplus));
+	dir->nfs        = nfs;
+	dir->is_opening = 1;
+	dir->path       = strdup(path);
+	if (dir->path == NULL) {
+		rpc_set_error(nfs->rpc, "out of memory: failed to copy path string");
+		free(dir);
+		return -1;
+	}
+
+	if (nfs_lookuppath_async(nfs, path, cb, private_data, nfs_opendirplus_continue_internal, dir, nfs_opendirplus_free, 0) != 0) {
+		printf("Out of memory: failed to start parsing the path components\n");
+		return -2;
+	}
+
+	return 0;
+}
+
+int nfs_readdirplus_async(struct nfs_context *nfs, struct nfsdirplus *dir, nfs_cb cb, void *private_data)
+{
+	if (dir->cb != NULL) {
+		rpc_set_error(nfs->rpc, "A read of %s is already waiting", dir->path);
+		return -1;
+	}
+
+	/* the last batch is done with */
+	if (dir->current != NULL) {
+		nfs_free_dirplus_batch(dir->current);
+		dir->current = NULL;
+	}
+
+	dir->cb           = cb;
+	dir->private_data = private_data;
+
+	dir->busy++;
+	nfs_dirplus_fetch(dir);
+	nfs_dirplus_deliver(dir);
+	dir->busy--;
+	nfs_dirplus_check_closed(dir);
+	return 0;
+}
+
+void nfs_closedirplus(struct nfs_context *nfs UNUSED, struct nfsdirplus *dir)
+{
+	/* a read still waiting is never called */
+	dir->cb = NULL;
+	dir->is_closing = 1;
+	nfs_dirplus_check_closed(dir);
+}
+
+
+
 
 
 
@@ -1690,6 +3720,26 @@ static void nfs_lseek_1_cb(struct rpc_context *rpc UNUSED, int status, void *com
 	free(data);
 }
 
+static int nfs_lseek_getattr(struct nfs_context *nfs, struct lseek_cb_data *data)
+{
+	if (rpc_nfs_getattr_async(nfs->rpc, nfs_lseek_1_cb, &data->nfsfh->fh, data) != 0) {
+		rpc_set_error(nfs->rpc, "RPC error: Failed to send LSEEK GETATTR call");
+		return -1;
+	}
+	return 0;
+}
+
+static void nfs_lseek_flushed(struct nfsfh *nfsfh, void *arg)
+{
+	struct lseek_cb_data *data = arg;
+	struct nfs_context *nfs = nfsfh->nfs;
+
+	if (nfs_lseek_getattr(nfs, data) != 0) {
+		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
+		free(data);
+	}
+}
+
 int nfs_lseek_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, int whence, nfs_cb cb, void *private_data)
 {
 	struct lseek_cb_data *data;
@@ -1717,8 +3767,16 @@ int nfs_lseek_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offs
 	data->cb           = cb;
 	data->private_data = private_data;
 
-	if (rpc_nfs_getattr_async(nfs->rpc, nfs_lseek_1_cb, &nfsfh->fh, data) != 0) {
-		rpc_set_error(nfs->rpc, "RPC error: Failed to send LSEEK GETATTR call");
+	/* SEEK_END is relative to a size which must include our writes */
+	nfs_wb_flush(nfs, nfsfh);
+	if (nfsfh->wb_inflight != 0) {
+		if (nfs_wb_wait(nfs, nfsfh, nfs_lseek_flushed, data) != 0) {
+			free(data);
+			return -1;
+		}
+		return 0;
+	}
+	if (nfs_lseek_getattr(nfs, data) != 0) {
 		free(data);
 		return -2;
 	}
@@ -1896,6 +3954,7 @@ static int nfs_chmod_continue_internal(struct nfs_context *nfs, struct nfs_cb_da
 	args.new_attributes.mode.set_it = 1;
 	args.new_attributes.mode.set_mode3_u.mode = data->continue_int;
 
+	nfs_cache_drop_attr(nfs, &data->fh);
 	if (rpc_nfs_setattr_async(nfs->rpc, nfs_chmod_cb, &args, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send SETATTR call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -2007,6 +4066,7 @@ static int nfs_chown_continue_internal(struct nfs_context *nfs, struct nfs_cb_da
 		args.new_attributes.gid.set_gid3_u.gid = chown_data->gid;
 	}
 
+	nfs_cache_drop_attr(nfs, &data->fh);
 	if (rpc_nfs_setattr_async(nfs->rpc, nfs_chown_cb, &args, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send SETATTR call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -2142,6 +4202,7 @@ static int nfs_utimes_continue_internal(struct nfs_context *nfs, struct nfs_cb_d
 		args.new_attributes.mtime.set_it = SET_TO_SERVER_TIME;
 	}
 
+	nfs_cache_drop_attr(nfs, &data->fh);
 	if (rpc_nfs_setattr_async(nfs->rpc, nfs_utimes_cb, &args, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send SETATTR call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -2356,6 +4417,7 @@ static int nfs_symlink_continue_internal(struct nfs_context *nfs, struct nfs_cb_
 {
 	struct nfs_symlink_data *symlink_data = data->continue_data;
 
+	nfs_cache_drop_name(nfs, &data->fh, symlink_data->newpathobject);
 	if (rpc_nfs_symlink_async(nfs->rpc, nfs_symlink_cb, &data->fh, symlink_data->newpathobject, symlink_data->oldpath, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send SYMLINK call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -2487,6 +4549,8 @@ static int nfs_rename_continue_2_internal(struct nfs_context *nfs, struct nfs_cb
 	rename_data->newdir.data.data_val = data->fh.data.data_val;
 	data->fh.data.data_val = NULL;
 
+	nfs_cache_drop_name(nfs, &rename_data->olddir, rename_data->oldobject);
+	nfs_cache_drop_name(nfs, &rename_data->newdir, rename_data->newobject);
 	if (rpc_nfs_rename_async(nfs->rpc, nfs_rename_cb, &rename_data->olddir, rename_data->oldobject, &rename_data->newdir, rename_data->newobject, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send RENAME call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
@@ -2643,6 +4707,8 @@ static int nfs_link_continue_2_internal(struct nfs_context *nfs, struct nfs_cb_d
 	link_data->newdir.data.data_val = data->fh.data.data_val;
 	data->fh.data.data_val = NULL;
 
+	nfs_cache_drop_attr(nfs, &link_data->oldfh);
+	nfs_cache_drop_name(nfs, &link_data->newdir, link_data->newobject);
 	if (rpc_nfs_link_async(nfs->rpc, nfs_link_cb, &link_data->oldfh, &link_data->newdir, link_data->newobject, data) != 0) {
 		rpc_set_error(nfs->rpc, "RPC error: Failed to send LINK call for %s", data->path);
 		data->cb(-ENOMEM, nfs, rpc_get_error(nfs->rpc), data->private_data);
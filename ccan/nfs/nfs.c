@@ -210,17 +210,70 @@ int rpc_nfs_access_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh,
 
 
 
-int rpc_nfs_read_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, nfs_off_t offset, size_t count, void *private_data)
+/* Like xdr_READ3res, but without copying the data into a malloced buffer.
+ * If data_val is set up (data_len being its size), the data is decoded
+ * straight into it; otherwise data_val is left pointing into the buffer we
+ * are decoding from.  Either way there is nothing for XDR_FREE to do. */
+static bool_t xdr_READ3res_nocopy(XDR *xdrs, READ3res *objp)
+{
+	READ3resok *resok = &objp->READ3res_u.resok;
+	char *buf = resok->data.data_val;
+	u_int size = resok->data.data_len;
+
+	if (xdrs->x_op == XDR_FREE) {
+		return TRUE;
+	}
+	if (xdrs->x_op != XDR_DECODE) {
+		return xdr_READ3res(xdrs, objp);
+	}
+
+	if (!xdr_nfsstat3(xdrs, &objp->status)) {
+		return FALSE;
+	}
+	if (objp->status != NFS3_OK) {
+		return xdr_READ3resfail(xdrs, &objp->READ3res_u.resfail);
+	}
+	if (!xdr_post_op_attr(xdrs, &resok->file_attributes)
+	    || !xdr_count3(xdrs, &resok->count)
+	    || !xdr_bool(xdrs, &resok->eof)
+	    || !xdr_u_int(xdrs, &resok->data.data_len)) {
+		return FALSE;
+	}
+	if (buf != NULL) {
+		if (resok->data.data_len > size) {
+			return FALSE;
+		}
+		return xdr_opaque(xdrs, buf, resok->data.data_len);
+	}
+	resok->data.data_val = (char *)xdr_inline(xdrs, RNDUP(resok->data.data_len));
+	return resok->data.data_val != NULL;
+}
+
+static int rpc_nfs_read_internal(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, nfs_off_t offset, size_t count, char *buf, void *private_data)
 {
 	struct rpc_pdu *pdu;
 	READ3args args;
+	READ3res *res;
 
-	pdu = rpc_allocate_pdu(rpc, NFS_PROGRAM, NFS_V3, NFS3_READ, cb, private_data, (xdrproc_t)xdr_READ3res, sizeof(READ3res));
+	pdu = rpc_allocate_pdu(rpc, NFS_PROGRAM, NFS_V3, NFS3_READ, cb, private_data, (xdrproc_t)xdr_READ3res_nocopy, sizeof(READ3res));
 	if (pdu == NULL) {
 		rpc_set_error(rpc, "Out of memory. Failed to allocate pdu for nfs/read call");
 		return -1;
 	}
 
+	if (buf != NULL) {
+		res = malloc(sizeof(READ3res));
+		if (res == NULL) {
+			rpc_set_error(rpc, "Out of memory. Failed to allocate reply for nfs/read call");
+			rpc_free_pdu(rpc, pdu);
+			return -1;
+		}
+		bzero(res, sizeof(READ3res));
+		res->READ3res_u.resok.data.data_val = buf;
+		res->READ3res_u.resok.data.data_len = count;
+		pdu->xdr_decode_buf = (caddr_t)res;
+	}
+
 	args.file.data.data_len = fh->data.data_len;
 	args.file.data.data_val = fh->data.data_val;
 	args.offset = offset;
@@ -241,6 +294,16 @@ int rpc_nfs_read_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, n
 	return 0;
 }
 
+int rpc_nfs_read_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, nfs_off_t offset, size_t count, void *private_data)
+{
+	return rpc_nfs_read_internal(rpc, cb, fh, offset, count, NULL, private_data);
+}
+
+int rpc_nfs_read_into_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, nfs_off_t offset, size_t count, char *buf, void *private_data)
+{
+	return rpc_nfs_read_internal(rpc, cb, fh, offset, count, buf, private_data);
+}
+
 
 int rpc_nfs_write_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, char *buf, nfs_off_t offset, size_t count, int stable_how, void *private_data)
 {
@@ -508,6 +571,40 @@ int rpc_nfs_readdir_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh
 	return 0;
 }
 
+int rpc_nfs_readdirplus_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, uint64_t cookie, char *cookieverf, int dircount, int maxcount, void *private_data)
+{
+	struct rpc_pdu *pdu;
+	READDIRPLUS3args args;
+
+	pdu = rpc_allocate_pdu(rpc, NFS_PROGRAM, NFS_V3, NFS3_READDIRPLUS, cb, private_data, (xdrproc_t)xdr_READDIRPLUS3res, sizeof(READDIRPLUS3res));
+	if (pdu == NULL) {
+		rpc_set_error(rpc, "Out of memory. Failed to allocate pdu for nfs/readdirplus call");
+		return -1;
+	}
+
+	bzero(&args, sizeof(READDIRPLUS3args));
+	args.dir.data.data_len = fh->data.data_len;
+	args.dir.data.data_val = fh->data.data_val;
+	args.cookie = cookie;
+	memcpy(&args.cookieverf, cookieverf, sizeof(cookieverf3));
+	args.dircount = dircount;
+	args.maxcount = maxcount;
+
+	if (xdr_READDIRPLUS3args(&pdu->xdr, &args) == 0) {
+		rpc_set_error(rpc, "XDR error: Failed to encode READDIRPLUS3args");
+		rpc_free_pdu(rpc, pdu);
+		return -2;
+	}
+
+	if (rpc_queue_pdu(rpc, pdu) != 0) {
+		rpc_set_error(rpc, "Out of memory. Failed to queue pdu for nfs/readdirplus call");
+		rpc_free_pdu(rpc, pdu);
+		return -3;
+	}
+
+	return 0;
+}
+
 int rpc_nfs_fsstat_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, void *private_data)
 {
 	struct rpc_pdu *pdu;
@@ -537,6 +634,35 @@ int rpc_nfs_fsstat_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh,
 	return 0;
 }
 
+int rpc_nfs_fsinfo_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, void *private_data)
+{
+	struct rpc_pdu *pdu;
+	FSINFO3args args;
+
+	pdu = rpc_allocate_pdu(rpc, NFS_PROGRAM, NFS_V3, NFS3_FSINFO, cb, private_data, (xdrproc_t)xdr_FSINFO3res, sizeof(FSINFO3res));
+	if (pdu == NULL) {
+		rpc_set_error(rpc, "Out of memory. Failed to allocate pdu for nfs/fsinfo call");
+		return -1;
+	}
+
+	args.fsroot.data.data_len = fh->data.data_len;
+	args.fsroot.data.data_val = fh->data.data_val;
+
+	if (xdr_FSINFO3args(&pdu->xdr, &args) == 0) {
+		rpc_set_error(rpc, "XDR error: Failed to encode FSINFO3args");
+		rpc_free_pdu(rpc, pdu);
+		return -2;
+	}
+
+	if (rpc_queue_pdu(rpc, pdu) != 0) {
+		rpc_set_error(rpc, "Out of memory. Failed to queue pdu for nfs/fsinfo call");
+		rpc_free_pdu(rpc, pdu);
+		return -3;
+	}
+
+	return 0;
+}
+
 
 int rpc_nfs_readlink_async(struct rpc_context *rpc, rpc_cb cb, struct nfs_fh3 *fh, void *private_data)
 {
@@ -20,6 +20,7 @@
  * This is the highlevel interface to access NFS resources using a posix-like interface
  */
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdint.h>
 
 typedef uint64_t nfs_off_t;
@@ -33,6 +34,88 @@ int nfs_get_fd(struct nfs_context *nfs);
 int nfs_which_events(struct nfs_context *nfs);
 int nfs_service(struct nfs_context *nfs, int revents);
 
+/*
+ * Several connections to the server.
+ *
+ * By default everything goes over one TCP connection. Call
+ * nfs_set_connections() before mounting to open <count> connections, at
+ * most NFS_MAX_CONNECTIONS, to the server instead. READs and WRITEs then
+ * go to whichever connection has the fewest calls outstanding; everything
+ * else stays on the first one. If some of the extra connections can't be
+ * opened, or are lost later, the rest carry on without them.
+ * nfs_get_connections() returns how many are up.
+ *
+ * With more than one connection, nfs_get_fd()/nfs_which_events()/
+ * nfs_service() only cover the first. Use nfs_get_pollfds() to fill in an
+ * array of up to NFS_MAX_CONNECTIONS pollfds instead, poll() it, and hand
+ * it back to nfs_service_pollfds(), which returns <0 if the first
+ * connection fails.
+ */
+#define NFS_MAX_CONNECTIONS 16
+
+struct pollfd;
+void nfs_set_connections(struct nfs_context *nfs, int count);
+int nfs_get_connections(struct nfs_context *nfs);
+int nfs_get_pollfds(struct nfs_context *nfs, struct pollfd *pfds, int count);
+int nfs_service_pollfds(struct nfs_context *nfs, struct pollfd *pfds, int count);
+
+/*
+ * Number of calls queued or in flight, ie. waiting for a reply.
+ */
+int nfs_queue_length(struct nfs_context *nfs);
+
+/*
+ * Largest READ and WRITE we send, as preferred by the server in FSINFO when
+ * we mounted. Larger pread/pwrite calls are split into chunks of this size
+ * and up to io_window chunks (default 8) are kept in flight at once.
+ */
+size_t nfs_get_readmax(struct nfs_context *nfs);
+size_t nfs_get_writemax(struct nfs_context *nfs);
+void nfs_set_io_window(struct nfs_context *nfs, int window);
+
+/*
+ * Read-ahead and write-behind for open files.
+ *
+ * Once a file is read sequentially, small reads are served from blocks of
+ * readmax bytes, and the next <blocks> blocks are read in the background.
+ * At most 4; the default, 0, turns read-ahead off. Blocks are trusted as
+ * long as the file's attributes would be cached, and are dropped when a
+ * READ shows that someone else has changed the file.
+ *
+ * With write-behind on, small sequential writes are gathered into writemax
+ * WRITEs. The write callback fires as soon as the data is buffered. The
+ * buffer is sent when it fills. fsync, close, reads, fstat and lseek
+ * SEEK_END wait for it to reach the server, so they see it. A failed
+ * buffered write is reported by the next write, fsync or close on the
+ * file. Write-behind is off by default.
+ */
+void nfs_set_readahead(struct nfs_context *nfs, int blocks);
+void nfs_set_writebehind(struct nfs_context *nfs, int enable);
+
+/*
+ * Attribute and lookup cache.
+ *
+ * stat() and path lookups are answered from the cache while the
+ * attributes are fresh. That is between acregmin and acregmax seconds for
+ * files and acdirmin and acdirmax for directories, longer for objects
+ * that have not been modified for a while. The defaults are 3/60/30/60.
+ * Setting both maximums to 0 turns the cache off.
+ * Changes made through this context invalidate what they touch; changes
+ * made by other clients are not seen until the entry times out.
+ * Answers from the cache are still delivered from nfs_service(), never
+ * from inside the call: while one is waiting, nfs_which_events() asks for
+ * POLLOUT so that poll() returns straight away.
+ */
+struct nfs_cache_stats {
+	uint64_t attr_hits;
+	uint64_t attr_misses;
+	uint64_t lookup_hits;
+	uint64_t lookup_misses;
+};
+void nfs_set_cache_timeouts(struct nfs_context *nfs, int acregmin, int acregmax, int acdirmin, int acdirmax);
+void nfs_get_cache_stats(struct nfs_context *nfs, struct nfs_cache_stats *stats);
+void nfs_flush_cache(struct nfs_context *nfs);
+
 /*
  * Used if you need different credentials than the default for the current user.
  */
@@ -227,11 +310,18 @@ int nfs_close_sync(struct nfs_context *nfs, struct nfsfh *nfsfh);
  * When the callback is invoked, status indicates the result:
  *    >=0 : Success.
  *          status is numer of bytes read.
- *          data is a pointer to the returned data.
+ *          data is a pointer to the returned data, valid until the callback returns.
  * -errno : An error occurred.
  *          data is the error string.
  */
 int nfs_pread_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, nfs_cb cb, void *private_data);
+/*
+ * Async pread() into a buffer
+ *
+ * As nfs_pread_async(), but the data is read straight into buf, which must
+ * hold count bytes. On success, data is buf.
+ */
+int nfs_pread_into_async(struct nfs_context *nfs, struct nfsfh *nfsfh, nfs_off_t offset, size_t count, char *buf, nfs_cb cb, void *private_data);
 /*
  * Sync pread()
  * Function returns
@@ -595,6 +685,86 @@ void nfs_closedir(struct nfs_context *nfs, struct nfsdir *nfsdir);
 
 
 
+/*
+ * OPENDIRPLUS()/READDIRPLUS()
+ *
+ * Stream a directory, with attributes, a batch of entries at a time.
+ * Unlike nfs_opendir(), which reads the whole listing before it returns,
+ * this uses READDIRPLUS and keeps the next call to the server going while
+ * the caller works through the batch it has. At most a couple of batches
+ * are held at any time, however large the directory is.
+ * The filehandles and attributes that come back also go into the
+ * attribute and lookup cache, so a stat() or open() of the entries right
+ * after needs no LOOKUP.
+ */
+struct nfsdirplus;
+struct nfsdirentplus {
+       struct nfsdirentplus *next;
+       char *name;
+       uint64_t inode;
+       /* st is only filled in if the server sent attributes */
+       int has_attr;
+       struct stat st;
+};
+/*
+ * Async opendirplus()
+ *
+ * Function returns
+ *  0 : The operation was initiated. Once the operation finishes, the callback will be invoked.
+ * <0 : An error occurred when trying to set up the operation. The callback will not be invoked.
+ *
+ * When struct nfsdirplus * is returned, this resource is closed/freed by calling nfs_closedirplus()
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ *          data is struct nfsdirplus *
+ * -errno : An error occurred.
+ *          data is the error string.
+ */
+int nfs_opendirplus_async(struct nfs_context *nfs, const char *path, nfs_cb cb, void *private_data);
+/*
+ * Sync opendirplus()
+ * Function returns
+ *      0 : Success
+ * -errno : An error occurred.
+ */
+int nfs_opendirplus_sync(struct nfs_context *nfs, const char *path, struct nfsdirplus **nfsdir);
+
+/*
+ * Async readdirplus()
+ *
+ * Fetch the next batch of entries. Only one read may be waiting at a
+ * time.
+ *
+ * Function returns
+ *  0 : The operation was initiated. Once the operation finishes, the callback will be invoked.
+ * <0 : An error occurred when trying to set up the operation. The callback will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *     >0 : Number of entries in the batch.
+ *          data is a struct nfsdirentplus * list, which stays valid until
+ *          the next nfs_readdirplus_async() or nfs_closedirplus().
+ *      0 : The end of the directory.
+ * -errno : An error occurred.
+ *          data is the error string.
+ */
+int nfs_readdirplus_async(struct nfs_context *nfs, struct nfsdirplus *nfsdir, nfs_cb cb, void *private_data);
+/*
+ * Sync readdirplus()
+ * Function returns
+ *     >0 : Number of entries, and *entries is the list
+ *      0 : The end of the directory
+ * -errno : An error occurred.
+ */
+int nfs_readdirplus_sync(struct nfs_context *nfs, struct nfsdirplus *nfsdir, struct nfsdirentplus **entries);
+
+/*
+ * nfs_closedirplus() never blocks, so no special sync/async versions are available
+ */
+void nfs_closedirplus(struct nfs_context *nfs, struct nfsdirplus *nfsdir);
+
+
+
 /*
  * STATVFS()
  */
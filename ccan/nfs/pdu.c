@@ -109,6 +109,7 @@ int rpc_queue_pdu(struct rpc_context *rpc, struct rpc_pdu *pdu)
 
 	memcpy(pdu->outdata.data, rpc->encodebuf, pdu->outdata.size);
 	DLIST_ADD_END(rpc->outqueue, pdu, NULL);
+	rpc->outqueue_len++;
 
 	return 0;
 }
@@ -133,7 +134,8 @@ static int rpc_process_reply(struct rpc_context *rpc, struct rpc_pdu *pdu, XDR *
 
 	bzero(&msg, sizeof(struct rpc_msg));
 	msg.acpted_rply.ar_verf = _null_auth;
-	if (pdu->xdr_decode_bufsize > 0) {
+	/* the caller may have set up the decode buffer already */
+	if (pdu->xdr_decode_bufsize > 0 && pdu->xdr_decode_buf == NULL) {
 		pdu->xdr_decode_buf = malloc(pdu->xdr_decode_bufsize);
 		if (pdu->xdr_decode_buf == NULL) {
 			printf("xdr_replymsg failed in portmap_getport_reply\n");
@@ -208,11 +210,12 @@ int rpc_process_pdu(struct rpc_context *rpc, char *buf, int size)
 	}
 	xdr_setpos(&xdr, pos);
 
-	for (pdu=rpc->waitpdu; pdu; pdu=pdu->next) {
+	for (pdu=rpc->waitpdu[rpc_hash_xid(xid)]; pdu; pdu=pdu->next) {
 		if (pdu->xid != xid) {
 			continue;
 		}
-		DLIST_REMOVE(rpc->waitpdu, pdu);
+		DLIST_REMOVE(rpc->waitpdu[rpc_hash_xid(xid)], pdu);
+		rpc->waitpdu_len--;
 		if (rpc_process_reply(rpc, pdu, &xdr) != 0) {
 			printf("rpc_procdess_reply failed\n");
 		}
@@ -24,7 +24,6 @@
 #include <time.h>
 #include <rpc/xdr.h>
 #include <arpa/inet.h>
-#include <sys/ioctl.h>
 #include "nfs.h"
 #include "libnfs-raw.h"
 #include "libnfs-private.h"
@@ -89,77 +88,107 @@ static int rpc_write_to_socket(struct rpc_context *rpc)
 			struct rpc_pdu *pdu = rpc->outqueue;
 
 	       	    	DLIST_REMOVE(rpc->outqueue, pdu);
-			DLIST_ADD_END(rpc->waitpdu, pdu, NULL);
+			rpc->outqueue_len--;
+			DLIST_ADD_END(rpc->waitpdu[rpc_hash_xid(pdu->xid)], pdu, NULL);
+			rpc->waitpdu_len++;
 		}
 	}
 	return 0;
 }
 
-static int rpc_read_from_socket(struct rpc_context *rpc)
+/* Make room for at least "need" more bytes after the data we already have.
+ * Only the (partial) pdu we're part way through is ever moved. */
+static int rpc_make_room(struct rpc_context *rpc, size_t need)
 {
-	int available;
-	int size;
-	unsigned char *buf;
-	ssize_t count;
+	char *buf;
+	size_t size;
 
-	if (ioctl(rpc->fd, FIONREAD, &available) != 0) {
-		rpc_set_error(rpc, "Ioctl FIONREAD returned error : %d. Closing socket.", errno);
-		return -1;
+	if (rpc->inpos > 0 && rpc->inbuflen - rpc->insize < need) {
+		memmove(rpc->inbuf, rpc->inbuf + rpc->inpos, rpc->insize - rpc->inpos);
+		rpc->insize -= rpc->inpos;
+		rpc->inpos   = 0;
 	}
-	if (available == 0) {
-		rpc_set_error(rpc, "Socket has been closed");
-		return -2;
+	if (rpc->inbuflen - rpc->insize >= need) {
+		return 0;
+	}
+
+	size = rpc->inbuflen ? rpc->inbuflen : RPC_INBUF_SIZE;
+	while (size - rpc->insize < need) {
+		size *= 2;
 	}
-	size = rpc->insize - rpc->inpos + available;
-	buf = malloc(size);
+	buf = realloc(rpc->inbuf, size);
 	if (buf == NULL) {
-		rpc_set_error(rpc, "Out of memory: failed to allocate %d bytes for input buffer. Closing socket.", size);
-		return -3;
+		rpc_set_error(rpc, "Out of memory: failed to allocate %zu bytes for input buffer. Closing socket.", size);
+		return -1;
 	}
-	if (rpc->insize > rpc->inpos) {
-		memcpy(buf, rpc->inbuf + rpc->inpos, rpc->insize - rpc->inpos);
-		rpc->insize -= rpc->inpos;
-		rpc->inpos   = 0;
+	rpc->inbuf    = buf;
+	rpc->inbuflen = size;
+	return 0;
+}
+
+static int rpc_read_from_socket(struct rpc_context *rpc)
+{
+	ssize_t count;
+	int need;
+
+	/* If we know how big the pdu we're reading is, make room for all
+	 * of it so it arrives in one piece. */
+	need = 4;
+	if (rpc->insize - rpc->inpos >= 4) {
+		need = rpc_get_pdu_size(rpc->inbuf + rpc->inpos);
+		if (need < 0) {
+			rpc_set_error(rpc, "Invalid/garbage pdu received from server. Closing socket");
+			return -5;
+		}
+		/* don't let the server make us allocate whatever it likes */
+		if (need > RPC_MAX_PDU_SIZE) {
+			rpc_set_error(rpc, "Oversized pdu (%d bytes) received from server. Closing socket", need);
+			return -5;
+		}
+		need -= rpc->insize - rpc->inpos;
+	}
+	if (rpc_make_room(rpc, need) != 0) {
+		return -3;
 	}
 
-	count = read(rpc->fd, buf + rpc->insize, available);
+	count = read(rpc->fd, rpc->inbuf + rpc->insize, rpc->inbuflen - rpc->insize);
 	if (count == -1) {
-		if (errno == EINTR) {
-			free(buf);
-			buf = NULL;
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
 			return 0;
 		}
 		rpc_set_error(rpc, "Read from socket failed, errno:%d. Closing socket.", errno);
-		free(buf);
-		buf = NULL;
 		return -4;
 	}
-
-	if (rpc->inbuf != NULL) {
-		free(rpc->inbuf);
+	if (count == 0) {
+		rpc_set_error(rpc, "Socket has been closed");
+		return -2;
 	}
-	rpc->inbuf   = (char *)buf;
 	rpc->insize += count;
 
-	while (1) {
-		if (rpc->insize - rpc->inpos < 4) {
-			return 0;
-		}
+	/* Replies are decoded straight out of the buffer. */
+	while (rpc->insize - rpc->inpos >= 4) {
 		count = rpc_get_pdu_size(rpc->inbuf + rpc->inpos);
-		if (rpc->insize + rpc->inpos < count) {
-			return 0;
+		if (count < 0) {
+			rpc_set_error(rpc, "Invalid/garbage pdu received from server. Closing socket");
+			return -5;
+		}
+		if (rpc->insize - rpc->inpos < count) {
+			break;
 		}
 		if (rpc_process_pdu(rpc, rpc->inbuf + rpc->inpos, count) != 0) {
 			rpc_set_error(rpc, "Invalid/garbage pdu received from server. Closing socket");
 			return -5;
 		}
-		rpc->inpos += count;
-		if (rpc->inpos == rpc->insize) {
-			free(rpc->inbuf);
-			rpc->inbuf = NULL;
-			rpc->insize = 0;
-			rpc->inpos = 0;
+		/* the callback may have disconnected us, and with that
+		 * thrown away the rest of the buffer */
+		if (rpc->insize == 0) {
+			return 0;
 		}
+		rpc->inpos += count;
+	}
+	if (rpc->inpos == rpc->insize) {
+		rpc->insize = 0;
+		rpc->inpos  = 0;
 	}
 	return 0;
 }
@@ -293,6 +322,8 @@ int rpc_disconnect(struct rpc_context *rpc, char *error)
 	rpc->fd  = -1;
 
 	rpc->is_connected = 0;
+	rpc->insize = 0;
+	rpc->inpos  = 0;
 
 	rpc_error_all_pdus(rpc, error);
 
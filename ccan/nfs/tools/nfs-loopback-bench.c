@@ -0,0 +1,345 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Measure NFS READ throughput without a real server.
+ * We fork a minimal server on a loopback socket which answers every call
+ * as an NFSv3 READ of the requested size, and keep a number of READs in
+ * flight against it using the raw interface.  With -C, the READs are
+ * spread over several connections the way nfs_set_connections() does,
+ * each to a server process of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <err.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ccan/compiler/compiler.h>
+#include <ccan/nfs/nfs.h>
+#include <ccan/nfs/libnfs-raw.h>
+#include <ccan/nfs/rpc/nfs.h>
+
+struct conn {
+	struct rpc_context *rpc;
+	int outstanding;
+	int is_connected;
+};
+
+struct client {
+	char **bufs;
+	size_t size;
+	int copy;
+	int depth;
+	int outstanding;
+	long long to_send, done_bytes;
+	struct conn *conns;
+	int num_conns;
+	struct nfs_fh3 fh;
+};
+
+/* one READ in flight, and the buffer it goes into */
+struct slot {
+	struct client *client;
+	struct conn *conn;
+	char *buf;
+};
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t count = read(fd, buf, len);
+		if (count <= 0) {
+			return -1;
+		}
+		buf = (char *)buf + count;
+		len -= count;
+	}
+	return 0;
+}
+
+static uint32_t get_word(const char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+/* Answer every call as a successful READ of the requested count. */
+static void serve(int fd, size_t maxsize)
+{
+	char *call = malloc(65536), *data = malloc(maxsize + 3);
+	uint32_t reply[12];
+	struct iovec iov[2];
+
+	memset(data, 'x', maxsize + 3);
+	for (;;) {
+		uint32_t marker, len, pos, count;
+
+		if (read_all(fd, &marker, 4) != 0) {
+			exit(0);
+		}
+		len = ntohl(marker) & 0x7fffffff;
+		if (len > 65536 || read_all(fd, call, len) != 0) {
+			exit(1);
+		}
+
+		/* xid, CALL, rpcvers, prog, vers, proc, then cred and verf */
+		pos = 24;
+		pos += 8 + ((get_word(call + pos + 4) + 3) & ~3);
+		pos += 8 + ((get_word(call + pos + 4) + 3) & ~3);
+		/* READ3args: file handle, offset, count */
+		pos += 4 + ((get_word(call + pos) + 3) & ~3);
+		count = get_word(call + pos + 8);
+		if (count > maxsize) {
+			count = maxsize;
+		}
+
+		iov[0].iov_base = reply;
+		iov[0].iov_len  = sizeof(reply);
+		iov[1].iov_base = data;
+		iov[1].iov_len  = (count + 3) & ~3;
+
+		reply[0]  = htonl(0x80000000 | (sizeof(reply) - 4 + iov[1].iov_len));
+		memcpy(&reply[1], call, 4);	/* xid */
+		reply[2]  = htonl(1);		/* REPLY */
+		reply[3]  = htonl(0);		/* MSG_ACCEPTED */
+		reply[4]  = htonl(0);		/* AUTH_NULL verifier */
+		reply[5]  = htonl(0);
+		reply[6]  = htonl(0);		/* SUCCESS */
+		reply[7]  = htonl(0);		/* NFS3_OK */
+		reply[8]  = htonl(0);		/* no file attributes */
+		reply[9]  = htonl(count);
+		reply[10] = htonl(0);		/* not eof */
+		reply[11] = htonl(count);	/* length of data */
+		if (writev(fd, iov, 2) < 0) {
+			exit(1);
+		}
+	}
+}
+
+static void send_reads(struct client *client);
+
+static void read_cb(struct rpc_context *rpc UNUSED, int status, void *data, void *private_data)
+{
+	struct slot *slot = private_data;
+	struct client *client = slot->client;
+	READ3res *res = data;
+
+	if (status != RPC_STATUS_SUCCESS) {
+		errx(1, "READ failed: %s", status == RPC_STATUS_ERROR ? (char *)data : "cancelled");
+	}
+	if (res->status != NFS3_OK) {
+		errx(1, "READ failed with status %d", res->status);
+	}
+	if (client->copy) {
+		memcpy(slot->buf, res->READ3res_u.resok.data.data_val, res->READ3res_u.resok.count);
+	}
+	client->done_bytes += res->READ3res_u.resok.count;
+	client->bufs[--client->outstanding] = slot->buf;
+	slot->conn->outstanding--;
+	free(slot);
+	send_reads(client);
+}
+
+/* like the library: the connection with the fewest READs outstanding */
+static struct conn *pick_conn(struct client *client)
+{
+	struct conn *best = &client->conns[0];
+	int i;
+
+	for (i = 1; i < client->num_conns; i++) {
+		if (client->conns[i].outstanding < best->outstanding) {
+			best = &client->conns[i];
+		}
+	}
+	return best;
+}
+
+static void send_reads(struct client *client)
+{
+	while (client->to_send > 0 && client->outstanding < client->depth) {
+		struct slot *slot = malloc(sizeof(*slot));
+		int ret;
+
+		slot->client = client;
+		slot->conn   = pick_conn(client);
+		slot->buf    = client->bufs[client->outstanding];
+		if (client->copy) {
+			ret = rpc_nfs_read_async(slot->conn->rpc, read_cb, &client->fh, 0, client->size, slot);
+		} else {
+			ret = rpc_nfs_read_into_async(slot->conn->rpc, read_cb, &client->fh, 0, client->size, slot->buf, slot);
+		}
+		if (ret != 0) {
+			errx(1, "Failed to send READ: %s", rpc_get_error(slot->conn->rpc));
+		}
+		client->outstanding++;
+		slot->conn->outstanding++;
+		client->to_send -= client->size;
+	}
+}
+
+static void connect_cb(struct rpc_context *rpc UNUSED, int status, void *data, void *private_data)
+{
+	struct conn *conn = private_data;
+
+	if (status != RPC_STATUS_SUCCESS) {
+		errx(1, "Connecting: %s", (char *)data);
+	}
+	conn->is_connected = 1;
+}
+
+static int all_connected(struct client *client)
+{
+	int i;
+
+	for (i = 0; i < client->num_conns; i++) {
+		if (!client->conns[i].is_connected) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct client client;
+	struct pollfd *pfds;
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	struct timeval start, stop;
+	char fhdata[32];
+	int depth = 16, mbytes = 1024, lfd, opt, i;
+	double secs;
+
+	memset(&client, 0, sizeof(client));
+	client.size = 1024 * 1024;
+	client.num_conns = 1;
+	while ((opt = getopt(argc, argv, "cC:d:n:s:")) != -1) {
+		switch (opt) {
+		case 'c':
+			client.copy = 1;
+			break;
+		case 'C':
+			client.num_conns = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'n':
+			mbytes = atoi(optarg);
+			break;
+		case 's':
+			client.size = atoi(optarg);
+			break;
+		default:
+			errx(1, "Usage: %s [-c] [-C <connections>] [-d <depth>] [-n <mbytes>] [-s <readsize>]", argv[0]);
+		}
+	}
+	if (depth <= 0 || mbytes <= 0 || client.size <= 0 || client.num_conns <= 0) {
+		errx(1, "depth, mbytes, readsize and connections must be positive");
+	}
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) != 0
+	    || listen(lfd, client.num_conns) != 0
+	    || getsockname(lfd, (struct sockaddr *)&sin, &sinlen) != 0) {
+		err(1, "Setting up loopback server");
+	}
+
+	/* a server process per connection, so the server side is never
+	 * what limits us */
+	for (i = 0; i < client.num_conns; i++) {
+		if (fork() == 0) {
+			int fd = accept(lfd, NULL, NULL);
+			if (fd < 0) {
+				err(1, "accept");
+			}
+			serve(fd, client.size);
+		}
+	}
+	close(lfd);
+
+	client.depth = depth;
+	client.bufs = calloc(depth, sizeof(char *));
+	for (i = 0; i < depth; i++) {
+		client.bufs[i] = malloc(client.size);
+	}
+	memset(fhdata, 0, sizeof(fhdata));
+	client.fh.data.data_len = sizeof(fhdata);
+	client.fh.data.data_val = fhdata;
+	client.to_send = (long long)mbytes * 1024 * 1024;
+
+	client.conns = calloc(client.num_conns, sizeof(struct conn));
+	pfds = calloc(client.num_conns, sizeof(struct pollfd));
+	for (i = 0; i < client.num_conns; i++) {
+		struct conn *conn = &client.conns[i];
+
+		conn->rpc = rpc_init_context();
+		if (rpc_connect_async(conn->rpc, "127.0.0.1", ntohs(sin.sin_port), 0, connect_cb, conn) != 0) {
+			errx(1, "Failed to start connection: %s", rpc_get_error(conn->rpc));
+		}
+	}
+
+	gettimeofday(&start, NULL);
+	for (;;) {
+		if (all_connected(&client) && client.outstanding == 0) {
+			if (client.to_send <= 0) {
+				break;
+			}
+			send_reads(&client);
+		}
+		for (i = 0; i < client.num_conns; i++) {
+			pfds[i].fd = rpc_get_fd(client.conns[i].rpc);
+			pfds[i].events = rpc_which_events(client.conns[i].rpc);
+		}
+		if (poll(pfds, client.num_conns, -1) < 0) {
+			err(1, "poll");
+		}
+		for (i = 0; i < client.num_conns; i++) {
+			struct rpc_context *rpc = client.conns[i].rpc;
+
+			if (pfds[i].revents && rpc_service(rpc, pfds[i].revents) < 0) {
+				errx(1, "rpc_service failed: %s", rpc_get_error(rpc));
+			}
+		}
+	}
+	gettimeofday(&stop, NULL);
+
+	secs = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1000000.0;
+	printf("%lld MB in %.2f secs: %.1f MB/sec (%zu byte READs, %d in flight over %d connection%s%s)\n",
+	       client.done_bytes / (1024 * 1024), secs,
+	       client.done_bytes / (1024 * 1024) / secs, client.size, depth,
+	       client.num_conns, client.num_conns == 1 ? "" : "s",
+	       client.copy ? ", copying" : "");
+
+	/* the servers exit when they see their connection close */
+	for (i = 0; i < client.num_conns; i++) {
+		rpc_destroy_context(client.conns[i].rpc);
+	}
+	while (wait(NULL) > 0) {
+	}
+	return 0;
+}
@@ -34,6 +34,7 @@
 #include "talloc.h"
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -42,12 +43,27 @@
    code that might not cope */
 #define ALWAYS_REALLOC 0
 
+/* build with -DTALLOC_THREADSAFE=1 to use talloc from several threads:
+   each tree must still only be used by one thread at a time, but the
+   trees hanging off the shared null and autofree contexts may be. */
+#ifndef TALLOC_THREADSAFE
+#define TALLOC_THREADSAFE 0
+#endif
+
 
 #define MAX_TALLOC_SIZE 0x7FFFFFFF
-#define TALLOC_MAGIC 0xe814ec70
+#define TALLOC_MAGIC 0xe814ec00
+#define TALLOC_FLAG_MASK 0x7F
 #define TALLOC_FLAG_FREE 0x01
 #define TALLOC_FLAG_LOOP 0x02
 #define TALLOC_FLAG_EXT_ALLOC 0x04
+#define TALLOC_FLAG_POOL 0x08
+/* children of this context may be linked and unlinked by any thread */
+#define TALLOC_FLAG_SHARED 0x10
+/* this chunk is on the child list of a TALLOC_FLAG_SHARED context */
+#define TALLOC_FLAG_IN_SHARED 0x20
+/* name was built by talloc_set_name(), so is unique to this chunk */
+#define TALLOC_FLAG_DYN_NAME 0x40
 #define TALLOC_MAGIC_REFERENCE ((const char *)1)
 
 /* by default we abort when given a bad pointer (such as when talloc_free() is called 
@@ -105,18 +121,33 @@ struct talloc_chunk {
 	const char *name;
 	size_t size;
 	unsigned flags;
+	/* the talloc_pool() this chunk was carved from, if any */
+	struct talloc_chunk *pool;
 };
 
 /* 16 byte alignment seems to keep everyone happy */
 #define TC_HDR_SIZE ((sizeof(struct talloc_chunk)+15)&~15)
 #define TC_PTR_FROM_CHUNK(tc) ((void *)(TC_HDR_SIZE + (char*)tc))
 
+/* A pool is one allocation laid out as [talloc_pool_hdr][chunk][space].
+   Every chunk carved from it, plus the pool chunk itself, holds a
+   count; the memory goes back to tc_free when it drops to zero. */
+struct talloc_pool_hdr {
+	char *next, *end;
+	unsigned int objects;
+};
+
+#define TP_HDR_SIZE ((sizeof(struct talloc_pool_hdr)+15)&~15)
+#define TP_HDR_FROM_CHUNK(tc) \
+	((struct talloc_pool_hdr *)((char *)(tc) - TP_HDR_SIZE))
+#define TP_ROUND(size) (((size)+15)&~(size_t)15)
+
 /* panic if we get a bad magic value */
 static inline struct talloc_chunk *talloc_chunk_from_ptr(const void *ptr)
 {
 	const char *pp = (const char *)ptr;
 	struct talloc_chunk *tc = discard_const_p(struct talloc_chunk, pp - TC_HDR_SIZE);
-	if (unlikely((tc->flags & (TALLOC_FLAG_FREE | ~0xF)) != TALLOC_MAGIC)) { 
+	if (unlikely((tc->flags & (TALLOC_FLAG_FREE | ~TALLOC_FLAG_MASK)) != TALLOC_MAGIC)) { 
 		if (tc->flags & TALLOC_FLAG_FREE) {
 			TALLOC_ABORT("Bad talloc magic value - double free"); 
 		} else {
@@ -153,7 +184,60 @@ do { \
 	if ((p) && ((p) != (list))) (p)->next = (p)->prev = NULL; \
 } while (0)
 
-static int locked;
+#if TALLOC_THREADSAFE
+#if !HAVE_THREAD_LOCAL || !HAVE_BUILTIN_ATOMIC
+#error "TALLOC_THREADSAFE needs __thread and the __atomic builtins"
+#endif
+#define TC_THREAD __thread
+
+/* Guards the child lists of shared contexts.  It is only ever held
+   across a few pointer updates, so spinning beats sleeping. */
+static int shared_locked;
+
+static inline void shared_lock(void)
+{
+	while (__atomic_exchange_n(&shared_locked, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&shared_locked, __ATOMIC_RELAXED));
+}
+
+static inline void shared_unlock(void)
+{
+	__atomic_store_n(&shared_locked, 0, __ATOMIC_RELEASE);
+}
+
+/* swap *pp from old to new, returning false if someone beat us to it */
+static inline bool tc_install(void *pp, void *old, void *new)
+{
+	return __atomic_compare_exchange_n((void **)pp, &old, new, false,
+					   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#else
+#define TC_THREAD
+
+static inline void shared_lock(void)
+{
+}
+
+static inline void shared_unlock(void)
+{
+}
+
+static inline bool tc_install(void *pp, void *old, void *new)
+{
+	*(void **)pp = new;
+	return true;
+}
+#endif
+
+/* does linking or unlinking tc under parent need shared_lock()? */
+static inline bool tc_needs_lock(const struct talloc_chunk *tc,
+				 const struct talloc_chunk *parent)
+{
+	return (tc->flags & TALLOC_FLAG_IN_SHARED)
+		|| (parent && (parent->flags & TALLOC_FLAG_SHARED));
+}
+
+static TC_THREAD int locked;
 static inline void lock(const void *p)
 {
 	if (tc_lock && p) {
@@ -176,6 +260,126 @@ static inline void unlock(void)
 	}
 }
 
+/*
+  per-name accounting, see talloc_enable_stats().  The table is keyed
+  by name pointer, with open addressing; names which are unique to a
+  chunk are folded into one of these buckets.
+*/
+static const char stat_unnamed[] = "UNNAMED";
+static const char stat_reference[] = ".reference";
+static const char stat_string[] = "(string)";
+static const char stat_dyn_name[] = "(dynamic name)";
+
+static bool stats_enabled;
+static struct talloc_stat *stat_table;
+static unsigned int stat_bits, stat_used;
+
+static const char *talloc_stat_key(const struct talloc_chunk *tc)
+{
+	if (unlikely(tc->flags & TALLOC_FLAG_DYN_NAME))
+		return stat_dyn_name;
+	if (tc->name == NULL)
+		return stat_unnamed;
+	if (tc->name == TALLOC_MAGIC_REFERENCE)
+		return stat_reference;
+	/* talloc_strdup() and friends name strings after themselves */
+	if (tc->name == TC_PTR_FROM_CHUNK(tc))
+		return stat_string;
+	return tc->name;
+}
+
+static inline unsigned int stat_hash(const char *key, unsigned int bits)
+{
+	return ((uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+static struct talloc_stat *stat_slot(struct talloc_stat *table,
+				     unsigned int bits, const char *key)
+{
+	unsigned int h = stat_hash(key, bits), mask = (1U << bits) - 1;
+
+	while (table[h].name && table[h].name != key)
+		h = (h + 1) & mask;
+	return &table[h];
+}
+
+/* find a name's counters, adding them if need be; NULL if out of memory */
+static struct talloc_stat *stat_find(const char *key)
+{
+	struct talloc_stat *st;
+
+	if (unlikely((stat_used + 1) * 4 > (3U << stat_bits))) {
+		unsigned int i, bits = stat_bits ? stat_bits + 1 : 6;
+		struct talloc_stat *table = calloc(1U << bits, sizeof(*table));
+
+		if (!table)
+			return NULL;
+		for (i = 0; stat_bits && i < (1U << stat_bits); i++) {
+			if (stat_table[i].name)
+				*stat_slot(table, bits, stat_table[i].name)
+					= stat_table[i];
+		}
+		free(stat_table);
+		stat_table = table;
+		stat_bits = bits;
+	}
+
+	st = stat_slot(stat_table, stat_bits, key);
+	if (!st->name) {
+		st->name = key;
+		stat_used++;
+	}
+	return st;
+}
+
+static void stat_add(const char *key, size_t size, unsigned int allocs)
+{
+	struct talloc_stat *st;
+
+	shared_lock();
+	st = stat_find(key);
+	if (likely(st)) {
+		st->count++;
+		st->bytes += size;
+		st->allocs += allocs;
+		if (st->count > st->peak_count)
+			st->peak_count = st->count;
+		if (st->bytes > st->peak_bytes)
+			st->peak_bytes = st->bytes;
+	}
+	shared_unlock();
+}
+
+static void stat_sub(const char *key, size_t size, unsigned int allocs)
+{
+	struct talloc_stat *st;
+
+	shared_lock();
+	st = stat_table ? stat_slot(stat_table, stat_bits, key) : NULL;
+	/* Chunks allocated before talloc_enable_stats() were never added. */
+	if (likely(st && st->name) && st->count) {
+		st->count--;
+		st->bytes -= size < st->bytes ? size : st->bytes;
+		st->allocs -= allocs;
+	}
+	shared_unlock();
+}
+
+/* tc has been renamed and/or resized: move it between counters */
+static void talloc_stat_move(const struct talloc_chunk *tc,
+			     const char *old_key, size_t old_size)
+{
+	const char *key = talloc_stat_key(tc);
+	/* allocations are credited to the name they are given after
+	   __talloc(), not to UNNAMED */
+	unsigned int allocs = (old_key == stat_unnamed && key != old_key);
+
+	if (key == old_key && tc->size == old_size)
+		return;
+	stat_sub(old_key, old_size, allocs);
+	stat_add(key, tc->size, allocs);
+}
+
 /*
   return the parent chunk of a pointer
 */
@@ -188,6 +392,15 @@ static inline struct talloc_chunk *talloc_parent_chunk(const void *ptr)
 	}
 
 	tc = talloc_chunk_from_ptr(ptr);
+	if (unlikely(tc->flags & TALLOC_FLAG_IN_SHARED)) {
+		struct talloc_chunk *parent;
+
+		shared_lock();
+		while (tc->prev) tc=tc->prev;
+		parent = tc->parent;
+		shared_unlock();
+		return parent;
+	}
 	while (tc->prev) tc=tc->prev;
 
 	return tc->parent;
@@ -241,8 +454,15 @@ static void *init_talloc(struct talloc_chunk *parent,
 	tc->child = NULL;
 	tc->name = NULL;
 	tc->refs = NULL;
+	tc->pool = NULL;
 
 	if (likely(parent)) {
+		bool shared = parent->flags & TALLOC_FLAG_SHARED;
+
+		if (unlikely(shared)) {
+			tc->flags |= TALLOC_FLAG_IN_SHARED;
+			shared_lock();
+		}
 		if (parent->child) {
 			parent->child->parent = NULL;
 			tc->next = parent->child;
@@ -253,19 +473,77 @@ static void *init_talloc(struct talloc_chunk *parent,
 		tc->parent = parent;
 		tc->prev = NULL;
 		parent->child = tc;
+		if (unlikely(shared))
+			shared_unlock();
 	} else {
 		tc->next = tc->prev = tc->parent = NULL;
 	}
 
+	if (unlikely(stats_enabled))
+		stat_add(stat_unnamed, size, 1);
+
 	return TC_PTR_FROM_CHUNK(tc);
 }
 
+/*
+  carve a chunk out of a pool, if there is room.  Returns NULL if the
+  caller should use tc_malloc instead.
+*/
+static struct talloc_chunk *talloc_pool_carve(struct talloc_chunk *pool,
+					      size_t size)
+{
+	struct talloc_pool_hdr *hdr;
+	struct talloc_chunk *tc;
+	size_t chunk_size = TP_ROUND(TC_HDR_SIZE + size);
+
+	/* a freed pool only lingers for its children: don't refill it. */
+	if (unlikely(pool->flags & TALLOC_FLAG_FREE)) {
+		return NULL;
+	}
+
+	hdr = TP_HDR_FROM_CHUNK(pool);
+	if (chunk_size > (size_t)(hdr->end - hdr->next)) {
+		return NULL;
+	}
+
+	tc = (struct talloc_chunk *)hdr->next;
+	hdr->next += chunk_size;
+#if TALLOC_THREADSAFE
+	/* a child stolen into another thread's tree may drop its count */
+	__atomic_add_fetch(&hdr->objects, 1, __ATOMIC_RELAXED);
+#else
+	hdr->objects++;
+#endif
+	return tc;
+}
+
+/*
+  drop one reference to a pool's memory, releasing it on the last one
+*/
+static void talloc_pool_release(struct talloc_chunk *pool)
+{
+	struct talloc_pool_hdr *hdr = TP_HDR_FROM_CHUNK(pool);
+
+#if TALLOC_THREADSAFE
+	/* We can't rewind: the owner may be carving from it right now. */
+	if (__atomic_sub_fetch(&hdr->objects, 1, __ATOMIC_ACQ_REL) == 0)
+		tc_free(hdr);
+#else
+	if (--hdr->objects == 0) {
+		tc_free(hdr);
+	} else if (hdr->objects == 1 && !(pool->flags & TALLOC_FLAG_FREE)) {
+		/* only the pool itself is left: rewind it for reuse. */
+		hdr->next = (char *)pool + TP_ROUND(TC_HDR_SIZE);
+	}
+#endif
+}
+
 /* 
    Allocate a bit of memory as a child of an existing pointer
 */
 static inline void *__talloc(const void *context, size_t size)
 {
-	struct talloc_chunk *tc;
+	struct talloc_chunk *tc, *pool;
 	struct talloc_chunk *parent = NULL;
 	int external = 0;
 
@@ -285,6 +563,16 @@ static inline void *__talloc(const void *context, size_t size)
 			external = 1;
 			goto alloc_done;
 		}
+		/* children of a pool, and their children, share it. */
+		pool = (parent->flags & TALLOC_FLAG_POOL) ? parent : parent->pool;
+		if (unlikely(pool != NULL)) {
+			tc = talloc_pool_carve(pool, size);
+			if (tc) {
+				init_talloc(parent, tc, size, 0);
+				tc->pool = pool;
+				return TC_PTR_FROM_CHUNK(tc);
+			}
+		}
 	}
 
 	tc = (struct talloc_chunk *)tc_malloc(TC_HDR_SIZE+size);
@@ -292,6 +580,58 @@ alloc_done:
 	return init_talloc(parent, tc, size, external);
 }
 
+/*
+  create a pool context: children (and their children) are carved out
+  of a single allocation of size bytes until it runs out.
+*/
+void *talloc_pool(const void *context, size_t size)
+{
+	struct talloc_chunk *tc, *parent = NULL;
+	struct talloc_pool_hdr *hdr;
+	size_t total;
+	void *ptr;
+
+	if (unlikely(context == NULL)) {
+		context = null_context;
+	}
+
+	if (unlikely(size >= MAX_TALLOC_SIZE)) {
+		return NULL;
+	}
+
+	/* children of an external context must come from its allocator,
+	   so there's nothing to carve: hand back a plain context. */
+	if (context
+	    && unlikely(talloc_chunk_from_ptr(context)->flags
+			& TALLOC_FLAG_EXT_ALLOC)) {
+		return talloc_named_const(context, 0, "talloc_pool");
+	}
+
+	total = TP_HDR_SIZE + TP_ROUND(TC_HDR_SIZE) + TP_ROUND(size);
+	hdr = tc_malloc(total);
+	if (unlikely(hdr == NULL)) {
+		return NULL;
+	}
+
+	tc = (struct talloc_chunk *)((char *)hdr + TP_HDR_SIZE);
+	hdr->next = (char *)tc + TP_ROUND(TC_HDR_SIZE);
+	hdr->end = (char *)hdr + total;
+	hdr->objects = 1;
+
+	lock(context);
+	if (likely(context)) {
+		parent = talloc_chunk_from_ptr(context);
+	}
+	ptr = init_talloc(parent, tc, 0, 0);
+	tc->flags |= TALLOC_FLAG_POOL;
+	tc->name = "talloc_pool";
+	if (unlikely(stats_enabled))
+		talloc_stat_move(tc, stat_unnamed, 0);
+	unlock();
+
+	return ptr;
+}
+
 /*
   setup a destructor to be called on free of a pointer
   the destructor should return 0 on success, or -1 on failure.
@@ -334,7 +674,17 @@ static int talloc_reference_destructor(struct talloc_reference_handle *handle)
 static inline void _talloc_set_name_const(const void *ptr, const char *name)
 {
 	struct talloc_chunk *tc = talloc_chunk_from_ptr(ptr);
+
+	if (unlikely(stats_enabled)) {
+		const char *old_key = talloc_stat_key(tc);
+
+		tc->name = name;
+		tc->flags &= ~TALLOC_FLAG_DYN_NAME;
+		talloc_stat_move(tc, old_key, tc->size);
+		return;
+	}
 	tc->name = name;
+	tc->flags &= ~TALLOC_FLAG_DYN_NAME;
 }
 
 /*
@@ -421,6 +771,7 @@ static int _talloc_is_parent(const void *context, const void *ptr)
 static void *__talloc_steal(const void *new_ctx, const void *ptr)
 {
 	struct talloc_chunk *tc, *new_tc;
+	bool shared;
 
 	if (unlikely(!ptr)) {
 		return NULL;
@@ -433,6 +784,10 @@ static void *__talloc_steal(const void *new_ctx, const void *ptr)
 	tc = talloc_chunk_from_ptr(ptr);
 
 	if (unlikely(new_ctx == NULL)) {
+		bool shared = tc_needs_lock(tc, NULL);
+
+		if (unlikely(shared))
+			shared_lock();
 		if (tc->parent) {
 			_TLIST_REMOVE(tc->parent->child, tc);
 			if (tc->parent->child) {
@@ -444,6 +799,9 @@ static void *__talloc_steal(const void *new_ctx, const void *ptr)
 		}
 		
 		tc->parent = tc->next = tc->prev = NULL;
+		tc->flags &= ~TALLOC_FLAG_IN_SHARED;
+		if (unlikely(shared))
+			shared_unlock();
 		return discard_const_p(void, ptr);
 	}
 
@@ -453,6 +811,10 @@ static void *__talloc_steal(const void *new_ctx, const void *ptr)
 		return discard_const_p(void, ptr);
 	}
 
+	shared = tc_needs_lock(tc, new_tc);
+	if (unlikely(shared))
+		shared_lock();
+
 	if (tc->parent) {
 		_TLIST_REMOVE(tc->parent->child, tc);
 		if (tc->parent->child) {
@@ -466,7 +828,13 @@ static void *__talloc_steal(const void *new_ctx, const void *ptr)
 	tc->parent = new_tc;
 	if (new_tc->child) new_tc->child->parent = NULL;
 	_TLIST_ADD(new_tc->child, tc);
+	if (new_tc->flags & TALLOC_FLAG_SHARED)
+		tc->flags |= TALLOC_FLAG_IN_SHARED;
+	else
+		tc->flags &= ~TALLOC_FLAG_IN_SHARED;
 
+	if (unlikely(shared))
+		shared_unlock();
 	return discard_const_p(void, ptr);
 }
 
@@ -477,6 +845,7 @@ static inline int _talloc_free(const void *ptr)
 {
 	struct talloc_chunk *tc;
 	void *oldparent = NULL;
+	bool shared;
 
 	if (unlikely(ptr == NULL)) {
 		return -1;
@@ -522,6 +891,9 @@ static inline int _talloc_free(const void *ptr)
 	if (unlikely(tc->flags & TALLOC_FLAG_EXT_ALLOC))
 		oldparent = talloc_parent_nolock(ptr);
 
+	shared = tc_needs_lock(tc, NULL);
+	if (unlikely(shared))
+		shared_lock();
 	if (tc->parent) {
 		_TLIST_REMOVE(tc->parent->child, tc);
 		if (tc->parent->child) {
@@ -531,6 +903,8 @@ static inline int _talloc_free(const void *ptr)
 		if (tc->prev) tc->prev->next = tc->next;
 		if (tc->next) tc->next->prev = tc->prev;
 	}
+	if (unlikely(shared))
+		shared_unlock();
 
 	tc->flags |= TALLOC_FLAG_LOOP;
 
@@ -570,10 +944,17 @@ static inline int _talloc_free(const void *ptr)
 		}
 	}
 
+	if (unlikely(stats_enabled))
+		stat_sub(talloc_stat_key(tc), tc->size, 0);
+
 	tc->flags |= TALLOC_FLAG_FREE;
 
 	if (unlikely(tc->flags & TALLOC_FLAG_EXT_ALLOC))
 		tc_external_realloc(oldparent, tc, 0);
+	else if (unlikely(tc->flags & TALLOC_FLAG_POOL))
+		talloc_pool_release(tc);
+	else if (tc->pool)
+		talloc_pool_release(tc->pool);
 	else
 		tc_free(tc);
 
@@ -688,10 +1069,16 @@ static inline const char *talloc_set_name_v(const void *ptr, const char *fmt, va
 static inline const char *talloc_set_name_v(const void *ptr, const char *fmt, va_list ap)
 {
 	struct talloc_chunk *tc = talloc_chunk_from_ptr(ptr);
+	const char *old_key = talloc_stat_key(tc);
+
 	tc->name = talloc_vasprintf(ptr, fmt, ap);
+	tc->flags &= ~TALLOC_FLAG_DYN_NAME;
 	if (likely(tc->name)) {
 		_talloc_set_name_const(tc->name, ".name");
+		tc->flags |= TALLOC_FLAG_DYN_NAME;
 	}
+	if (unlikely(stats_enabled))
+		talloc_stat_move(tc, old_key, tc->size);
 	return tc->name;
 }
 
@@ -893,6 +1280,9 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 {
 	struct talloc_chunk *tc;
 	void *new_ptr;
+	bool shared;
+	const char *old_key;
+	size_t old_size;
 
 	/* size zero is equivalent to free() */
 	if (unlikely(size == 0)) {
@@ -911,18 +1301,52 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 
 	tc = talloc_chunk_from_ptr(ptr);
 
-	/* don't allow realloc on referenced pointers */
-	if (unlikely(tc->refs)) {
+	/* don't allow realloc on referenced pointers, nor move a pool */
+	if (unlikely(tc->refs || (tc->flags & TALLOC_FLAG_POOL))) {
 		return NULL;
 	}
 
+	/* Other threads can follow links to a shared chunk (or into its
+	   child list) at any time, so they must not see it half-moved:
+	   hold shared_lock from the copy until everything is relinked. */
+	shared = tc->flags & (TALLOC_FLAG_SHARED|TALLOC_FLAG_IN_SHARED);
+
 	lock(ptr);
-	if (unlikely(tc->flags & TALLOC_FLAG_EXT_ALLOC)) {
+	old_key = talloc_stat_key(tc);
+	old_size = tc->size;
+	if (unlikely(tc->pool)) {
+		struct talloc_chunk *pool = tc->pool;
+
+		/* pool memory can't be resized: shrink in place, or
+		   move out into a malloc'd chunk of our own. */
+		if (size <= tc->size) {
+			tc->size = size;
+			tc->name = name;
+			tc->flags &= ~TALLOC_FLAG_DYN_NAME;
+			if (unlikely(stats_enabled))
+				talloc_stat_move(tc, old_key, old_size);
+			unlock();
+			return ptr;
+		}
+		if (unlikely(shared))
+			shared_lock();
+		tc->flags |= TALLOC_FLAG_FREE;
+		new_ptr = tc_malloc(size + TC_HDR_SIZE);
+		if (new_ptr) {
+			memcpy(new_ptr, tc, tc->size + TC_HDR_SIZE);
+			((struct talloc_chunk *)new_ptr)->pool = NULL;
+			talloc_pool_release(pool);
+		}
+	} else if (unlikely(tc->flags & TALLOC_FLAG_EXT_ALLOC)) {
 		/* need to get parent before setting free flag. */
 		void *parent = talloc_parent_nolock(ptr);
+		if (unlikely(shared))
+			shared_lock();
 		tc->flags |= TALLOC_FLAG_FREE;
 		new_ptr = tc_external_realloc(parent, tc, size + TC_HDR_SIZE);
 	} else {
+		if (unlikely(shared))
+			shared_lock();
 		/* by resetting magic we catch users of the old memory */
 		tc->flags |= TALLOC_FLAG_FREE;
 
@@ -939,6 +1363,8 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 
 	if (unlikely(!new_ptr)) {	
 		tc->flags &= ~TALLOC_FLAG_FREE; 
+		if (unlikely(shared))
+			shared_unlock();
 		unlock();
 		return NULL; 
 	}
@@ -958,9 +1384,14 @@ void *_talloc_realloc(const void *context, void *ptr, size_t size, const char *n
 	if (tc->next) {
 		tc->next->prev = tc;
 	}
+	if (unlikely(shared))
+		shared_unlock();
 
 	tc->size = size;
-	_talloc_set_name_const(TC_PTR_FROM_CHUNK(tc), name);
+	tc->name = name;
+	tc->flags &= ~TALLOC_FLAG_DYN_NAME;
+	if (unlikely(stats_enabled))
+		talloc_stat_move(tc, old_key, old_size);
 	unlock();
 
 	return TC_PTR_FROM_CHUNK(tc);
@@ -1229,6 +1660,7 @@ void talloc_enable_null_tracking(void)
 {
 	if (null_context == NULL) {
 		null_context = _talloc_named_const(NULL, 0, "null_context");
+		talloc_chunk_from_ptr(null_context)->flags |= TALLOC_FLAG_SHARED;
 	}
 }
 
@@ -1241,6 +1673,46 @@ void talloc_disable_null_tracking(void)
 	null_context = NULL;
 }
 
+/*
+  start per-name accounting
+*/
+void talloc_enable_stats(void)
+{
+	stats_enabled = true;
+}
+
+/*
+  stop per-name accounting, and forget the counters
+*/
+void talloc_disable_stats(void)
+{
+	shared_lock();
+	stats_enabled = false;
+	free(stat_table);
+	stat_table = NULL;
+	stat_bits = stat_used = 0;
+	shared_unlock();
+}
+
+/*
+  copy out up to num per-name counters, returning how many names there are
+*/
+size_t talloc_get_stats(struct talloc_stat *stats, size_t num)
+{
+	size_t i, n = 0;
+
+	shared_lock();
+	for (i = 0; stat_bits && i < (1U << stat_bits); i++) {
+		if (!stat_table[i].name)
+			continue;
+		if (n < num)
+			stats[n] = stat_table[i];
+		n++;
+	}
+	shared_unlock();
+	return n;
+}
+
 /*
   enable leak reporting on exit
 */
@@ -1532,12 +2004,20 @@ static void talloc_autofree(void)
 */
 void *talloc_autofree_context(void)
 {
-	if (autofree_context == NULL || *autofree_context != getpid()) {
-		autofree_context = talloc(NULL, pid_t);
-		*autofree_context = getpid();
-		talloc_set_name_const(autofree_context, "autofree_context");
-		
-		talloc_set_destructor(autofree_context, talloc_autofree_destructor);
+	pid_t *old = autofree_context, *ctx;
+
+	if (old == NULL || *old != getpid()) {
+		ctx = talloc(NULL, pid_t);
+		*ctx = getpid();
+		talloc_set_name_const(ctx, "autofree_context");
+		talloc_chunk_from_ptr(ctx)->flags |= TALLOC_FLAG_SHARED;
+
+		/* another thread may have got there first */
+		if (!tc_install(&autofree_context, old, ctx)) {
+			talloc_free(ctx);
+			return autofree_context;
+		}
+		talloc_set_destructor(ctx, talloc_autofree_destructor);
 		atexit(talloc_autofree);
 	}
 	return autofree_context;
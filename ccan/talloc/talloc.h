@@ -449,6 +449,47 @@ void talloc_report(const void *ptr, FILE *f);
  */
 #define talloc_new(ctx) talloc_named_const(ctx, 0, "talloc_new: " __location__)
 
+/**
+ * talloc_pool - create a context which children are carved out of
+ * @ctx: the context to use as a parent.
+ * @size: the number of bytes of children to reserve.
+ *
+ * This makes a single allocation of roughly @size bytes (plus the talloc
+ * headers).  Children of the returned context, and their children in turn,
+ * are handed out from it until it is exhausted, after which they fall back
+ * to the normal allocator.  This turns the hundreds of malloc/free calls of
+ * a large short-lived tree into one.
+ *
+ * Children freed individually do not return their space to the pool (unless
+ * they were the last), and the memory is only released once the pool and
+ * every child carved from it have been freed: a child talloc_steal()ed
+ * elsewhere keeps the whole pool allocation alive.  Destructors are called
+ * exactly as for any other context.  A pool cannot be talloc_realloc()ed,
+ * and growing a child moves it out of the pool.  Under a context from
+ * talloc_add_external() everything must come from the external allocator,
+ * so this returns an ordinary empty context instead.
+ *
+ * Example:
+ *	struct request {
+ *		char *path;
+ *		char **args;
+ *	};
+ *
+ *	static struct request *new_request(const void *ctx, const char *path)
+ *	{
+ *		void *pool = talloc_pool(ctx, 4096);
+ *		struct request *req;
+ *
+ *		if (!pool)
+ *			return NULL;
+ *		req = talloc(pool, struct request);
+ *		req->path = talloc_strdup(req, path);
+ *		req->args = talloc_array(req, char *, 8);
+ *		return req;
+ *	}
+ */
+void *talloc_pool(const void *ctx, size_t size);
+
 /**
  * talloc_zero_size -  allocate a particular size of zeroed memory
  *
@@ -874,6 +915,72 @@ void talloc_enable_null_tracking(void);
  */
 void talloc_disable_null_tracking(void);
 
+/**
+ * struct talloc_stat - accounting for one name
+ * @name: the name (talloc_set_name_const() or the type for talloc())
+ * @count: number of live allocations with this name
+ * @bytes: bytes in those allocations, excluding talloc headers
+ * @peak_count: the highest @count has been
+ * @peak_bytes: the highest @bytes has been
+ * @allocs: total allocations ever made with this name
+ *
+ * Names are compared by pointer, so identical names from different source
+ * files usually (but not always) share counters.  Names which are unique to
+ * an allocation are grouped: "(string)" for talloc_strdup() and friends,
+ * "(dynamic name)" for talloc_set_name() and talloc_named(), "UNNAMED" and
+ * ".reference".
+ */
+struct talloc_stat {
+	const char *name;
+	size_t count, bytes;
+	size_t peak_count, peak_bytes;
+	size_t allocs;
+};
+
+/**
+ * talloc_enable_stats - keep per-name allocation counters
+ *
+ * From now on, every allocation, free, rename and resize updates a small
+ * table of struct talloc_stat, one per name.  Unlike talloc_report() this
+ * never walks the tree, so it is cheap enough to leave on in production and
+ * read with talloc_get_stats() every few seconds.
+ *
+ * Allocations made before this is called are not counted, so enable it
+ * early.
+ */
+void talloc_enable_stats(void);
+
+/**
+ * talloc_disable_stats - stop keeping per-name counters
+ *
+ * This also discards the counters gathered so far.
+ */
+void talloc_disable_stats(void);
+
+/**
+ * talloc_get_stats - read the per-name counters
+ * @stats: the array to fill
+ * @num: the number of entries in @stats
+ *
+ * Copies up to @num counters into @stats (in no particular order), and
+ * returns the number of names there are: if that is more than @num, call
+ * again with a larger array.  This takes time proportional to the number
+ * of names, not the number of allocations.
+ *
+ * Example:
+ *	static void print_stats(FILE *f)
+ *	{
+ *		struct talloc_stat st[100];
+ *		size_t i, n = talloc_get_stats(st, 100);
+ *
+ *		for (i = 0; i < n && i < 100; i++)
+ *			fprintf(f, "%s: %zu bytes in %zu (peak %zu in %zu)\n",
+ *				st[i].name, st[i].bytes, st[i].count,
+ *				st[i].peak_bytes, st[i].peak_count);
+ *	}
+ */
+size_t talloc_get_stats(struct talloc_stat *stats, size_t num);
+
 /**
  * talloc_enable_leak_report - call talloc_report on program exit
  *
@@ -0,0 +1,126 @@
+#include <ccan/talloc/talloc.c>
+#include <ccan/tap/tap.h>
+
+struct foo {
+	int x, y;
+};
+
+static struct talloc_stat *find_stat(struct talloc_stat *st, size_t n,
+				     const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (strcmp(st[i].name, name) == 0)
+			return &st[i];
+	return NULL;
+}
+
+static struct talloc_stat *get(const char *name)
+{
+	static struct talloc_stat st[100];
+	size_t n = talloc_get_stats(st, 100);
+
+	return find_stat(st, n < 100 ? n : 100, name);
+}
+
+int main(void)
+{
+	struct talloc_stat *s;
+	struct foo *foo[10];
+	void *ctx, *pool;
+	char *str;
+	int *arr;
+	unsigned int i;
+
+	plan_tests(29);
+
+	/* Not counted: allocated before stats were enabled. */
+	ctx = talloc_named_const(NULL, 0, "ctx");
+	talloc_enable_stats();
+	ok1(talloc_get_stats(NULL, 0) == 0);
+
+	for (i = 0; i < 10; i++)
+		foo[i] = talloc(ctx, struct foo);
+	s = get("struct foo");
+	ok1(s && s->count == 10 && s->allocs == 10);
+	ok1(s && s->bytes == 10 * sizeof(struct foo));
+	for (i = 0; i < 5; i++)
+		talloc_free(foo[i]);
+	s = get("struct foo");
+	ok1(s && s->count == 5 && s->peak_count == 10);
+	ok1(s && s->bytes == 5 * sizeof(struct foo));
+	ok1(s && s->peak_bytes == 10 * sizeof(struct foo));
+	ok1(s && s->allocs == 10);
+
+	/* Everything gets named straight away. */
+	s = get("UNNAMED");
+	ok1(s && s->count == 0 && s->allocs == 0);
+
+	/* Strings are named after themselves: they're grouped. */
+	str = talloc_strdup(ctx, "hello");
+	talloc_strdup(ctx, "world!");
+	s = get("(string)");
+	ok1(s && s->count == 2 && s->bytes == 6 + 7);
+	/* ... and that survives them moving. */
+	str = talloc_append_string(str, " there");
+	s = get("(string)");
+	ok1(s && s->count == 2 && s->bytes == 12 + 7);
+	talloc_free(str);
+	s = get("(string)");
+	ok1(s && s->count == 1 && s->bytes == 7);
+
+	/* Dynamic names are grouped, and their name string is counted. */
+	talloc_set_name(foo[5], "foo %u", 5);
+	s = get("struct foo");
+	ok1(s && s->count == 4);
+	s = get("(dynamic name)");
+	ok1(s && s->count == 1 && s->bytes == sizeof(struct foo));
+	s = get(".name");
+	ok1(s && s->count == 1 && s->bytes == strlen("foo 5") + 1);
+	talloc_free(foo[5]);
+	s = get("(dynamic name)");
+	ok1(s && s->count == 0);
+	s = get(".name");
+	ok1(s && s->count == 0);
+
+	/* Resizing moves the bytes. */
+	arr = talloc_array(ctx, int, 10);
+	s = get("int");
+	ok1(s && s->count == 1 && s->bytes == 10 * sizeof(int));
+	arr = talloc_realloc(ctx, arr, int, 100);
+	s = get("int");
+	ok1(s && s->count == 1 && s->bytes == 100 * sizeof(int));
+	ok1(s && s->allocs == 1);
+	arr = talloc_realloc(ctx, arr, int, 1);
+	s = get("int");
+	ok1(s && s->bytes == sizeof(int) && s->peak_bytes == 100 * sizeof(int));
+
+	/* Pools and their children are counted too. */
+	pool = talloc_pool(ctx, 1024);
+	arr = talloc_array(pool, int, 10);
+	s = get("talloc_pool");
+	ok1(s && s->count == 1);
+	s = get("int");
+	ok1(s && s->count == 2 && s->bytes == 11 * sizeof(int));
+	arr = talloc_realloc(NULL, arr, int, 5);
+	s = get("int");
+	ok1(s && s->count == 2 && s->bytes == 6 * sizeof(int));
+
+	/* Freeing the lot zeroes everything. */
+	talloc_free(ctx);
+	s = get("struct foo");
+	ok1(s && s->count == 0 && s->bytes == 0);
+	s = get("int");
+	ok1(s && s->count == 0 && s->bytes == 0);
+	s = get("talloc_pool");
+	ok1(s && s->count == 0);
+	s = get("(string)");
+	ok1(s && s->count == 0 && s->bytes == 0);
+	ok1(get("ctx") == NULL);
+
+	talloc_disable_stats();
+	ok1(talloc_get_stats(NULL, 0) == 0);
+
+	return exit_status();
+}
@@ -0,0 +1,106 @@
+#include <ccan/talloc/talloc.c>
+#include <ccan/tap/tap.h>
+#include <assert.h>
+
+static int malloc_count, free_count, destructor_count, ext_count;
+
+static void *count_malloc(size_t size)
+{
+	malloc_count++;
+	return malloc(size);
+}
+
+static void count_free(void *ptr)
+{
+	free_count++;
+	free(ptr);
+}
+
+static void *ext_realloc(const void *parent, void *ptr, size_t size)
+{
+	ext_count++;
+	return realloc(ptr, size);
+}
+
+static int count_destructor(char *p)
+{
+	destructor_count++;
+	return 0;
+}
+
+int main(void)
+{
+	void *pool, *root, *ext;
+	char *p[100], *q, *big;
+	unsigned int i;
+
+	plan_tests(24);
+	talloc_set_allocator(count_malloc, count_free, realloc);
+
+	root = talloc_new(NULL);
+	malloc_count = free_count = 0;
+
+	/* Children, and grandchildren, come out of one allocation. */
+	pool = talloc_pool(root, 100 * 128);
+	ok1(pool);
+	ok1(malloc_count == 1);
+	for (i = 0; i < 100; i++) {
+		p[i] = talloc_array(i ? p[i-1] : pool, char, 10);
+		memset(p[i], i, 10);
+	}
+	ok1(malloc_count == 1);
+	ok1(talloc_parent(p[0]) == pool);
+	ok1(talloc_parent(p[99]) == p[98]);
+	ok1(talloc_total_blocks(pool) == 101);
+
+	/* Once exhausted, we fall back to malloc. */
+	big = talloc_array(pool, char, 100000);
+	ok1(big);
+	ok1(malloc_count == 2);
+	talloc_free(big);
+	ok1(free_count == 1);
+
+	/* Freeing a child doesn't free anything. */
+	talloc_set_destructor(p[99], count_destructor);
+	talloc_free(p[99]);
+	ok1(destructor_count == 1);
+	ok1(free_count == 1);
+
+	/* Growing a child moves it out of the pool; shrinking doesn't. */
+	q = talloc_realloc(NULL, p[98], char, 5);
+	ok1(q == p[98]);
+	q = talloc_realloc(NULL, p[98], char, 1000);
+	ok1(q && malloc_count == 3);
+	p[98] = q;
+	ok1(p[98][4] == 98);
+
+	/* Can't resize the pool itself. */
+	ok1(talloc_realloc_size(NULL, pool, 10) == NULL);
+
+	/* A stolen child keeps the pool memory alive. */
+	q = talloc_steal(root, p[50]);
+	talloc_set_destructor(p[40], count_destructor);
+	talloc_free(pool);
+	ok1(destructor_count == 2);
+	ok1(free_count == 1);
+	ok1(p[50][9] == 50);
+	/* ... so we can still allocate off it, just not from the pool. */
+	ok1(talloc_strdup(p[50], "hello") != NULL && malloc_count == 4);
+
+	/* Freeing it releases everything (root itself was counted out). */
+	talloc_free(root);
+	ok1(free_count == malloc_count + 1);
+
+	/* External contexts get a plain context, from their allocator. */
+	ext = talloc_add_external(NULL, ext_realloc, NULL, NULL);
+	malloc_count = ext_count = 0;
+	pool = talloc_pool(ext, 4096);
+	ok1(pool && ext_count == 1 && malloc_count == 0);
+	ok1(!(talloc_chunk_from_ptr(pool)->flags & TALLOC_FLAG_POOL));
+	q = talloc_strdup(pool, "hello");
+	ok1(q && ext_count == 2 && malloc_count == 0);
+	talloc_free(ext);
+	ok1(ext_count == 5 && malloc_count == 0);
+
+	return exit_status();
+}
@@ -0,0 +1,85 @@
+#define TALLOC_THREADSAFE 1
+#include <ccan/talloc/talloc.c>
+#include <ccan/tap/tap.h>
+#include <pthread.h>
+
+#define NUM_THREADS 4
+#define NUM_LOOPS 20000
+
+static void *autofree;
+
+/* Each thread has its own tree, but they all hang off (and steal into)
+ * the shared null and autofree contexts. */
+static void *worker(void *arg)
+{
+	unsigned int i, kept = 0;
+	void *keep = talloc_new(autofree);
+
+	for (i = 0; i < NUM_LOOPS; i++) {
+		char *top = talloc_array(NULL, char, 16);
+		char *child = talloc_strdup(top, "child");
+
+		talloc_asprintf(child, "%u", i);
+		if (i % 4 == 0) {
+			talloc_steal(autofree, child);
+			talloc_free(child);
+		} else if (i % 4 == 1) {
+			talloc_steal(keep, child);
+			kept++;
+		}
+		if (talloc_parent(top) != null_context)
+			return NULL;
+		talloc_free(top);
+	}
+
+	if (talloc_total_blocks(keep) != 1 + kept * 2)
+		return NULL;
+	talloc_free(keep);
+	return arg;
+}
+
+/* Meanwhile, these keep moving their chunks around on autofree's list. */
+static void *reallocer(void *arg)
+{
+	unsigned int i;
+	char *p = talloc_array(autofree, char, 1);
+
+	for (i = 0; i < NUM_LOOPS; i++) {
+		p = talloc_realloc(NULL, p, char, 1 + (i * 37) % 4096);
+		if (!p || talloc_parent(p) != autofree)
+			return NULL;
+		p[0] = i;
+	}
+	talloc_free(p);
+	return arg;
+}
+
+int main(void)
+{
+	pthread_t threads[NUM_THREADS], reallocers[NUM_THREADS];
+	unsigned int i, ids[NUM_THREADS], rids[NUM_THREADS];
+	void *ret;
+
+	plan_tests(NUM_THREADS * 2 + 3);
+
+	talloc_enable_null_tracking();
+	autofree = talloc_autofree_context();
+	ok1(talloc_parent(autofree) == null_context);
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_create(&threads[i], NULL, worker, &ids[i]);
+		pthread_create(&reallocers[i], NULL, reallocer, &rids[i]);
+	}
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_join(threads[i], &ret);
+		ok1(ret == &ids[i]);
+		pthread_join(reallocers[i], &ret);
+		ok1(ret == &rids[i]);
+	}
+
+	/* Everything was freed or handed back. */
+	ok1(talloc_total_blocks(autofree) == 1);
+	ok1(talloc_total_blocks(null_context) == 2);
+
+	return exit_status();
+}
@@ -0,0 +1,82 @@
+/* Allocations per second with several threads each building and freeing
+ * their own talloc trees.  With -n the trees hang off the tracked null
+ * context, so every top-level allocation touches shared state: only use
+ * that with mtbench-threadsafe. */
+#include <ccan/talloc/talloc.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+static unsigned int trees = 10000, nodes = 100;
+
+static double timeval_diff(const struct timeval *start,
+			   const struct timeval *stop)
+{
+	return (stop->tv_sec - start->tv_sec)
+		+ (stop->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void *build_trees(void *arg)
+{
+	void **node = malloc(sizeof(*node) * nodes);
+	unsigned int i, j;
+
+	for (i = 0; i < trees; i++) {
+		node[0] = talloc_new(NULL);
+		/* Each node has up to four children. */
+		for (j = 1; j < nodes; j++)
+			node[j] = talloc_size(node[(j - 1) / 4], 16 + j % 64);
+		talloc_free(node[0]);
+	}
+	free(node);
+	return arg;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int max_threads = 4, i, n;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "nt:")) != -1) {
+		switch (opt) {
+		case 'n':
+			talloc_enable_null_tracking();
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		default:
+			errx(1, "Usage: mtbench [-n] [-t <maxthreads>] [<trees> [<nodes>]]");
+		}
+	}
+	if (optind < argc)
+		trees = atoi(argv[optind++]);
+	if (optind < argc)
+		nodes = atoi(argv[optind++]);
+	if (!max_threads || !trees || !nodes)
+		errx(1, "Need at least one thread, tree and node");
+
+	for (n = 1; n <= max_threads; n *= 2) {
+		pthread_t *threads = malloc(sizeof(*threads) * n);
+		struct timeval start, stop;
+		double secs;
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < n; i++)
+			if (pthread_create(&threads[i], NULL, build_trees, NULL))
+				err(1, "Creating thread");
+		for (i = 0; i < n; i++)
+			pthread_join(threads[i], NULL);
+		gettimeofday(&stop, NULL);
+
+		secs = timeval_diff(&start, &stop);
+		printf("%u threads: %.0f allocs/sec (%.2f secs)\n",
+		       n, (double)n * trees * nodes / secs, secs);
+		free(threads);
+	}
+	return 0;
+}
@@ -29,6 +29,12 @@ static uint64_t jenkins_hash(const void *key, size_t length, uint64_t seed,
 	return (ret >> 32) | (ret << 32);
 }
 
+uint64_t tdb_fast_hash(const void *key, size_t length, uint64_t seed,
+		       void *unused)
+{
+	return hash64_fast_stable(key, length, seed);
+}
+
 void tdb_hash_init(struct tdb_context *tdb)
 {
 	tdb->khash = jenkins_hash;
@@ -178,6 +178,11 @@ int tdb_transaction_commit(struct tdb_context *tdb);
 
 char *tdb_summary(struct tdb_context *tdb, enum tdb_summary_flags flags);
 
+/* Much faster than the default hash on long keys: hand it to tdb_open()
+ * in a TDB_ATTRIBUTE_HASH.  Databases created with it must always be
+ * opened with it. */
+uint64_t tdb_fast_hash(const void *key, size_t len, uint64_t seed, void *unused);
+
 extern struct tdb_data tdb_null;
 
 #ifdef  __cplusplus
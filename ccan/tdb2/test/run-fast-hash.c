@@ -0,0 +1,69 @@
+#include <ccan/tdb2/tdb.c>
+#include <ccan/tdb2/free.c>
+#include <ccan/tdb2/lock.c>
+#include <ccan/tdb2/io.c>
+#include <ccan/tdb2/hash.c>
+#include <ccan/tdb2/check.c>
+#include <ccan/tdb2/transaction.c>
+#include <ccan/tap/tap.h>
+#include "logging.h"
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, j;
+	struct tdb_context *tdb;
+	union tdb_attribute attr;
+	int flags[] = { TDB_INTERNAL, TDB_DEFAULT, TDB_NOMMAP,
+			TDB_INTERNAL|TDB_CONVERT, TDB_CONVERT, 
+			TDB_NOMMAP|TDB_CONVERT };
+	struct tdb_data key = { (unsigned char *)&j, sizeof(j) };
+	struct tdb_data data = { (unsigned char *)&j, sizeof(j) };
+
+	attr.hash.base.attr = TDB_ATTRIBUTE_HASH;
+	attr.hash.base.next = &tap_log_attr;
+	attr.hash.hash_fn = tdb_fast_hash;
+	attr.hash.hash_private = NULL;
+
+	plan_tests(sizeof(flags) / sizeof(flags[0]) * 3 + 4 * 4);
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		tdb = tdb_open("run-fast-hash.tdb", flags[i],
+			       O_RDWR|O_CREAT|O_TRUNC, 0600, &attr);
+		ok1(tdb);
+		if (!tdb)
+			continue;
+
+		for (j = 0; j < 1000; j++)
+			if (tdb_store(tdb, key, data, TDB_INSERT) != 0)
+				break;
+		ok1(j == 1000);
+		ok1(tdb_check(tdb, NULL, NULL) == 0);
+		tdb_close(tdb);
+
+		if (flags[i] & TDB_INTERNAL)
+			continue;
+
+		/* Reopening with the same hash finds everything. */
+		tdb = tdb_open("run-fast-hash.tdb", flags[i], O_RDWR, 0600,
+			       &attr);
+		ok1(tdb);
+		if (!tdb)
+			continue;
+		for (j = 0; j < 1000; j++) {
+			struct tdb_data d = tdb_fetch(tdb, key);
+			if (d.dsize != sizeof(j)
+			    || memcmp(d.dptr, &j, sizeof(j)) != 0)
+				break;
+			free(d.dptr);
+		}
+		ok1(j == 1000);
+		tdb_close(tdb);
+
+		/* Opening with the default hash fails. */
+		tap_log_messages = 0;
+		tdb = tdb_open("run-fast-hash.tdb", flags[i], O_RDWR, 0600,
+			       &tap_log_attr);
+		ok1(!tdb);
+		ok1(tap_log_messages == 1);
+	}
+	return exit_status();
+}
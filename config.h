@@ -12,11 +12,13 @@
 #define HAVE_ATTRIBUTE_USED 1
 #define HAVE_BIG_ENDIAN 0
 #define HAVE_BSWAP_64 1
+#define HAVE_BUILTIN_ATOMIC 1
 #define HAVE_BUILTIN_CHOOSE_EXPR 1
 #define HAVE_BUILTIN_CLZ 1
 #define HAVE_BUILTIN_CLZL 1
 #define HAVE_BUILTIN_CLZLL 1
 #define HAVE_BUILTIN_CONSTANT_P 1
+#define HAVE_BUILTIN_CPU_SUPPORTS 1
 #define HAVE_BUILTIN_EXPECT 1
 #define HAVE_BUILTIN_FFSL 1
 #define HAVE_BUILTIN_FFSLL 1
@@ -28,9 +30,13 @@
 #define HAVE_FLEXIBLE_ARRAY_MEMBER 1
 #define HAVE_GETPAGESIZE 1
 #define HAVE_LITTLE_ENDIAN 1
+#define HAVE_LINUX_FUTEX 1
 #define HAVE_MMAP 1
 #define HAVE_NESTED_FUNCTIONS 1
+#define HAVE_PCLMUL_INTRINSICS 1
+#define HAVE_SSE4_2_INTRINSICS 1
 #define HAVE_STATEMENT_EXPR 1
+#define HAVE_THREAD_LOCAL 1
 #define HAVE_TYPEOF 1
 #define HAVE_UTIME 1
 #define HAVE_WARN_UNUSED_RESULT 1
@@ -60,6 +60,9 @@ static struct test tests[] = {
 	{ "HAVE_BSWAP_64", DEFINES_FUNC, "HAVE_BYTESWAP_H",
 	  "#include <byteswap.h>\n"
 	  "static int func(int x) { return bswap_64(x); }" },
+	{ "HAVE_BUILTIN_ATOMIC", INSIDE_MAIN, NULL,
+	  "int x = argc;\n"
+	  "return __atomic_exchange_n(&x, 0, __ATOMIC_ACQUIRE) == argc ? 0 : 1;" },
 	{ "HAVE_BUILTIN_CHOOSE_EXPR", INSIDE_MAIN, NULL,
 	  "return __builtin_choose_expr(1, 0, \"garbage\");" },
 	{ "HAVE_BUILTIN_CLZ", INSIDE_MAIN, NULL,
@@ -70,6 +73,9 @@ static struct test tests[] = {
 	  "return __builtin_clzll(1) == (sizeof(long long)*8 - 1) ? 0 : 1;" },
 	{ "HAVE_BUILTIN_CONSTANT_P", INSIDE_MAIN, NULL,
 	  "return __builtin_constant_p(1) ? 0 : 1;" },
+	{ "HAVE_BUILTIN_CPU_SUPPORTS", INSIDE_MAIN, NULL,
+	  "__builtin_cpu_init();\n"
+	  "return __builtin_cpu_supports(\"sse4.2\") ? 0 : 0;" },
 	{ "HAVE_BUILTIN_EXPECT", INSIDE_MAIN, NULL,
 	  "return __builtin_expect(argc == 1, 1) ? 0 : 1;" },
 	{ "HAVE_BUILTIN_FFSL", INSIDE_MAIN, NULL,
@@ -97,6 +103,13 @@ static struct test tests[] = {
 	  "union { int i; char c[sizeof(int)]; } u;\n"
 	  "u.i = 0x01020304;\n"
 	  "return u.c[0] == 0x04 && u.c[1] == 0x03 && u.c[2] == 0x02 && u.c[3] == 0x01 ? 0 : 1;" },
+	{ "HAVE_LINUX_FUTEX", DEFINES_FUNC, NULL,
+	  "#include <linux/futex.h>\n"
+	  "#include <sys/syscall.h>\n"
+	  "#include <unistd.h>\n"
+	  "static long func(int *p) {\n"
+	  "	return syscall(SYS_futex, p, FUTEX_WAKE, 1, NULL, NULL, 0);\n"
+	  "}" },
 	{ "HAVE_MMAP", DEFINES_FUNC, NULL,
 	  "#include <sys/mman.h>\n"
 	  "static void *func(int fd) {\n"
@@ -109,8 +122,19 @@ static struct test tests[] = {
 	  "	add(7);\n"
 	  "	return val;\n"
 	  "}" },
+	{ "HAVE_PCLMUL_INTRINSICS", DEFINES_FUNC, NULL,
+	  "#include <wmmintrin.h>\n"
+	  "static __m128i __attribute__((target(\"pclmul\")))\n"
+	  "func(__m128i a) { return _mm_clmulepi64_si128(a, a, 0); }" },
+	{ "HAVE_SSE4_2_INTRINSICS", DEFINES_FUNC, NULL,
+	  "#include <nmmintrin.h>\n"
+	  "static unsigned int __attribute__((target(\"sse4.2\")))\n"
+	  "func(unsigned int crc) { return _mm_crc32_u8(crc, 1); }" },
 	{ "HAVE_STATEMENT_EXPR", INSIDE_MAIN, NULL,
 	  "return ({ int x = argc; x == argc ? 0 : 1; });" },
+	{ "HAVE_THREAD_LOCAL", DEFINES_FUNC, NULL,
+	  "static __thread int x;\n"
+	  "static int *func(void) { return &x; }" },
 	{ "HAVE_TYPEOF", INSIDE_MAIN, NULL,
 	  "__typeof__(argc) i; i = argc; return i == argc ? 0 : 1;" },
 	{ "HAVE_UTIME", DEFINES_FUNC, NULL,